@@ -0,0 +1,195 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+/**
+ * Compare the transform with a basis stored in float32, float16 and int16 to the transform with
+ * the basis in native double precision, on the synthetic model of SyntheticStatisticalModel.h.
+ *
+ * Each stored value has an error of at most a fraction of the largest magnitude of its component:
+ * 6e-8 in float32 and 4.9e-4 in float16, whose relative errors are 2^-24 and 2^-11, and 1.53e-5 in
+ * int16, half a step of a scale that maps the largest magnitude to 32767. The interpolation weights
+ * sum to one, so an entry of the parameter Jacobian has at most the error of its mode, and a
+ * displacement at most that of the mean plus the errors of the modes times the magnitudes of the
+ * coefficients. The test checks these bounds at the voxels of the model and at random points.
+ */
+
+#include "itkAdvancedStatisticalDeformationModelTransform.h"
+#include "itkStandardImageRepresenter.h"
+#include "itkStatisticalModel.h"
+#include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "SyntheticStatisticalModel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+const unsigned int Dimension = 3;
+const unsigned int ModelSize = 12;
+const unsigned int NumberOfModes = 20;
+const unsigned int NumberOfRandomPoints = 2000;
+
+typedef itk::Vector<double, Dimension>                              VectorPixelType;
+typedef itk::Image<VectorPixelType, Dimension>                      ImageType;
+typedef itk::StandardImageRepresenter<VectorPixelType, Dimension>   RepresenterType;
+typedef itk::StatisticalModel<ImageType>                            StatisticalModelType;
+typedef itk::AdvancedStatisticalDeformationModelTransform<
+  RepresenterType, double, Dimension >                              TransformType;
+typedef TransformType::BasisType                                    BasisType;
+
+
+/** The tolerance of a stored value, relative to the largest magnitude of its component. */
+double GetStorageTolerance( BasisType::StorageType storage )
+{
+  switch ( storage )
+  {
+    case BasisType::Float32Storage: return 6e-8;
+    case BasisType::Float16Storage: return 4.9e-4;
+    case BasisType::Int16Storage:   return 1.53e-5;
+    default:                        return 1e-12;
+  }
+}
+
+
+int main( int, char *[] )
+{
+  StatisticalModelType::Pointer model
+    = CreateSyntheticModel< StatisticalModelType, RepresenterType >( ModelSize, NumberOfModes );
+
+  TransformType::Pointer reference = TransformType::New();
+  reference->SetStatisticalModel( model );
+
+  typedef itk::Statistics::MersenneTwisterRandomVariateGenerator GeneratorType;
+  GeneratorType::Pointer generator = GeneratorType::New();
+  generator->Initialize( 1 );
+
+  TransformType::ParametersType parameters( reference->GetNumberOfParameters() );
+  for ( unsigned int k = 0; k < parameters.GetSize(); k++ )
+  {
+    parameters[ k ] = generator->GetUniformVariate( -2.0, 2.0 );
+  }
+  reference->SetParameters( parameters );
+
+  /** The voxels of the model, where the largest magnitudes are taken, and random points between them. */
+  std::vector< TransformType::InputPointType > points;
+  TransformType::InputPointType point;
+  for ( unsigned int v = 0; v < ModelSize * ModelSize * ModelSize; v++ )
+  {
+    point[ 0 ] = v % ModelSize;
+    point[ 1 ] = ( v / ModelSize ) % ModelSize;
+    point[ 2 ] = v / ( ModelSize * ModelSize );
+    points.push_back( point );
+  }
+  const unsigned int numberOfVoxels = static_cast< unsigned int >( points.size() );
+  for ( unsigned int p = 0; p < NumberOfRandomPoints; p++ )
+  {
+    for ( unsigned int i = 0; i < Dimension; i++ )
+    {
+      point[ i ] = generator->GetUniformVariate( 0.0, ModelSize - 1.0 );
+    }
+    points.push_back( point );
+  }
+
+  /** The largest magnitude of the mean and of each mode, over the voxels. */
+  TransformType::JacobianType jacobian;
+  TransformType::NonZeroJacobianIndicesType nonZeroJacobianIndices;
+  double meanMagnitude = 0.0;
+  std::vector< double > modeMagnitudes( NumberOfModes, 0.0 );
+  reference->SetIdentity();
+  for ( unsigned int p = 0; p < numberOfVoxels; p++ )
+  {
+    const TransformType::OutputPointType meanPoint = reference->TransformPoint( points[ p ] );
+    reference->ComputeJacobianWithRespectToParameters( points[ p ], jacobian );
+    for ( unsigned int i = 0; i < Dimension; i++ )
+    {
+      meanMagnitude = std::max( meanMagnitude, std::abs( meanPoint[ i ] - points[ p ][ i ] ) );
+      for ( unsigned int k = 0; k < NumberOfModes; k++ )
+      {
+        modeMagnitudes[ k ] = std::max( modeMagnitudes[ k ], std::abs( jacobian[ i ][ k ] ) );
+      }
+    }
+  }
+  reference->SetParameters( parameters );
+
+  const BasisType::StorageType storages[] =
+    { BasisType::Float32Storage, BasisType::Float16Storage, BasisType::Int16Storage };
+  bool passed = true;
+  for ( unsigned int s = 0; s < sizeof( storages ) / sizeof( storages[ 0 ] ); s++ )
+  {
+    TransformType::Pointer transform = TransformType::New();
+    transform->SetBasisStorageType( storages[ s ] );
+    transform->SetStatisticalModel( model );
+    transform->SetParameters( parameters );
+
+    const double tolerance = GetStorageTolerance( storages[ s ] );
+    double displacementTolerance = tolerance * meanMagnitude + 1e-12;
+    for ( unsigned int k = 0; k < NumberOfModes; k++ )
+    {
+      displacementTolerance += tolerance * modeMagnitudes[ k ] * std::abs( parameters[ k ] );
+    }
+
+    TransformType::JacobianType referenceJacobian;
+    double maximumDisplacementError = 0.0;
+    double maximumJacobianError = 0.0;
+    bool jacobianWithinTolerance = true;
+    for ( unsigned int p = 0; p < points.size(); p++ )
+    {
+      const TransformType::OutputPointType expected = reference->TransformPoint( points[ p ] );
+      const TransformType::OutputPointType actual = transform->TransformPoint( points[ p ] );
+      reference->ComputeJacobianWithRespectToParameters( points[ p ], referenceJacobian );
+      transform->GetJacobian( points[ p ], jacobian, nonZeroJacobianIndices );
+      for ( unsigned int i = 0; i < Dimension; i++ )
+      {
+        maximumDisplacementError = std::max( maximumDisplacementError, std::abs( actual[ i ] - expected[ i ] ) );
+        for ( unsigned int k = 0; k < NumberOfModes; k++ )
+        {
+          const double error = std::abs( jacobian[ i ][ k ] - referenceJacobian[ i ][ k ] );
+          maximumJacobianError = std::max( maximumJacobianError, error );
+          jacobianWithinTolerance &= ( error <= tolerance * modeMagnitudes[ k ] + 1e-15 );
+        }
+      }
+    }
+
+    const bool storagePassed = jacobianWithinTolerance && maximumDisplacementError <= displacementTolerance;
+    std::cout << BasisType::GetStorageTypeAsString( storages[ s ] ) << ": largest displacement error "
+      << maximumDisplacementError << " mm, tolerance " << displacementTolerance
+      << "; largest Jacobian error " << maximumJacobianError << ", tolerance " << tolerance
+      << " of the magnitude of the mode. " << ( storagePassed ? "Passed." : "FAILED." ) << std::endl;
+    passed &= storagePassed;
+  }
+
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,220 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+
+/**
+ * Check that GetJacobian, ComputeJacobianWithRespectToParameters and TransformPoint do not allocate
+ * memory once the caller's Jacobian has its size, as the metrics call them for every sample in every
+ * iteration. The global operators new and delete are replaced by versions that count the allocations.
+ * The test covers the voxel basis, the Jacobian cache, the support index, the Jacobian kept by
+ * TransformPoint with and without the support index, and a B-spline basis.
+ */
+
+#include "itkAdvancedStatisticalDeformationModelTransform.h"
+#include "itkStandardImageRepresenter.h"
+#include "itkStatisticalModel.h"
+#include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "SyntheticStatisticalModel.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#if __cplusplus < 201103L
+#define COUNTING_NEW_THROW throw( std::bad_alloc )
+#define COUNTING_DELETE_NOTHROW throw()
+#else
+#define COUNTING_NEW_THROW
+#define COUNTING_DELETE_NOTHROW noexcept
+#endif
+
+/** The number of calls of the operators new and new[] so far. */
+static unsigned long numberOfAllocations = 0;
+
+void * operator new( std::size_t size ) COUNTING_NEW_THROW
+{
+  numberOfAllocations++;
+  void * memory = std::malloc( size > 0 ? size : 1 );
+  if ( memory == 0 )
+  {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void * operator new[]( std::size_t size ) COUNTING_NEW_THROW
+{
+  return operator new( size );
+}
+
+void operator delete( void * memory ) COUNTING_DELETE_NOTHROW
+{
+  std::free( memory );
+}
+
+void operator delete[]( void * memory ) COUNTING_DELETE_NOTHROW
+{
+  std::free( memory );
+}
+
+const unsigned int Dimension = 3;
+const unsigned int ModelSize = 16;
+const unsigned int NumberOfModes = 12;
+const unsigned int NumberOfPoints = 1000;
+
+typedef itk::Vector<double, Dimension>                              VectorPixelType;
+typedef itk::Image<VectorPixelType, Dimension>                      ImageType;
+typedef itk::StandardImageRepresenter<VectorPixelType, Dimension>   RepresenterType;
+typedef itk::StatisticalModel<ImageType>                            StatisticalModelType;
+typedef itk::AdvancedStatisticalDeformationModelTransform<
+  RepresenterType, double, Dimension >                              TransformType;
+
+
+/**
+ * Call the three operations at all points, in the order of the metrics, once to size the outputs
+ * and once counting the allocations. Returns the number of allocations of the second pass.
+ */
+unsigned long CountAllocations( const TransformType * transform, const TransformType::PointListType & points )
+{
+  TransformType::JacobianType jacobian;
+  TransformType::JacobianType parameterJacobian;
+  TransformType::NonZeroJacobianIndicesType nonZeroJacobianIndices;
+  TransformType::OutputPointType transformedPoint;
+
+  unsigned long allocations = 0;
+  for ( unsigned int pass = 0; pass < 2; pass++ )
+  {
+    const unsigned long before = numberOfAllocations;
+    for ( unsigned int p = 0; p < points.size(); p++ )
+    {
+      transformedPoint = transform->TransformPoint( points[ p ] );
+      transform->GetJacobian( points[ p ], jacobian, nonZeroJacobianIndices );
+      transform->ComputeJacobianWithRespectToParameters( points[ p ], parameterJacobian );
+    }
+    allocations = numberOfAllocations - before;
+  }
+  return allocations;
+}
+
+
+int main( int, char *[] )
+{
+  StatisticalModelType::Pointer model
+    = CreateSyntheticModel< StatisticalModelType, RepresenterType >( ModelSize, NumberOfModes );
+
+  typedef itk::Statistics::MersenneTwisterRandomVariateGenerator GeneratorType;
+  GeneratorType::Pointer generator = GeneratorType::New();
+  generator->Initialize( 1 );
+
+  /** Random points inside the model and a few outside, which take a different branch. */
+  TransformType::PointListType points;
+  TransformType::InputPointType point;
+  for ( unsigned int p = 0; p < NumberOfPoints; p++ )
+  {
+    const double upper = ( p % 10 == 0 ) ? 2.0 * ModelSize : ModelSize - 1.0;
+    for ( unsigned int i = 0; i < Dimension; i++ )
+    {
+      point[ i ] = generator->GetUniformVariate( 0.0, upper );
+    }
+    points.push_back( point );
+  }
+
+  std::vector< std::string > names;
+  std::vector< TransformType::Pointer > transforms;
+
+  TransformType::Pointer transform = TransformType::New();
+  transform->SetStatisticalModel( model );
+  names.push_back( "Voxels" );
+  transforms.push_back( transform );
+
+  transform = TransformType::New();
+  transform->SetStatisticalModel( model );
+  transform->SetJacobianCacheMaximumMemory(
+    TransformType::JacobianCacheType::GetRequiredMemory( points.size(), transform->GetNumberOfParameters() ) );
+  if ( !transform->BuildJacobianCache( points ) )
+  {
+    std::cerr << "The Jacobian cache could not be built." << std::endl;
+    return EXIT_FAILURE;
+  }
+  names.push_back( "JacobianCache" );
+  transforms.push_back( transform );
+
+  transform = TransformType::New();
+  transform->SetStatisticalModel( model );
+  transform->SetModeSupport( 4 );
+  names.push_back( "ModeSupport" );
+  transforms.push_back( transform );
+
+  transform = TransformType::New();
+  transform->SetStatisticalModel( model );
+  transform->SetFusedJacobian( true );
+  names.push_back( "FusedJacobian" );
+  transforms.push_back( transform );
+
+  transform = TransformType::New();
+  transform->SetStatisticalModel( model );
+  transform->SetModeSupport( 4 );
+  transform->SetFusedJacobian( true );
+  names.push_back( "FusedJacobianModeSupport" );
+  transforms.push_back( transform );
+
+  TransformType::ShrinkFactorsType spacing;
+  spacing.Fill( 4 );
+  transform = TransformType::New();
+  transform->SetBSplineControlPointSpacing( spacing );
+  transform->SetStatisticalModel( model );
+  names.push_back( "BSpline" );
+  transforms.push_back( transform );
+
+  TransformType::ParametersType parameters( NumberOfModes );
+  for ( unsigned int k = 0; k < NumberOfModes; k++ )
+  {
+    parameters[ k ] = generator->GetUniformVariate( -2.0, 2.0 );
+  }
+
+  bool passed = true;
+  for ( unsigned int t = 0; t < transforms.size(); t++ )
+  {
+    transforms[ t ]->SetParameters( parameters );
+    const unsigned long allocations = CountAllocations( transforms[ t ], points );
+    std::cout << names[ t ] << ": " << allocations << " allocations in " << points.size()
+      << " calls of each operation. " << ( allocations == 0 ? "Passed." : "FAILED." ) << std::endl;
+    passed &= ( allocations == 0 );
+  }
+
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,154 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+
+/**
+ * Check GetJacobian against the Jacobian of the statistical model with
+ * GetMaximumStatisticalModelJacobianDifference, on the synthetic model of SyntheticStatisticalModel.h.
+ * statismo returns the modes at the closest voxel, so at the voxels of the model the two agree up to
+ * rounding, with all modes evaluated and with the support index, whose columns are compared with the
+ * modes of their indices. With SetFusedJacobian, GetJacobian after TransformPoint at the same point
+ * copies the Jacobian that TransformPoint kept; the test checks that it does so at every voxel and that
+ * the point and the Jacobian are those of a transform that evaluates them separately.
+ */
+
+#include "itkAdvancedStatisticalDeformationModelTransform.h"
+#include "itkStandardImageRepresenter.h"
+#include "itkStatisticalModel.h"
+#include "SyntheticStatisticalModel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+const unsigned int Dimension = 3;
+const unsigned int ModelSize = 10;
+const unsigned int NumberOfModes = 15;
+const double       Tolerance = 1e-10;
+
+typedef itk::Vector<double, Dimension>                              VectorPixelType;
+typedef itk::Image<VectorPixelType, Dimension>                      ImageType;
+typedef itk::StandardImageRepresenter<VectorPixelType, Dimension>   RepresenterType;
+typedef itk::StatisticalModel<ImageType>                            StatisticalModelType;
+typedef itk::AdvancedStatisticalDeformationModelTransform<
+  RepresenterType, double, Dimension >                              TransformType;
+
+
+int main( int, char *[] )
+{
+  StatisticalModelType::Pointer model
+    = CreateSyntheticModel< StatisticalModelType, RepresenterType >( ModelSize, NumberOfModes );
+
+  TransformType::PointListType points;
+  TransformType::InputPointType point;
+  for ( unsigned int v = 0; v < ModelSize * ModelSize * ModelSize; v++ )
+  {
+    point[ 0 ] = v % ModelSize;
+    point[ 1 ] = ( v / ModelSize ) % ModelSize;
+    point[ 2 ] = v / ( ModelSize * ModelSize );
+    points.push_back( point );
+  }
+
+  /** Block sizes of the support index; 0 evaluates all modes. */
+  const unsigned int blockSizes[] = { 0, 4, 8 };
+  bool passed = true;
+  for ( unsigned int b = 0; b < sizeof( blockSizes ) / sizeof( blockSizes[ 0 ] ); b++ )
+  {
+    TransformType::Pointer transform = TransformType::New();
+    transform->SetStatisticalModel( model );
+    transform->SetModeSupport( blockSizes[ b ] );
+
+    const double difference = transform->GetMaximumStatisticalModelJacobianDifference( points );
+    const bool blockPassed = difference <= Tolerance;
+    std::cout << "Support block size " << blockSizes[ b ] << ": largest difference " << difference
+      << " at " << points.size() << " voxels, tolerance " << Tolerance << ". "
+      << ( blockPassed ? "Passed." : "FAILED." ) << std::endl;
+    passed &= blockPassed;
+  }
+
+  for ( unsigned int b = 0; b < sizeof( blockSizes ) / sizeof( blockSizes[ 0 ] ); b++ )
+  {
+    TransformType::Pointer reference = TransformType::New();
+    reference->SetStatisticalModel( model );
+    reference->SetModeSupport( blockSizes[ b ] );
+    TransformType::Pointer transform = TransformType::New();
+    transform->SetStatisticalModel( model );
+    transform->SetModeSupport( blockSizes[ b ] );
+    transform->SetFusedJacobian( true );
+    transform->SetInstrumentation( true );
+
+    TransformType::ParametersType parameters( NumberOfModes );
+    for ( unsigned int k = 0; k < NumberOfModes; k++ )
+    {
+      parameters[ k ] = 0.25 * k - 1.5;
+    }
+    reference->SetParameters( parameters );
+    transform->SetParameters( parameters );
+
+    TransformType::JacobianType jacobian;
+    TransformType::JacobianType referenceJacobian;
+    TransformType::NonZeroJacobianIndicesType nonZeroJacobianIndices;
+    TransformType::NonZeroJacobianIndicesType referenceIndices;
+    double difference = 0.0;
+    bool sameIndices = true;
+    for ( unsigned int p = 0; p < points.size(); p++ )
+    {
+      const TransformType::OutputPointType transformedPoint = transform->TransformPoint( points[ p ] );
+      const TransformType::OutputPointType referencePoint = reference->TransformPoint( points[ p ] );
+      transform->GetJacobian( points[ p ], jacobian, nonZeroJacobianIndices );
+      reference->GetJacobian( points[ p ], referenceJacobian, referenceIndices );
+      sameIndices &= ( nonZeroJacobianIndices == referenceIndices );
+      for ( unsigned int i = 0; i < Dimension; i++ )
+      {
+        difference = std::max( difference, std::abs( transformedPoint[ i ] - referencePoint[ i ] ) );
+        for ( unsigned int j = 0; j < jacobian.cols() && j < referenceJacobian.cols(); j++ )
+        {
+          difference = std::max( difference, std::abs( jacobian[ i ][ j ] - referenceJacobian[ i ][ j ] ) );
+        }
+      }
+    }
+    const TransformType::CountersType::Values values = transform->GetCounters()->GetValues();
+    const itk::SizeValueType hits = values.Counts[ TransformType::CountersType::FusedJacobianHits ];
+    const bool fusedPassed = sameIndices && hits == points.size() && difference <= Tolerance;
+    std::cout << "Fused Jacobian, support block size " << blockSizes[ b ] << ": " << hits << " of "
+      << points.size() << " Jacobians kept by TransformPoint, largest difference " << difference
+      << ( sameIndices ? "" : ", different indices" ) << ". " << ( fusedPassed ? "Passed." : "FAILED." ) << std::endl;
+    passed &= fusedPassed;
+  }
+
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,181 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+/**
+ * Convert a statismo deformation model into a basis file that can be mapped into memory by
+ * the SimpleStatisticalDeformationModelTransform, see the parameter StatisticalModelBasisFileName.
+ *
+ * Usage: StatisticalModelToBasisFile model.h5 model.basis [numberOfModes] [dimension] [precision] [tileSize]
+ *          [controlPointSpacing]
+ *
+ * numberOfModes defaults to 0, which writes all modes. dimension is 3 by default.
+ * precision is "native" (double, as used by elastix), "float32", "float16" or "int16".
+ * tileSize is the edge length in voxels of the tiles of the file, a power of two, e.g. 8 or 16.
+ * A tiled file can be used with a memory budget, see StatisticalModelBasisTileCacheSize.
+ * The default 0 writes the voxels in linear order.
+ * controlPointSpacing, in voxels, writes the control points of a cubic B-spline fitted to the basis
+ * instead of the voxels, see StatisticalModelBSplineControlPointSpacing. The error of the fit is printed.
+ * The default 0 writes the voxels.
+ *
+ * The input may also be a basis file, e.g. to tile it. It is mapped into memory and copied tile by
+ * tile, so it may be larger than the memory; numberOfModes and precision are then ignored. With a
+ * controlPointSpacing the B-spline is fitted to it in memory.
+ */
+
+#include "itkAdvancedStatisticalDeformationModelTransform.h"
+#include "itkStandardImageRepresenter.h"
+#include "itkStatisticalModel.h"
+#include "itksys/SystemTools.hxx"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+template < class TBasis >
+void PrintApproximationErrors( const TBasis * basis )
+{
+  const typename TBasis::VarianceVectorType & errors = basis->GetApproximationErrors();
+  const typename TBasis::VarianceVectorType & relativeErrors = basis->GetRelativeApproximationErrors();
+  for ( unsigned int k = 0; k < errors.GetSize(); k++ )
+  {
+    std::cout << ( k == 0 ? "Mean" : "Mode " ) ;
+    if ( k > 0 )
+    {
+      std::cout << k;
+    }
+    std::cout << ": RMS error " << errors[ k ] << ", relative " << relativeErrors[ k ] << std::endl;
+  }
+}
+
+
+template < unsigned int VDimension >
+int ConvertStatisticalModel( const std::string & modelFileName, const std::string & basisFileName,
+  unsigned int numberOfModes, const std::string & precision, unsigned int tileSize, unsigned int controlPointSpacing )
+{
+  typedef itk::Vector<double, VDimension>                               VectorPixelType;
+  typedef itk::Image<VectorPixelType, VDimension>                       ImageType;
+  typedef itk::StandardImageRepresenter<VectorPixelType, VDimension>    RepresenterType;
+  typedef itk::StatisticalModel<ImageType>                              StatisticalModelType;
+  typedef itk::AdvancedStatisticalDeformationModelTransform<
+    RepresenterType, double, VDimension >                               TransformType;
+
+  typedef typename TransformType::BasisType                             BasisType;
+
+  typename BasisType::ShrinkFactorsType spacing;
+  spacing.Fill( controlPointSpacing );
+
+  typename BasisType::StorageType storage;
+  if ( !BasisType::GetStorageTypeFromString( precision, storage ) )
+  {
+    std::cerr << "Unknown precision " << precision << "." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if ( itksys::SystemTools::GetFilenameLastExtension( modelFileName ) == ".basis" )
+  {
+    typename BasisType::Pointer basis = BasisType::New();
+    basis->ReadFromFile( modelFileName );
+    if ( controlPointSpacing > 0 && basis->GetSplineOrder() == 1 )
+    {
+      basis = basis->FitBSpline( spacing );
+      PrintApproximationErrors<BasisType>( basis );
+    }
+    basis->WriteToFile( basisFileName, tileSize );
+    std::cout << "Wrote the mean and " << basis->GetNumberOfModes() << " modes of " << modelFileName
+      << " in tiles of " << tileSize << " voxels to " << basisFileName << "." << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  typename StatisticalModelType::Pointer model = StatisticalModelType::New();
+  typename RepresenterType::Pointer representer = RepresenterType::New();
+  model->Load( representer, modelFileName.c_str() );
+
+  /** The transform draws the mean and the used modes into the interleaved basis. */
+  typename TransformType::Pointer transform = TransformType::New();
+  transform->SetBasisStorageType( storage );
+  transform->SetBSplineControlPointSpacing( spacing );
+  if ( numberOfModes > 0 )
+  {
+    transform->SetUsedNumberOfCoefficients( numberOfModes );
+  }
+  transform->SetStatisticalModel( model );
+  PrintApproximationErrors<BasisType>( transform->GetFullResolutionBasis() );
+
+  transform->GetFullResolutionBasis()->WriteToFile( basisFileName, tileSize );
+  std::cout << "Wrote the mean and " << transform->GetFullResolutionBasis()->GetNumberOfModes()
+    << " modes of " << modelFileName << " in " << precision << " precision to " << basisFileName << "." << std::endl;
+
+  return EXIT_SUCCESS;
+}
+
+
+int main( int argc, char * argv[] )
+{
+  if ( argc < 3 )
+  {
+    std::cerr << "Usage: " << argv[ 0 ] << " model.h5 model.basis [numberOfModes] [dimension] [precision] [tileSize]"
+      << " [controlPointSpacing]" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const unsigned int numberOfModes = ( argc > 3 ) ? std::atoi( argv[ 3 ] ) : 0;
+  const unsigned int dimension = ( argc > 4 ) ? std::atoi( argv[ 4 ] ) : 3;
+  const std::string precision = ( argc > 5 ) ? argv[ 5 ] : "native";
+  const unsigned int tileSize = ( argc > 6 ) ? std::atoi( argv[ 6 ] ) : 0;
+  const unsigned int controlPointSpacing = ( argc > 7 ) ? std::atoi( argv[ 7 ] ) : 0;
+
+  try
+  {
+    if ( dimension == 2 )
+    {
+      return ConvertStatisticalModel<2>( argv[ 1 ], argv[ 2 ], numberOfModes, precision, tileSize, controlPointSpacing );
+    }
+    if ( dimension == 3 )
+    {
+      return ConvertStatisticalModel<3>( argv[ 1 ], argv[ 2 ], numberOfModes, precision, tileSize, controlPointSpacing );
+    }
+    std::cerr << "Only models of dimension 2 and 3 are supported." << std::endl;
+  }
+  catch ( itk::ExceptionObject & e )
+  {
+    std::cerr << e << std::endl;
+  }
+  catch ( std::exception & e )
+  {
+    std::cerr << e.what() << std::endl;
+  }
+
+  return EXIT_FAILURE;
+}
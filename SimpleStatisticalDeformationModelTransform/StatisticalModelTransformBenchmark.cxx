@@ -0,0 +1,387 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+/**
+ * Time the SimpleStatisticalDeformationModelTransform on a synthetic statistical model that is
+ * generated in memory, so that it can be measured without elastix and without a model file.
+ *
+ * Usage: StatisticalModelTransformBenchmark [dimension] [size] [numberOfModes] [numberOfPoints]
+ *          [numberOfThreads] [precision] [controlPointSpacing] [output.json]
+ *
+ * The model, see SyntheticStatisticalModel.h, has size voxels along each axis, 48 by default, and
+ * 50 modes. Measured are SetStatisticalModel, which draws the basis, TransformPoint,
+ * ComputeJacobianWithRespectToParameters and GetJacobian at numberOfPoints random points, 100000 by
+ * default, and GenerateDeformationField on the model grid and on a grid of half its spacing. Each
+ * is run with one thread and with numberOfThreads threads, 0 being the default of itk::MultiThreader.
+ * The point operations are timed once more with the Jacobian cache built on the points, as for a
+ * fixed sample set, under names ending in "Cached". precision and controlPointSpacing are as for
+ * StatisticalModelToBasisFile. Finally, the resident memory of the process is measured before and
+ * after ReleaseStatisticalModel, which frees the model once its modes have been drawn into the basis.
+ *
+ * The results are written as JSON to the output file, or to the standard output.
+ */
+
+#include "itkAdvancedStatisticalDeformationModelTransform.h"
+#include "itkStandardImageRepresenter.h"
+#include "itkStatisticalModel.h"
+#include "SyntheticStatisticalModel.h"
+#include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkMemoryUsageObserver.h"
+#include "itkMultiThreader.h"
+#include "itkTimeProbe.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct BenchmarkResult
+{
+  std::string  Name;
+  unsigned int NumberOfThreads;
+  unsigned int NumberOfCalls;
+  double       Seconds;
+};
+
+
+/** Evaluates one of the point operations at the points of a thread, i modulo the number of threads. */
+template < class TTransform >
+struct PointBenchmarkThreadStruct
+{
+  enum OperationType { TransformPointOperation, ComputeJacobianOperation, GetJacobianOperation };
+
+  const TTransform *                                     Transform;
+  const std::vector< typename TTransform::InputPointType > * Points;
+  OperationType                                          Operation;
+  std::vector< double >                                  Checksums;
+};
+
+
+template < class TTransform >
+ITK_THREAD_RETURN_TYPE PointBenchmarkThreaderCallback( void * arg )
+{
+  typedef PointBenchmarkThreadStruct< TTransform > ThreadStructType;
+  const itk::MultiThreader::ThreadInfoStruct * info = static_cast< itk::MultiThreader::ThreadInfoStruct * >( arg );
+  ThreadStructType * str = static_cast< ThreadStructType * >( info->UserData );
+
+  typename TTransform::JacobianType jacobian;
+  typename TTransform::NonZeroJacobianIndicesType nonZeroJacobianIndices;
+  double checksum = 0.0;
+  for ( std::size_t p = info->ThreadID; p < str->Points->size(); p += info->NumberOfThreads )
+  {
+    const typename TTransform::InputPointType & point = ( *str->Points )[ p ];
+    switch ( str->Operation )
+    {
+      case ThreadStructType::TransformPointOperation:
+        checksum += str->Transform->TransformPoint( point )[ 0 ];
+        break;
+      case ThreadStructType::ComputeJacobianOperation:
+        str->Transform->ComputeJacobianWithRespectToParameters( point, jacobian );
+        checksum += jacobian[ 0 ][ 0 ];
+        break;
+      case ThreadStructType::GetJacobianOperation:
+        str->Transform->GetJacobian( point, jacobian, nonZeroJacobianIndices );
+        checksum += jacobian[ 0 ][ 0 ];
+        break;
+    }
+  }
+  str->Checksums[ info->ThreadID ] = checksum;
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+
+template < class TTransform >
+BenchmarkResult TimePointOperation( const TTransform * transform,
+  const std::vector< typename TTransform::InputPointType > & points,
+  typename PointBenchmarkThreadStruct< TTransform >::OperationType operation,
+  const std::string & name, unsigned int numberOfThreads )
+{
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  if ( numberOfThreads > 0 )
+  {
+    threader->SetNumberOfThreads( numberOfThreads );
+  }
+
+  PointBenchmarkThreadStruct< TTransform > str;
+  str.Transform = transform;
+  str.Points = &points;
+  str.Operation = operation;
+  str.Checksums.resize( threader->GetNumberOfThreads(), 0.0 );
+  threader->SetSingleMethod( PointBenchmarkThreaderCallback< TTransform >, &str );
+
+  itk::TimeProbe probe;
+  probe.Start();
+  threader->SingleMethodExecute();
+  probe.Stop();
+
+  BenchmarkResult result;
+  result.Name = name;
+  result.NumberOfThreads = threader->GetNumberOfThreads();
+  result.NumberOfCalls = static_cast< unsigned int >( points.size() );
+  result.Seconds = probe.GetTotal();
+  return result;
+}
+
+
+/** The field covers the grid of the model, of spacing 1 from the origin, at refinement voxels per voxel. */
+template < class TTransform >
+BenchmarkResult TimeDeformationField( const TTransform * transform, unsigned int modelSize,
+  unsigned int refinement, const std::string & name, unsigned int numberOfThreads )
+{
+  typedef typename TTransform::BasisType::DeformationFieldType FieldType;
+
+  typename FieldType::Pointer field = FieldType::New();
+  typename FieldType::SizeType size;
+  typename FieldType::SpacingType spacing;
+  size.Fill( ( modelSize - 1 ) * refinement + 1 );
+  spacing.Fill( 1.0 / refinement );
+  field->SetRegions( size );
+  field->SetSpacing( spacing );
+  field->Allocate();
+
+  itk::TimeProbe probe;
+  probe.Start();
+  transform->GenerateDeformationField( field, numberOfThreads );
+  probe.Stop();
+
+  BenchmarkResult result;
+  result.Name = name;
+  result.NumberOfThreads = numberOfThreads;
+  result.NumberOfCalls = static_cast< unsigned int >( field->GetLargestPossibleRegion().GetNumberOfPixels() );
+  result.Seconds = probe.GetTotal();
+  return result;
+}
+
+
+template < unsigned int VDimension >
+int RunBenchmark( unsigned int size, unsigned int numberOfModes, unsigned int numberOfPoints,
+  unsigned int numberOfThreads, const std::string & precision, unsigned int controlPointSpacing, std::ostream & os )
+{
+  typedef itk::Vector<double, VDimension>                               VectorPixelType;
+  typedef itk::Image<VectorPixelType, VDimension>                       ImageType;
+  typedef itk::StandardImageRepresenter<VectorPixelType, VDimension>    RepresenterType;
+  typedef itk::StatisticalModel<ImageType>                              StatisticalModelType;
+  typedef itk::AdvancedStatisticalDeformationModelTransform<
+    RepresenterType, double, VDimension >                               TransformType;
+  typedef PointBenchmarkThreadStruct< TransformType >                   ThreadStructType;
+
+  typedef typename TransformType::BasisType                             BasisType;
+
+  typename BasisType::StorageType storage;
+  if ( !BasisType::GetStorageTypeFromString( precision, storage ) )
+  {
+    std::cerr << "Unknown precision " << precision << "." << std::endl;
+    return EXIT_FAILURE;
+  }
+  typename BasisType::ShrinkFactorsType spacing;
+  spacing.Fill( controlPointSpacing );
+
+  typename StatisticalModelType::Pointer model
+    = CreateSyntheticModel< StatisticalModelType, RepresenterType >( size, numberOfModes );
+
+  const unsigned int maximumNumberOfThreads = ( numberOfThreads > 0 )
+    ? numberOfThreads : itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  std::vector< unsigned int > threadCounts( 1, 1 );
+  if ( maximumNumberOfThreads > 1 )
+  {
+    threadCounts.push_back( maximumNumberOfThreads );
+  }
+
+  std::vector< BenchmarkResult > results;
+  typename TransformType::Pointer transform;
+  for ( unsigned int t = 0; t < threadCounts.size(); t++ )
+  {
+    transform = TransformType::New();
+    transform->SetBasisStorageType( storage );
+    transform->SetBSplineControlPointSpacing( spacing );
+    transform->SetNumberOfBasisThreads( threadCounts[ t ] );
+
+    itk::TimeProbe probe;
+    probe.Start();
+    transform->SetStatisticalModel( model );
+    probe.Stop();
+
+    BenchmarkResult result;
+    result.Name = "SetStatisticalModel";
+    result.NumberOfThreads = threadCounts[ t ];
+    result.NumberOfCalls = 1;
+    result.Seconds = probe.GetTotal();
+    results.push_back( result );
+  }
+
+  /** Random coefficients within the variation of the model and random points within its domain. */
+  typedef itk::Statistics::MersenneTwisterRandomVariateGenerator GeneratorType;
+  GeneratorType::Pointer generator = GeneratorType::New();
+  generator->Initialize( 1 );
+
+  typename TransformType::ParametersType parameters( transform->GetNumberOfParameters() );
+  for ( unsigned int i = 0; i < parameters.GetSize(); i++ )
+  {
+    parameters[ i ] = generator->GetUniformVariate( -1.0, 1.0 );
+  }
+  transform->SetParameters( parameters );
+
+  std::vector< typename TransformType::InputPointType > points( numberOfPoints );
+  for ( unsigned int p = 0; p < numberOfPoints; p++ )
+  {
+    for ( unsigned int a = 0; a < VDimension; a++ )
+    {
+      points[ p ][ a ] = generator->GetUniformVariate( 0.0, size - 1.0 );
+    }
+  }
+
+  for ( unsigned int t = 0; t < threadCounts.size(); t++ )
+  {
+    results.push_back( TimePointOperation< TransformType >( transform, points,
+      ThreadStructType::TransformPointOperation, "TransformPoint", threadCounts[ t ] ) );
+    results.push_back( TimePointOperation< TransformType >( transform, points,
+      ThreadStructType::ComputeJacobianOperation, "ComputeJacobianWithRespectToParameters", threadCounts[ t ] ) );
+    results.push_back( TimePointOperation< TransformType >( transform, points,
+      ThreadStructType::GetJacobianOperation, "GetJacobian", threadCounts[ t ] ) );
+    results.push_back( TimeDeformationField< TransformType >( transform, size,
+      1, "GenerateDeformationField", threadCounts[ t ] ) );
+    results.push_back( TimeDeformationField< TransformType >( transform, size,
+      2, "GenerateDeformationFieldRefined", threadCounts[ t ] ) );
+  }
+
+  /** The same point operations with the Jacobian cache, to compare with the direct evaluation. */
+  transform->SetJacobianCacheMaximumMemory(
+    TransformType::JacobianCacheType::GetRequiredMemory( points.size(), transform->GetNumberOfParameters() ) );
+  if ( transform->BuildJacobianCache( points ) )
+  {
+    for ( unsigned int t = 0; t < threadCounts.size(); t++ )
+    {
+      results.push_back( TimePointOperation< TransformType >( transform, points,
+        ThreadStructType::TransformPointOperation, "TransformPointCached", threadCounts[ t ] ) );
+      results.push_back( TimePointOperation< TransformType >( transform, points,
+        ThreadStructType::ComputeJacobianOperation, "ComputeJacobianWithRespectToParametersCached", threadCounts[ t ] ) );
+      results.push_back( TimePointOperation< TransformType >( transform, points,
+        ThreadStructType::GetJacobianOperation, "GetJacobianCached", threadCounts[ t ] ) );
+    }
+    transform->ClearJacobianCache();
+  }
+
+  /** The model is held by the transform only, so releasing it frees its basis matrix and mean. */
+  itk::MemoryUsageObserver memoryObserver;
+  const itk::MemoryUsageObserver::MemoryLoadType residentWithModel = memoryObserver.GetMemoryUsage();
+  transform->ReleaseStatisticalModel();
+  model = 0;
+  const itk::MemoryUsageObserver::MemoryLoadType residentWithoutModel = memoryObserver.GetMemoryUsage();
+  const double modelKilobytes = static_cast< double >( numberOfModes + 1 ) * VDimension
+    * std::pow( static_cast< double >( size ), static_cast< double >( VDimension ) ) * sizeof( double ) / 1024.0;
+
+  os << "{\n"
+     << "  \"dimension\": " << VDimension << ",\n"
+     << "  \"size\": " << size << ",\n"
+     << "  \"numberOfModes\": " << numberOfModes << ",\n"
+     << "  \"numberOfPoints\": " << numberOfPoints << ",\n"
+     << "  \"precision\": \"" << precision << "\",\n"
+     << "  \"controlPointSpacing\": " << controlPointSpacing << ",\n"
+     << "  \"modelKilobytes\": " << modelKilobytes << ",\n"
+     << "  \"residentKilobytesWithModel\": " << residentWithModel << ",\n"
+     << "  \"residentKilobytesAfterReleaseStatisticalModel\": " << residentWithoutModel << ",\n"
+     << "  \"releasedKilobytes\": "
+     << static_cast< double >( residentWithModel ) - static_cast< double >( residentWithoutModel ) << ",\n"
+     << "  \"results\": [\n";
+  for ( unsigned int r = 0; r < results.size(); r++ )
+  {
+    const BenchmarkResult & result = results[ r ];
+    os << "    { \"name\": \"" << result.Name << "\", \"threads\": " << result.NumberOfThreads
+       << ", \"calls\": " << result.NumberOfCalls << ", \"seconds\": " << result.Seconds
+       << ", \"nanosecondsPerCall\": " << 1e9 * result.Seconds / std::max( 1u, result.NumberOfCalls ) << " }"
+       << ( r + 1 < results.size() ? "," : "" ) << "\n";
+  }
+  os << "  ]\n}" << std::endl;
+
+  return EXIT_SUCCESS;
+}
+
+
+int main( int argc, char * argv[] )
+{
+  const unsigned int dimension = ( argc > 1 ) ? std::atoi( argv[ 1 ] ) : 3;
+  const unsigned int size = ( argc > 2 ) ? std::atoi( argv[ 2 ] ) : 48;
+  const unsigned int numberOfModes = ( argc > 3 ) ? std::atoi( argv[ 3 ] ) : 50;
+  const unsigned int numberOfPoints = ( argc > 4 ) ? std::atoi( argv[ 4 ] ) : 100000;
+  const unsigned int numberOfThreads = ( argc > 5 ) ? std::atoi( argv[ 5 ] ) : 0;
+  const std::string precision = ( argc > 6 ) ? argv[ 6 ] : "native";
+  const unsigned int controlPointSpacing = ( argc > 7 ) ? std::atoi( argv[ 7 ] ) : 0;
+
+  if ( size < 2 || numberOfModes == 0 )
+  {
+    std::cerr << "Usage: " << argv[ 0 ] << " [dimension] [size] [numberOfModes] [numberOfPoints] [numberOfThreads]"
+      << " [precision] [controlPointSpacing] [output.json]" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::ofstream file;
+  if ( argc > 8 )
+  {
+    file.open( argv[ 8 ] );
+    if ( !file )
+    {
+      std::cerr << "Cannot write " << argv[ 8 ] << "." << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  std::ostream & os = ( argc > 8 ) ? static_cast< std::ostream & >( file ) : std::cout;
+
+  try
+  {
+    if ( dimension == 2 )
+    {
+      return RunBenchmark<2>( size, numberOfModes, numberOfPoints, numberOfThreads, precision, controlPointSpacing, os );
+    }
+    if ( dimension == 3 )
+    {
+      return RunBenchmark<3>( size, numberOfModes, numberOfPoints, numberOfThreads, precision, controlPointSpacing, os );
+    }
+    std::cerr << "Only models of dimension 2 and 3 are supported." << std::endl;
+  }
+  catch ( itk::ExceptionObject & e )
+  {
+    std::cerr << e << std::endl;
+  }
+  catch ( std::exception & e )
+  {
+    std::cerr << e.what() << std::endl;
+  }
+
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,160 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef __SyntheticStatisticalModel_h
+#define __SyntheticStatisticalModel_h
+
+/**
+ * A synthetic statistical deformation model generated in memory, for the benchmark and the tests.
+ *
+ * The model has size voxels of spacing 1 along each axis, from the origin. Its modes are products of
+ * cosines of low frequencies, i.e. orthonormal discrete cosine vectors in one component each, with
+ * variances that decrease with the frequency. The mean is half a sine period along each axis.
+ */
+
+#include "itkStatisticalModel.h"
+
+#include <cmath>
+#include <vector>
+
+/**
+ * The frequencies of the modes: all tuples of frequencies per axis, ordered by their sum, each used
+ * for every component in turn. Frequency 0 along all axes is a translation.
+ */
+template < unsigned int VDimension >
+std::vector< std::vector< unsigned int > > GetModeFrequencies( unsigned int numberOfModes )
+{
+  const unsigned int numberOfTuples = ( numberOfModes + VDimension - 1 ) / VDimension;
+  unsigned int maximumFrequency = 1;
+  while ( std::pow( static_cast< double >( maximumFrequency ), static_cast< double >( VDimension ) ) < numberOfTuples )
+  {
+    maximumFrequency++;
+  }
+
+  std::vector< std::vector< unsigned int > > tuples;
+  std::vector< unsigned int > tuple( VDimension, 0 );
+  for ( unsigned int sum = 0; tuples.size() < numberOfTuples; sum++ )
+  {
+    const unsigned int numberOfCandidates = static_cast< unsigned int >(
+      std::pow( static_cast< double >( maximumFrequency ), static_cast< double >( VDimension ) ) );
+    for ( unsigned int c = 0; c < numberOfCandidates && tuples.size() < numberOfTuples; c++ )
+    {
+      unsigned int rest = c;
+      unsigned int tupleSum = 0;
+      for ( unsigned int a = 0; a < VDimension; a++ )
+      {
+        tuple[ a ] = rest % maximumFrequency;
+        rest /= maximumFrequency;
+        tupleSum += tuple[ a ];
+      }
+      if ( tupleSum == sum )
+      {
+        tuples.push_back( tuple );
+      }
+    }
+  }
+  return tuples;
+}
+
+
+/** Generate the synthetic model on a grid of size voxels of spacing 1 along each axis. */
+template < class TStatisticalModel, class TRepresenter >
+typename TStatisticalModel::Pointer CreateSyntheticModel( unsigned int size, unsigned int numberOfModes )
+{
+  typedef typename TRepresenter::DatasetType  ImageType;
+  itkStaticConstMacro( Dimension, unsigned int, ImageType::ImageDimension );
+
+  typename ImageType::Pointer reference = ImageType::New();
+  typename ImageType::SizeType imageSize;
+  imageSize.Fill( size );
+  reference->SetRegions( imageSize );
+  reference->Allocate();
+
+  typename TRepresenter::Pointer representer = TRepresenter::New();
+  representer->SetReference( reference );
+
+  const unsigned int numberOfVoxels = static_cast< unsigned int >( reference->GetLargestPossibleRegion().GetNumberOfPixels() );
+  const std::vector< std::vector< unsigned int > > frequencies = GetModeFrequencies< Dimension >( numberOfModes );
+
+  statismo::VectorType mean( numberOfVoxels * Dimension );
+  statismo::MatrixType basis( numberOfVoxels * Dimension, numberOfModes );
+  statismo::VectorType variances( numberOfModes );
+  basis.setZero();
+
+  const double pi = std::acos( -1.0 );
+  for ( unsigned int k = 0; k < numberOfModes; k++ )
+  {
+    const std::vector< unsigned int > & frequency = frequencies[ k / Dimension ];
+    const unsigned int component = k % Dimension;
+    double squaredFrequency = 0.0;
+    for ( unsigned int a = 0; a < Dimension; a++ )
+    {
+      squaredFrequency += frequency[ a ] * frequency[ a ];
+    }
+    variances[ k ] = 4.0 / ( ( 1.0 + squaredFrequency ) * ( 1.0 + squaredFrequency ) );
+
+    double squaredNorm = 0.0;
+    for ( unsigned int v = 0; v < numberOfVoxels; v++ )
+    {
+      double value = 1.0;
+      unsigned int rest = v;
+      for ( unsigned int a = 0; a < Dimension; a++ )
+      {
+        value *= std::cos( pi * frequency[ a ] * ( rest % size + 0.5 ) / size );
+        rest /= size;
+      }
+      basis( v * Dimension + component, k ) = value;
+      squaredNorm += value * value;
+    }
+    basis.col( k ) /= std::sqrt( squaredNorm );
+  }
+
+  for ( unsigned int v = 0; v < numberOfVoxels; v++ )
+  {
+    unsigned int rest = v;
+    for ( unsigned int a = 0; a < Dimension; a++ )
+    {
+      mean[ v * Dimension + a ] = 0.5 * std::sin( pi * ( rest % size + 0.5 ) / size );
+      rest /= size;
+    }
+  }
+
+  typename TStatisticalModel::Pointer model = TStatisticalModel::New();
+  model->SetstatismoImplObj( TStatisticalModel::ImplType::Create( representer, mean, basis, variances, 0.0 ) );
+  return model;
+}
+
+
+#endif // __SyntheticStatisticalModel_h
@@ -17,6 +17,7 @@
 #ifndef __elxStatisticalDeformationModelTransform_H_
 #define __elxStatisticalDeformationModelTransform_H_
 #include "itkAdvancedStatisticalDeformationModelTransform.h"
+#include "itkStatisticalModelCache.h"
 
 
 #include "itkStatisticalModel.h"
@@ -37,12 +38,11 @@ namespace elastix
    * This is a transform based on a statistical deformation model.
    * A linear combination of deformation fields defines the transformation of points.
    * A statistical shape model needs to be specified.
-   * In addition, a set of source and target landmarks can be specified, which are used to
-   * constrain the model to adhere to these landmarks. \n
-   * A certain amount of slack or noise is assumed in the landmark placement. This can be
-   * specified. Because the landmarks are typically defined on a surface, the noise can be
-   * specified in normal and tangential direction to this surface, because typically the
-   * accuracy is higher in normal than in tangential direction. \n
+   * In addition, a set of corresponding fixed and moving landmarks can be specified, which are used
+   * to constrain the model to adhere to these landmarks. \n
+   * A certain amount of slack or noise is assumed in the landmark placement, given as an isotropic
+   * variance. The registration starts from the posterior mean of the coefficients given the
+   * landmarks, or optionally uses the posterior model built by statismo instead of the model. \n
    *
    * The parameters used in this class are:
    * \parameter Transform: Select this transform as follows:\n
@@ -50,12 +50,157 @@ namespace elastix
    * \parameter StatisticalModelName: The file name of the statistical deformation
    * 		model to be used. \n
    *    example: <tt>(StatisticalModelName "DeformationModel.h5")</tt> \n
+   * \parameter StatisticalModelBasisFileName: A basis file written by the StatisticalModelToBasisFile
+   * 		tool, used instead of the model. The file is mapped into memory, so the registration starts
+   * 		without loading the model, and processes that use the same file share its pages.
+   * 		StatisticalModelName is then optional. \n
+   *    example: <tt>(StatisticalModelBasisFileName "DeformationModel.basis")</tt> \n
+   * \parameter StatisticalModelBasisTileCacheSize: Memory budget in megabytes for the tiles of a tiled
+   * 		basis file, written with a tile size by StatisticalModelToBasisFile. Beyond the budget tiles that
+   * 		have not been used recently are released and read again from the file when needed, so a model larger
+   * 		than the memory can be used. The tiles in which the samples of the metric lie are read ahead
+   * 		whenever the sample set changes. The misses and evictions of the tiles are written to the log after
+   * 		each resolution. A tiled basis is not downsampled by UseStatisticalModelPyramid. Can be given
+   * 		for each resolution. \n
+   *    example: <tt>(StatisticalModelBasisTileCacheSize 4096)</tt> \n
+   *    The default value is 0, which keeps all tiles that have been used.\n
+   * \parameter StatisticalModelBasisPrecision: The precision in which the mean and the modes are stored:
+   * 		"native" (the precision of elastix, usually double), "float32", "float16", or "int16" with a
+   * 		scale per mode. The coefficients are always applied in double. float16 has a relative error
+   * 		of at most 4.9e-4 per value, int16 an absolute error of at most 1.53e-5 times the largest
+   * 		magnitude of the mode. A basis file keeps the precision it was written with. \n
+   *    example: <tt>(StatisticalModelBasisPrecision "float16")</tt> \n
+   *    The default value is "native".\n
+   * \parameter StatisticalModelSupportBlockSize: For models whose modes are local, e.g. models of
+   * 		several organs with separate modes, the edge length in voxels of the blocks in which is
+   * 		indexed which modes are non-zero. The Jacobians with respect to the coefficients then hold
+   * 		only the modes that are non-zero at the point, so that the metric derivative costs time in
+   * 		proportion to the overlap of the modes instead of their number. The number of modes per point
+   * 		is written to the log in each resolution. Disables StatisticalModelJacobianCacheSize. \n
+   *    example: <tt>(StatisticalModelSupportBlockSize 8)</tt> \n
+   *    The default value is 0, which evaluates all modes at every point.\n
+   * \parameter StatisticalModelSupportTolerance: A mode is taken as zero in a block where its magnitude
+   * 		is at most this fraction of its largest magnitude. \n
+   *    example: <tt>(StatisticalModelSupportTolerance 0.001)</tt> \n
+   *    The default value is 0, which leaves out the modes that are exactly zero only.\n
+   * \parameter StatisticalModelBSplineControlPointSpacing: The spacing in voxels of the model of the
+   * 		control points of a cubic B-spline that replaces the voxels of the basis. The mean and each mode
+   * 		are fitted once, in the least squares sense, after the basis has been drawn or mapped, so that the
+   * 		basis takes about spacing^Dimension times less memory, and a point reads 4^Dimension control points
+   * 		instead of 2^Dimension voxels. The B-spline is smooth, so no model pyramid is built. The error of
+   * 		the fit per mode is written to the log. Can be given for each dimension. \n
+   *    example: <tt>(StatisticalModelBSplineControlPointSpacing 4 4 2)</tt> \n
+   *    The default value is 0, which keeps the voxels.\n
    * \parameter UsedNumberOfStatisticalModelCoefficients: The number of coefficients and
    * 		deformation fields used for the statistical model. Choosing a number lower than the
    * 		amount of deformation fields in the model may speed up the registration, possibly at
-   * 		the cost of accuracy. \n
+   * 		the cost of accuracy. Only the used deformation fields are drawn from the model and
+   * 		interpolated, and only the used coefficients are parameters of the transform. \n
    *    example: <tt>(UsedNumberOfStatisticalModelCoefficients 10)</tt> \n
+   *    The number can be given for each resolution, in which case the coefficients of a resolution
+   *    are carried forward to the next one and additional modes start at zero. This way the coarse
+   *    resolutions only optimize the dominant modes. \n
+   *    example: <tt>(UsedNumberOfStatisticalModelCoefficients 5 20 80)</tt> \n
    *    The default value is 0, which results in all available coefficients to be used.\n
+   * \parameter StatisticalModelLazyBasis: Whether to draw only the modes of the first resolution from
+   * 		the model before the registration starts, and the further modes of each resolution when it
+   * 		starts, keeping those drawn before. Only useful with a number of coefficients per resolution.
+   * 		The modes are drawn in parallel in any case. transformix always draws all modes at once. \n
+   *    example: <tt>(StatisticalModelLazyBasis "true")</tt> \n
+   *    The default value is "false".\n
+   * \parameter StatisticalModelJacobianCacheSize: Memory budget in megabytes for caching the
+   * 		mean displacement and the parameter Jacobian at each sample point. The model is linear in its
+   * 		coefficients, so these do not change as long as the sample set stays the same. The cache
+   * 		is only used when (NewSamplesEveryIteration "false") or with the "Grid" and "Full" image
+   * 		samplers, and is skipped if the samples do not fit in the budget. Can be given for each
+   * 		resolution. \n
+   *    example: <tt>(StatisticalModelJacobianCacheSize 256)</tt> \n
+   *    The default value is 0, which disables the cache.\n
+   * \parameter StatisticalModelFusedJacobian: Whether TransformPoint keeps the parameter Jacobian that it
+   * 		interpolates on the way, so that the GetJacobian of the metric at the same sample copies it
+   * 		instead of interpolating all modes a second time. Not used with a non-zero
+   * 		StatisticalModelSupportTolerance, nor for samples in the Jacobian cache. Can be given for each
+   * 		resolution. \n
+   *    example: <tt>(StatisticalModelFusedJacobian "false")</tt> \n
+   *    The default value is "true".\n
+   * \parameter UseStatisticalModelPyramid: Whether to evaluate a smoothed and downsampled copy of the
+   * 		model basis at the coarse resolutions. The copies follow the schedule of the fixed image pyramid,
+   * 		with the same smoothing as the recursive image pyramids, applied to the grid of the model. \n
+   *    example: <tt>(UseStatisticalModelPyramid "true")</tt> \n
+   *    The default value is "false".\n
+   * \parameter StatisticalModelPyramidSchedule: The shrink factors of the model grid for each resolution
+   * 		and dimension, used instead of the image pyramid schedule. Setting it implies
+   * 		(UseStatisticalModelPyramid "true"). \n
+   *    example: <tt>(StatisticalModelPyramidSchedule 4 4 4 2 2 2 1 1 1)</tt> \n
+   * \parameter UseStatisticalModelParameterScales: Whether to pass scales derived from the variances of
+   * 		the modes to the optimizer, sqrt(variance_k / variance_0) for coefficient k. They give every
+   * 		column of the parameter Jacobian the same norm, a diagonal preconditioner that needs no samples.
+   * 		The analytic Jacobian terms of the scaled coefficients, including a strict bound on the norm of
+   * 		the Jacobian, are written to the log, so the sampling of NumberOfJacobianMeasurements by the
+   * 		AutomaticParameterEstimation of AdaptiveStochasticGradientDescent can be shortened or replaced by
+   * 		a fixed SP_a. Can be given for each resolution. \n
+   *    example: <tt>(UseStatisticalModelParameterScales "true")</tt> \n
+   *    The default value is "false".\n
+   * \parameter ReleaseStatisticalModel: Whether to free the loaded model once the used modes have been
+   * 		drawn into the basis, which otherwise holds the same data a second time. The model is loaded
+   * 		only for drawing the basis; the parameter Jacobian, the output and transformix use the basis.
+   * 		All used modes are drawn at once, so StatisticalModelLazyBasis is ignored, and a model cached by
+   * 		CacheStatisticalModel keeps its basis only. \n
+   *    example: <tt>(ReleaseStatisticalModel "true")</tt> \n
+   *    The default value is "false".\n
+   * \parameter CacheStatisticalModel: Whether to keep the loaded model and its basis in memory,
+   * 		such that later registrations in the same process that use the same model file and the same
+   * 		number of coefficients do not load it again. A file that has been modified is loaded again.
+   * 		The most recently used model is kept after its registration has finished. \n
+   *    example: <tt>(CacheStatisticalModel "true")</tt> \n
+   *    The default value is "false".\n
+   * \parameter StatisticalModelInversePointFileName: For transformix: a file of points in the moving image,
+   * 		in the format of transformix -def, that are mapped to the fixed image by the approximate inverse of
+   * 		the model deformation. The points are written to inverseoutputpoints.txt in the output directory,
+   * 		with the residual |T(x) - y| of each. Newton iterations with the analytic spatial Jacobian stop at
+   * 		StatisticalModelInverseTolerance mm. Points given as indices are converted with the geometry of
+   * 		the moving image, so these need transformix -in. Only the transform of the parameter file given to
+   * 		transformix inverts the points, not one loaded as its initial transform, and that transform must
+   * 		not have an initial transform itself. \n
+   *    example: <tt>(StatisticalModelInversePointFileName "movingpoints.txt")</tt> \n
+   * \parameter StatisticalModelInverseLatticeSpacing: With StatisticalModelInversePointFileName: the spacing,
+   * 		in voxels of the model, of a lattice that is inverted first, such that each point starts from the
+   * 		inverse interpolated from it. Pays off for dense point sets only. \n
+   *    example: <tt>(StatisticalModelInverseLatticeSpacing 4)</tt> \n
+   *    The default value is 0, which starts each point from its own fixed point guess.\n
+   * \parameter StatisticalModelInverseTolerance: The residual in mm at which the inversion of a point stops. \n
+   *    example: <tt>(StatisticalModelInverseTolerance 0.001)</tt> \n
+   *    The default value is 0.0001.\n
+   * \parameter StatisticalModelInstrumentation: Whether to count the calls of TransformPoint and of the
+   * 		Jacobians, the points outside the model domain and the Jacobian cache hits, and to time them and
+   * 		the loading of the model. Each thread counts on its own, so the metric threads do not wait for
+   * 		each other. The counts of each resolution are written to the log, and those of the whole
+   * 		registration to the transform parameter file. The number of Jacobians evaluated before the
+   * 		first iteration of each resolution, e.g. for the automatic parameter estimation of the optimizer,
+   * 		is written to the log after the second iteration. \n
+   *    example: <tt>(StatisticalModelInstrumentation "true")</tt> \n
+   *    The default value is "false".\n
+   * \parameter StatisticalModelFixedLandmarkFileName: A file of landmarks in the fixed image, in the
+   * 		format of transformix -def, that correspond to those of StatisticalModelMovingLandmarkFileName.
+   * 		The registration starts from the closed-form posterior mean of the coefficients given that the
+   * 		model maps each fixed landmark to its moving landmark, instead of from the mean of the model.
+   * 		The landmarks are taken in the domain of the model, so an initial transform is not applied to
+   * 		them. The RMS landmark error before and after is written to the log. \n
+   *    example: <tt>(StatisticalModelFixedLandmarkFileName "fixedlandmarks.txt")</tt> \n
+   * \parameter StatisticalModelMovingLandmarkFileName: The corresponding landmarks in the moving image. \n
+   *    example: <tt>(StatisticalModelMovingLandmarkFileName "movinglandmarks.txt")</tt> \n
+   * \parameter StatisticalModelLandmarkVariance: The variance in mm^2 of the noise of the landmark
+   * 		positions, the same in all directions. Small values make the model interpolate the landmarks. \n
+   *    example: <tt>(StatisticalModelLandmarkVariance 4.0)</tt> \n
+   *    The default value is 1.0.\n
+   * \parameter StatisticalModelLandmarkPosteriorBasis: Whether to replace the model by the posterior model
+   * 		that statismo builds from the landmarks, whose mean passes near the landmarks and whose modes vary
+   * 		only where the landmarks leave freedom, ordered by their posterior variance. Fewer coefficients,
+   * 		see UsedNumberOfStatisticalModelCoefficients, then suffice. Needs the model, not a basis file;
+   * 		ReleaseStatisticalModel is ignored. The landmarks are written to the transform parameter file, so
+   * 		that transformix builds the same posterior model. \n
+   *    example: <tt>(StatisticalModelLandmarkPosteriorBasis "true")</tt> \n
+   *    The default value is "false".\n
 
    *
    * \ingroup Transforms
@@ -109,6 +254,7 @@ namespace elastix
     typedef typename Superclass1::OutputVnlVectorType       OutputVnlVectorType;
     typedef typename Superclass1::InputPointType            InputPointType;
     typedef typename Superclass1::OutputPointType           OutputPointType;
+    typedef typename Superclass1::NonZeroJacobianIndicesType NonZeroJacobianIndicesType;
 
     /** Typedef's from the TransformBase class. */
     typedef typename Superclass2::ElastixType               ElastixType;
@@ -122,6 +268,12 @@ namespace elastix
     typedef typename Superclass2::MovingImageType           MovingImageType;
     typedef typename Superclass2::ITKBaseType               ITKBaseType;
     typedef typename Superclass2::CombinationTransformType  CombinationTransformType;
+    typedef typename Superclass2::DeformationFieldImageType DeformationFieldImageType;
+
+    /** Typedef's for reading the sample set of the metric. */
+    typedef typename ElastixType::MetricBaseType            MetricBaseType;
+    typedef typename MetricBaseType::ImageSamplerBaseType   ImageSamplerBaseType;
+    typedef typename ImageSamplerBaseType::ImageSampleContainerType ImageSampleContainerType;
 
     /** Statismo typedefs */
 	typedef itk::Vector<CoordRepType, elx::TransformBase<TElastix>::FixedImageDimension> VectorPixelType;
@@ -134,6 +286,10 @@ namespace elastix
     typedef itk::AdvancedStatisticalDeformationModelTransform<
       RepresenterType, CoordRepType, elx::TransformBase<TElastix>::FixedImageDimension >   StatisticalDeformationModelTransformType;
     typedef typename StatisticalDeformationModelTransformType::Pointer      StatisticalDeformationModelTransformPointer;
+    typedef typename StatisticalDeformationModelTransformType::PointListType PointListType;
+    typedef typename StatisticalDeformationModelTransformType::BasisType     BasisType;
+    typedef itk::StatisticalModelCache<StatisticalModelType, BasisType>      StatisticalModelCacheType;
+    typedef typename StatisticalDeformationModelTransformType::CountersType  CountersType;
 
     /** Execute stuff before the actual registration:
      * \li Call InitializeTransform.
@@ -142,22 +298,78 @@ namespace elastix
 
     virtual int BeforeAllTransformix(void);
 
+    /** Execute stuff before each resolution:
+     * \li Activate the number of coefficients used in this resolution.
+     * \li Select the basis of this resolution from the model pyramid.
+     * \li Pass the parameter scales of the model to the optimizer, if requested.
+     * \li Reset the Jacobian cache.
+     * \li Set the memory budget of the tiles of a tiled basis file.
+     */
+    virtual void BeforeEachResolution(void);
+
+    /** Execute stuff after each resolution:
+     * \li Print the misses and evictions of the tiles of a tiled basis file.
+     * \li Print the counters of the transform, if StatisticalModelInstrumentation is set.
+     */
+    virtual void AfterEachResolution(void);
+
+    /** Read the transform parameters, and map the points of StatisticalModelInversePointFileName
+     * with the approximate inverse, if given.
+     */
+    virtual void ReadFromFile( void );
+
+    /** Execute stuff after the registration:
+     * \li Return to the full resolution basis for the final result.
+     */
+    virtual void AfterRegistration(void);
+
+    /** Read the shrink factors of the model pyramid and pass them to the transform. */
+    virtual void SetBasisPyramidSchedule(void);
+
+    /** Execute stuff after each iteration:
+     * \li Print the Jacobian evaluations before the first iteration, see PrintStartupJacobianEvaluations.
+     * \li (Re)build the Jacobian cache if the sample set of the metric changed.
+     * \li Read ahead the tiles of a tiled basis file in which the new samples lie.
+     */
+    virtual void AfterEachIteration(void);
+
+    /** Print, after the second iteration of a resolution and with StatisticalModelInstrumentation, how
+     * many Jacobians were evaluated before the first iteration, e.g. by the automatic parameter estimation
+     * of the optimizer, from the counts after the first and the second iteration.
+     */
+    void PrintStartupJacobianEvaluations(void);
+
     /** Initialize Transform.
      * \li Set all parameters to zero.
-     * \li Set initial translation:
-     *  the initial translation between fixed and moving image is guessed,
-     *  if the user has set (AutomaticTransformInitialization "true").
+     * \li Constrain the model to the landmarks, if given, see InitializeFromLandmarks.
      */
     virtual void InitializeTransform(void);
 
+    /** Read the landmarks of StatisticalModelFixedLandmarkFileName and StatisticalModelMovingLandmarkFileName
+     * and replace the model by the posterior model given them, with StatisticalModelLandmarkPosteriorBasis,
+     * or else set the parameters to the posterior mean of the coefficients. transformix only builds the
+     * posterior model; it reads the coefficients.
+     */
+    virtual void InitializeFromLandmarks(void);
+
+    /** Generate the deformation field on the output grid of the resampler, e.g. for transformix -def all.
+     * Without an initial transform the field is evaluated from the model basis in one multithreaded pass;
+     * otherwise the pointwise implementation of the TransformBase is used.
+     */
+    virtual typename DeformationFieldImageType::Pointer GenerateDeformationFieldImage( void ) const;
+
     /** Function to write transform-parameters to a file. */
     virtual void WriteToFile( const ParametersType & param ) const;
     /** Function to write everything specific to this transform to file. */
     virtual void WriteToFileSpecific( const ParametersType & param ) const;
 
 
-    /** Read a file of landmarks from a file. */
-    std::vector<InputPointType> ReadPointSetFromFile( const std::string filename ) const;
+    /** Print the size of the B-spline basis and the error of its fit per mode, if the basis is a B-spline. */
+    void PrintBSplineApproximationErrors( void ) const;
+
+    /** Read a file of points, in the format of transformix -def, in the fixed or the moving image. */
+    std::vector<InputPointType> ReadPointSetFromFile( const std::string filename,
+      const bool inMovingImage = false ) const;
 
 
     virtual void ComputeJacobianWithRespectToParameters(
@@ -179,6 +391,28 @@ namespace elastix
     StatisticalDeformationModelTransformPointer m_StatisticalDeformationModelTransform;
     typename StatisticalModelType::Pointer m_StatisticalModel;
     std::string m_StatisticalModelName;
+    std::string m_StatisticalModelBasisFileName;
+
+    /** State of the per-sample Jacobian cache of the current resolution, and of the sample set last seen. */
+    bool m_UseJacobianCache;
+    bool m_PrefetchBasisTiles;
+    bool m_JacobianCacheIgnoresSampleTime;
+    const ImageSampleContainerType * m_JacobianCacheSamples;
+    unsigned long m_JacobianCacheSamplesMTime;
+
+    /** The iterations of the current resolution seen so far, up to 2, and the Jacobian evaluations
+     * of the resolution up to the end of its first iteration, with StatisticalModelInstrumentation. */
+    unsigned int m_NumberOfIterationsOfResolution;
+    itk::SizeValueType m_JacobianEvaluationsOfFirstIteration;
+
+    /** The counters of the finished resolutions, with StatisticalModelInstrumentation. */
+    typename CountersType::Values m_InstrumentationTotals;
+
+    /** The landmarks that constrain the model; transformix needs them for the posterior model only. */
+    std::string m_FixedLandmarkFileName;
+    std::string m_MovingLandmarkFileName;
+    double m_LandmarkVariance;
+    bool m_UseLandmarkPosteriorBasis;
 
 
 
@@ -28,6 +28,16 @@
 
 #include <Eigen/QR>
 
+#include <itkPointSet.h>
+#include "itkPosteriorModelBuilder.h"
+#include <itkTimeProbe.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include "itksys/SystemTools.hxx"
+
 namespace elastix
 {
 
@@ -37,11 +47,21 @@ namespace elastix
 
   template <class TElastix>
     SimpleStatisticalDeformationModelTransformElastix<TElastix>
-    ::SimpleStatisticalDeformationModelTransformElastix()
+    ::SimpleStatisticalDeformationModelTransformElastix() :
+    m_UseJacobianCache(false),
+    m_PrefetchBasisTiles(false),
+    m_JacobianCacheIgnoresSampleTime(false),
+    m_JacobianCacheSamples(0),
+    m_JacobianCacheSamplesMTime(0),
+    m_NumberOfIterationsOfResolution(0),
+    m_JacobianEvaluationsOfFirstIteration(0),
+    m_LandmarkVariance(1.0),
+    m_UseLandmarkPosteriorBasis(false)
   {
     this->m_StatisticalDeformationModelTransform =
       StatisticalDeformationModelTransformType::New();
     this->SetCurrentTransform( this->m_StatisticalDeformationModelTransform );
+    std::memset( &this->m_InstrumentationTotals, 0, sizeof( this->m_InstrumentationTotals ) );
   } // end Constructor
 
 
@@ -53,6 +73,9 @@ namespace elastix
     int SimpleStatisticalDeformationModelTransformElastix<TElastix>
     ::BeforeAll(void)
   {
+  	/** The model pyramid must be known before the basis is built. */
+    this->SetBasisPyramidSchedule();
+
   	/** Give initial parameters to this->m_Registration.*/
     this->InitializeTransform();
     return 0;
@@ -64,11 +87,459 @@ namespace elastix
     ::BeforeAllTransformix(void)
   {
 
-  	return this->BeforeAll();
+    /** Transformix always uses the full resolution basis. */
+    this->InitializeTransform();
+    return 0;
 
   } // end BeforeAllTransformix
 
 
+  /**
+   * ******************* SetBasisPyramidSchedule ***********************
+   */
+
+  template <class TElastix>
+    void SimpleStatisticalDeformationModelTransformElastix<TElastix>
+    ::SetBasisPyramidSchedule(void)
+  {
+    const unsigned int numberOfModelScheduleEntries =
+      this->GetConfiguration()->CountNumberOfParameterEntries( "StatisticalModelPyramidSchedule" );
+    bool useStatisticalModelPyramid = numberOfModelScheduleEntries > 0;
+    this->GetConfiguration()->ReadParameter( useStatisticalModelPyramid,
+      "UseStatisticalModelPyramid", 0, false );
+    if ( !useStatisticalModelPyramid )
+    {
+      return;
+    }
+
+    unsigned int numberOfResolutions = 3;
+    this->GetConfiguration()->ReadParameter( numberOfResolutions, "NumberOfResolutions", 0, false );
+
+    /** Take the schedule of the model, or else that of the fixed image pyramid. */
+    std::string scheduleName = "StatisticalModelPyramidSchedule";
+    if ( numberOfModelScheduleEntries == 0 )
+    {
+      scheduleName = "FixedImagePyramidSchedule";
+      if ( this->GetConfiguration()->CountNumberOfParameterEntries( scheduleName ) == 0 )
+      {
+        scheduleName = "ImagePyramidSchedule";
+      }
+    }
+    const unsigned int numberOfScheduleEntries =
+      this->GetConfiguration()->CountNumberOfParameterEntries( scheduleName );
+    const bool useDefaultSchedule = numberOfScheduleEntries != numberOfResolutions * SpaceDimension;
+    if ( useDefaultSchedule && numberOfScheduleEntries > 0 )
+    {
+      xout["warning"] << "WARNING: " << scheduleName << " does not have NumberOfResolutions x "
+        << SpaceDimension << " entries; the model pyramid halves the grid per resolution instead." << std::endl;
+    }
+
+    /** By default each coarser resolution halves the grid, as the image pyramids do. */
+    typename StatisticalDeformationModelTransformType::BasisPyramidScheduleType schedule( numberOfResolutions );
+    for ( unsigned int level = 0; level < numberOfResolutions; level++ )
+    {
+      for ( unsigned int i = 0; i < SpaceDimension; i++ )
+      {
+        unsigned int factor = 1u << ( numberOfResolutions - level - 1 );
+        if ( !useDefaultSchedule )
+        {
+          this->GetConfiguration()->ReadParameter( factor, scheduleName, level * SpaceDimension + i, false );
+        }
+        schedule[ level ][ i ] = factor;
+      }
+    }
+
+    this->m_StatisticalDeformationModelTransform->SetBasisPyramidSchedule( schedule );
+
+  } // end SetBasisPyramidSchedule
+
+
+  /**
+   * ******************* BeforeEachResolution ***********************
+   */
+
+  template <class TElastix>
+    void SimpleStatisticalDeformationModelTransformElastix<TElastix>
+    ::BeforeEachResolution(void)
+  {
+    const unsigned int level =
+      this->m_Registration->GetAsITKBaseType()->GetCurrentLevel();
+
+    /** Activate the modes of this resolution. The coefficients of the modes that stay
+     * active are carried forward; newly activated modes start at zero. */
+    unsigned usedNumberOfStatisticalModelCoefficients = 0;
+    this->GetConfiguration()->ReadParameter( usedNumberOfStatisticalModelCoefficients,
+      "UsedNumberOfStatisticalModelCoefficients", this->GetComponentLabel(), level, 0, false );
+    if ( usedNumberOfStatisticalModelCoefficients == 0 )
+    {
+      usedNumberOfStatisticalModelCoefficients =
+        this->m_StatisticalDeformationModelTransform->GetNumberOfPrincipalComponents();
+    }
+    const BasisType * previousBasis = this->m_StatisticalDeformationModelTransform->GetFullResolutionBasis();
+    const unsigned int numberOfDrawnModes = ( previousBasis != 0 ) ? previousBasis->GetNumberOfModes() : 0;
+    this->m_StatisticalDeformationModelTransform->SetUsedNumberOfCoefficients( usedNumberOfStatisticalModelCoefficients );
+    const BasisType * currentBasis = this->m_StatisticalDeformationModelTransform->GetFullResolutionBasis();
+    if ( currentBasis != 0 && currentBasis->GetNumberOfModes() > numberOfDrawnModes )
+    {
+      elxout << "  Drew modes " << numberOfDrawnModes << " to " << currentBasis->GetNumberOfModes() - 1
+        << " from the model for this resolution." << std::endl;
+    }
+    this->m_Registration->GetAsITKBaseType()->
+      SetInitialTransformParametersOfNextLevel( this->GetParameters() );
+    elxout << "  Optimizing " << this->GetNumberOfParameters()
+      << " statistical model coefficients in this resolution." << std::endl;
+
+    this->m_StatisticalDeformationModelTransform->SetCurrentBasisLevel( level );
+    if ( this->m_StatisticalDeformationModelTransform->HasModeSupport() )
+    {
+      elxout << "  At most " << this->m_StatisticalDeformationModelTransform->GetNumberOfNonZeroJacobianIndices()
+        << " of the " << this->GetNumberOfParameters() << " modes are non-zero at any point." << std::endl;
+    }
+
+    /** Keep the Jacobian of TransformPoint for the GetJacobian of the metric at the same sample. */
+    bool fusedJacobian = true;
+    this->GetConfiguration()->ReadParameter( fusedJacobian,
+      "StatisticalModelFusedJacobian", this->GetComponentLabel(), level, 0, false );
+    this->m_StatisticalDeformationModelTransform->SetFusedJacobian( fusedJacobian );
+
+    /** Precondition the optimizer with the variances of the modes, instead of sampling. */
+    bool useParameterScales = false;
+    this->GetConfiguration()->ReadParameter( useParameterScales,
+      "UseStatisticalModelParameterScales", this->GetComponentLabel(), level, 0, false );
+    if ( useParameterScales )
+    {
+      typename StatisticalDeformationModelTransformType::ScalesType scales;
+      this->m_StatisticalDeformationModelTransform->GetParameterScales( scales );
+      this->m_Registration->GetAsITKBaseType()->GetOptimizer()->SetScales( scales );
+
+      double TrC = 0.0;
+      double TrCC = 0.0;
+      double maxJJ = 0.0;
+      double maxJCJ = 0.0;
+      this->m_StatisticalDeformationModelTransform->ComputeJacobianTerms( scales, TrC, TrCC, maxJJ, maxJCJ );
+      elxout << "  Analytic Jacobian terms of the scaled coefficients: TrC = " << TrC
+        << ", TrCC = " << TrCC << ", maxJJ <= " << maxJJ << ", maxJCJ <= " << maxJCJ
+        << ", i.e. |dT/dp| <= " << std::sqrt( maxJJ ) << " everywhere." << std::endl;
+    }
+
+    /** The samples of the previous resolution are of no use anymore. */
+    this->m_StatisticalDeformationModelTransform->ClearJacobianCache();
+    this->m_JacobianCacheSamples = 0;
+    this->m_JacobianCacheSamplesMTime = 0;
+
+    unsigned int jacobianCacheSize = 0;
+    this->GetConfiguration()->ReadParameter( jacobianCacheSize,
+      "StatisticalModelJacobianCacheSize", this->GetComponentLabel(), level, 0, false );
+
+    /** A cache only pays off if the samples are reused in the next iterations. */
+    bool newSamplesEveryIteration = false;
+    this->GetConfiguration()->ReadParameter( newSamplesEveryIteration,
+      "NewSamplesEveryIteration", "", level, 0, false );
+    std::string imageSampler = "";
+    this->GetConfiguration()->ReadParameter( imageSampler, "ImageSampler", 0, false );
+    this->m_JacobianCacheIgnoresSampleTime = ( imageSampler == "Grid" || imageSampler == "Full" );
+
+    this->m_UseJacobianCache = jacobianCacheSize > 0
+      && ( !newSamplesEveryIteration || this->m_JacobianCacheIgnoresSampleTime );
+    if ( this->m_UseJacobianCache && this->m_StatisticalDeformationModelTransform->HasModeSupport() )
+    {
+      elxout << "  The Jacobian cache holds dense Jacobians and is not used with StatisticalModelSupportBlockSize."
+        << std::endl;
+      this->m_UseJacobianCache = false;
+    }
+    this->m_StatisticalDeformationModelTransform->SetJacobianCacheMaximumMemory(
+      static_cast<itk::SizeValueType>( jacobianCacheSize ) * 1024 * 1024 );
+
+    /** A tiled basis file keeps the used tiles in memory up to the budget. */
+    const BasisType * basis = this->m_StatisticalDeformationModelTransform->GetBasis();
+    itk::DeformationBasisTileCache * tileCache = ( basis != 0 ) ? basis->GetTileCache() : 0;
+    this->m_PrefetchBasisTiles = tileCache != 0;
+    if ( tileCache != 0 )
+    {
+      unsigned int tileCacheSize = 0;
+      this->GetConfiguration()->ReadParameter( tileCacheSize,
+        "StatisticalModelBasisTileCacheSize", this->GetComponentLabel(), level, 0, false );
+      tileCache->SetMaximumMemory( static_cast<itk::SizeValueType>( tileCacheSize ) * 1024 * 1024 );
+      tileCache->ResetCounters();
+    }
+
+    CountersType * counters = this->m_StatisticalDeformationModelTransform->GetCounters();
+    if ( counters != 0 )
+    {
+      counters->Reset();
+    }
+    this->m_NumberOfIterationsOfResolution = 0;
+    this->m_JacobianEvaluationsOfFirstIteration = 0;
+
+  } // end BeforeEachResolution
+
+
+  /**
+   * ******************* AfterEachResolution ***********************
+   */
+
+  template <class TElastix>
+    void SimpleStatisticalDeformationModelTransformElastix<TElastix>
+    ::AfterEachResolution(void)
+  {
+    const BasisType * basis = this->m_StatisticalDeformationModelTransform->GetBasis();
+    const itk::DeformationBasisTileCache * tileCache = ( basis != 0 ) ? basis->GetTileCache() : 0;
+    if ( tileCache != 0 )
+    {
+      elxout << "  Basis tiles: " << tileCache->GetNumberOfMisses() << " misses, "
+        << tileCache->GetNumberOfPrefetches() << " prefetched, "
+        << tileCache->GetNumberOfEvictions() << " evicted; "
+        << tileCache->GetNumberOfResidentTiles() << " of " << tileCache->GetNumberOfTiles()
+        << " tiles of " << tileCache->GetTileSize() / 1024 << " kB resident." << std::endl;
+    }
+
+    const CountersType * counters = this->m_StatisticalDeformationModelTransform->GetCounters();
+    if ( counters == 0 )
+    {
+      return;
+    }
+    const typename CountersType::Values values = counters->GetValues();
+    const itk::SizeValueType numberOfCalls = values.GetNumberOfCalls();
+    elxout << "  Transform calls: " << values.Counts[ CountersType::TransformPointCalls ] << " TransformPoint, "
+      << values.Counts[ CountersType::JacobianCalls ] << " ComputeJacobianWithRespectToParameters, "
+      << values.Counts[ CountersType::GetJacobianCalls ] << " GetJacobian; "
+      << values.Counts[ CountersType::JacobianCacheHits ] << " Jacobian cache hits, "
+      << values.Counts[ CountersType::FusedJacobianHits ] << " GetJacobian from the preceding TransformPoint";
+    if ( numberOfCalls > 0 )
+    {
+      elxout << ", " << 100.0 * values.Counts[ CountersType::OutsidePoints ] / numberOfCalls
+        << "% of the points outside the model, " << 1e9 * values.EvaluationSeconds / numberOfCalls
+        << " ns per call";
+    }
+    elxout << ", " << values.EvaluationSeconds << " s in all threads." << std::endl;
+
+    for ( unsigned int c = 0; c < CountersType::NumberOfCounters; c++ )
+    {
+      this->m_InstrumentationTotals.Counts[ c ] += values.Counts[ c ];
+    }
+    this->m_InstrumentationTotals.EvaluationSeconds += values.EvaluationSeconds;
+    this->m_InstrumentationTotals.StartupSeconds = values.StartupSeconds;
+
+  } // end AfterEachResolution
+
+
+  /**
+   * ******************* AfterEachIteration ***********************
+   */
+
+  template <class TElastix>
+    void SimpleStatisticalDeformationModelTransformElastix<TElastix>
+    ::AfterEachIteration(void)
+  {
+    this->PrintStartupJacobianEvaluations();
+
+    if ( !this->m_UseJacobianCache && !this->m_PrefetchBasisTiles )
+    {
+      return;
+    }
+
+    ImageSamplerBaseType * sampler =
+      this->GetElastix()->GetElxMetricBase()->GetAdvancedMetricImageSampler();
+    if ( sampler == 0 )
+    {
+      this->m_UseJacobianCache = false;
+      this->m_PrefetchBasisTiles = false;
+      return;
+    }
+
+    /** The cache is keyed by the sample container; grid samplers refill it with the same points. */
+    const ImageSampleContainerType * samples = sampler->GetOutput();
+    const unsigned long samplesMTime = this->m_JacobianCacheIgnoresSampleTime ? 0 : samples->GetMTime();
+    if ( samples == this->m_JacobianCacheSamples && samplesMTime == this->m_JacobianCacheSamplesMTime )
+    {
+      return;
+    }
+
+    /** The model is evaluated where the points arrive, i.e. after a composed initial transform. */
+    const typename Superclass1::InitialTransformType * initialTransform =
+      this->GetUseComposition() ? this->GetInitialTransform() : 0;
+    PointListType points;
+    points.reserve( samples->Size() );
+    for ( typename ImageSampleContainerType::ConstIterator it = samples->Begin(); it != samples->End(); ++it )
+    {
+      InputPointType point;
+      for ( unsigned int i = 0; i < SpaceDimension; i++ )
+      {
+        point[ i ] = it->Value().m_ImageCoordinates[ i ];
+      }
+      points.push_back( initialTransform != 0 ? initialTransform->TransformPoint( point ) : point );
+    }
+
+    /** The samples of a fixed set, or of a sampler over a fixed region, are read in the next iterations too. */
+    if ( this->m_PrefetchBasisTiles )
+    {
+      this->m_StatisticalDeformationModelTransform->GetBasis()->PrefetchPoints( points );
+    }
+    if ( !this->m_UseJacobianCache )
+    {
+      this->m_JacobianCacheSamples = samples;
+      this->m_JacobianCacheSamplesMTime = samplesMTime;
+      return;
+    }
+
+    if ( !this->m_StatisticalDeformationModelTransform->BuildJacobianCache( points ) )
+    {
+      elxout << "  The Jacobian cache for " << points.size()
+        << " samples exceeds StatisticalModelJacobianCacheSize; evaluating the model directly." << std::endl;
+      this->m_UseJacobianCache = false;
+      return;
+    }
+
+    this->m_JacobianCacheSamples = samples;
+    this->m_JacobianCacheSamplesMTime = samplesMTime;
+
+  } // end AfterEachIteration
+
+
+  /**
+   * ******************* PrintStartupJacobianEvaluations ***********************
+   */
+
+  template <class TElastix>
+    void SimpleStatisticalDeformationModelTransformElastix<TElastix>
+    ::PrintStartupJacobianEvaluations(void)
+  {
+    const CountersType * counters = this->m_StatisticalDeformationModelTransform->GetCounters();
+    if ( counters == 0 || this->m_NumberOfIterationsOfResolution >= 2 )
+    {
+      return;
+    }
+    this->m_NumberOfIterationsOfResolution++;
+
+    /** The counters are reset before each resolution, so they hold the evaluations of the
+     * resolution so far, including those of e.g. the automatic parameter estimation of the optimizer. */
+    const typename CountersType::Values values = counters->GetValues();
+    const itk::SizeValueType evaluations
+      = values.Counts[ CountersType::JacobianCalls ] + values.Counts[ CountersType::GetJacobianCalls ];
+    if ( this->m_NumberOfIterationsOfResolution == 1 )
+    {
+      this->m_JacobianEvaluationsOfFirstIteration = evaluations;
+      return;
+    }
+
+    /** The second iteration shows what an iteration takes; the rest of the first happened before it. */
+    const itk::SizeValueType evaluationsPerIteration = evaluations - this->m_JacobianEvaluationsOfFirstIteration;
+    const itk::SizeValueType startupEvaluations = this->m_JacobianEvaluationsOfFirstIteration > evaluationsPerIteration
+      ? this->m_JacobianEvaluationsOfFirstIteration - evaluationsPerIteration : 0;
+    elxout << "  Jacobian evaluations: " << this->m_JacobianEvaluationsOfFirstIteration
+      << " up to the end of the first iteration, " << evaluationsPerIteration
+      << " per iteration, i.e. " << startupEvaluations << " before the first iteration." << std::endl;
+
+  } // end PrintStartupJacobianEvaluations
+
+
+  /**
+   * ******************* AfterRegistration ***********************
+   */
+
+  template <class TElastix>
+    void SimpleStatisticalDeformationModelTransformElastix<TElastix>
+    ::AfterRegistration(void)
+  {
+    /** The resampler asks for the points only. */
+    this->m_StatisticalDeformationModelTransform->SetFusedJacobian( false );
+    this->m_StatisticalDeformationModelTransform->UseFullResolutionBasis();
+
+  } // end AfterRegistration
+
+
+  /**
+   * ************************* ReadFromFile *********************
+   */
+
+  template <class TElastix>
+    void SimpleStatisticalDeformationModelTransformElastix<TElastix>
+    ::ReadFromFile( void )
+  {
+    this->Superclass2::ReadFromFile();
+
+    /** Map points from the moving to the fixed image with the approximate inverse. */
+    std::string inversePointFileName = "";
+    this->GetConfiguration()->ReadParameter( inversePointFileName, "StatisticalModelInversePointFileName", 0, false );
+    if ( inversePointFileName.empty() )
+    {
+      return;
+    }
+
+    /** Only in transformix, and only for its own transform, not for one read as an initial transform. */
+    if ( this->m_Registration != 0 || this->GetElastix()->GetElxTransformBase() != this )
+    {
+      return;
+    }
+    if ( this->GetInitialTransform() != 0 )
+    {
+      xout["warning"] << "WARNING: StatisticalModelInversePointFileName is not supported with an initial transform."
+        << std::endl;
+      return;
+    }
+
+    unsigned int latticeSpacing = 0;
+    double tolerance = this->m_StatisticalDeformationModelTransform->GetInverseTolerance();
+    this->GetConfiguration()->ReadParameter( latticeSpacing, "StatisticalModelInverseLatticeSpacing", 0, false );
+    this->GetConfiguration()->ReadParameter( tolerance, "StatisticalModelInverseTolerance", 0, false );
+    this->m_StatisticalDeformationModelTransform->SetInverseTolerance( tolerance );
+
+    const std::vector<InputPointType> points = this->ReadPointSetFromFile( inversePointFileName, true );
+    const itk::SizeValueType numberOfPoints = points.size();
+    std::vector<CoordRepType> coordinates( SpaceDimension * numberOfPoints );
+    std::vector<CoordRepType> inverseCoordinates( SpaceDimension * numberOfPoints );
+    std::vector<double> residuals( numberOfPoints );
+    CoordRepType * pointCoordinates[ SpaceDimension ];
+    CoordRepType * inversePointCoordinates[ SpaceDimension ];
+    for ( unsigned int i = 0; i < SpaceDimension; i++ )
+    {
+      pointCoordinates[ i ] = numberOfPoints > 0 ? &coordinates[ i * numberOfPoints ] : 0;
+      inversePointCoordinates[ i ] = numberOfPoints > 0 ? &inverseCoordinates[ i * numberOfPoints ] : 0;
+      for ( itk::SizeValueType p = 0; p < numberOfPoints; p++ )
+      {
+        pointCoordinates[ i ][ p ] = points[ p ][ i ];
+      }
+    }
+
+    itk::TimeProbe timer;
+    timer.Start();
+    const double maximumResidual = this->m_StatisticalDeformationModelTransform->InverseTransformPoints(
+      numberOfPoints, pointCoordinates, inversePointCoordinates, numberOfPoints > 0 ? &residuals[ 0 ] : 0,
+      latticeSpacing );
+    timer.Stop();
+
+    const std::string outputFileName = this->GetConfiguration()->GetCommandLineArgument( "-out" )
+      + "inverseoutputpoints.txt";
+    std::ofstream outputFile( outputFileName.c_str() );
+    if ( !outputFile )
+    {
+      itkExceptionMacro( << "Unable to write " << outputFileName );
+    }
+    itk::SizeValueType numberOfUnconverged = 0;
+    for ( itk::SizeValueType p = 0; p < numberOfPoints; p++ )
+    {
+      outputFile << "Point\t" << p << "\t; InputPoint = [ ";
+      for ( unsigned int i = 0; i < SpaceDimension; i++ )
+      {
+        outputFile << pointCoordinates[ i ][ p ] << " ";
+      }
+      outputFile << "]\t; OutputPoint = [ ";
+      for ( unsigned int i = 0; i < SpaceDimension; i++ )
+      {
+        outputFile << inversePointCoordinates[ i ][ p ] << " ";
+      }
+      outputFile << "]\t; Residual = " << residuals[ p ] << std::endl;
+      numberOfUnconverged += ( residuals[ p ] > tolerance ) ? 1 : 0;
+    }
+
+    elxout << "Inverted " << numberOfPoints << " points of " << inversePointFileName << " in "
+      << 1000.0 * timer.GetTotal() << " ms; the largest residual is " << maximumResidual << " mm, "
+      << numberOfUnconverged << " points did not reach " << tolerance << " mm. Written to "
+      << outputFileName << "." << std::endl;
+
+  } // end ReadFromFile
+
+
   /**
    * ************************* InitializeTransform *********************
    */
@@ -81,28 +552,212 @@ namespace elastix
   	std::cout << "InitializeTransform" << std::endl;
 
 
-  	// Read original statistical model. If no initialization with
-  	// point values is performed, this one is used in the registration.
+  	// Read original statistical model. If no posterior model is built
+  	// from landmarks, this one is used in the registration.
+    /** With a precomputed basis file the model itself is not needed. */
+    this->m_StatisticalModelBasisFileName = "";
+    this->GetConfiguration()->ReadParameter( m_StatisticalModelBasisFileName,
+      "StatisticalModelBasisFileName", 0, false );
     this->GetConfiguration()->ReadParameter( m_StatisticalModelName,
-      "StatisticalModelName", 0);
-    typename StatisticalModelType::Pointer statisticalModel = StatisticalModelType::New();
-	typename RepresenterType::Pointer representer = RepresenterType::New();
-	statisticalModel->Load(representer,m_StatisticalModelName.c_str());
+      "StatisticalModelName", 0, m_StatisticalModelBasisFileName.empty() );
+
+    /** The number of used coefficients may be given per resolution. Draw as many modes as
+     * the resolution that uses most of them needs; BeforeEachResolution selects the active ones.
+     * A lazy basis draws the modes of the first resolution only, and BeforeEachResolution the
+     * others when a resolution needs them. transformix always draws all of them. */
+    bool lazyBasis = false;
+    this->GetConfiguration()->ReadParameter( lazyBasis, "StatisticalModelLazyBasis", 0, false );
+    lazyBasis &= ( this->m_Registration != 0 );
 
+    /** A released model cannot draw further modes, so all of them are drawn at once. */
+    bool releaseStatisticalModel = false;
+    this->GetConfiguration()->ReadParameter( releaseStatisticalModel, "ReleaseStatisticalModel", 0, false );
+    if ( releaseStatisticalModel && lazyBasis )
+    {
+      xout["warning"] << "WARNING: StatisticalModelLazyBasis is ignored with (ReleaseStatisticalModel \"true\")."
+        << std::endl;
+      lazyBasis = false;
+    }
+
+    /** Landmarks that constrain the model, see InitializeFromLandmarks. The posterior model is
+     * built from the loaded model, so the model is kept. */
+    this->m_FixedLandmarkFileName = "";
+    this->m_MovingLandmarkFileName = "";
+    this->m_LandmarkVariance = 1.0;
+    this->m_UseLandmarkPosteriorBasis = false;
+    this->GetConfiguration()->ReadParameter( m_FixedLandmarkFileName, "StatisticalModelFixedLandmarkFileName", 0, false );
+    this->GetConfiguration()->ReadParameter( m_MovingLandmarkFileName, "StatisticalModelMovingLandmarkFileName", 0, false );
+    this->GetConfiguration()->ReadParameter( m_LandmarkVariance, "StatisticalModelLandmarkVariance", 0, false );
+    this->GetConfiguration()->ReadParameter( m_UseLandmarkPosteriorBasis, "StatisticalModelLandmarkPosteriorBasis", 0, false );
+    if ( m_FixedLandmarkFileName.empty() != m_MovingLandmarkFileName.empty() )
+    {
+      xout["warning"] << "WARNING: StatisticalModelFixedLandmarkFileName and StatisticalModelMovingLandmarkFileName"
+        << " must be given together; the landmarks are ignored." << std::endl;
+      this->m_FixedLandmarkFileName = "";
+      this->m_MovingLandmarkFileName = "";
+    }
+    this->m_UseLandmarkPosteriorBasis &= !m_FixedLandmarkFileName.empty();
+    if ( this->m_UseLandmarkPosteriorBasis && releaseStatisticalModel )
+    {
+      xout["warning"] << "WARNING: ReleaseStatisticalModel is ignored with (StatisticalModelLandmarkPosteriorBasis \"true\")."
+        << std::endl;
+      releaseStatisticalModel = false;
+    }
+    const unsigned int numberOfEntries = lazyBasis ? 1u : std::max( 1u, static_cast<unsigned int>(
+      this->GetConfiguration()->CountNumberOfParameterEntries( "UsedNumberOfStatisticalModelCoefficients" ) ) );
     unsigned usedNumberOfStatisticalModelCoefficients = 0;
-    this->GetConfiguration()->ReadParameter( usedNumberOfStatisticalModelCoefficients,  "UsedNumberOfStatisticalModelCoefficients", 0, false);
+    for ( unsigned int i = 0; i < numberOfEntries; i++ )
+    {
+      unsigned usedNumberInEntry = 0;
+      this->GetConfiguration()->ReadParameter( usedNumberInEntry,  "UsedNumberOfStatisticalModelCoefficients", i, false);
+      if ( usedNumberInEntry == 0 )
+      {
+        usedNumberOfStatisticalModelCoefficients = 0;
+        break;
+      }
+      usedNumberOfStatisticalModelCoefficients = std::max( usedNumberOfStatisticalModelCoefficients, usedNumberInEntry );
+    }
 
     if(usedNumberOfStatisticalModelCoefficients > 0) {
     	this->m_StatisticalDeformationModelTransform->SetUsedNumberOfCoefficients(usedNumberOfStatisticalModelCoefficients);
     }
 
-    bool automaticTransformInitialization = false;		 
+    /** The precision in which the basis is stored. A mapped basis file keeps its own. */
+    std::string basisPrecision = "native";
+    this->GetConfiguration()->ReadParameter( basisPrecision, "StatisticalModelBasisPrecision", 0, false );
+    typename BasisType::StorageType basisStorageType = BasisType::NativeStorage;
+    if ( !BasisType::GetStorageTypeFromString( basisPrecision, basisStorageType ) )
+    {
+      xout["warning"] << "WARNING: unknown StatisticalModelBasisPrecision \"" << basisPrecision
+        << "\"; the basis is stored in native precision." << std::endl;
+    }
+    this->m_StatisticalDeformationModelTransform->SetBasisStorageType( basisStorageType );
+
+    /** Index which modes are non-zero where, for models of local modes; 0 evaluates all modes everywhere. */
+    unsigned int supportBlockSize = 0;
+    double supportTolerance = 0.0;
+    this->GetConfiguration()->ReadParameter( supportBlockSize, "StatisticalModelSupportBlockSize", 0, false );
+    this->GetConfiguration()->ReadParameter( supportTolerance, "StatisticalModelSupportTolerance", 0, false );
+    this->m_StatisticalDeformationModelTransform->SetModeSupport( supportBlockSize, supportTolerance );
+
+    /** Replace the voxels of the basis by a cubic B-spline; one spacing for all dimensions or one per dimension. */
+    typename BasisType::ShrinkFactorsType controlPointSpacing;
+    controlPointSpacing.Fill( 0 );
+    const unsigned int numberOfSpacings =
+      this->GetConfiguration()->CountNumberOfParameterEntries( "StatisticalModelBSplineControlPointSpacing" );
+    for ( unsigned int i = 0; i < SpaceDimension; i++ )
+    {
+      this->GetConfiguration()->ReadParameter( controlPointSpacing[ i ],
+        "StatisticalModelBSplineControlPointSpacing", numberOfSpacings == SpaceDimension ? i : 0, false );
+    }
+    this->m_StatisticalDeformationModelTransform->SetBSplineControlPointSpacing( controlPointSpacing );
+
+    /** Count and time the hot path of the transform during the registration. */
+    bool instrumentation = false;
+    this->GetConfiguration()->ReadParameter( instrumentation, "StatisticalModelInstrumentation", 0, false );
+    this->m_StatisticalDeformationModelTransform->SetInstrumentation( instrumentation && this->m_Registration != 0 );
+    CountersType * counters = this->m_StatisticalDeformationModelTransform->GetCounters();
+    const double loadStart = CountersType::GetTime();
+
+    if ( !m_StatisticalModelBasisFileName.empty() )
+    {
+      /** Map the basis file; its pages are loaded on first access and shared between processes. */
+      typename BasisType::Pointer mappedBasis = BasisType::New();
+      mappedBasis->ReadFromFile( m_StatisticalModelBasisFileName );
+      if ( counters != 0 )
+      {
+        counters->AddStartupTime( CountersType::GetTime() - loadStart );
+      }
+      elxout << "Mapped the " << mappedBasis->GetNumberOfModes() << " modes of "
+        << m_StatisticalModelBasisFileName << ", stored in "
+        << BasisType::GetStorageTypeAsString( mappedBasis->GetStorageType() ) << " precision";
+      if ( mappedBasis->GetTileSize() > 0 )
+      {
+        elxout << " in " << mappedBasis->GetTileCache()->GetNumberOfTiles() << " tiles of "
+          << mappedBasis->GetTileCache()->GetTileSize() / 1024 << " kB";
+      }
+      elxout << "." << std::endl;
+
+      this->m_StatisticalModel = 0;
+      this->m_StatisticalDeformationModelTransform->SetBasis( mappedBasis );
+      this->PrintBSplineApproximationErrors();
+      this->m_StatisticalDeformationModelTransform->SetIdentity();
+      this->InitializeFromLandmarks();
+
+      if(this->m_Registration)
+        this->m_Registration->GetAsITKBaseType()->
+        SetInitialTransformParameters( this->GetParameters() );
+      return;
+    }
+
+    /** Reuse the model and the basis of an earlier registration in this process, if the file has
+     * not changed since. The key holds the requested number of coefficients, 0 meaning all. */
+    bool cacheStatisticalModel = false;
+    this->GetConfiguration()->ReadParameter( cacheStatisticalModel, "CacheStatisticalModel", 0, false );
+
+    typename StatisticalModelCacheType::KeyType cacheKey;
+    cacheKey.FileName = m_StatisticalModelName;
+    cacheKey.ModifiedTime = itksys::SystemTools::ModifiedTime( m_StatisticalModelName.c_str() );
+    cacheKey.NumberOfModes = usedNumberOfStatisticalModelCoefficients;
+    cacheKey.StorageType = basisStorageType;
+    cacheKey.ControlPointSpacing = controlPointSpacing;
+    cacheKey.BasisOnly = releaseStatisticalModel;
+
+    typename StatisticalModelType::Pointer statisticalModel;
+    typename BasisType::ConstPointer basis;
+    if ( cacheStatisticalModel
+      && StatisticalModelCacheType::Find( cacheKey, statisticalModel, basis ) )
+    {
+      elxout << "Reusing the " << ( statisticalModel.IsNull() ? "basis of the " : "" ) << "statistical model "
+        << m_StatisticalModelName << ", which has been loaded before." << std::endl;
+    }
+    else
+    {
+      statisticalModel = StatisticalModelType::New();
+      typename RepresenterType::Pointer representer = RepresenterType::New();
+      statisticalModel->Load(representer,m_StatisticalModelName.c_str());
+      basis = 0;
+    }
+    if ( counters != 0 )
+    {
+      counters->AddStartupTime( CountersType::GetTime() - loadStart );
+    }
 
 		this->m_StatisticalModel = statisticalModel;
 
-		this->m_StatisticalDeformationModelTransform->SetStatisticalModel(m_StatisticalModel);
-		this->m_StatisticalDeformationModelTransform->SetIdentity();
+		if ( statisticalModel.IsNull() )
+		{
+		  this->m_StatisticalDeformationModelTransform->SetBasis( basis );
+		}
+		else
+		{
+		  this->m_StatisticalDeformationModelTransform->SetStatisticalModel(m_StatisticalModel, basis);
+		}
 
+		/** Keep the drawn basis only; statismo holds the mean and all modes once more. */
+		if ( releaseStatisticalModel && statisticalModel.IsNotNull() )
+		{
+		  const double modelSize = static_cast<double>( statisticalModel->GetMeanVector().size() )
+		    * ( statisticalModel->GetNumberOfPrincipalComponents() + 1 ) * sizeof( statismo::ScalarType );
+		  this->m_StatisticalDeformationModelTransform->ReleaseStatisticalModel();
+		  this->m_StatisticalModel = 0;
+		  statisticalModel = 0;
+		  elxout << "Released the statistical model, which took at least "
+		    << static_cast<unsigned long>( modelSize / ( 1024 * 1024 ) ) << " MB." << std::endl;
+		}
+		if ( cacheStatisticalModel && basis.IsNull() )
+		{
+		  StatisticalModelCacheType::Insert( cacheKey, m_StatisticalModel,
+		    this->m_StatisticalDeformationModelTransform->GetFullResolutionBasis() );
+		}
+		elxout << "The basis takes "
+		  << this->m_StatisticalDeformationModelTransform->GetFullResolutionBasis()->GetBufferSize() / ( 1024 * 1024 )
+		  << " MB in " << BasisType::GetStorageTypeAsString(
+		    this->m_StatisticalDeformationModelTransform->GetFullResolutionBasis()->GetStorageType() )
+		  << " precision." << std::endl;
+		this->PrintBSplineApproximationErrors();
+		this->m_StatisticalDeformationModelTransform->SetIdentity();
+		this->InitializeFromLandmarks();
 
     /** Set the initial parameters in this->m_Registration.*/
     if(this->m_Registration)
@@ -112,6 +767,261 @@ namespace elastix
   } // end InitializeTransform
 
 
+  /**
+   * ************************* InitializeFromLandmarks *********************
+   */
+
+  template <class TElastix>
+    void SimpleStatisticalDeformationModelTransformElastix<TElastix>
+    ::InitializeFromLandmarks( void )
+  {
+    if ( m_FixedLandmarkFileName.empty() || ( this->m_Registration == 0 && !m_UseLandmarkPosteriorBasis ) )
+    {
+      return;
+    }
+
+    const PointListType fixedLandmarks = this->ReadPointSetFromFile( m_FixedLandmarkFileName );
+    const PointListType movingLandmarks = this->ReadPointSetFromFile( m_MovingLandmarkFileName, true );
+    if ( fixedLandmarks.size() != movingLandmarks.size() )
+    {
+      itkExceptionMacro( << m_FixedLandmarkFileName << " holds " << fixedLandmarks.size() << " landmarks, but "
+        << m_MovingLandmarkFileName << " holds " << movingLandmarks.size() << "." );
+    }
+
+    if ( m_UseLandmarkPosteriorBasis && this->m_StatisticalModel.IsNull() )
+    {
+      xout["warning"] << "WARNING: StatisticalModelLandmarkPosteriorBasis needs the statistical model, not a basis"
+        << " file; the landmarks only initialize the coefficients." << std::endl;
+      this->m_UseLandmarkPosteriorBasis = false;
+    }
+
+    /** The posterior model is built from the original one, which stays in the StatisticalModelCache. */
+    if ( m_UseLandmarkPosteriorBasis )
+    {
+      typedef itk::PosteriorModelBuilder<ImageType> PosteriorModelBuilderType;
+      typename PosteriorModelBuilderType::PointValueListType pointValues;
+      for ( unsigned int p = 0; p < fixedLandmarks.size(); p++ )
+      {
+        typename RepresenterType::PointType point;
+        typename RepresenterType::ValueType value;
+        for ( unsigned int i = 0; i < SpaceDimension; i++ )
+        {
+          point[ i ] = fixedLandmarks[ p ][ i ];
+          value[ i ] = movingLandmarks[ p ][ i ] - fixedLandmarks[ p ][ i ];
+        }
+        pointValues.push_back( typename PosteriorModelBuilderType::PointValuePairType( point, value ) );
+      }
+
+      itk::TimeProbe timer;
+      timer.Start();
+      typename PosteriorModelBuilderType::Pointer posteriorModelBuilder = PosteriorModelBuilderType::New();
+      this->m_StatisticalModel = posteriorModelBuilder->BuildNewModelFromModel(
+        this->m_StatisticalModel, pointValues, m_LandmarkVariance );
+      this->m_StatisticalDeformationModelTransform->SetStatisticalModel( this->m_StatisticalModel );
+      this->m_StatisticalDeformationModelTransform->SetIdentity();
+      timer.Stop();
+      elxout << "Built the posterior model of " << fixedLandmarks.size() << " landmarks with variance "
+        << m_LandmarkVariance << " mm^2 in " << timer.GetTotal() << " s." << std::endl;
+    }
+    if ( this->m_Registration == 0 )
+    {
+      return;
+    }
+
+    /** The RMS distance of the transformed fixed landmarks to the moving ones, before and after. */
+    double errorBefore = 0.0;
+    for ( unsigned int p = 0; p < fixedLandmarks.size(); p++ )
+    {
+      errorBefore += this->m_StatisticalDeformationModelTransform->TransformPoint( fixedLandmarks[ p ] )
+        .SquaredEuclideanDistanceTo( movingLandmarks[ p ] );
+    }
+
+    unsigned int numberOfLandmarks = fixedLandmarks.size();
+    if ( !m_UseLandmarkPosteriorBasis )
+    {
+      ParametersType coefficients;
+      numberOfLandmarks = this->m_StatisticalDeformationModelTransform->ComputeLandmarkPosterior(
+        fixedLandmarks, movingLandmarks, m_LandmarkVariance, coefficients );
+      this->m_StatisticalDeformationModelTransform->SetParameters( coefficients );
+    }
+
+    double errorAfter = 0.0;
+    for ( unsigned int p = 0; p < fixedLandmarks.size(); p++ )
+    {
+      errorAfter += this->m_StatisticalDeformationModelTransform->TransformPoint( fixedLandmarks[ p ] )
+        .SquaredEuclideanDistanceTo( movingLandmarks[ p ] );
+    }
+    const double normalization = fixedLandmarks.empty() ? 1.0 : static_cast<double>( fixedLandmarks.size() );
+    elxout << "Initialized the " << this->GetNumberOfParameters() << " coefficients from " << numberOfLandmarks
+      << " of " << fixedLandmarks.size() << " landmarks" << ( m_UseLandmarkPosteriorBasis ? " by the posterior model" : "" )
+      << ": the RMS landmark error is " << std::sqrt( errorAfter / normalization ) << " mm, instead of "
+      << std::sqrt( errorBefore / normalization ) << " mm at the mean of the model." << std::endl;
+
+  } // end InitializeFromLandmarks
+
+
+  /**
+   * ******************* PrintBSplineApproximationErrors ***********************
+   */
+
+  template <class TElastix>
+  void SimpleStatisticalDeformationModelTransformElastix<TElastix>
+  ::PrintBSplineApproximationErrors( void ) const
+  {
+    const BasisType * basis = this->m_StatisticalDeformationModelTransform->GetFullResolutionBasis();
+    if ( basis == 0 || basis->GetSplineOrder() == 1 )
+    {
+      return;
+    }
+
+    elxout << "The basis is a B-spline of " << basis->GetSize().GetNumberOfPixels() << " control points, "
+      << basis->GetBufferSize() / ( 1024 * 1024 ) << " MB." << std::endl;
+    const typename BasisType::VarianceVectorType & errors = basis->GetApproximationErrors();
+    const typename BasisType::VarianceVectorType & relativeErrors = basis->GetRelativeApproximationErrors();
+    if ( errors.GetSize() == 0 )
+    {
+      return;
+    }
+    elxout << "  RMS error of the fit per component, mean first: ";
+    for ( unsigned int k = 0; k < errors.GetSize(); k++ )
+    {
+      elxout << ( k > 0 ? " " : "" ) << errors[ k ];
+    }
+    elxout << "\n  relative to the RMS magnitude: ";
+    for ( unsigned int k = 0; k < relativeErrors.GetSize(); k++ )
+    {
+      elxout << ( k > 0 ? " " : "" ) << relativeErrors[ k ];
+    }
+    elxout << std::endl;
+
+  } // end PrintBSplineApproximationErrors
+
+
+
+
+  /**
+   * ******************* ReadPointSetFromFile ***********************
+   *
+   * Points given as indices are converted with the geometry of the image they are in. For the fixed
+   * image, transformix has no image, but the output of the resampler has its geometry; the moving image
+   * is only there if transformix is given one.
+   */
+
+  template <class TElastix>
+  std::vector<typename SimpleStatisticalDeformationModelTransformElastix<TElastix>::InputPointType>
+  SimpleStatisticalDeformationModelTransformElastix<TElastix>
+  ::ReadPointSetFromFile( const std::string filename, const bool inMovingImage ) const
+  {
+    typedef itk::PointSet<CoordRepType, SpaceDimension,
+      itk::DefaultStaticMeshTraits<CoordRepType, SpaceDimension, SpaceDimension, CoordRepType> > PointSetType;
+    typedef itk::TransformixInputPointFileReader<PointSetType> PointSetReaderType;
+
+    typename PointSetReaderType::Pointer reader = PointSetReaderType::New();
+    reader->SetFileName( filename.c_str() );
+    reader->Update();
+    const typename PointSetType::PointsContainer * inputPoints = reader->GetOutput()->GetPoints();
+
+    typename ImageType::Pointer geometry = ImageType::New();
+    if ( reader->GetPointsAreIndices() && inMovingImage )
+    {
+      const MovingImageType * movingImage = this->GetElastix()->GetMovingImage();
+      if ( movingImage == 0 )
+      {
+        itkExceptionMacro( << "The points of " << filename << " are indices in the moving image, but there is"
+          << " no moving image; give it to transformix with -in, or give the points as points." );
+      }
+      geometry->CopyInformation( movingImage );
+    }
+    else if ( reader->GetPointsAreIndices() )
+    {
+      const FixedImageType * fixedImage = this->GetElastix()->GetFixedImage();
+      if ( fixedImage != 0 )
+      {
+        geometry->CopyInformation( fixedImage );
+      }
+      else
+      {
+        const typename ElastixType::ResamplerBaseType::ITKBaseType * resampler =
+          this->GetElastix()->GetElxResamplerBase()->GetAsITKBaseType();
+        geometry->SetSpacing( resampler->GetOutputSpacing() );
+        geometry->SetOrigin( resampler->GetOutputOrigin() );
+        geometry->SetDirection( resampler->GetOutputDirection() );
+      }
+    }
+
+    std::vector<InputPointType> points( reader->GetNumberOfPoints() );
+    for ( unsigned int p = 0; p < points.size(); p++ )
+    {
+      const typename PointSetType::PointType & inputPoint = inputPoints->ElementAt( p );
+      if ( reader->GetPointsAreIndices() )
+      {
+        itk::ContinuousIndex<CoordRepType, SpaceDimension> index;
+        for ( unsigned int i = 0; i < SpaceDimension; i++ )
+        {
+          index[ i ] = inputPoint[ i ];
+        }
+        geometry->TransformContinuousIndexToPhysicalPoint( index, points[ p ] );
+      }
+      else
+      {
+        for ( unsigned int i = 0; i < SpaceDimension; i++ )
+        {
+          points[ p ][ i ] = inputPoint[ i ];
+        }
+      }
+    }
+    return points;
+
+  } // end ReadPointSetFromFile()
+
+
+  /**
+   * ******************* GenerateDeformationFieldImage ***********************
+   */
+
+  template <class TElastix>
+  typename SimpleStatisticalDeformationModelTransformElastix<TElastix>::DeformationFieldImageType::Pointer
+  SimpleStatisticalDeformationModelTransformElastix<TElastix>
+  ::GenerateDeformationFieldImage( void ) const
+  {
+    if ( this->GetInitialTransform() != 0 )
+    {
+      return this->Superclass2::GenerateDeformationFieldImage();
+    }
+
+    typedef typename BasisType::DeformationFieldType ModelDeformationFieldType;
+    const typename ElastixType::ResamplerBaseType::ITKBaseType * resampler =
+      this->GetElastix()->GetElxResamplerBase()->GetAsITKBaseType();
+    typename ModelDeformationFieldType::RegionType region;
+    region.SetIndex( resampler->GetOutputStartIndex() );
+    region.SetSize( resampler->GetSize() );
+
+    typename ModelDeformationFieldType::Pointer modelField = ModelDeformationFieldType::New();
+    modelField->SetRegions( region );
+    modelField->SetSpacing( resampler->GetOutputSpacing() );
+    modelField->SetOrigin( resampler->GetOutputOrigin() );
+    modelField->SetDirection( resampler->GetOutputDirection() );
+    modelField->Allocate();
+    this->m_StatisticalDeformationModelTransform->GenerateDeformationField( modelField );
+
+    /** The TransformBase writes the field in its own pixel type. */
+    typename DeformationFieldImageType::Pointer field = DeformationFieldImageType::New();
+    field->CopyInformation( modelField );
+    field->SetRegions( region );
+    field->Allocate();
+    const typename ModelDeformationFieldType::PixelType * source = modelField->GetBufferPointer();
+    typename DeformationFieldImageType::PixelType * target = field->GetBufferPointer();
+    for ( itk::SizeValueType v = 0; v < region.GetNumberOfPixels(); v++ )
+    {
+      for ( unsigned int i = 0; i < SpaceDimension; i++ )
+      {
+        target[ v ][ i ] = static_cast<typename DeformationFieldImageType::PixelType::ValueType>( source[ v ][ i ] );
+      }
+    }
+
+    return field;
+
+  } // end GenerateDeformationFieldImage()
 
 
   /**
@@ -146,6 +1056,38 @@ namespace elastix
     xout["transpar"] << std::endl << "// StatsisticalDeformationModel specific" << std::endl;
 
     xout["transpar"] << "(StatisticalModelName \"" << m_StatisticalModelName << "\")" << std::endl;
+    if ( !m_StatisticalModelBasisFileName.empty() )
+    {
+      xout["transpar"] << "(StatisticalModelBasisFileName \""
+        << m_StatisticalModelBasisFileName << "\")" << std::endl;
+    }
+
+    /** Transformix needs the same number of used coefficients to match the number of parameters. */
+    xout["transpar"] << "(UsedNumberOfStatisticalModelCoefficients "
+      << this->m_StatisticalDeformationModelTransform->GetNumberOfParameters() << ")" << std::endl;
+
+    /** The counters of the registration so far; transformix ignores them. */
+    if ( this->m_StatisticalDeformationModelTransform->GetCounters() != 0 )
+    {
+      for ( unsigned int c = 0; c < CountersType::NumberOfCounters; c++ )
+      {
+        xout["transpar"] << "(StatisticalModel" << CountersType::GetCounterName( static_cast<typename CountersType::CounterType>( c ) )
+          << " " << this->m_InstrumentationTotals.Counts[ c ] << ")" << std::endl;
+      }
+      xout["transpar"] << "(StatisticalModelEvaluationSeconds " << this->m_InstrumentationTotals.EvaluationSeconds
+        << ")" << std::endl;
+      xout["transpar"] << "(StatisticalModelStartupSeconds " << this->m_InstrumentationTotals.StartupSeconds
+        << ")" << std::endl;
+    }
+
+    /** transformix builds the same posterior model; the coefficients refer to its modes. */
+    if ( this->m_UseLandmarkPosteriorBasis )
+    {
+      xout["transpar"] << "(StatisticalModelFixedLandmarkFileName \"" << m_FixedLandmarkFileName << "\")" << std::endl;
+      xout["transpar"] << "(StatisticalModelMovingLandmarkFileName \"" << m_MovingLandmarkFileName << "\")" << std::endl;
+      xout["transpar"] << "(StatisticalModelLandmarkVariance " << m_LandmarkVariance << ")" << std::endl;
+      xout["transpar"] << "(StatisticalModelLandmarkPosteriorBasis \"true\")" << std::endl;
+    }
 
 
 
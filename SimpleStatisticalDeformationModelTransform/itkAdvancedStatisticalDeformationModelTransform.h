@@ -36,13 +36,23 @@
 #ifndef __ItkAdvancedStatisticalDeformationModelTransform
 #define __ItkAdvancedStatisticalDeformationModelTransform
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <string>
+#include <vector>
 #include "itkAdvancedStatisticalModelTransformBase.h"
 #include "itkStandardImageRepresenter.h"
-#include "itkVectorLinearInterpolateImageFunction.h"
+#include "itkInterleavedDeformationBasis.h"
+#include "itkDeformationModelJacobianCache.h"
+#include "itkDeformationModelRecentJacobians.h"
+#include "itkDeformationModelTransformCounters.h"
 #include "itkStatisticalModel.h"
 #include "itkImage.h"
 #include "itkVector.h"
+#include "vnl/vnl_det.h"
+#include "vnl/vnl_inverse.h"
+#include "vnl/algo/vnl_cholesky.h"
 
 namespace itk
 {
@@ -78,9 +88,26 @@ public:
 	typedef typename Superclass::RepresenterType RepresenterType;
 	typedef typename Superclass::StatisticalModelType StatisticalModelType;
 	typedef typename Superclass::JacobianType JacobianType;
+	typedef typename Superclass::NonZeroJacobianIndicesType NonZeroJacobianIndicesType;
+	typedef typename Superclass::NumberOfParametersType NumberOfParametersType;
+	typedef typename Superclass::ParametersType ParametersType;
+	typedef typename Superclass::VectorType VectorType;
+	typedef typename Superclass::SpatialJacobianType SpatialJacobianType;
+	typedef typename Superclass::SpatialHessianType SpatialHessianType;
+	typedef typename Superclass::JacobianOfSpatialJacobianType JacobianOfSpatialJacobianType;
+	typedef typename Superclass::JacobianOfSpatialHessianType JacobianOfSpatialHessianType;
 
 	typedef typename RepresenterType::DatasetType DeformationFieldType;
-	typedef VectorLinearInterpolateImageFunction<DeformationFieldType, TScalarType> InterpolatorType;
+	typedef InterleavedDeformationBasis<TScalarType, TDimension> BasisType;
+	typedef typename BasisType::ShrinkFactorsType ShrinkFactorsType;
+	typedef typename BasisType::StorageType BasisStorageType;
+	typedef typename BasisType::ModeSupportType ModeSupportType;
+	typedef std::vector<ShrinkFactorsType> BasisPyramidScheduleType;
+	typedef DeformationModelJacobianCache<TScalarType, TDimension> JacobianCacheType;
+	typedef typename JacobianCacheType::PointListType PointListType;
+	typedef DeformationModelRecentJacobians<TScalarType, TDimension> RecentJacobiansType;
+	typedef DeformationModelTransformCounters CountersType;
+	typedef Array<double> ScalesType;
 
 
 	  /**
@@ -92,42 +119,465 @@ public:
 		  ::itk::LightObject::Pointer smartPtr;
 		  Pointer another = Self::New().GetPointer();
 		  this->CopyBaseMembers(another);
-		  another->m_meanDeformation = this->m_meanDeformation;
-		  another->m_PCABasisDeformations = this->m_PCABasisDeformations;
+		  another->m_Basis = this->m_Basis;
+		  another->m_FullResolutionBasis = this->m_FullResolutionBasis;
+		  another->m_BasisPyramid = this->m_BasisPyramid;
+		  another->m_BasisPyramidSchedule = this->m_BasisPyramidSchedule;
+		  another->m_BasisStorageType = this->m_BasisStorageType;
+		  another->m_ModeSupportBlockSize = this->m_ModeSupportBlockSize;
+		  another->m_ModeSupportTolerance = this->m_ModeSupportTolerance;
+		  another->m_ModeSupport = this->m_ModeSupport;
+		  another->m_FullResolutionModeSupport = this->m_FullResolutionModeSupport;
+		  another->m_ModeSupportPyramid = this->m_ModeSupportPyramid;
+		  another->m_BSplineControlPointSpacing = this->m_BSplineControlPointSpacing;
+		  another->m_NumberOfBasisThreads = this->m_NumberOfBasisThreads;
+		  another->m_InverseTolerance = this->m_InverseTolerance;
+		  another->m_InverseMaximumNumberOfIterations = this->m_InverseMaximumNumberOfIterations;
+		  another->m_FusedJacobian = this->m_FusedJacobian;
+		  another->ResetRecentJacobians();
 		  smartPtr = static_cast<Pointer>(another);
 		  return smartPtr;
 	     }
 
+		/**
+		 * Set the statistical model and copy its mean and basis into one interleaved buffer,
+		 * such that all components belonging to a voxel are contiguous.
+		 * Only the used coefficients are drawn from the model.
+		 */
 		virtual void SetStatisticalModel(const StatisticalModelType* model) {
 
 			itkDebugMacro( << "setting statistical model in new super metric");
 			this->Superclass::SetStatisticalModel(model);
+			m_JacobianCache->Clear();
 
-			m_meanDeformation = InterpolatorType::New();
-			typename DeformationFieldType::Pointer meanDf = model->DrawMean();
-			m_meanDeformation->SetInputImage(meanDf);
-			for (unsigned i = 0; i < model->GetNumberOfPrincipalComponents(); i++) {
-				typename DeformationFieldType::Pointer deformationField = model->DrawPCABasisSample(i);
-				typename InterpolatorType::Pointer basisI = InterpolatorType::New();
-				basisI->SetInputImage(deformationField);
-				m_PCABasisDeformations.push_back(basisI);
+			m_FullResolutionBasis = 0;
+			this->BuildBasis(this->GetNumberOfParameters());
+		}
+
+		/**
+		 * Set the statistical model together with a basis that has been drawn from it before,
+		 * e.g. by another transform. The basis is shared, not copied. If it holds fewer modes than
+		 * the used coefficients, a copy is extended by the missing modes.
+		 */
+		virtual void SetStatisticalModel(const StatisticalModelType* model, const BasisType* basis) {
+			this->Superclass::SetStatisticalModel(model);
+			m_JacobianCache->Clear();
+
+			m_FullResolutionBasis = basis;
+			if (basis == 0 || basis->GetNumberOfModes() < this->GetNumberOfParameters()) {
+				this->BuildBasis(this->GetNumberOfParameters());
+				return;
 			}
+			m_Basis = m_FullResolutionBasis;
+			this->FitBSplineBasis();
+			this->BuildBasisPyramid();
 		}
 
+		/**
+		 * Use a basis without a statistical model, e.g. one that has been mapped from a file
+		 * by BasisType::ReadFromFile. All modes of the basis are available as coefficients.
+		 */
+		virtual void SetBasis(const BasisType* basis) {
+			const double start = CountersType::GetTime();
+			this->m_StatisticalModel = 0;
+			this->SetNumberOfPrincipalComponents(basis->GetNumberOfModes());
+			m_JacobianCache->Clear();
 
+			m_FullResolutionBasis = basis;
+			m_Basis = m_FullResolutionBasis;
+			this->FitBSplineBasis();
+			this->BuildBasisPyramid();
+			if (m_Counters.IsNotNull()) {
+				m_Counters->AddStartupTime(CountersType::GetTime() - start);
+			}
+		}
 
-		void ComputeJacobianWithRespectToParameters(const InputPointType  &pt, JacobianType &jacobian)  const
-		{
-			jacobian.SetSize(TDimension, m_PCABasisDeformations.size());
-			jacobian.Fill(0);
-			if (m_meanDeformation->IsInsideBuffer(pt) == false)
+		/**
+		 * Drop the reference to the statistical model once its modes have been drawn, so that the
+		 * model, which holds the modes as well, can be freed. The transform then evaluates the basis
+		 * only, as after SetBasis. Modes that have not been drawn are no longer available, so the
+		 * number of principal components becomes that of the basis; the used coefficients keep their
+		 * values.
+		 */
+		void ReleaseStatisticalModel() {
+			if (this->m_StatisticalModel.IsNull() || m_FullResolutionBasis.IsNull()) {
+				return;
+			}
+			this->m_StatisticalModel = 0;
+
+			const unsigned numberOfModes = m_FullResolutionBasis->GetNumberOfModes();
+			if (numberOfModes < this->GetNumberOfPrincipalComponents()) {
+				const ParametersType parameters = this->GetParameters();
+				this->SetNumberOfPrincipalComponents(numberOfModes);
+				ParametersType kept(this->GetNumberOfParameters());
+				for (unsigned i = 0; i < kept.GetSize(); i++) {
+					kept[i] = (i < parameters.GetSize()) ? parameters[i] : 0.0;
+				}
+				this->SetParameters(kept);
+			}
+			this->ResetRecentJacobians();
+			this->Modified();
+		}
+
+		/**
+		 * Change the number of used coefficients. Only these modes are evaluated.
+		 * The basis is extended if more modes are requested than have been drawn so far; the modes
+		 * drawn before are kept, so a registration can draw the modes of its first resolution only
+		 * and the others when a resolution needs them.
+		 */
+		virtual void SetUsedNumberOfCoefficients(unsigned n) {
+			this->Superclass::SetUsedNumberOfCoefficients(n);
+			m_JacobianCache->Clear();
+
+			if (this->m_StatisticalModel.IsNotNull() && m_FullResolutionBasis.IsNotNull()
+				&& this->GetNumberOfParameters() > m_FullResolutionBasis->GetNumberOfModes()) {
+				this->BuildBasis(this->GetNumberOfParameters());
+			}
+			this->ResetRecentJacobians();
+		}
+
+		/**
+		 * The type in which the basis is stored when it is drawn from the model. Reduced precision
+		 * saves memory and bandwidth; the evaluation is still done in double.
+		 * Takes effect at the next SetStatisticalModel. A basis passed in keeps its own type.
+		 */
+		void SetBasisStorageType(BasisStorageType storage) { m_BasisStorageType = storage; }
+		BasisStorageType GetBasisStorageType() const { return m_BasisStorageType; }
+
+		/**
+		 * Represent the basis by a cubic B-spline with a control point every spacing[i] voxels along
+		 * axis i, fitted once to the voxel basis; see BasisType::FitBSpline. All zeros, the default,
+		 * keeps the voxels. Takes effect at the next SetStatisticalModel or SetBasis; a B-spline basis
+		 * passed in is used as it is. The pyramid is not built for a B-spline basis, which is smooth.
+		 */
+		void SetBSplineControlPointSpacing(const ShrinkFactorsType& spacing) { m_BSplineControlPointSpacing = spacing; }
+		const ShrinkFactorsType& GetBSplineControlPointSpacing() const { return m_BSplineControlPointSpacing; }
+
+		/**
+		 * The number of threads that draw the modes from the model, each a different mode at a time.
+		 * 0, the default, uses the global default of itk::MultiThreader, 1 draws them one by one.
+		 */
+		void SetNumberOfBasisThreads(ThreadIdType numberOfThreads) { m_NumberOfBasisThreads = numberOfThreads; }
+		ThreadIdType GetNumberOfBasisThreads() const { return m_NumberOfBasisThreads; }
+
+		/**
+		 * Returns the interleaved mean and basis deformations.
+		 */
+		const BasisType* GetBasis() const { return m_Basis.GetPointer(); }
+
+		/**
+		 * Returns the basis at the resolution of the model, independent of the current level.
+		 */
+		const BasisType* GetFullResolutionBasis() const { return m_FullResolutionBasis.GetPointer(); }
+
+		/**
+		 * Count the calls of TransformPoint and of the Jacobians, the points outside the basis and
+		 * the Jacobian cache hits, and time them and the setup of the basis. Off by default; when
+		 * off, the hot path tests a null pointer only. Enable it before SetStatisticalModel to
+		 * include the drawing of the basis in the startup time.
+		 */
+		void SetInstrumentation(bool enabled) {
+			if (enabled && m_Counters.IsNull()) {
+				m_Counters = CountersType::New();
+			}
+			else if (!enabled) {
+				m_Counters = 0;
+			}
+		}
+		bool GetInstrumentation() const { return m_Counters.IsNotNull(); }
+
+		/** The counters, or 0 without instrumentation. */
+		CountersType* GetCounters() const { return m_Counters.GetPointer(); }
+
+		/**
+		 * Build a downsampled copy of the basis for each resolution of the registration.
+		 * Entry l of the schedule holds the shrink factors of resolution l with respect to the
+		 * grid of the model; a resolution with all factors 1 uses the full basis, as do all
+		 * resolutions of a tiled or B-spline basis. An empty schedule removes the pyramid.
+		 */
+		void SetBasisPyramidSchedule(const BasisPyramidScheduleType& schedule) {
+			m_BasisPyramidSchedule = schedule;
+			this->BuildBasisPyramid();
+		}
+
+		const BasisPyramidScheduleType& GetBasisPyramidSchedule() const { return m_BasisPyramidSchedule; }
+
+		/**
+		 * Evaluate the basis of the given resolution. Levels outside the schedule use the full basis.
+		 */
+		void SetCurrentBasisLevel(unsigned level) {
+			m_Basis = (level < m_BasisPyramid.size()) ? m_BasisPyramid[level] : m_FullResolutionBasis;
+			m_ModeSupport = (level < m_ModeSupportPyramid.size()) ? m_ModeSupportPyramid[level] : m_FullResolutionModeSupport;
+			m_JacobianCache->Clear();
+			this->ResetRecentJacobians();
+			this->Modified();
+		}
+
+		/**
+		 * Evaluate the full resolution basis, e.g. after the registration.
+		 */
+		void UseFullResolutionBasis() {
+			this->SetCurrentBasisLevel(static_cast<unsigned>(m_BasisPyramid.size()));
+		}
+
+		/**
+		 * Index the spatial support of the modes in blocks of blockSize^D voxels, for models whose
+		 * modes are local. The Jacobians then hold only the modes that are non-zero at the point,
+		 * padded to GetNumberOfNonZeroJacobianIndices() columns, together with their true indices.
+		 * A mode is taken as zero where it is below tolerance times its largest magnitude; with a
+		 * tolerance of 0 the results are exactly those of the dense evaluation. The index is built
+		 * for the full basis and every level of the pyramid, and is kept by the transform, so that a
+		 * basis shared with other transforms is not changed. A blockSize of 0 switches it off.
+		 * The Jacobian cache is not used while the index is on.
+		 */
+		void SetModeSupport(unsigned blockSize, double tolerance = 0.0) {
+			m_ModeSupportBlockSize = blockSize;
+			m_ModeSupportTolerance = tolerance;
+			m_JacobianCache->Clear();
+			this->BuildModeSupport();
+			this->Modified();
+		}
+
+		unsigned GetModeSupportBlockSize() const { return m_ModeSupportBlockSize; }
+		double GetModeSupportTolerance() const { return m_ModeSupportTolerance; }
+
+		/** True if the Jacobians are evaluated for the supporting modes only. */
+		bool HasModeSupport() const { return m_Basis.IsNotNull() && m_ModeSupport.BlockSize > 0; }
+
+		/**
+		 * The number of columns of the Jacobian, the largest number of modes that are non-zero
+		 * at any point of the current basis level with a support index, otherwise all parameters.
+		 */
+		virtual NumberOfParametersType GetNumberOfNonZeroJacobianIndices() const {
+			const unsigned numberOfModes = this->GetNumberOfParameters();
+			return this->HasModeSupport() ? BasisType::GetMaximumNumberOfSupportingModes(m_ModeSupport, numberOfModes) : numberOfModes;
+		}
+
+		/**
+		 * Memory budget in bytes for the per-sample Jacobian cache.
+		 */
+		void SetJacobianCacheMaximumMemory(SizeValueType bytes) { m_JacobianCache->SetMaximumMemory(bytes); }
+		SizeValueType GetJacobianCacheMaximumMemory() const { return m_JacobianCache->GetMaximumMemory(); }
+
+		/**
+		 * Cache the mean displacement and the parameter Jacobian at a fixed set of sample points.
+		 * As long as the cache holds a point, TransformPoint at that point is x + m + J c and its
+		 * Jacobian is a lookup. Returns false, leaving the cache empty, if the memory budget is exceeded
+		 * or the modes have a support index, as the cache holds dense Jacobians.
+		 */
+		bool BuildJacobianCache(const PointListType& points) {
+			if (this->HasModeSupport()) {
+				m_JacobianCache->Clear();
+				return false;
+			}
+			return m_JacobianCache->Build(m_Basis, this->GetNumberOfParameters(), points);
+		}
+
+		void ClearJacobianCache() { m_JacobianCache->Clear(); }
+
+		/**
+		 * Keep the parameter Jacobian that TransformPoint interpolates on the way to the displacement,
+		 * so that GetJacobian at the same point copies it instead of interpolating all modes again. The
+		 * metrics of elastix call the two in this order for each sample, through the combination
+		 * transform, which passes the same point to both, also after an initial transform. A lookup in
+		 * the Jacobian cache takes precedence. TransformPoint then writes the Jacobian besides the
+		 * displacement, so this only pays off while the Jacobians are asked for, i.e. during the
+		 * registration. The results are those of the separate calls, up to rounding. Not used with a
+		 * support index of non-zero tolerance, whose supported displacement leaves out modes. Off by
+		 * default; see DeformationModelRecentJacobians.
+		 */
+		void SetFusedJacobian(bool enabled) {
+			m_FusedJacobian = enabled;
+			this->ResetRecentJacobians();
+		}
+		bool GetFusedJacobian() const { return m_FusedJacobian; }
+
+		/**
+		 * Compare GetJacobian with the reference GetStatisticalModelJacobian at the given points and
+		 * return the largest absolute difference of an entry. statismo returns the modes at the
+		 * closest voxel of the model, so the two agree at the voxels of the full resolution voxel
+		 * basis, up to the precision in which the basis is stored; between the voxels, at the coarse
+		 * resolutions of the basis pyramid and for a B-spline basis they differ by the interpolation.
+		 * Requires the statistical model.
+		 */
+		double GetMaximumStatisticalModelJacobianDifference(const PointListType& points) const {
+			JacobianType jacobian;
+			JacobianType referenceJacobian;
+			NonZeroJacobianIndicesType nonZeroJacobianIndices;
+			NonZeroJacobianIndicesType referenceIndices;
+			double maximumDifference = 0;
+			for (SizeValueType p = 0; p < points.size(); p++) {
+				this->GetJacobian(points[p], jacobian, nonZeroJacobianIndices);
+				this->GetStatisticalModelJacobian(points[p], referenceJacobian, referenceIndices);
+				for (unsigned j = 0; j < nonZeroJacobianIndices.size(); j++) {
+					for (unsigned i = 0; i < TDimension; i++) {
+						maximumDifference = std::max(maximumDifference,
+							std::abs(jacobian[i][j] - referenceJacobian[i][nonZeroJacobianIndices[j]]));
+						referenceJacobian[i][nonZeroJacobianIndices[j]] = 0;
+					}
+				}
+				// Modes outside the support of the point must vanish in the reference.
+				for (unsigned i = 0; i < referenceJacobian.rows(); i++) {
+					for (unsigned j = 0; j < referenceJacobian.cols(); j++) {
+						maximumDifference = std::max(maximumDifference, std::abs(referenceJacobian[i][j]));
+					}
+				}
+			}
+			return maximumDifference;
+		}
+
+		/**
+		 * The closed-form posterior of the coefficients given corresponding landmarks: TransformPoint of
+		 * fixedPoints[j] is observed as movingPoints[j] with isotropic Gaussian noise of the given variance
+		 * in mm^2. The coefficients have a standard normal prior, so the posterior is normal with precision
+		 * P = I + A^T A / variance and mean P^-1 A^T r / variance, where A stacks the basis at the landmarks
+		 * and r the observed displacements minus the mean. This is the posterior of the Gaussian process of
+		 * the model restricted to its used modes, as statismo's PosteriorModelBuilder computes it, at the
+		 * cost of a single evaluation of the basis per landmark. Landmarks outside the model are left out.
+		 * mean receives the posterior mean of the coefficients and covariance, if not null, P^-1.
+		 * Returns the number of landmarks used.
+		 */
+		unsigned ComputeLandmarkPosterior(const PointListType& fixedPoints, const PointListType& movingPoints,
+			double variance, ParametersType& mean, vnl_matrix<double>* covariance = 0) const {
+			if (fixedPoints.size() != movingPoints.size()) {
+				itkExceptionMacro(<< "There are " << fixedPoints.size() << " fixed but " << movingPoints.size()
+					<< " moving landmarks.");
+			}
+			if (!(variance > 0)) {
+				itkExceptionMacro(<< "The variance of the landmarks must be positive, not " << variance << ".");
+			}
+			const unsigned numberOfModes = this->GetNumberOfParameters();
+			vnl_matrix<double> precision(numberOfModes, numberOfModes);
+			precision.set_identity();
+			vnl_vector<double> projection(numberOfModes, 0.0);
+			const vnl_vector<double> zeros(numberOfModes, 0.0);
+			JacobianType basis(TDimension, numberOfModes);
+			typename BasisType::VectorType meanDisplacement;
+			unsigned numberOfLandmarks = 0;
+			for (SizeValueType p = 0; p < fixedPoints.size(); p++) {
+				if (m_Basis->EvaluateDisplacementAndBasis(fixedPoints[p], zeros.data_block(), numberOfModes,
+					meanDisplacement, basis) == false) {
+					continue;
+				}
+				numberOfLandmarks++;
+				for (unsigned i = 0; i < TDimension; i++) {
+					const double residual = movingPoints[p][i] - fixedPoints[p][i] - meanDisplacement[i];
+					for (unsigned k = 0; k < numberOfModes; k++) {
+						projection[k] += basis[i][k] * residual / variance;
+						for (unsigned l = 0; l <= k; l++) {
+							precision[k][l] += basis[i][k] * basis[i][l] / variance;
+						}
+					}
+				}
+			}
+			for (unsigned k = 0; k < numberOfModes; k++) {
+				for (unsigned l = 0; l < k; l++) {
+					precision[l][k] = precision[k][l];
+				}
+			}
+
+			// P is the identity plus a positive semidefinite matrix, so the Cholesky factor exists.
+			vnl_cholesky cholesky(precision, vnl_cholesky::quiet);
+			const vnl_vector<double> solution = cholesky.solve(projection);
+			mean.SetSize(numberOfModes);
+			for (unsigned k = 0; k < numberOfModes; k++) {
+				mean[k] = solution[k];
+			}
+			if (covariance != 0) {
+				*covariance = cholesky.inverse();
+			}
+			return numberOfLandmarks;
+		}
+
+		const JacobianCacheType* GetJacobianCache() const { return m_JacobianCache.GetPointer(); }
+
+		/**
+		 * Scales for a scaled optimizer, s_k = sqrt(variance_k / variance_0), one per parameter.
+		 * The column of the parameter Jacobian of mode k has a norm proportional to the standard
+		 * deviation of the mode, so dividing by s_k gives all columns the same norm, i.e. a Jacobi
+		 * preconditioner that is known without sampling. The coefficients of statismo are already
+		 * in units of standard deviation, so no further normalisation is needed. Without variances,
+		 * e.g. for a basis file of an older version, the mean norms of the modes are used instead.
+		 */
+		void GetParameterScales(ScalesType& scales) const {
+			const unsigned numberOfModes = this->GetNumberOfParameters();
+			scales.SetSize(numberOfModes);
+			scales.Fill(1.0);
+			if (numberOfModes == 0) {
 				return;
+			}
+
+			typename BasisType::VarianceVectorType variances = m_FullResolutionBasis->GetModeVariances();
+			bool haveVariances = variances.GetSize() >= numberOfModes;
+			for (unsigned k = 0; haveVariances && k < numberOfModes; k++) {
+				haveVariances = variances[k] > 0.0;
+			}
+			if (!haveVariances) {
+				double maximumSquaredNorm = 0.0;
+				m_Basis->ComputeModeNorms(numberOfModes, 0, variances, maximumSquaredNorm);
+			}
+			for (unsigned k = 0; k < numberOfModes; k++) {
+				if (variances[0] > 0.0 && variances[k] > 0.0) {
+					scales[k] = std::sqrt(variances[k] / variances[0]);
+				}
+			}
+		}
+
+		/**
+		 * Analytic counterparts of the Jacobian terms that elastix's AdaptiveStochasticGradientDescent
+		 * estimates from samples, for the parameters divided by the given scales (empty for none):
+		 * TrC and TrCC are the trace of C = E[ J^T J ] and of C^2, maxJJ and maxJCJ bound the largest
+		 * |J|^2 and J C J^T. C is taken as diagonal, which is exact for modes that are orthogonal over
+		 * the grid, as PCA modes are; maxJJ is a strict bound, see BasisType::ComputeModeNorms.
+		 * The cost is one pass over the basis of the current level, without any sampling.
+		 */
+		void ComputeJacobianTerms(const ScalesType& scales,
+			double& TrC, double& TrCC, double& maxJJ, double& maxJCJ) const {
+			const unsigned numberOfModes = this->GetNumberOfParameters();
+			std::vector<double> weights(numberOfModes, 1.0);
+			for (unsigned k = 0; k < numberOfModes && k < scales.GetSize(); k++) {
+				weights[k] = (scales[k] > 0.0) ? 1.0 / scales[k] : 1.0;
+			}
+
+			typename BasisType::VarianceVectorType meanSquaredNorms;
+			maxJJ = 0.0;
+			m_Basis->ComputeModeNorms(numberOfModes, numberOfModes > 0 ? &weights[0] : 0, meanSquaredNorms, maxJJ);
+
+			TrC = 0.0;
+			TrCC = 0.0;
+			double maximumVariance = 0.0;
+			for (unsigned k = 0; k < numberOfModes; k++) {
+				const double variance = meanSquaredNorms[k] * weights[k] * weights[k];
+				TrC += variance;
+				TrCC += variance * variance;
+				maximumVariance = std::max(maximumVariance, variance);
+			}
+			maxJCJ = maximumVariance * maxJJ;
+		}
+
 
-			for(unsigned j = 0; j < m_PCABasisDeformations.size(); j++) {
-				typename RepresenterType::ValueType d = m_PCABasisDeformations[j]->Evaluate(pt);
-		        for(unsigned i = 0; i < TDimension; i++) {
-					jacobian(i,j) += d[i] ;
-		        }
+
+		/**
+		 * The jacobian is only resized if it does not have D x n entries yet; the basis
+		 * overwrites all of them, so the hot path neither allocates nor clears memory.
+		 */
+		void ComputeJacobianWithRespectToParameters(const InputPointType  &pt, JacobianType &jacobian)  const
+		{
+			if (jacobian.rows() != TDimension || jacobian.cols() != this->GetNumberOfParameters()) {
+				jacobian.SetSize(TDimension, this->GetNumberOfParameters());
+			}
+			const double start = m_Counters.IsNull() ? 0.0 : CountersType::GetTime();
+			const OffsetValueType entry = m_JacobianCache->IsEmpty() ? -1 : m_JacobianCache->Find(pt);
+			bool inside = true;
+			if (entry >= 0) {
+				m_JacobianCache->GetJacobian(entry, jacobian);
+			}
+			else if (m_Basis->EvaluateBasis(pt, this->GetNumberOfParameters(), jacobian) == false) {
+				jacobian.Fill(0);
+				inside = false;
+			}
+			if (m_Counters.IsNotNull()) {
+				this->CountCall(CountersType::JacobianCalls, inside, entry, start);
 			}
 
 			itkDebugMacro( << "Jacobian with MM:\n" << jacobian);
@@ -135,25 +585,86 @@ public:
 					<< "\nJacobian = \n" << jacobian);
 		}
 
+		/**
+		 * Looks the Jacobian up in the sample cache, if the point is cached, copies the one that
+		 * TransformPoint kept at the point, see SetFusedJacobian, and evaluates the basis otherwise;
+		 * the statistical model is not queried, see GetMaximumStatisticalModelJacobianDifference.
+		 * With a support index only the supporting modes are evaluated, see SetModeSupport.
+		 */
+		virtual void GetJacobian(const InputPointType & pt, JacobianType & jacobian,
+			NonZeroJacobianIndicesType & nonZeroJacobianIndices) const
+		{
+			const double start = m_Counters.IsNull() ? 0.0 : CountersType::GetTime();
+			OffsetValueType entry = -1;
+			bool inside = true;
+			bool fused = false;
+			if (this->HasModeSupport()) {
+				const unsigned numberOfColumns = this->PrepareSupportedJacobianOutput(jacobian);
+				if (m_RecentJacobians->Find(pt, jacobian, &nonZeroJacobianIndices)) {
+					fused = true;
+				}
+				else if (m_Basis->EvaluateSupportedDisplacementAndBasis(m_ModeSupport, pt, this->m_Parameters.data_block(), this->GetNumberOfParameters(),
+					numberOfColumns, 0, jacobian, nonZeroJacobianIndices) == false) {
+					m_Basis->GetSupportingModes(m_ModeSupport, pt, this->GetNumberOfParameters(), numberOfColumns, nonZeroJacobianIndices);
+					jacobian.Fill(0);
+					inside = false;
+				}
+			}
+			else {
+				entry = m_JacobianCache->IsEmpty() ? -1 : m_JacobianCache->Find(pt);
+				this->PrepareJacobianOutput(jacobian, nonZeroJacobianIndices);
+				if (entry >= 0) {
+					m_JacobianCache->GetJacobian(entry, jacobian);
+				}
+				else if (m_RecentJacobians->Find(pt, jacobian, 0)) {
+					fused = true;
+				}
+				else if (m_Basis->EvaluateBasis(pt, this->GetNumberOfParameters(), jacobian) == false) {
+					jacobian.Fill(0);
+					inside = false;
+				}
+			}
+			if (m_Counters.IsNotNull()) {
+				if (fused) {
+					m_Counters->Add(CountersType::FusedJacobianHits, false, 0.0);
+				}
+				this->CountCall(CountersType::GetJacobianCalls, inside, entry, start);
+			}
+		}
+
 
 	/**
 	 * Transform a given point according to the deformation induced by the StatisticalModel,
 	 * given the current parameters.
 	 *
+	 * The cell weights are computed once, after which the mean and all basis deformations
+	 * are combined with the coefficients in one pass over the interleaved buffer. With
+	 * SetFusedJacobian, the same pass keeps the parameter Jacobian for GetJacobian.
+	 *
 	 * \param pt The point to tranform
 	 * \return The transformed point
 	 */
 	virtual OutputPointType  TransformPoint(const InputPointType &pt) const
 	{
-	  if (m_meanDeformation->IsInsideBuffer(pt) == false) {
-	    return pt;
-	  }
-	  assert(this->m_coeff_vector.size() == m_PCABasisDeformations.size());
-	  typename RepresenterType::ValueType def = m_meanDeformation->Evaluate(pt);
-
-		for (unsigned i = 0; i < m_PCABasisDeformations.size(); i++) {
-			typename RepresenterType::ValueType defBasisI =  m_PCABasisDeformations[i]->Evaluate(pt);
-			def += (defBasisI * this->m_coeff_vector[i]);
+		assert(this->GetNumberOfParameters() <= m_Basis->GetNumberOfModes());
+		const double start = m_Counters.IsNull() ? 0.0 : CountersType::GetTime();
+		typename BasisType::VectorType def;
+		const OffsetValueType entry = m_JacobianCache->IsEmpty() ? -1 : m_JacobianCache->Find(pt);
+		bool inside = true;
+		if (entry >= 0) {
+			m_JacobianCache->EvaluateDisplacement(entry, this->m_Parameters.data_block(), def);
+		}
+		else if (m_RecentJacobians->IsEmpty()) {
+			inside = m_Basis->EvaluateDisplacement(pt, this->m_Parameters.data_block(), this->GetNumberOfParameters(), def);
+		}
+		else {
+			inside = this->EvaluateDisplacementAndKeepJacobian(pt, def);
+		}
+		if (m_Counters.IsNotNull()) {
+			this->CountCall(CountersType::TransformPointCalls, inside, entry, start);
+		}
+		if (!inside) {
+			return pt;
 		}
 
 		OutputPointType transformedPoint;
@@ -164,9 +675,665 @@ public:
 		return transformedPoint;
 	}
 
+	/**
+	 * Transform numberOfPoints points at once, e.g. a landmark set or a sample container. Point p is
+	 * (coordinates[0][p], ..., coordinates[D-1][p]) and its transform is written to
+	 * transformedCoordinates[i][p]. If jacobians is not null, it receives the D x n parameter Jacobian
+	 * of each point, row by row, point after point. The results are those of TransformPoint and
+	 * ComputeJacobianWithRespectToParameters, but without a virtual call per point; the points are
+	 * sorted by their cell in the model grid and split over numberOfThreads threads.
+	 */
+	void TransformPoints(SizeValueType numberOfPoints, const TScalarType* const* coordinates,
+		TScalarType* const* transformedCoordinates, double* jacobians = 0, ThreadIdType numberOfThreads = 0) const
+	{
+		m_Basis->EvaluatePoints(numberOfPoints, coordinates, this->m_Parameters.data_block(), this->GetNumberOfParameters(),
+			transformedCoordinates, jacobians, numberOfThreads);
+		for (unsigned i = 0; i < TDimension; i++) {
+			for (SizeValueType p = 0; p < numberOfPoints; p++) {
+				transformedCoordinates[i][p] += coordinates[i][p];
+			}
+		}
+	}
+
+	/**
+	 * Fill an allocated field with the displacement of the transform at each of its voxels, as
+	 * TransformPoint(x) - x, in one multithreaded pass over the basis instead of one TransformPoint
+	 * per voxel. See BasisType::EvaluateDisplacementField for the fast paths.
+	 */
+	void GenerateDeformationField(typename BasisType::DeformationFieldType* field, ThreadIdType numberOfThreads = 0) const
+	{
+		m_Basis->EvaluateDisplacementField(this->m_Parameters.data_block(), this->GetNumberOfParameters(), field, numberOfThreads);
+	}
+
+	/**
+	 * The approximate inverse stops once |TransformPoint(x) - y| is at most the tolerance, in mm,
+	 * or after the maximum number of Newton iterations. The defaults are 1e-4 mm and 20.
+	 */
+	void SetInverseTolerance(double tolerance) { m_InverseTolerance = tolerance; }
+	double GetInverseTolerance() const { return m_InverseTolerance; }
+	void SetInverseMaximumNumberOfIterations(unsigned iterations) { m_InverseMaximumNumberOfIterations = iterations; }
+	unsigned GetInverseMaximumNumberOfIterations() const { return m_InverseMaximumNumberOfIterations; }
+
+	/**
+	 * Find x with TransformPoint(x) = y. Starting from the fixed point guess y - u(y), Newton steps are
+	 * taken with the analytic spatial Jacobian I + du/dx, halved while they do not reduce the residual.
+	 * A step at a singular spatial Jacobian, i.e. where the model folds, falls back to the fixed point
+	 * step. Returns whether the tolerance was reached; residual receives |TransformPoint(x) - y|.
+	 */
+	bool InverseTransformPoint(const OutputPointType & y, InputPointType & x, double & residual) const
+	{
+		typename BasisType::VectorType def;
+		for (unsigned i = 0; i < TDimension; i++) {
+			x[i] = y[i];
+		}
+		if (m_Basis->EvaluateDisplacement(y, this->m_Parameters.data_block(), this->GetNumberOfParameters(), def)) {
+			for (unsigned i = 0; i < TDimension; i++) {
+				x[i] -= def[i];
+			}
+		}
+		return this->RefineInverse(y, x, residual);
+	}
+
+	/**
+	 * Invert numberOfPoints points at once, laid out as for TransformPoints: point p is
+	 * (coordinates[0][p], ..., coordinates[D-1][p]) and its inverse is written to
+	 * inverseCoordinates[i][p]. If residuals is not null, it receives the residual of each point.
+	 * The points are split over numberOfThreads threads. With a lattice spacing, the inverse is first
+	 * computed at the nodes of a lattice that has a node every latticeSpacing voxels of the model
+	 * grid, and each point starts from the inverse interpolated linearly from the lattice, so that
+	 * dense point sets, e.g. the voxels of an image, need fewer Newton iterations.
+	 * Returns the largest residual.
+	 */
+	double InverseTransformPoints(SizeValueType numberOfPoints, const TScalarType* const* coordinates,
+		TScalarType* const* inverseCoordinates, double* residuals = 0, unsigned latticeSpacing = 0,
+		ThreadIdType numberOfThreads = 0) const
+	{
+		typename InverseLatticeType::Pointer lattice;
+		if (latticeSpacing > 0) {
+			lattice = this->ComputeInverseLattice(latticeSpacing, numberOfThreads);
+		}
+		return this->InverseTransformPointsInternal(numberOfPoints, coordinates, inverseCoordinates, residuals,
+			lattice, numberOfThreads);
+	}
+
+	/**
+	 * The spatial derivatives are those of the interpolated basis, I + d displacement / dx,
+	 * computed analytically from the corner weights. Outside the model domain the transform is
+	 * the identity, so the spatial Jacobian is I and all other derivatives are zero.
+	 */
+	virtual void GetSpatialJacobian(const InputPointType & pt, SpatialJacobianType & sj) const
+	{
+		SpatialJacobianType gradient;
+		sj.SetIdentity();
+		if (m_Basis->EvaluateSpatialJacobian(pt, this->m_Parameters.data_block(), this->GetNumberOfParameters(), gradient, 0)) {
+			sj += gradient;
+		}
+	}
+
+	virtual void GetSpatialHessian(const InputPointType & pt, SpatialHessianType & sh) const
+	{
+		if (m_Basis->EvaluateSpatialHessian(pt, this->m_Parameters.data_block(), this->GetNumberOfParameters(), sh, 0) == false) {
+			for (unsigned i = 0; i < TDimension; i++) {
+				sh[i].Fill(0.0);
+			}
+		}
+	}
+
+	virtual void GetJacobianOfSpatialJacobian(const InputPointType & pt, JacobianOfSpatialJacobianType & jsj,
+		NonZeroJacobianIndicesType & nonZeroJacobianIndices) const
+	{
+		SpatialJacobianType sj;
+		this->GetJacobianOfSpatialJacobian(pt, sj, jsj, nonZeroJacobianIndices);
+	}
+
+	virtual void GetJacobianOfSpatialJacobian(const InputPointType & pt, SpatialJacobianType & sj,
+		JacobianOfSpatialJacobianType & jsj, NonZeroJacobianIndicesType & nonZeroJacobianIndices) const
+	{
+		const unsigned numberOfModes = this->GetNumberOfParameters();
+		if (jsj.size() != numberOfModes) {
+			jsj.resize(numberOfModes);
+		}
+		nonZeroJacobianIndices = this->GetNonZeroJacobianIndices();
+
+		SpatialJacobianType gradient;
+		sj.SetIdentity();
+		if (m_Basis->EvaluateSpatialJacobian(pt, this->m_Parameters.data_block(), numberOfModes, gradient, &jsj)) {
+			sj += gradient;
+		}
+		else {
+			for (unsigned k = 0; k < numberOfModes; k++) {
+				jsj[k].Fill(0.0);
+			}
+		}
+
+		if (this->HasModeSupport()) {
+			SpatialJacobianType zero;
+			zero.Fill(0.0);
+			this->CompactToSupportingModes(pt, jsj, zero, nonZeroJacobianIndices);
+		}
+	}
+
+	virtual void GetJacobianOfSpatialHessian(const InputPointType & pt, JacobianOfSpatialHessianType & jsh,
+		NonZeroJacobianIndicesType & nonZeroJacobianIndices) const
+	{
+		SpatialHessianType sh;
+		this->GetJacobianOfSpatialHessian(pt, sh, jsh, nonZeroJacobianIndices);
+	}
+
+	virtual void GetJacobianOfSpatialHessian(const InputPointType & pt, SpatialHessianType & sh,
+		JacobianOfSpatialHessianType & jsh, NonZeroJacobianIndicesType & nonZeroJacobianIndices) const
+	{
+		const unsigned numberOfModes = this->GetNumberOfParameters();
+		if (jsh.size() != numberOfModes) {
+			jsh.resize(numberOfModes);
+		}
+		nonZeroJacobianIndices = this->GetNonZeroJacobianIndices();
+
+		if (m_Basis->EvaluateSpatialHessian(pt, this->m_Parameters.data_block(), numberOfModes, sh, &jsh) == false) {
+			for (unsigned i = 0; i < TDimension; i++) {
+				sh[i].Fill(0.0);
+				for (unsigned k = 0; k < numberOfModes; k++) {
+					jsh[k][i].Fill(0.0);
+				}
+			}
+		}
+
+		if (this->HasModeSupport()) {
+			SpatialHessianType zero;
+			for (unsigned i = 0; i < TDimension; i++) {
+				zero[i].Fill(0.0);
+			}
+			this->CompactToSupportingModes(pt, jsh, zero, nonZeroJacobianIndices);
+		}
+	}
+
 	virtual ~AdvancedStatisticalDeformationModelTransform() {}
 
-	AdvancedStatisticalDeformationModelTransform() {}
+	AdvancedStatisticalDeformationModelTransform() :
+		m_BasisStorageType(BasisType::NativeStorage),
+		m_ModeSupportBlockSize(0),
+		m_ModeSupportTolerance(0.0),
+		m_NumberOfBasisThreads(0),
+		m_InverseTolerance(1e-4),
+		m_InverseMaximumNumberOfIterations(20),
+		m_FusedJacobian(false)
+	{
+		m_BSplineControlPointSpacing.Fill(0);
+		m_JacobianCache = JacobianCacheType::New();
+		m_RecentJacobians = RecentJacobiansType::New();
+	}
+
+protected:
+
+	/**
+	 * Draw the mean and the first numberOfModes basis deformations from the model. A voxel basis
+	 * drawn before in the requested storage type is extended by the missing modes only.
+	 */
+	void BuildBasis(unsigned numberOfModes) {
+		const double start = CountersType::GetTime();
+		const StatisticalModelType* model = this->m_StatisticalModel;
+
+		typename BasisType::Pointer basis;
+		unsigned firstMode = 0;
+		if (m_FullResolutionBasis.IsNotNull() && m_FullResolutionBasis->GetSplineOrder() == 1
+			&& m_FullResolutionBasis->GetTileSize() == 0 && m_FullResolutionBasis->GetStorageType() == m_BasisStorageType
+			&& m_FullResolutionBasis->GetNumberOfModes() < numberOfModes) {
+			firstMode = m_FullResolutionBasis->GetNumberOfModes();
+			basis = m_FullResolutionBasis->ExtendModes(numberOfModes);
+		}
+		else {
+			typename DeformationFieldType::Pointer meanDf = model->DrawMean();
+			basis = BasisType::New();
+			basis->Allocate(meanDf, numberOfModes, m_BasisStorageType);
+			basis->SetComponent(0, meanDf);
+		}
+		this->DrawModes(basis, firstMode, numberOfModes);
+
+		typename BasisType::VarianceVectorType variances(numberOfModes);
+		const VectorType& pcaVariances = model->GetPCAVarianceVector();
+		for (unsigned i = 0; i < numberOfModes; i++) {
+			variances[i] = pcaVariances[i];
+		}
+		basis->SetModeVariances(variances);
+
+		m_FullResolutionBasis = basis;
+		m_Basis = m_FullResolutionBasis;
+		this->FitBSplineBasis();
+		this->BuildBasisPyramid();
+		if (m_Counters.IsNotNull()) {
+			m_Counters->AddStartupTime(CountersType::GetTime() - start);
+		}
+	}
+
+	/** The inverse displacement x - y at the nodes of a lattice, see InverseTransformPoints. */
+	typedef typename BasisType::DeformationFieldType InverseLatticeType;
+
+	/**
+	 * Newton iterations from the guess in x, see InverseTransformPoint. The displacement and the
+	 * spatial Jacobian are zero outside the model domain, where the transform is the identity.
+	 */
+	bool RefineInverse(const OutputPointType & y, InputPointType & x, double & residual) const
+	{
+		const double* coefficients = this->m_Parameters.data_block();
+		const unsigned numberOfModes = this->GetNumberOfParameters();
+		typename BasisType::VectorType def;
+		vnl_vector_fixed<double, TDimension> r;
+
+		if (m_Basis->EvaluateDisplacement(x, coefficients, numberOfModes, def) == false) {
+			def.Fill(0.0);
+		}
+		for (unsigned i = 0; i < TDimension; i++) {
+			r[i] = x[i] + def[i] - y[i];
+		}
+		residual = r.magnitude();
+
+		for (unsigned iteration = 0; iteration < m_InverseMaximumNumberOfIterations && residual > m_InverseTolerance; iteration++) {
+			SpatialJacobianType gradient;
+			vnl_matrix_fixed<double, TDimension, TDimension> jacobian;
+			jacobian.set_identity();
+			if (m_Basis->EvaluateSpatialJacobian(x, coefficients, numberOfModes, gradient, 0)) {
+				for (unsigned i = 0; i < TDimension; i++) {
+					for (unsigned j = 0; j < TDimension; j++) {
+						jacobian(i, j) += gradient(i, j);
+					}
+				}
+			}
+			vnl_vector_fixed<double, TDimension> step = r;
+			if (std::abs(vnl_det(jacobian)) > 1e-12) {
+				step = vnl_inverse(jacobian) * r;
+			}
+
+			/** Halve the step while it does not reduce the residual. */
+			bool reduced = false;
+			for (unsigned halving = 0; halving < 8 && !reduced; halving++, step /= 2.0) {
+				InputPointType candidate;
+				for (unsigned i = 0; i < TDimension; i++) {
+					candidate[i] = x[i] - step[i];
+				}
+				if (m_Basis->EvaluateDisplacement(candidate, coefficients, numberOfModes, def) == false) {
+					def.Fill(0.0);
+				}
+				vnl_vector_fixed<double, TDimension> candidateResidual;
+				for (unsigned i = 0; i < TDimension; i++) {
+					candidateResidual[i] = candidate[i] + def[i] - y[i];
+				}
+				if (candidateResidual.magnitude() < residual) {
+					x = candidate;
+					r = candidateResidual;
+					residual = r.magnitude();
+					reduced = true;
+				}
+			}
+			if (!reduced) {
+				break;
+			}
+		}
+		return residual <= m_InverseTolerance;
+	}
+
+	/**
+	 * Point p is inverted by thread p modulo the number of threads, starting from the lattice if
+	 * there is one and it holds the point.
+	 */
+	struct InverseThreadStruct {
+		const Self* Transform;
+		SizeValueType NumberOfPoints;
+		const TScalarType* const* Coordinates;
+		TScalarType* const* InverseCoordinates;
+		double* Residuals;
+		const InverseLatticeType* Lattice;
+		std::vector<double> MaximumResiduals;
+	};
+
+	static ITK_THREAD_RETURN_TYPE InverseThreaderCallback(void* arg) {
+		const MultiThreader::ThreadInfoStruct* info = static_cast<MultiThreader::ThreadInfoStruct*>(arg);
+		InverseThreadStruct* str = static_cast<InverseThreadStruct*>(info->UserData);
+		double maximumResidual = 0.0;
+		for (SizeValueType p = info->ThreadID; p < str->NumberOfPoints; p += info->NumberOfThreads) {
+			OutputPointType y;
+			for (unsigned i = 0; i < TDimension; i++) {
+				y[i] = str->Coordinates[i][p];
+			}
+			InputPointType x;
+			double residual = 0.0;
+			typename BasisType::VectorType inverseDef;
+			if (str->Lattice != 0 && InterpolateInverseLattice(str->Lattice, y, inverseDef)) {
+				for (unsigned i = 0; i < TDimension; i++) {
+					x[i] = y[i] + inverseDef[i];
+				}
+				str->Transform->RefineInverse(y, x, residual);
+			}
+			else {
+				str->Transform->InverseTransformPoint(y, x, residual);
+			}
+			for (unsigned i = 0; i < TDimension; i++) {
+				str->InverseCoordinates[i][p] = x[i];
+			}
+			if (str->Residuals != 0) {
+				str->Residuals[p] = residual;
+			}
+			maximumResidual = std::max(maximumResidual, residual);
+		}
+		str->MaximumResiduals[info->ThreadID] = maximumResidual;
+		return ITK_THREAD_RETURN_VALUE;
+	}
+
+	double InverseTransformPointsInternal(SizeValueType numberOfPoints, const TScalarType* const* coordinates,
+		TScalarType* const* inverseCoordinates, double* residuals, const InverseLatticeType* lattice,
+		ThreadIdType numberOfThreads) const
+	{
+		MultiThreader::Pointer threader = MultiThreader::New();
+		if (numberOfThreads > 0) {
+			threader->SetNumberOfThreads(numberOfThreads);
+		}
+
+		InverseThreadStruct str;
+		str.Transform = this;
+		str.NumberOfPoints = numberOfPoints;
+		str.Coordinates = coordinates;
+		str.InverseCoordinates = inverseCoordinates;
+		str.Residuals = residuals;
+		str.Lattice = lattice;
+		str.MaximumResiduals.assign(threader->GetNumberOfThreads(), 0.0);
+		threader->SetSingleMethod(Self::InverseThreaderCallback, &str);
+		threader->SingleMethodExecute();
+
+		return *std::max_element(str.MaximumResiduals.begin(), str.MaximumResiduals.end());
+	}
+
+	/**
+	 * Invert the nodes of a lattice over the grid of the basis with a node every latticeSpacing
+	 * voxels, and store x - y at each node.
+	 */
+	typename InverseLatticeType::Pointer ComputeInverseLattice(unsigned latticeSpacing, ThreadIdType numberOfThreads) const
+	{
+		typename InverseLatticeType::SizeType size;
+		typename InverseLatticeType::SpacingType spacing;
+		for (unsigned i = 0; i < TDimension; i++) {
+			size[i] = (m_Basis->GetSize()[i] + latticeSpacing - 2) / latticeSpacing + 1;
+			spacing[i] = m_Basis->GetSpacing()[i] * latticeSpacing;
+		}
+		typename InverseLatticeType::Pointer lattice = InverseLatticeType::New();
+		lattice->SetRegions(size);
+		lattice->SetSpacing(spacing);
+		lattice->SetOrigin(m_Basis->GetOrigin());
+		lattice->SetDirection(m_Basis->GetDirection());
+		lattice->Allocate();
+
+		const SizeValueType numberOfNodes = lattice->GetLargestPossibleRegion().GetNumberOfPixels();
+		std::vector<TScalarType> nodes(TDimension * numberOfNodes);
+		std::vector<TScalarType> inverseNodes(TDimension * numberOfNodes);
+		TScalarType* nodeCoordinates[TDimension];
+		TScalarType* inverseNodeCoordinates[TDimension];
+		for (unsigned i = 0; i < TDimension; i++) {
+			nodeCoordinates[i] = &nodes[i * numberOfNodes];
+			inverseNodeCoordinates[i] = &inverseNodes[i * numberOfNodes];
+		}
+		for (SizeValueType n = 0; n < numberOfNodes; n++) {
+			typename InverseLatticeType::PointType node;
+			lattice->TransformIndexToPhysicalPoint(lattice->ComputeIndex(n), node);
+			for (unsigned i = 0; i < TDimension; i++) {
+				nodeCoordinates[i][n] = node[i];
+			}
+		}
+
+		this->InverseTransformPointsInternal(numberOfNodes, nodeCoordinates, inverseNodeCoordinates, 0, 0, numberOfThreads);
+
+		typename InverseLatticeType::PixelType* inverseDef = lattice->GetBufferPointer();
+		for (SizeValueType n = 0; n < numberOfNodes; n++) {
+			for (unsigned i = 0; i < TDimension; i++) {
+				inverseDef[n][i] = inverseNodeCoordinates[i][n] - nodeCoordinates[i][n];
+			}
+		}
+		return lattice;
+	}
+
+	/** Interpolate the lattice linearly at the point. Returns false if the point is outside the lattice. */
+	static bool InterpolateInverseLattice(const InverseLatticeType* lattice, const OutputPointType & y,
+		typename BasisType::VectorType & inverseDef)
+	{
+		typedef ContinuousIndex<TScalarType, TDimension> ContinuousIndexType;
+		ContinuousIndexType index;
+		if (lattice->TransformPhysicalPointToContinuousIndex(y, index) == false) {
+			return false;
+		}
+		const typename InverseLatticeType::SizeType & size = lattice->GetLargestPossibleRegion().GetSize();
+		typename InverseLatticeType::IndexType base;
+		double fraction[TDimension];
+		for (unsigned i = 0; i < TDimension; i++) {
+			base[i] = std::min<IndexValueType>(static_cast<IndexValueType>(std::floor(index[i])),
+				static_cast<IndexValueType>(size[i]) - 2);
+			base[i] = std::max<IndexValueType>(base[i], 0);
+			fraction[i] = std::min(std::max(static_cast<double>(index[i]) - base[i], 0.0), 1.0);
+		}
+
+		inverseDef.Fill(0.0);
+		for (unsigned corner = 0; corner < (1u << TDimension); corner++) {
+			typename InverseLatticeType::IndexType cornerIndex = base;
+			double weight = 1.0;
+			for (unsigned i = 0; i < TDimension; i++) {
+				const bool upper = ((corner >> i) & 1) != 0;
+				cornerIndex[i] = std::min<IndexValueType>(base[i] + (upper ? 1 : 0), static_cast<IndexValueType>(size[i]) - 1);
+				weight *= upper ? fraction[i] : 1.0 - fraction[i];
+			}
+			if (weight > 0.0) {
+				inverseDef += lattice->GetPixel(cornerIndex) * weight;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Count a call of the hot path, and a Jacobian cache hit if entry is not negative.
+	 */
+	void CountCall(CountersType::CounterType counter, bool inside, OffsetValueType entry, double start) const {
+		if (entry >= 0) {
+			m_Counters->Add(CountersType::JacobianCacheHits, false, 0.0);
+		}
+		m_Counters->Add(counter, !inside, start);
+	}
+
+	/**
+	 * Mode i is drawn by thread i modulo the number of threads. Each thread holds one drawn mode
+	 * at a time, so the memory grows with the number of threads, not with that of the modes.
+	 */
+	struct DrawModesThreadStruct {
+		const StatisticalModelType* Model;
+		BasisType* Basis;
+		unsigned FirstMode;
+		unsigned LastMode;
+		std::vector<std::string> Errors;
+	};
+
+	static ITK_THREAD_RETURN_TYPE DrawModesThreaderCallback(void* arg) {
+		const MultiThreader::ThreadInfoStruct* info = static_cast<MultiThreader::ThreadInfoStruct*>(arg);
+		DrawModesThreadStruct* str = static_cast<DrawModesThreadStruct*>(info->UserData);
+		try {
+			for (unsigned i = str->FirstMode + info->ThreadID; i < str->LastMode; i += info->NumberOfThreads) {
+				typename DeformationFieldType::Pointer deformationField = str->Model->DrawPCABasisSample(i);
+				str->Basis->WriteComponent(i + 1, deformationField);
+			}
+		}
+		catch (ExceptionObject& e) {
+			str->Errors[info->ThreadID] = e.GetDescription();
+		}
+		catch (std::exception& e) {
+			str->Errors[info->ThreadID] = e.what();
+		}
+		return ITK_THREAD_RETURN_VALUE;
+	}
+
+	/**
+	 * Draw the modes from firstMode to lastMode - 1 into the basis, in parallel. The threads write
+	 * the buffer only; the basis is marked as modified once they have joined.
+	 */
+	void DrawModes(BasisType* basis, unsigned firstMode, unsigned lastMode) {
+		if (firstMode >= lastMode) {
+			return;
+		}
+		MultiThreader::Pointer threader = MultiThreader::New();
+		if (m_NumberOfBasisThreads > 0) {
+			threader->SetNumberOfThreads(m_NumberOfBasisThreads);
+		}
+		threader->SetNumberOfThreads(std::min<ThreadIdType>(threader->GetNumberOfThreads(), lastMode - firstMode));
+
+		DrawModesThreadStruct str;
+		str.Model = this->m_StatisticalModel;
+		str.Basis = basis;
+		str.FirstMode = firstMode;
+		str.LastMode = lastMode;
+		str.Errors.resize(threader->GetNumberOfThreads());
+		threader->SetSingleMethod(Self::DrawModesThreaderCallback, &str);
+		threader->SingleMethodExecute();
+		basis->Modified();
+
+		for (unsigned t = 0; t < str.Errors.size(); t++) {
+			if (!str.Errors[t].empty()) {
+				itkExceptionMacro( << "Drawing the modes of the model failed: " << str.Errors[t] );
+			}
+		}
+	}
+
+	/**
+	 * Replace a voxel basis by its B-spline fit if a control point spacing has been set.
+	 */
+	void FitBSplineBasis() {
+		bool enabled = false;
+		for (unsigned i = 0; i < TDimension; i++) {
+			enabled |= (m_BSplineControlPointSpacing[i] > 0);
+		}
+		if (!enabled || m_FullResolutionBasis.IsNull() || m_FullResolutionBasis->GetSplineOrder() != 1) {
+			return;
+		}
+		m_FullResolutionBasis = m_FullResolutionBasis->FitBSpline(m_BSplineControlPointSpacing);
+		m_Basis = m_FullResolutionBasis;
+	}
+
+	/**
+	 * Downsample the full basis according to the pyramid schedule.
+	 */
+	void BuildBasisPyramid() {
+		m_BasisPyramid.clear();
+		if (m_FullResolutionBasis.IsNull()) {
+			return;
+		}
+		for (unsigned level = 0; level < m_BasisPyramidSchedule.size(); level++) {
+			bool fullResolution = true;
+			for (unsigned i = 0; i < TDimension; i++) {
+				fullResolution &= (m_BasisPyramidSchedule[level][i] <= 1);
+			}
+			/** A tiled basis is streamed from its file; a downsampled copy would have to fit in memory. */
+			fullResolution |= m_FullResolutionBasis->GetTileSize() > 0;
+			fullResolution |= m_FullResolutionBasis->GetSplineOrder() != 1;
+			m_BasisPyramid.push_back(fullResolution ? m_FullResolutionBasis
+				: typename BasisType::ConstPointer(m_FullResolutionBasis->Downsample(m_BasisPyramidSchedule[level])));
+		}
+		this->BuildModeSupport();
+	}
+
+	/**
+	 * Index the support of the modes of the full basis and of each level that does not share it,
+	 * and select the index of the current basis.
+	 */
+	void BuildModeSupport() {
+		m_ModeSupport = ModeSupportType();
+		m_FullResolutionModeSupport = ModeSupportType();
+		m_ModeSupportPyramid.clear();
+		if (m_FullResolutionBasis.IsNull()) {
+			this->ResetRecentJacobians();
+			return;
+		}
+		m_FullResolutionBasis->BuildModeSupport(m_ModeSupportBlockSize, m_ModeSupportTolerance, m_FullResolutionModeSupport);
+		bool found = (m_Basis.GetPointer() == m_FullResolutionBasis.GetPointer());
+		if (found) {
+			m_ModeSupport = m_FullResolutionModeSupport;
+		}
+		m_ModeSupportPyramid.resize(m_BasisPyramid.size());
+		for (unsigned level = 0; level < m_BasisPyramid.size(); level++) {
+			if (m_BasisPyramid[level].GetPointer() == m_FullResolutionBasis.GetPointer()) {
+				m_ModeSupportPyramid[level] = m_FullResolutionModeSupport;
+			}
+			else {
+				m_BasisPyramid[level]->BuildModeSupport(m_ModeSupportBlockSize, m_ModeSupportTolerance, m_ModeSupportPyramid[level]);
+			}
+			if (!found && m_BasisPyramid[level].GetPointer() == m_Basis.GetPointer()) {
+				m_ModeSupport = m_ModeSupportPyramid[level];
+				found = true;
+			}
+		}
+
+		/** A level of a previous schedule stays in use until the next SetCurrentBasisLevel. */
+		if (!found && m_Basis.IsNotNull()) {
+			m_Basis->BuildModeSupport(m_ModeSupportBlockSize, m_ModeSupportTolerance, m_ModeSupport);
+		}
+		this->ResetRecentJacobians();
+	}
+
+	/**
+	 * Size the table of the Jacobians kept by TransformPoint for the current basis, number of modes
+	 * and support index, with a few slots per thread, or free it if SetFusedJacobian is off.
+	 */
+	void ResetRecentJacobians() {
+		if (!m_FusedJacobian || m_Basis.IsNull() || (this->HasModeSupport() && m_ModeSupportTolerance > 0.0)) {
+			m_RecentJacobians->Clear();
+			return;
+		}
+		m_RecentJacobians->Allocate(4 * MultiThreader::GetGlobalDefaultNumberOfThreads(),
+			this->GetNumberOfNonZeroJacobianIndices());
+	}
+
+	/**
+	 * The displacement at the point, evaluated together with the Jacobian, which is kept for
+	 * GetJacobian. Without a free slot, the displacement is evaluated alone.
+	 */
+	bool EvaluateDisplacementAndKeepJacobian(const InputPointType & pt, typename BasisType::VectorType & def) const
+	{
+		const OffsetValueType slot = m_RecentJacobians->Lock(pt);
+		if (slot < 0) {
+			return m_Basis->EvaluateDisplacement(pt, this->m_Parameters.data_block(), this->GetNumberOfParameters(), def);
+		}
+		bool inside = false;
+		if (this->HasModeSupport()) {
+			inside = m_Basis->EvaluateSupportedDisplacementAndBasis(m_ModeSupport, pt, this->m_Parameters.data_block(),
+				this->GetNumberOfParameters(), m_RecentJacobians->GetNumberOfColumns(), &def,
+				m_RecentJacobians->GetJacobian(slot), m_RecentJacobians->GetModes(slot));
+		}
+		else {
+			inside = m_Basis->EvaluateDisplacementAndBasis(pt, this->m_Parameters.data_block(), this->GetNumberOfParameters(),
+				def, m_RecentJacobians->GetJacobian(slot));
+		}
+		m_RecentJacobians->Unlock(slot, pt, inside);
+		return inside;
+	}
+
+	/**
+	 * Size the jacobian for the supporting modes. Returns its number of columns.
+	 */
+	unsigned PrepareSupportedJacobianOutput(JacobianType & jacobian) const {
+		const unsigned numberOfColumns = this->GetNumberOfNonZeroJacobianIndices();
+		if (jacobian.rows() != TDimension || jacobian.cols() != numberOfColumns) {
+			jacobian.SetSize(TDimension, numberOfColumns);
+		}
+		return numberOfColumns;
+	}
+
+	/**
+	 * Reduce derivatives that have been evaluated for all modes to the columns of GetJacobian
+	 * at the point, so that all Jacobians of a point have the same indices. The supporting modes
+	 * come first and in ascending order, so the derivatives can be moved down in place.
+	 */
+	template <class TDerivative>
+	void CompactToSupportingModes(const InputPointType & pt, std::vector<TDerivative> & derivatives,
+		const TDerivative & zero, NonZeroJacobianIndicesType & nonZeroJacobianIndices) const {
+		const unsigned numberOfModes = this->GetNumberOfParameters();
+		const unsigned numberOfColumns = this->GetNumberOfNonZeroJacobianIndices();
+		const unsigned numberOfSupportingModes
+			= m_Basis->GetSupportingModes(m_ModeSupport, pt, numberOfModes, numberOfColumns, nonZeroJacobianIndices);
+		for (unsigned j = 0; j < numberOfColumns; j++) {
+			derivatives[j] = (j < numberOfSupportingModes) ? derivatives[nonZeroJacobianIndices[j]] : zero;
+		}
+		derivatives.resize(numberOfColumns);
+	}
 
 private:
 
@@ -176,8 +1343,26 @@ private:
 
 
 
-	typename InterpolatorType::Pointer m_meanDeformation;
-	std::vector<typename InterpolatorType::Pointer> m_PCABasisDeformations;
+	typename BasisType::ConstPointer m_Basis;
+	typename BasisType::ConstPointer m_FullResolutionBasis;
+	std::vector<typename BasisType::ConstPointer> m_BasisPyramid;
+	BasisPyramidScheduleType m_BasisPyramidSchedule;
+	BasisStorageType m_BasisStorageType;
+	unsigned m_ModeSupportBlockSize;
+	double m_ModeSupportTolerance;
+
+	/** The support index of the current basis, of the full basis and of each level of the pyramid. */
+	ModeSupportType m_ModeSupport;
+	ModeSupportType m_FullResolutionModeSupport;
+	std::vector<ModeSupportType> m_ModeSupportPyramid;
+	ShrinkFactorsType m_BSplineControlPointSpacing;
+	ThreadIdType m_NumberOfBasisThreads;
+	double m_InverseTolerance;
+	unsigned m_InverseMaximumNumberOfIterations;
+	typename JacobianCacheType::Pointer m_JacobianCache;
+	bool m_FusedJacobian;
+	typename RecentJacobiansType::Pointer m_RecentJacobians;
+	CountersType::Pointer m_Counters;
 
 };
 
@@ -111,6 +111,7 @@ public:
  	  another->m_StatisticalModel = m_StatisticalModel;
  	  another->m_coeff_vector = m_coeff_vector;
  	  another->m_usedNumberCoefficients = m_usedNumberCoefficients;
+ 	  another->m_NonZeroJacobianIndices = m_NonZeroJacobianIndices;
  	  another->m_FixedParameters = m_FixedParameters;
  	  another->m_Parameters = this->m_Parameters;
    }
@@ -201,7 +202,16 @@ public:
    * Convenicne method to set the coefficients of the underlying StatisticalModel from a statismo::VectorType.
    * This has the same effect as calling SetParameters.
    */
-  virtual void SetCoefficients( VectorType& coefficients) { m_coeff_vector = coefficients; }
+  virtual void SetCoefficients( VectorType& coefficients) {
+	  m_coeff_vector = coefficients;
+	  for (unsigned i = this->m_Parameters.GetSize(); i < m_coeff_vector.size(); i++) {
+		  m_coeff_vector[i] = 0;
+	  }
+	  for (unsigned i = 0; i < this->m_Parameters.GetSize(); i++) {
+		  this->m_Parameters[i] = (i < coefficients.size()) ? coefficients[i] : 0.0;
+	  }
+	  this->Modified();
+  }
 
   /**
    * Set the statistical model that defines the valid transformations.
@@ -217,20 +227,46 @@ typename StatisticalModelType::ConstPointer GetStatisticalModel() const;
  * Set the number of PCA Coefficients used by the model. This parameters has a
  * regularization effect. Setting it to a small value will restrict the possible tranformations
  * to the main modes of variations.
+ * Only the used coefficients are parameters of the transform, so this also sets the number of parameters.
  */
-void SetUsedNumberOfCoefficients(unsigned n) { m_usedNumberCoefficients = n; }
+virtual void SetUsedNumberOfCoefficients(unsigned n);
 
 /**
  * returns the number of used model coefficients.
  */
 unsigned GetUsedNumberOfCoefficients() { return m_usedNumberCoefficients; }
 
+/**
+ * returns the number of modes of the model, i.e. the number of coefficients that may be used.
+ */
+unsigned GetNumberOfPrincipalComponents() const { return static_cast<unsigned>(m_coeff_vector.size()); }
+
+/**
+ * Every parameter influences every point, so the non-zero Jacobian indices are always 0..n-1.
+ * They are computed once whenever the number of parameters changes.
+ */
+const NonZeroJacobianIndicesType & GetNonZeroJacobianIndices() const { return m_NonZeroJacobianIndices; }
 
-  /** Compute the Jacobian of the transformation. */
+
+  /** Compute the Jacobian of the transformation. Calls GetStatisticalModelJacobian. */
   virtual void GetJacobian(
-    const InputPointType &,
-    JacobianType &,
-    NonZeroJacobianIndicesType & ) const;
+    const InputPointType & pt,
+    JacobianType & jacobian,
+    NonZeroJacobianIndicesType & nonZeroJacobianIndices ) const
+  {
+    this->GetStatisticalModelJacobian( pt, jacobian, nonZeroJacobianIndices );
+  }
+
+  /**
+   * Compute the Jacobian by querying the statistical model at the point. statismo looks up the
+   * closest point of the representer and allocates the full matrix of all modes on every call, so
+   * this is slow; subclasses that hold the modes themselves override GetJacobian, and this method
+   * remains as a reference to check them against.
+   */
+  void GetStatisticalModelJacobian(
+    const InputPointType & pt,
+    JacobianType & jacobian,
+    NonZeroJacobianIndicesType & nonZeroJacobianIndices ) const;
 
   /** Compute the spatial Jacobian of the transformation. */
   virtual void GetSpatialJacobian(
@@ -296,9 +332,31 @@ protected:
 
 	void PrintSelf(std::ostream &os, Indent indent) const;
 
+	/**
+	 * Size the coefficients and the parameters for a model with the given number of modes,
+	 * and set them to zero. Allows subclasses to work without a statistical model.
+	 */
+	void SetNumberOfPrincipalComponents(unsigned numberOfPrincipalComponents);
+
+	/** Refill m_NonZeroJacobianIndices after the number of parameters has changed. */
+	void UpdateNonZeroJacobianIndices();
+
+	/**
+	 * Size the outputs of GetJacobian for the current number of parameters. Storage that already
+	 * has the right size is reused, so that no memory is allocated when the caller keeps it.
+	 */
+	void PrepareJacobianOutput(JacobianType & jacobian, NonZeroJacobianIndicesType & nonZeroJacobianIndices) const
+	{
+		if (jacobian.rows() != OutputSpaceDimension || jacobian.cols() != this->GetNumberOfParameters()) {
+			jacobian.SetSize(OutputSpaceDimension, this->GetNumberOfParameters());
+		}
+		nonZeroJacobianIndices = m_NonZeroJacobianIndices;
+	}
+
 	typename StatisticalModelType::ConstPointer m_StatisticalModel;
 	VectorType m_coeff_vector;
 	unsigned m_usedNumberCoefficients;
+	NonZeroJacobianIndicesType m_NonZeroJacobianIndices;
 	ParametersType m_FixedParameters;
 
 private:
@@ -75,6 +75,7 @@ AdvancedStatisticalModelTransformBase<TRepresenter, TScalarType, TDimension>
 
 /*!
  * Set the morphable model and ajust the parameters dimension.
+ * Only the used coefficients are parameters; the others stay zero.
  */
 template < class TRepresenter, class TScalarType,  unsigned int TDimension >
 void
@@ -84,12 +85,68 @@ AdvancedStatisticalModelTransformBase<TRepresenter,  TScalarType, TDimension>
 	itkDebugMacro( << "Setting statistical model ");
 	m_StatisticalModel = model;
 
+	this->SetNumberOfPrincipalComponents(model->GetNumberOfPrincipalComponents());
+}
+
 
-	this->m_Parameters.SetSize(model->GetNumberOfPrincipalComponents());
+/*!
+ * Size the coefficients for a model with the given number of modes and reset them to zero.
+ */
+template < class TRepresenter, class TScalarType,  unsigned int TDimension >
+void
+AdvancedStatisticalModelTransformBase<TRepresenter,  TScalarType, TDimension>
+::SetNumberOfPrincipalComponents(unsigned numberOfPrincipalComponents)
+{
+	this->m_Parameters.SetSize(std::min(m_usedNumberCoefficients, numberOfPrincipalComponents));
 	this->m_Parameters.Fill(0.0);
 
-	this->m_coeff_vector.set_size(model->GetNumberOfPrincipalComponents());
+	this->m_coeff_vector.set_size(numberOfPrincipalComponents);
+	this->m_coeff_vector.fill(0);
+
+	this->UpdateNonZeroJacobianIndices();
+	this->Modified();
+}
+
+
+template < class TRepresenter, class TScalarType,  unsigned int TDimension >
+void
+AdvancedStatisticalModelTransformBase<TRepresenter,  TScalarType, TDimension>
+::UpdateNonZeroJacobianIndices()
+{
+	m_NonZeroJacobianIndices.resize(this->GetNumberOfParameters());
+	for (unsigned i = 0; i < m_NonZeroJacobianIndices.size(); i++) {
+		m_NonZeroJacobianIndices[i] = i;
+	}
+}
+
+
+/*!
+ * Change the number of used coefficients. If the number of modes is known, the parameters are
+ * resized and the values of the coefficients that stay in use are kept.
+ */
+template < class TRepresenter, class TScalarType,  unsigned int TDimension >
+void
+AdvancedStatisticalModelTransformBase<TRepresenter,  TScalarType, TDimension>
+::SetUsedNumberOfCoefficients(unsigned n)
+{
+	m_usedNumberCoefficients = n;
+	if (this->m_coeff_vector.size() == 0) {
+		return;
+	}
+
+	const unsigned numberOfParameters = std::min(n, static_cast<unsigned>(this->m_coeff_vector.size()));
+	this->m_Parameters.SetSize(numberOfParameters);
+	for (unsigned i = 0; i < this->m_coeff_vector.size(); i++) {
+		if (i < numberOfParameters) {
+			this->m_Parameters[i] = this->m_coeff_vector[i];
+		}
+		else {
+			this->m_coeff_vector[i] = 0;
+		}
+	}
 
+	this->UpdateNonZeroJacobianIndices();
+	this->Modified();
 }
 
 template < class TRepresenter, class TScalarType,  unsigned int TDimension >
@@ -113,8 +170,9 @@ AdvancedStatisticalModelTransformBase<TRepresenter,  TScalarType, TDimension>
 {
 	itkDebugMacro( << "Setting Identity");
 
-	for (unsigned i = 0; i  < this->GetNumberOfParameters(); i++)
+	for (unsigned i = 0; i  < this->m_coeff_vector.size(); i++)
 		this->m_coeff_vector[i] = 0;
+	this->m_Parameters.Fill(0.0);
 
 
 	this->Modified();
@@ -128,14 +186,13 @@ AdvancedStatisticalModelTransformBase<TRepresenter,  TScalarType, TDimension>
 {
   itkDebugMacro( << "Setting parameters " << parameters );
 
-  // Set angle
-  for(unsigned int i=0; i < std::min(m_usedNumberCoefficients, (unsigned) this->GetNumberOfParameters()); i++)
+  // Only the used coefficients are parameters; the remaining ones stay zero.
+  // m_Parameters keeps the coefficients in double precision for the subclasses.
+  for(unsigned int i=0; i < this->GetNumberOfParameters(); i++)
     {
 	m_coeff_vector[i] = parameters[i];
+	this->m_Parameters[i] = parameters[i];
     }
-  for (unsigned int i = std::min(m_usedNumberCoefficients, (unsigned) this->GetNumberOfParameters()); i <  this->GetNumberOfParameters(); i++) {
-	  m_coeff_vector[i] = 0;
-  }
 
   // Modified is always called since we just have a pointer to the
   // parameters and cannot know if the parameters have changed.
@@ -152,12 +209,7 @@ AdvancedStatisticalModelTransformBase<TRepresenter,  TScalarType, TDimension>
 {
   itkDebugMacro( << "Getting parameters ");
 
-
-  // Get the translation
-  for(unsigned int i=0; i < this->GetNumberOfParameters(); i++)
-    {
-    this->m_Parameters[i] = this->m_coeff_vector[i];
-    }
+  // m_Parameters is kept in sync with m_coeff_vector by SetParameters and SetCoefficients.
   itkDebugMacro(<<"After getting parameters " << this->m_Parameters );
 
   return this->m_Parameters;
@@ -179,25 +231,28 @@ PrintSelf(std::ostream &os, Indent indent) const
 
 
 /**
- * ********************* GetJacobian ****************************
+ * ********************* GetStatisticalModelJacobian ****************************
  */
 
 template < class TRepresenter, class TScalarType,  unsigned int TDimension >
 void
 AdvancedStatisticalModelTransformBase<TRepresenter,  TScalarType, TDimension>
-::GetJacobian(
+::GetStatisticalModelJacobian(
   const InputPointType & pt,
   JacobianType & jacobian,
   NonZeroJacobianIndicesType & nonZeroJacobianIndices ) const
 {
-	jacobian.SetSize(OutputSpaceDimension, m_StatisticalModel->GetNumberOfPrincipalComponents());
-	jacobian.Fill(0);
+	// Only the used coefficients are parameters, so the Jacobian has one column per used coefficient.
+	if (m_StatisticalModel.IsNull()) {
+		itkExceptionMacro( << "No statistical model to compute the Jacobian with." );
+	}
+	this->PrepareJacobianOutput(jacobian, nonZeroJacobianIndices);
 
 	const MatrixType& statModelJacobian = m_StatisticalModel->GetJacobian(pt);
 
-	for (unsigned i = 0; i < statModelJacobian.rows(); i++) {
-		for (unsigned j = 0; j <  std::min(m_usedNumberCoefficients, (unsigned) this->GetNumberOfParameters()); j++) {
-			jacobian[i][j] = statModelJacobian[i][j];
+	for (unsigned i = 0; i < OutputSpaceDimension; i++) {
+		for (unsigned j = 0; j < this->GetNumberOfParameters(); j++) {
+			jacobian[i][j] = (i < statModelJacobian.rows()) ? statModelJacobian[i][j] : 0.0;
 		}
 	}
 
@@ -206,12 +261,7 @@ AdvancedStatisticalModelTransformBase<TRepresenter,  TScalarType, TDimension>
 	itkDebugMacro( << "After GetMorphableModelJacobian:"
 			<< "\nJacobian = \n" << jacobian);
 
-	nonZeroJacobianIndices.resize(this->m_StatisticalModel->GetNumberOfPrincipalComponents());
-	for(int i = 0; i < nonZeroJacobianIndices.size(); i++) {
-		nonZeroJacobianIndices[i] = i;
-	}
-
-} // end GetJacobian()
+} // end GetStatisticalModelJacobian()
 
 } // namespace
 
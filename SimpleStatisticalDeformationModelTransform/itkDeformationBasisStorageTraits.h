@@ -0,0 +1,183 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef __itkDeformationBasisStorageTraits_h
+#define __itkDeformationBasisStorageTraits_h
+
+#include "itkIntTypes.h"
+
+#include <cmath>
+#include <cstring>
+
+namespace itk
+{
+
+/** Tags for the reduced precision formats that have no C++ type of their own. */
+struct Float16StorageTag {};
+struct Int16StorageTag {};
+
+/**
+ * \brief Conversion between double and the type in which a deformation basis is stored.
+ *
+ * Decode returns the stored value as double, Encode rounds a double to the storage type.
+ * Quantized formats store value / scale, with one scale per component of the basis; the
+ * scale is applied by the caller, so that it can be folded into the coefficients.
+ *
+ * \ingroup Transforms
+ */
+template < class TStorage >
+struct DeformationBasisStorageTraits
+{
+  typedef TStorage ValueType;
+  static const bool IsQuantized = false;
+  static const int  MaximumQuantizedValue = 0;
+
+  static double Decode( ValueType value ) { return value; }
+  static ValueType Encode( double value ) { return static_cast<ValueType>( value ); }
+};
+
+
+/**
+ * IEEE 754 half precision: 11 significant bits, i.e. a relative rounding error of at most
+ * 2^-11, and a range of +-65504. Conversions are done in software, round to nearest even.
+ */
+template <>
+struct DeformationBasisStorageTraits<Float16StorageTag>
+{
+  typedef uint16_t ValueType;
+  static const bool IsQuantized = false;
+  static const int  MaximumQuantizedValue = 0;
+
+  static double Decode( ValueType value )
+  {
+    const uint32_t sign = static_cast<uint32_t>( value & 0x8000 ) << 16;
+    const uint32_t magnitude = value & 0x7fff;
+    if ( magnitude < 0x0400 )
+    {
+      /** Zero or subnormal: magnitude * 2^-24. */
+      const double subnormal = magnitude * 5.9604644775390625e-8;
+      return sign ? -subnormal : subnormal;
+    }
+
+    uint32_t bits;
+    if ( magnitude >= 0x7c00 )
+    {
+      bits = sign | 0x7f800000 | ( ( magnitude & 0x03ff ) << 13 );
+    }
+    else
+    {
+      bits = sign | ( ( magnitude << 13 ) + 0x38000000 );
+    }
+    float single;
+    std::memcpy( &single, &bits, sizeof( single ) );
+    return single;
+  }
+
+  static ValueType Encode( double value )
+  {
+    const float single = static_cast<float>( value );
+    uint32_t bits;
+    std::memcpy( &bits, &single, sizeof( bits ) );
+
+    const ValueType sign = static_cast<ValueType>( ( bits >> 16 ) & 0x8000 );
+    const uint32_t magnitude = bits & 0x7fffffff;
+    if ( magnitude >= 0x7f800000 )
+    {
+      /** Infinity stays infinity, NaN stays NaN. */
+      return sign | 0x7c00 | ( magnitude > 0x7f800000 ? 0x0200 : 0 );
+    }
+    if ( magnitude >= 0x477ff000 )
+    {
+      /** Rounds to 65520 or more, which overflows. */
+      return sign | 0x7c00;
+    }
+    if ( magnitude < 0x38800000 )
+    {
+      /** Below the smallest normal number; 2^-25 and less round to zero. */
+      if ( magnitude <= 0x33000000 )
+      {
+        return sign;
+      }
+      const uint32_t mantissa = ( magnitude & 0x007fffff ) | 0x00800000;
+      const unsigned int shift = 126 - ( magnitude >> 23 );
+      uint32_t subnormal = mantissa >> shift;
+      const uint32_t remainder = mantissa & ( ( 1u << shift ) - 1 );
+      const uint32_t halfway = 1u << ( shift - 1 );
+      if ( remainder > halfway || ( remainder == halfway && ( subnormal & 1 ) ) )
+      {
+        subnormal++;
+      }
+      return sign | static_cast<ValueType>( subnormal );
+    }
+
+    /** Rebias the exponent from 127 to 15 and round the mantissa to 10 bits. */
+    uint32_t normal = magnitude - 0x38000000;
+    normal += 0x0fff + ( ( normal >> 13 ) & 1 );
+    return sign | static_cast<ValueType>( normal >> 13 );
+  }
+};
+
+
+/**
+ * 16 bit integers, scaled such that the largest magnitude of a component maps to 32767.
+ * The absolute rounding error of a component is at most half its scale.
+ */
+template <>
+struct DeformationBasisStorageTraits<Int16StorageTag>
+{
+  typedef int16_t ValueType;
+  static const bool IsQuantized = true;
+  static const int  MaximumQuantizedValue = 32767;
+
+  static double Decode( ValueType value ) { return value; }
+
+  static ValueType Encode( double value )
+  {
+    const double rounded = std::floor( value + 0.5 );
+    if ( rounded > MaximumQuantizedValue )
+    {
+      return MaximumQuantizedValue;
+    }
+    if ( rounded < -MaximumQuantizedValue )
+    {
+      return -MaximumQuantizedValue;
+    }
+    return static_cast<ValueType>( rounded );
+  }
+};
+
+}  // namespace itk
+
+#endif /* __itkDeformationBasisStorageTraits_h */
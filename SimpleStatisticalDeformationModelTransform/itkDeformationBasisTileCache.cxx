@@ -0,0 +1,220 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#include "itkDeformationBasisTileCache.h"
+#include "itkMutexLockHolder.h"
+
+#include <algorithm>
+
+namespace itk
+{
+
+DeformationBasisTileCache
+::DeformationBasisTileCache() :
+  m_DataOffset(0),
+  m_TileSize(0),
+  m_MaximumMemory(0),
+  m_MinimumNumberOfTiles(1),
+  m_ClockHand(0),
+  m_NumberOfMisses(0),
+  m_NumberOfEvictions(0),
+  m_NumberOfPrefetches(0)
+{
+}
+
+
+void
+DeformationBasisTileCache
+::Initialize( const MemoryMappedFile * file, SizeValueType dataOffset, SizeValueType tileSize,
+  SizeValueType numberOfTiles, SizeValueType minimumNumberOfTiles )
+{
+  MutexLockHolder<SimpleFastMutexLock> holder( this->m_Mutex );
+  this->m_File = file;
+  this->m_DataOffset = dataOffset;
+  this->m_TileSize = tileSize;
+  this->m_MinimumNumberOfTiles = std::max<SizeValueType>( minimumNumberOfTiles, 1 );
+  this->m_ResidentTiles.clear();
+  this->m_ClockHand = 0;
+  this->m_Resident.assign( numberOfTiles, 0 );
+  this->m_Referenced.assign( numberOfTiles, 0 );
+  this->m_NumberOfMisses = 0;
+  this->m_NumberOfEvictions = 0;
+  this->m_NumberOfPrefetches = 0;
+}
+
+
+void
+DeformationBasisTileCache
+::SetMaximumMemory( SizeValueType bytes )
+{
+  MutexLockHolder<SimpleFastMutexLock> holder( this->m_Mutex );
+  this->m_MaximumMemory = bytes;
+  this->EvictToBudget();
+}
+
+
+void
+DeformationBasisTileCache
+::Load( SizeValueType tile )
+{
+  MutexLockHolder<SimpleFastMutexLock> holder( this->m_Mutex );
+  if ( this->MakeResident( tile ) )
+  {
+    this->m_NumberOfMisses++;
+    this->EvictToBudget();
+  }
+}
+
+
+bool
+DeformationBasisTileCache
+::MakeResident( SizeValueType tile )
+{
+  this->m_Referenced[ tile ] = 1;
+  if ( this->m_Resident[ tile ] )
+  {
+    return false;
+  }
+  this->m_Resident[ tile ] = 1;
+  this->m_ResidentTiles.push_back( tile );
+  return true;
+}
+
+
+/**
+ * The hand clears the reference flags of the tiles it passes and evicts the first tile whose flag
+ * is clear. Threads may set the flags again while the hand goes round, so after a full round
+ * without an eviction the tile at the hand is evicted anyway. The released range is narrowed to
+ * whole pages, but tiles are page aligned in the file, so a tile is released completely.
+ */
+void
+DeformationBasisTileCache
+::EvictToBudget()
+{
+  if ( this->m_MaximumMemory == 0 || this->m_TileSize == 0 )
+  {
+    return;
+  }
+  const SizeValueType maximumNumberOfTiles =
+    std::max( this->m_MaximumMemory / this->m_TileSize, this->m_MinimumNumberOfTiles );
+  SizeValueType numberOfPassedTiles = 0;
+  while ( this->m_ResidentTiles.size() > maximumNumberOfTiles )
+  {
+    if ( this->m_ClockHand >= this->m_ResidentTiles.size() )
+    {
+      this->m_ClockHand = 0;
+    }
+    const SizeValueType tile = this->m_ResidentTiles[ this->m_ClockHand ];
+    if ( this->m_Referenced[ tile ] && numberOfPassedTiles < this->m_ResidentTiles.size() )
+    {
+      this->m_Referenced[ tile ] = 0;
+      this->m_ClockHand++;
+      numberOfPassedTiles++;
+      continue;
+    }
+    this->m_ResidentTiles[ this->m_ClockHand ] = this->m_ResidentTiles.back();
+    this->m_ResidentTiles.pop_back();
+    this->m_Resident[ tile ] = 0;
+    this->m_Referenced[ tile ] = 0;
+    this->m_NumberOfEvictions++;
+    numberOfPassedTiles = 0;
+    if ( this->m_File.IsNotNull() )
+    {
+      this->m_File->DontNeed( this->m_DataOffset + tile * this->m_TileSize, this->m_TileSize );
+    }
+  }
+}
+
+
+/**
+ * Only tiles that are not resident yet are read ahead. Tiles beyond the budget are not prefetched,
+ * as they would evict each other before their use.
+ */
+void
+DeformationBasisTileCache
+::Prefetch( const std::vector<SizeValueType> & tiles )
+{
+  MutexLockHolder<SimpleFastMutexLock> holder( this->m_Mutex );
+  SizeValueType maximumNumberOfTiles = tiles.size();
+  if ( this->m_MaximumMemory > 0 && this->m_TileSize > 0 )
+  {
+    maximumNumberOfTiles = std::min( maximumNumberOfTiles,
+      std::max( this->m_MaximumMemory / this->m_TileSize, this->m_MinimumNumberOfTiles ) );
+  }
+  for ( SizeValueType i = 0; i < maximumNumberOfTiles; i++ )
+  {
+    const SizeValueType tile = tiles[ i ];
+    if ( tile >= this->m_Resident.size() )
+    {
+      continue;
+    }
+    if ( this->MakeResident( tile ) )
+    {
+      this->m_NumberOfPrefetches++;
+      if ( this->m_File.IsNotNull() )
+      {
+        this->m_File->WillNeed( this->m_DataOffset + tile * this->m_TileSize, this->m_TileSize );
+      }
+    }
+  }
+  this->EvictToBudget();
+}
+
+
+void
+DeformationBasisTileCache
+::ResetCounters()
+{
+  MutexLockHolder<SimpleFastMutexLock> holder( this->m_Mutex );
+  this->m_NumberOfMisses = 0;
+  this->m_NumberOfEvictions = 0;
+  this->m_NumberOfPrefetches = 0;
+}
+
+
+void
+DeformationBasisTileCache
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "TileSize: " << this->m_TileSize << std::endl;
+  os << indent << "NumberOfTiles: " << this->m_Resident.size() << std::endl;
+  os << indent << "MaximumMemory: " << this->m_MaximumMemory << std::endl;
+  os << indent << "NumberOfResidentTiles: " << this->m_ResidentTiles.size() << std::endl;
+  os << indent << "NumberOfMisses: " << this->m_NumberOfMisses << std::endl;
+  os << indent << "NumberOfEvictions: " << this->m_NumberOfEvictions << std::endl;
+}
+
+}  // namespace itk
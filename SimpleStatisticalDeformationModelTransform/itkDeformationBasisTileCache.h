@@ -0,0 +1,166 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef __itkDeformationBasisTileCache_h
+#define __itkDeformationBasisTileCache_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkMemoryMappedFile.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/**
+ * \brief Residency of the tiles of a memory mapped basis file, with clock replacement.
+ *
+ * A tiled basis file stores its voxels in cubic tiles, each holding all modes of its voxels in
+ * a page aligned block of TileSize bytes. The file is mapped as a whole, so a tile is read by the
+ * operating system on its first access. This class keeps track of the tiles that have been
+ * accessed, and once more than MaximumMemory bytes of them have been touched, releases the pages
+ * of a tile that has not been used since the clock hand last passed it, an approximation of the
+ * least recently used one. A released tile is read again from the file on its next access, so a
+ * tile that is evicted while another thread reads it only costs time, never correctness. Prefetch
+ * asks the operating system to read tiles ahead of their use.
+ *
+ * Touching a resident tile only sets its reference flag, without a lock, so the threads of a
+ * metric do not wait for each other; a flag is a byte of its own and is only written if it is
+ * not set yet. Making a tile resident and evicting tiles is done under a mutex. A thread may see
+ * the residency of a tile late, which at worst takes the mutex or keeps an evicted tile once more.
+ *
+ * \ingroup Transforms
+ */
+class DeformationBasisTileCache : public Object
+{
+public:
+  /** Standard typedefs   */
+  typedef DeformationBasisTileCache  Self;
+  typedef Object                     Superclass;
+  typedef SmartPointer<Self>         Pointer;
+  typedef SmartPointer<const Self>   ConstPointer;
+
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( DeformationBasisTileCache, Object );
+
+  /**
+   * Manage numberOfTiles tiles of tileSize bytes each, the first of which starts at byte dataOffset
+   * of the file. At least minimumNumberOfTiles tiles stay resident, whatever the memory budget.
+   * Forgets all tiles and resets the counters.
+   */
+  void Initialize( const MemoryMappedFile * file, SizeValueType dataOffset, SizeValueType tileSize,
+    SizeValueType numberOfTiles, SizeValueType minimumNumberOfTiles );
+
+  /**
+   * Memory budget in bytes for the resident tiles, 0 meaning no limit. Lowering it evicts tiles
+   * at once.
+   */
+  void SetMaximumMemory( SizeValueType bytes );
+  SizeValueType GetMaximumMemory() const { return m_MaximumMemory; }
+
+  /** Record an access to the tile. A tile that is not resident is counted as a miss. */
+  void Touch( SizeValueType tile )
+  {
+    if ( tile >= m_Resident.size() )
+    {
+      return;
+    }
+    if ( !m_Resident[ tile ] )
+    {
+      this->Load( tile );
+    }
+    else if ( !m_Referenced[ tile ] )
+    {
+      m_Referenced[ tile ] = 1;
+    }
+  }
+
+  /** Ask for the tiles to be read ahead, and make them the most recently used ones. */
+  void Prefetch( const std::vector<SizeValueType> & tiles );
+
+  /** Counters since the last ResetCounters. Accesses to resident tiles are not counted. */
+  SizeValueType GetNumberOfMisses() const { return m_NumberOfMisses; }
+  SizeValueType GetNumberOfEvictions() const { return m_NumberOfEvictions; }
+  SizeValueType GetNumberOfPrefetches() const { return m_NumberOfPrefetches; }
+  void ResetCounters();
+
+  SizeValueType GetNumberOfTiles() const { return m_Resident.size(); }
+  SizeValueType GetNumberOfResidentTiles() const { return m_ResidentTiles.size(); }
+  SizeValueType GetTileSize() const { return m_TileSize; }
+
+protected:
+
+  DeformationBasisTileCache();
+  virtual ~DeformationBasisTileCache() {};
+
+  void PrintSelf( std::ostream & os, Indent indent ) const;
+
+  /** Make the tile resident under the mutex, unless another thread has done so already. */
+  void Load( SizeValueType tile );
+
+  /** Mark the tile resident and referenced. Returns false if it was resident already. The mutex must be held. */
+  bool MakeResident( SizeValueType tile );
+
+  /** Evict unreferenced tiles at the clock hand until the budget is met. The mutex must be held. */
+  void EvictToBudget();
+
+private:
+
+  DeformationBasisTileCache( const Self & ); // purposely not implemented
+  void operator=( const Self & );            // purposely not implemented
+
+  MemoryMappedFile::ConstPointer          m_File;
+  SizeValueType                           m_DataOffset;
+  SizeValueType                           m_TileSize;
+  SizeValueType                           m_MaximumMemory;
+  SizeValueType                           m_MinimumNumberOfTiles;
+  std::vector<SizeValueType>              m_ResidentTiles;
+  SizeValueType                           m_ClockHand;
+  std::vector<unsigned char>              m_Resident;
+  std::vector<unsigned char>              m_Referenced;
+  SizeValueType                           m_NumberOfMisses;
+  SizeValueType                           m_NumberOfEvictions;
+  SizeValueType                           m_NumberOfPrefetches;
+  SimpleFastMutexLock                     m_Mutex;
+
+}; // class DeformationBasisTileCache
+
+}  // namespace itk
+
+#endif /* __itkDeformationBasisTileCache_h */
@@ -0,0 +1,81 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+
+#ifndef __itkDeformationModelAtomicFlag_h
+#define __itkDeformationModelAtomicFlag_h
+
+#if defined( _WIN32 )
+#include "itkWindows.h"
+#endif
+
+namespace itk
+{
+
+/**
+ * \brief A flag that one thread at a time can set, without a mutex.
+ *
+ * Guards the per-thread slots of DeformationModelTransformCounters and the slots of
+ * DeformationModelRecentJacobians: a thread that fails to set the flag of a slot does not wait,
+ * but takes another slot or does without.
+ *
+ * \ingroup Transforms
+ */
+struct DeformationModelAtomicFlag
+{
+  /** Set the flag from 0 to 1. Returns false if it was set already. */
+  static bool TrySet( volatile long * flag )
+  {
+#if defined( _WIN32 )
+    return InterlockedCompareExchange( flag, 1, 0 ) == 0;
+#else
+    return __sync_bool_compare_and_swap( flag, 0L, 1L );
+#endif
+  }
+
+  /** Clear the flag, after the writes before it have become visible. */
+  static void Clear( volatile long * flag )
+  {
+#if defined( _WIN32 )
+    InterlockedExchange( flag, 0 );
+#else
+    __sync_lock_release( flag );
+#endif
+  }
+};
+
+}  // namespace itk
+
+#endif /* __itkDeformationModelAtomicFlag_h */
@@ -0,0 +1,153 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef __itkDeformationModelJacobianCache_h
+#define __itkDeformationModelJacobianCache_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkInterleavedDeformationBasis.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/**
+ * \brief Per-sample cache of the mean displacement and the parameter Jacobian of a deformation model.
+ *
+ * The displacement of a statistical deformation model is linear in its coefficients, so the
+ * Jacobian with respect to the parameters at a given point does not change between optimizer
+ * iterations. For a fixed set of sample points this class stores the interpolated mean m and the
+ * Dimension x K basis matrix J per point. TransformPoint then reduces to x + m + J c and the
+ * parameter Jacobian to a lookup.
+ *
+ * The entries are stored in the order of the samples, each with its point, in one flat buffer.
+ * A point is found through an open addressing hash table of entry numbers on its coordinates,
+ * so a lookup costs one hash, usually one probe, and a comparison with the entry that is read
+ * anyway. As the metrics visit the samples in order, the entries are read sequentially.
+ *
+ * The cache is only built if it fits in the configured memory budget; otherwise it stays empty
+ * and callers fall back to direct evaluation of the basis.
+ *
+ * \ingroup Transforms
+ */
+template < class TScalarType, unsigned int TDimension >
+class DeformationModelJacobianCache : public Object
+{
+public:
+  /** Standard typedefs   */
+  typedef DeformationModelJacobianCache Self;
+  typedef Object                        Superclass;
+  typedef SmartPointer<Self>            Pointer;
+  typedef SmartPointer<const Self>      ConstPointer;
+
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( DeformationModelJacobianCache, Object );
+
+  typedef InterleavedDeformationBasis<TScalarType, TDimension> BasisType;
+  typedef typename BasisType::PointType                        PointType;
+  typedef typename BasisType::VectorType                       VectorType;
+  typedef typename BasisType::JacobianType                     JacobianType;
+  typedef std::vector<PointType>                               PointListType;
+
+  /** Memory budget in bytes. Build fails if the cache would need more than this. */
+  itkSetMacro( MaximumMemory, SizeValueType );
+  itkGetConstMacro( MaximumMemory, SizeValueType );
+
+  /** Number of modes stored per entry. */
+  itkGetConstMacro( NumberOfModes, unsigned int );
+
+  /** Approximate number of bytes needed to cache the given number of points. */
+  static SizeValueType GetRequiredMemory( SizeValueType numberOfPoints, unsigned int numberOfModes );
+
+  /**
+   * Evaluate the basis at all points that lie inside the basis buffer and store the result.
+   * Returns false, and leaves the cache empty, if the memory budget is exceeded.
+   */
+  bool Build( const BasisType * basis, unsigned int numberOfModes, const PointListType & points );
+
+  /** Remove all entries. */
+  void Clear();
+
+  bool IsEmpty() const { return this->m_NumberOfEntries == 0; }
+
+  SizeValueType GetNumberOfEntries() const { return this->m_NumberOfEntries; }
+
+  /** Returns the entry of the point, or -1 if it is not cached. */
+  OffsetValueType Find( const PointType & point ) const;
+
+  /** Displacement m + J c of a cached entry. */
+  void EvaluateDisplacement( OffsetValueType entry, const double * coefficients, VectorType & displacement ) const;
+
+  /** Copy the cached basis matrix into the first GetNumberOfModes() columns of the jacobian. */
+  void GetJacobian( OffsetValueType entry, JacobianType & jacobian ) const;
+
+  /** Hash of the coordinates of the point, FNV-1a over their bytes. */
+  static SizeValueType Hash( const PointType & point );
+
+protected:
+
+  DeformationModelJacobianCache();
+  virtual ~DeformationModelJacobianCache() {};
+
+  void PrintSelf( std::ostream & os, Indent indent ) const;
+
+private:
+
+  DeformationModelJacobianCache( const Self & ); // purposely not implemented
+  void operator=( const Self & );                // purposely not implemented
+
+  /** Slot of the point in the table, either holding its entry or the empty slot where it would go. */
+  SizeValueType FindSlot( const PointType & point ) const;
+
+  SizeValueType                m_MaximumMemory;
+  unsigned int                 m_NumberOfModes;
+  unsigned int                 m_EntrySize;
+  SizeValueType                m_NumberOfEntries;
+  std::vector<OffsetValueType> m_Slots;
+  std::vector<double>          m_Data;
+
+}; // class DeformationModelJacobianCache
+
+}  // namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+# include "itkDeformationModelJacobianCache.txx"
+#endif
+
+#endif /* __itkDeformationModelJacobianCache_h */
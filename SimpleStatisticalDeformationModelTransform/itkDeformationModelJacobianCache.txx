@@ -0,0 +1,241 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef _itkDeformationModelJacobianCache_txx
+#define _itkDeformationModelJacobianCache_txx
+
+#include "itkDeformationModelJacobianCache.h"
+
+namespace itk
+{
+
+template < class TScalarType, unsigned int TDimension >
+DeformationModelJacobianCache<TScalarType, TDimension>
+::DeformationModelJacobianCache() :
+	m_MaximumMemory(0),
+	m_NumberOfModes(0),
+	m_EntrySize(2 * TDimension),
+	m_NumberOfEntries(0)
+{
+}
+
+
+/*!
+ * Entry data, i.e. the point, the mean and the basis matrix, plus two slots of the hash table.
+ */
+template < class TScalarType, unsigned int TDimension >
+SizeValueType
+DeformationModelJacobianCache<TScalarType, TDimension>
+::GetRequiredMemory( SizeValueType numberOfPoints, unsigned int numberOfModes )
+{
+	const SizeValueType entryBytes = (numberOfModes + 2) * TDimension * sizeof(double);
+	const SizeValueType slotBytes = 2 * sizeof(OffsetValueType);
+	return numberOfPoints * (entryBytes + slotBytes);
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+bool
+DeformationModelJacobianCache<TScalarType, TDimension>
+::Build( const BasisType * basis, unsigned int numberOfModes, const PointListType & points )
+{
+	this->Clear();
+
+	if (GetRequiredMemory(points.size(), numberOfModes) > this->m_MaximumMemory) {
+		itkDebugMacro( << "Jacobian cache for " << points.size() << " points exceeds the memory budget");
+		return false;
+	}
+
+	// At most half of the slots are used, so that a probe sequence is short.
+	SizeValueType numberOfSlots = 16;
+	while (numberOfSlots < 2 * points.size()) {
+		numberOfSlots *= 2;
+	}
+	this->m_Slots.assign(numberOfSlots, -1);
+	this->m_NumberOfModes = numberOfModes;
+	this->m_EntrySize = (numberOfModes + 2) * TDimension;
+	this->m_Data.reserve(points.size() * this->m_EntrySize);
+
+	JacobianType jacobian(TDimension, numberOfModes);
+	VectorType mean;
+	for (typename PointListType::const_iterator it = points.begin(); it != points.end(); ++it) {
+		const SizeValueType slot = this->FindSlot(*it);
+		if (this->m_Slots[slot] >= 0) {
+			continue;
+		}
+		if (basis->EvaluateDisplacement(*it, 0, 0, mean) == false) {
+			continue;
+		}
+		basis->EvaluateBasis(*it, numberOfModes, jacobian);
+
+		this->m_Slots[slot] = this->m_NumberOfEntries++;
+		for (unsigned int d = 0; d < TDimension; d++) {
+			this->m_Data.push_back((*it)[d]);
+		}
+		for (unsigned int d = 0; d < TDimension; d++) {
+			this->m_Data.push_back(mean[d]);
+		}
+		for (unsigned int d = 0; d < TDimension; d++) {
+			this->m_Data.insert(this->m_Data.end(), jacobian[d], jacobian[d] + numberOfModes);
+		}
+	}
+
+	this->Modified();
+	return true;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+DeformationModelJacobianCache<TScalarType, TDimension>
+::Clear()
+{
+	std::vector<OffsetValueType>().swap(this->m_Slots);
+	std::vector<double>().swap(this->m_Data);
+	this->m_NumberOfEntries = 0;
+	this->m_NumberOfModes = 0;
+	this->m_EntrySize = 2 * TDimension;
+}
+
+
+/*!
+ * 0 and -0 compare equal, so both are hashed as 0.
+ */
+template < class TScalarType, unsigned int TDimension >
+SizeValueType
+DeformationModelJacobianCache<TScalarType, TDimension>
+::Hash( const PointType & point )
+{
+	SizeValueType hash = static_cast<SizeValueType>(2166136261u);
+	for (unsigned int d = 0; d < TDimension; d++) {
+		const TScalarType value = (point[d] == 0) ? TScalarType(0) : point[d];
+		const unsigned char * bytes = reinterpret_cast<const unsigned char *>(&value);
+		for (unsigned int b = 0; b < sizeof(TScalarType); b++) {
+			hash = (hash ^ bytes[b]) * static_cast<SizeValueType>(16777619u);
+		}
+	}
+	return hash ^ (hash >> 15);
+}
+
+
+/*!
+ * Linear probing; the table always has empty slots, so the loop ends.
+ */
+template < class TScalarType, unsigned int TDimension >
+SizeValueType
+DeformationModelJacobianCache<TScalarType, TDimension>
+::FindSlot( const PointType & point ) const
+{
+	const SizeValueType mask = this->m_Slots.size() - 1;
+	SizeValueType slot = Hash(point) & mask;
+	for (;;) {
+		const OffsetValueType entry = this->m_Slots[slot];
+		if (entry < 0) {
+			return slot;
+		}
+		const double * stored = &this->m_Data[entry * this->m_EntrySize];
+		unsigned int d = 0;
+		while (d < TDimension && stored[d] == static_cast<double>(point[d])) {
+			d++;
+		}
+		if (d == TDimension) {
+			return slot;
+		}
+		slot = (slot + 1) & mask;
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+OffsetValueType
+DeformationModelJacobianCache<TScalarType, TDimension>
+::Find( const PointType & point ) const
+{
+	if (this->m_NumberOfEntries == 0) {
+		return -1;
+	}
+	return this->m_Slots[this->FindSlot(point)];
+}
+
+
+/*!
+ * Small GEMV: m + J c, with J stored row by row.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+DeformationModelJacobianCache<TScalarType, TDimension>
+::EvaluateDisplacement( OffsetValueType entry, const double * coefficients, VectorType & displacement ) const
+{
+	const double * data = &this->m_Data[entry * this->m_EntrySize] + TDimension;
+	const double * row = data + TDimension;
+	for (unsigned int d = 0; d < TDimension; d++) {
+		double value = data[d];
+		for (unsigned int k = 0; k < this->m_NumberOfModes; k++) {
+			value += row[k] * coefficients[k];
+		}
+		displacement[d] = value;
+		row += this->m_NumberOfModes;
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+DeformationModelJacobianCache<TScalarType, TDimension>
+::GetJacobian( OffsetValueType entry, JacobianType & jacobian ) const
+{
+	const double * row = &this->m_Data[entry * this->m_EntrySize] + 2 * TDimension;
+	for (unsigned int d = 0; d < TDimension; d++) {
+		std::copy(row, row + this->m_NumberOfModes, jacobian[d]);
+		row += this->m_NumberOfModes;
+	}
+}
+
+
+// Print self
+template < class TScalarType, unsigned int TDimension >
+void
+DeformationModelJacobianCache<TScalarType, TDimension>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+	Superclass::PrintSelf(os, indent);
+	os << indent << "MaximumMemory: " << this->m_MaximumMemory << std::endl;
+	os << indent << "NumberOfModes: " << this->m_NumberOfModes << std::endl;
+	os << indent << "NumberOfEntries: " << this->m_NumberOfEntries << std::endl;
+}
+
+} // namespace
+
+#endif
@@ -0,0 +1,162 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+
+#ifndef __itkDeformationModelRecentJacobians_h
+#define __itkDeformationModelRecentJacobians_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkInterleavedDeformationBasis.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/**
+ * \brief The parameter Jacobians that TransformPoint has evaluated most recently, by their point.
+ *
+ * The metrics of elastix ask for the transformed point of a sample and then for the parameter
+ * Jacobian at the same sample, in two calls through the AdvancedCombinationTransform. The
+ * transform interpolates all modes at the point for the first call anyway, so it can keep the
+ * Jacobian in this table, and the second call copies it instead of interpolating the basis again.
+ *
+ * A point has one slot, at the hash of its coordinates, that holds the Jacobian of the last point
+ * that was stored there. A slot is taken with an atomic flag for a store or a lookup; a thread that
+ * finds the slot of its point taken, or holding another point, does not wait but evaluates the
+ * basis itself. With a few slots per thread, the points of different threads rarely meet, and a
+ * thread finds its own point as long as it has not transformed another point with the same hash
+ * in between.
+ *
+ * The Jacobian at a point does not depend on the coefficients, so an entry stays valid as long as
+ * the basis, the number of modes and the support index of the transform do not change; the
+ * transform reallocates the table whenever they do. Allocate and Clear must not be called while
+ * another thread evaluates the transform. Store and Find do not allocate.
+ *
+ * \ingroup Transforms
+ */
+template < class TScalarType, unsigned int TDimension >
+class DeformationModelRecentJacobians : public Object
+{
+public:
+  /** Standard typedefs   */
+  typedef DeformationModelRecentJacobians Self;
+  typedef Object                          Superclass;
+  typedef SmartPointer<Self>              Pointer;
+  typedef SmartPointer<const Self>        ConstPointer;
+
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( DeformationModelRecentJacobians, Object );
+
+  typedef InterleavedDeformationBasis<TScalarType, TDimension> BasisType;
+  typedef typename BasisType::PointType                        PointType;
+  typedef typename BasisType::JacobianType                     JacobianType;
+  typedef typename BasisType::ModeIndicesType                  ModeIndicesType;
+
+  /**
+   * Make room for at least numberOfSlots Jacobians of Dimension x numberOfColumns, rounded up to
+   * a power of two, and drop the Jacobians stored before.
+   */
+  void Allocate( SizeValueType numberOfSlots, unsigned int numberOfColumns );
+
+  /** Free the table; Lock and Find then always fail. */
+  void Clear();
+
+  bool IsEmpty() const { return this->m_Slots.empty(); }
+
+  /** The number of columns of the stored Jacobians. */
+  itkGetConstMacro( NumberOfColumns, unsigned int );
+
+  /**
+   * Take the slot of the point for a store. Returns the slot, whose Jacobian and mode indices are
+   * then written with GetJacobian and GetModes, or -1 if another thread holds it.
+   */
+  OffsetValueType Lock( const PointType & point );
+
+  /** The Jacobian and the mode indices of a slot taken with Lock. */
+  JacobianType & GetJacobian( OffsetValueType slot ) { return this->m_Slots[ slot ].Jacobian; }
+  ModeIndicesType & GetModes( OffsetValueType slot ) { return this->m_Slots[ slot ].Modes; }
+
+  /**
+   * Give a slot of Lock back. If valid, it holds the Jacobian of the point from now on; otherwise,
+   * e.g. for a point outside the basis, it holds none.
+   */
+  void Unlock( OffsetValueType slot, const PointType & point, bool valid );
+
+  /**
+   * Copy the Jacobian of the point into the jacobian, which must have Dimension x
+   * GetNumberOfColumns() entries, and its mode indices into modes unless that is null. Returns
+   * false, leaving both untouched, if the slot of the point is taken or holds no Jacobian of it.
+   */
+  bool Find( const PointType & point, JacobianType & jacobian, ModeIndicesType * modes );
+
+protected:
+
+  DeformationModelRecentJacobians();
+  virtual ~DeformationModelRecentJacobians() {};
+
+  void PrintSelf( std::ostream & os, Indent indent ) const;
+
+  /** A stored Jacobian, padded so that the flags of neighbouring slots do not share a cache line. */
+  struct SlotType
+  {
+    volatile long   InUse;
+    bool            Valid;
+    PointType       Point;
+    JacobianType    Jacobian;
+    ModeIndicesType Modes;
+    char            Padding[ 64 ];
+  };
+
+private:
+
+  DeformationModelRecentJacobians( const Self & ); // purposely not implemented
+  void operator=( const Self & );                  // purposely not implemented
+
+  unsigned int          m_NumberOfColumns;
+  std::vector<SlotType> m_Slots;
+
+}; // class DeformationModelRecentJacobians
+
+}  // namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+# include "itkDeformationModelRecentJacobians.txx"
+#endif
+
+#endif /* __itkDeformationModelRecentJacobians_h */
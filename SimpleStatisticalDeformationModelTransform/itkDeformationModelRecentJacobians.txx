@@ -0,0 +1,153 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef _itkDeformationModelRecentJacobians_txx
+#define _itkDeformationModelRecentJacobians_txx
+
+#include "itkDeformationModelRecentJacobians.h"
+#include "itkDeformationModelJacobianCache.h"
+#include "itkDeformationModelAtomicFlag.h"
+
+#include <algorithm>
+
+namespace itk
+{
+
+template < class TScalarType, unsigned int TDimension >
+DeformationModelRecentJacobians<TScalarType, TDimension>
+::DeformationModelRecentJacobians() :
+	m_NumberOfColumns(0)
+{
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+DeformationModelRecentJacobians<TScalarType, TDimension>
+::Allocate( SizeValueType numberOfSlots, unsigned int numberOfColumns )
+{
+	SizeValueType size = 1;
+	while (size < numberOfSlots) {
+		size *= 2;
+	}
+	this->Clear();
+	this->m_NumberOfColumns = numberOfColumns;
+	this->m_Slots.resize(size);
+	for (SizeValueType s = 0; s < size; s++) {
+		SlotType & slot = this->m_Slots[s];
+		slot.InUse = 0;
+		slot.Valid = false;
+		slot.Jacobian.SetSize(TDimension, numberOfColumns);
+		slot.Modes.resize(numberOfColumns);
+	}
+	this->Modified();
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+DeformationModelRecentJacobians<TScalarType, TDimension>
+::Clear()
+{
+	std::vector<SlotType>().swap(this->m_Slots);
+	this->m_NumberOfColumns = 0;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+OffsetValueType
+DeformationModelRecentJacobians<TScalarType, TDimension>
+::Lock( const PointType & point )
+{
+	if (this->m_Slots.empty()) {
+		return -1;
+	}
+	typedef DeformationModelJacobianCache<TScalarType, TDimension> JacobianCacheType;
+	const SizeValueType slot = JacobianCacheType::Hash(point) & (this->m_Slots.size() - 1);
+	if (DeformationModelAtomicFlag::TrySet(&this->m_Slots[slot].InUse) == false) {
+		return -1;
+	}
+	return static_cast<OffsetValueType>(slot);
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+DeformationModelRecentJacobians<TScalarType, TDimension>
+::Unlock( OffsetValueType slot, const PointType & point, bool valid )
+{
+	SlotType & entry = this->m_Slots[slot];
+	entry.Point = point;
+	entry.Valid = valid;
+	DeformationModelAtomicFlag::Clear(&entry.InUse);
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+bool
+DeformationModelRecentJacobians<TScalarType, TDimension>
+::Find( const PointType & point, JacobianType & jacobian, ModeIndicesType * modes )
+{
+	const OffsetValueType slot = this->Lock(point);
+	if (slot < 0) {
+		return false;
+	}
+	SlotType & entry = this->m_Slots[slot];
+	const bool found = entry.Valid && entry.Point == point;
+	if (found) {
+		std::copy(entry.Jacobian.data_block(), entry.Jacobian.data_block() + entry.Jacobian.size(), jacobian.data_block());
+		if (modes != 0) {
+			modes->assign(entry.Modes.begin(), entry.Modes.end());
+		}
+	}
+	DeformationModelAtomicFlag::Clear(&entry.InUse);
+	return found;
+}
+
+
+// Print self
+template < class TScalarType, unsigned int TDimension >
+void
+DeformationModelRecentJacobians<TScalarType, TDimension>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+	Superclass::PrintSelf(os, indent);
+	os << indent << "NumberOfSlots: " << this->m_Slots.size() << std::endl;
+	os << indent << "NumberOfColumns: " << this->m_NumberOfColumns << std::endl;
+}
+
+} // namespace
+
+#endif
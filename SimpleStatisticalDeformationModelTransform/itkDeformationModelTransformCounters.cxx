@@ -0,0 +1,216 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#include "itkDeformationModelTransformCounters.h"
+#include "itkMutexLockHolder.h"
+#include "itkDeformationModelAtomicFlag.h"
+
+#if defined( _WIN32 )
+#include "itkWindows.h"
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+namespace itk
+{
+
+namespace
+{
+
+/** The number of slots; more concurrent threads than this share one slot under the mutex. */
+const unsigned int NumberOfSlots = 256;
+
+SizeValueType GetCurrentThreadKey()
+{
+#if defined( _WIN32 )
+  return static_cast<SizeValueType>( GetCurrentThreadId() );
+#else
+  /** pthread_t is an integer on some systems and a pointer on others. */
+  const pthread_t thread = pthread_self();
+  SizeValueType key = 0;
+  std::memcpy( &key, &thread, std::min( sizeof( key ), sizeof( thread ) ) );
+  return key;
+#endif
+}
+
+}
+
+
+DeformationModelTransformCounters
+::DeformationModelTransformCounters() :
+  m_StartupSeconds(0.0)
+{
+  Slot empty;
+  std::memset( &empty, 0, sizeof( empty ) );
+  this->m_Slots.assign( NumberOfSlots, empty );
+  this->m_SharedSlot = empty;
+}
+
+
+const char *
+DeformationModelTransformCounters
+::GetCounterName( CounterType counter )
+{
+  switch ( counter )
+  {
+    case TransformPointCalls: return "TransformPointCalls";
+    case JacobianCalls:       return "JacobianCalls";
+    case GetJacobianCalls:    return "GetJacobianCalls";
+    case JacobianCacheHits:   return "JacobianCacheHits";
+    case FusedJacobianHits:   return "FusedJacobianHits";
+    case OutsidePoints:       return "OutsidePoints";
+    default:                  return "";
+  }
+}
+
+
+double
+DeformationModelTransformCounters
+::GetTime()
+{
+#if defined( _WIN32 )
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER count;
+  QueryPerformanceFrequency( &frequency );
+  QueryPerformanceCounter( &count );
+  return static_cast<double>( count.QuadPart ) / static_cast<double>( frequency.QuadPart );
+#elif defined( CLOCK_MONOTONIC )
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return now.tv_sec + 1e-9 * now.tv_nsec;
+#else
+  struct timeval now;
+  gettimeofday( &now, 0 );
+  return now.tv_sec + 1e-6 * now.tv_usec;
+#endif
+}
+
+
+/**
+ * The slots are probed linearly from the hash of the thread id. A slot is only in use while a
+ * count is added, so the probe stops at the first slot unless two threads hash to the same one.
+ */
+DeformationModelTransformCounters::Slot *
+DeformationModelTransformCounters
+::AcquireSlot()
+{
+  const SizeValueType key = GetCurrentThreadKey();
+  const SizeValueType hash = ( key ^ ( key >> 12 ) ) * 2654435761u;
+  for ( unsigned int i = 0; i < NumberOfSlots; i++ )
+  {
+    Slot & slot = this->m_Slots[ ( hash + i ) % NumberOfSlots ];
+    if ( DeformationModelAtomicFlag::TrySet( &slot.InUse ) )
+    {
+      return &slot;
+    }
+  }
+  return 0;
+}
+
+
+void
+DeformationModelTransformCounters
+::ReleaseSlot( Slot * slot )
+{
+  DeformationModelAtomicFlag::Clear( &slot->InUse );
+}
+
+
+void
+DeformationModelTransformCounters
+::AddShared( CounterType counter, bool outside, double seconds )
+{
+  MutexLockHolder<SimpleFastMutexLock> holder( this->m_Mutex );
+  this->m_SharedSlot.Counts[ counter ]++;
+  this->m_SharedSlot.Counts[ OutsidePoints ] += outside ? 1 : 0;
+  this->m_SharedSlot.Seconds += seconds;
+}
+
+
+DeformationModelTransformCounters::Values
+DeformationModelTransformCounters
+::GetValues() const
+{
+  Values values;
+  std::memset( &values, 0, sizeof( values ) );
+  for ( unsigned int s = 0; s <= this->m_Slots.size(); s++ )
+  {
+    const Slot & slot = ( s < this->m_Slots.size() ) ? this->m_Slots[ s ] : this->m_SharedSlot;
+    for ( unsigned int c = 0; c < NumberOfCounters; c++ )
+    {
+      values.Counts[ c ] += slot.Counts[ c ];
+    }
+    values.EvaluationSeconds += slot.Seconds;
+  }
+  values.StartupSeconds = this->m_StartupSeconds;
+  return values;
+}
+
+
+void
+DeformationModelTransformCounters
+::Reset()
+{
+  MutexLockHolder<SimpleFastMutexLock> holder( this->m_Mutex );
+  for ( unsigned int s = 0; s <= this->m_Slots.size(); s++ )
+  {
+    Slot & slot = ( s < this->m_Slots.size() ) ? this->m_Slots[ s ] : this->m_SharedSlot;
+    std::memset( slot.Counts, 0, sizeof( slot.Counts ) );
+    slot.Seconds = 0.0;
+    slot.InUse = 0;
+  }
+}
+
+
+void
+DeformationModelTransformCounters
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+  const Values values = this->GetValues();
+  for ( unsigned int c = 0; c < NumberOfCounters; c++ )
+  {
+    os << indent << GetCounterName( static_cast<CounterType>( c ) ) << ": " << values.Counts[ c ] << std::endl;
+  }
+  os << indent << "EvaluationSeconds: " << values.EvaluationSeconds << std::endl;
+  os << indent << "StartupSeconds: " << values.StartupSeconds << std::endl;
+}
+
+}  // namespace itk
@@ -0,0 +1,167 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef __itkDeformationModelTransformCounters_h
+#define __itkDeformationModelTransformCounters_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkSimpleFastMutexLock.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/**
+ * \brief Call counters and timers of the hot path of a statistical deformation model transform.
+ *
+ * Each count is added to a slot that the thread holds only for that addition. The search starts at
+ * the hash of the thread id, so a thread usually finds the same slot free each time, and the threads
+ * of a metric neither wait for each other nor share cache lines. A slot is taken and given back with
+ * an atomic flag, so no slot is owned by a thread beyond a call and the slots do not run out when
+ * the multithreader starts new threads. Only with more concurrent threads than slots do the others
+ * add to a shared slot under the mutex. GetValues sums the slots, and Reset clears them and their
+ * flags; both should be called while no thread evaluates the transform, e.g. between the resolutions
+ * of a registration.
+ *
+ * \ingroup Transforms
+ */
+class DeformationModelTransformCounters : public Object
+{
+public:
+  /** Standard typedefs   */
+  typedef DeformationModelTransformCounters  Self;
+  typedef Object                             Superclass;
+  typedef SmartPointer<Self>                 Pointer;
+  typedef SmartPointer<const Self>           ConstPointer;
+
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( DeformationModelTransformCounters, Object );
+
+  /** The counted events. A point is outside if it is not inside the buffer of the basis. A fused
+   * Jacobian hit is a GetJacobian that copies the Jacobian of the preceding TransformPoint. */
+  typedef enum {
+    TransformPointCalls,
+    JacobianCalls,
+    GetJacobianCalls,
+    JacobianCacheHits,
+    FusedJacobianHits,
+    OutsidePoints,
+    NumberOfCounters
+  } CounterType;
+
+  /** The sums over all threads. EvaluationSeconds is the time spent in the counted calls. */
+  struct Values
+  {
+    SizeValueType Counts[ NumberOfCounters ];
+    double        EvaluationSeconds;
+    double        StartupSeconds;
+
+    SizeValueType GetNumberOfCalls() const
+    {
+      return Counts[ TransformPointCalls ] + Counts[ JacobianCalls ] + Counts[ GetJacobianCalls ];
+    }
+  };
+
+  /** The name of a counter, e.g. for a parameter file. */
+  static const char * GetCounterName( CounterType counter );
+
+  /** A monotonic time in seconds, to measure intervals. */
+  static double GetTime();
+
+  /** Count an event, and add the time since start to the evaluation time if start is not 0. */
+  void Add( CounterType counter, bool outside, double start )
+  {
+    const double seconds = ( start != 0.0 ) ? GetTime() - start : 0.0;
+    Slot * slot = this->AcquireSlot();
+    if ( slot == 0 )
+    {
+      this->AddShared( counter, outside, seconds );
+      return;
+    }
+    slot->Counts[ counter ]++;
+    slot->Counts[ OutsidePoints ] += outside ? 1 : 0;
+    slot->Seconds += seconds;
+    this->ReleaseSlot( slot );
+  }
+
+  /** Time spent to load the model and to set up the basis; not reset by Reset. */
+  void AddStartupTime( double seconds ) { m_StartupSeconds += seconds; }
+
+  Values GetValues() const;
+  void Reset();
+
+protected:
+
+  DeformationModelTransformCounters();
+  virtual ~DeformationModelTransformCounters() {};
+
+  void PrintSelf( std::ostream & os, Indent indent ) const;
+
+  /** Counters that one thread at a time adds to, padded so that neighbouring slots do not share a cache line. */
+  struct Slot
+  {
+    volatile long InUse;
+    SizeValueType Counts[ NumberOfCounters ];
+    double        Seconds;
+    char          Padding[ 64 ];
+  };
+
+  /** Take a free slot, preferably the one of the calling thread, or return 0 if all are in use. */
+  Slot * AcquireSlot();
+
+  /** Give a slot of AcquireSlot back. */
+  void ReleaseSlot( Slot * slot );
+
+  void AddShared( CounterType counter, bool outside, double seconds );
+
+private:
+
+  DeformationModelTransformCounters( const Self & ); // purposely not implemented
+  void operator=( const Self & );                    // purposely not implemented
+
+  std::vector<Slot>     m_Slots;
+  Slot                  m_SharedSlot;
+  double                m_StartupSeconds;
+  SimpleFastMutexLock   m_Mutex;
+
+}; // class DeformationModelTransformCounters
+
+}  // namespace itk
+
+#endif /* __itkDeformationModelTransformCounters_h */
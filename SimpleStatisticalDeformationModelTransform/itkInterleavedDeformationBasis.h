@@ -0,0 +1,726 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef __itkInterleavedDeformationBasis_h
+#define __itkInterleavedDeformationBasis_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkImage.h"
+#include "itkImportImageContainer.h"
+#include "itkArray.h"
+#include "itkArray2D.h"
+#include "itkFixedArray.h"
+#include "itkMatrix.h"
+#include "itkMultiThreader.h"
+#include "itkPoint.h"
+#include "itkVector.h"
+#include "itkMemoryMappedFile.h"
+#include "itkDeformationBasisTileCache.h"
+#include "itkDeformationBasisStorageTraits.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace itk
+{
+
+/**
+ * \brief Voxel-major storage of the mean and the PCA basis of a statistical deformation model.
+ *
+ * The mean deformation and the K basis deformations are kept in a single buffer, in which all
+ * (K+1) x Dimension components of a voxel are contiguous:
+ * [ mean | basis 0 | basis 1 | ... | basis K-1 ] for voxel 0, then voxel 1, and so on.
+ *
+ * A linear interpolation thus computes the cell weights and the neighbour offsets once per point,
+ * and then reads 2^Dimension contiguous blocks, instead of asking K+1 separate interpolators which
+ * each read from a different image.
+ *
+ * The buffer test and the clamping of neighbours at the border are the same as in
+ * itk::VectorLinearInterpolateImageFunction, so the results are identical.
+ *
+ * The buffer may hold the components in reduced precision, see StorageType, to save memory and
+ * bandwidth. The interpolation and the products with the coefficients are always computed in
+ * double. The rounding errors of the stored components are:
+ * \li Float32Storage: relative error of at most 2^-24, i.e. 6e-8 times the value.
+ * \li Float16Storage: relative error of at most 2^-11, i.e. 4.9e-4 times the value. Values beyond
+ *     65504 overflow, so displacements should be given in mm rather than in micrometers.
+ * \li Int16Storage: absolute error of at most 1/65534 of the largest magnitude of that component.
+ * A displacement is the mean plus a sum of coefficient times mode, so its error is bounded by the
+ * error of the mean plus the sum over the modes of |coefficient| times the error of the mode.
+ *
+ * The buffer can be written to a file and mapped back into memory with ReadFromFile, which
+ * avoids loading the model and drawing its basis at every start. The file consists of a header
+ * with the geometry, followed by the variances of the modes and, at a page aligned offset, the
+ * buffer as stored in memory. Numbers are written in the byte order of the writing machine.
+ *
+ * For grids that do not fit in memory the file can be written in tiles: cubes of TileSize^Dimension
+ * voxels, each holding all components of its voxels in a page aligned block. A point then reads
+ * from at most 2^Dimension tiles, and a mapped tiled basis keeps only the recently used tiles in
+ * memory, see DeformationBasisTileCache. The offset of a voxel is a sum of offsets per axis in
+ * both layouts, so all methods accept either with the same results.
+ *
+ * The modes are smooth, so they can also be represented by the coefficients of a cubic B-spline on
+ * a control grid that is coarser than the voxels, see FitBSpline. The buffer then holds the control
+ * points in the same interleaved order, and a point reads 4^Dimension control points with weights
+ * that are shared by all components. The grid, offsets and storage types are the same as for
+ * voxels, so all methods work on either; GetSplineOrder tells them apart.
+ *
+ * \ingroup Transforms
+ */
+template < class TScalarType, unsigned int TDimension >
+class InterleavedDeformationBasis : public Object
+{
+public:
+  /** Standard typedefs   */
+  typedef InterleavedDeformationBasis Self;
+  typedef Object                      Superclass;
+  typedef SmartPointer<Self>          Pointer;
+  typedef SmartPointer<const Self>    ConstPointer;
+
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( InterleavedDeformationBasis, Object );
+
+  itkStaticConstMacro( Dimension, unsigned int, TDimension );
+  itkStaticConstMacro( NumberOfCorners, unsigned int, 1 << TDimension );
+  itkStaticConstMacro( MaximumNumberOfCorners, unsigned int, 1 << ( 2 * TDimension ) );
+
+  typedef TScalarType                                 ValueType;
+  typedef Point<TScalarType, TDimension>              PointType;
+  typedef Vector<TScalarType, TDimension>             VectorType;
+  typedef Image<VectorType, TDimension>               DeformationFieldType;
+  typedef typename DeformationFieldType::IndexType    IndexType;
+  typedef typename DeformationFieldType::SizeType     SizeType;
+  typedef typename DeformationFieldType::SpacingType  SpacingType;
+  typedef typename DeformationFieldType::PointType    OriginType;
+  typedef typename DeformationFieldType::DirectionType DirectionType;
+  typedef Matrix<double, TDimension, TDimension>      InternalMatrixType;
+  typedef Array2D<double>                             JacobianType;
+  typedef ImportImageContainer<SizeValueType, unsigned char> BufferType;
+  typedef FixedArray<unsigned int, TDimension>        ShrinkFactorsType;
+  typedef Array<double>                               VarianceVectorType;
+  typedef Array<double>                               ScaleVectorType;
+  typedef Array2D<double>                             QuadraticFormType;
+  typedef std::vector<unsigned long>                  ModeIndicesType;
+
+  /** Spatial derivatives, with the same layout as in itk::AdvancedTransform. */
+  typedef Matrix<TScalarType, TDimension, TDimension> SpatialJacobianType;
+  typedef FixedArray<SpatialJacobianType, TDimension> SpatialHessianType;
+  typedef std::vector<SpatialJacobianType>            JacobianOfSpatialJacobianType;
+  typedef std::vector<SpatialHessianType>             JacobianOfSpatialHessianType;
+
+  /** The type in which the components are stored. NativeStorage stores them as TScalarType. */
+  typedef enum {
+    NativeStorage = 0,
+    Float32Storage = 1,
+    Float16Storage = 2,
+    Int16Storage = 3
+  } StorageType;
+
+  /** Size in bytes of one stored component value. */
+  static unsigned int GetStorageElementSize( StorageType storage );
+
+  /** "native", "float32", "float16" or "int16". */
+  static const char * GetStorageTypeAsString( StorageType storage );
+
+  /** Parse one of the names of GetStorageTypeAsString. Returns false if the name is unknown. */
+  static bool GetStorageTypeFromString( const std::string & name, StorageType & storage );
+
+  /**
+   * Take over the geometry of the reference field and allocate room for the mean
+   * and numberOfModes basis deformations, stored as the given type.
+   */
+  void Allocate( const DeformationFieldType * reference, unsigned int numberOfModes,
+    StorageType storage = NativeStorage );
+
+  /**
+   * Copy a deformation field into the buffer, converted to the storage type. Component 0 is
+   * the mean, component i+1 the i-th basis deformation. With Int16Storage the scale of the
+   * component is chosen such that its largest magnitude maps to 32767.
+   */
+  void SetComponent( unsigned int component, const DeformationFieldType * field );
+
+  /**
+   * SetComponent without Modified, for threads that write different components at the same time;
+   * they write disjoint parts of the buffer only. Call Modified once all threads have finished.
+   */
+  void WriteComponent( unsigned int component, const DeformationFieldType * field );
+
+  /**
+   * Create a copy with room for numberOfModes modes, of which the modes of this basis are copied and
+   * the others are zero, to be set by SetComponent. The mode variances are extended with zeros. A
+   * tiled or B-spline basis is not extended, nor is the number of modes reduced; an ExceptionObject
+   * is thrown.
+   */
+  Pointer ExtendModes( unsigned int numberOfModes ) const;
+
+  /**
+   * Create a coarser copy of the basis, for use at a coarse resolution of the registration.
+   * Along each axis the components are smoothed with a Gaussian of sigma = 0.5 * factor voxels,
+   * as in the recursive image pyramids of elastix, and sampled every factor voxels.
+   * A tiled basis is not downsampled, as its copy would have to be held in memory as a whole,
+   * nor is a B-spline basis, which is smooth already; an ExceptionObject is thrown.
+   */
+  Pointer Downsample( const ShrinkFactorsType & factors ) const;
+
+  /**
+   * Fit the mean and each mode of a voxel basis to a cubic B-spline with a control point every
+   * controlPointSpacing[a] voxels along axis a, and return the B-spline basis, stored in the same
+   * type. The control grid extends one control point beyond the voxels on either side, and the
+   * B-spline is interpolated in the region of the voxels only. The fit is a least squares fit to all
+   * voxels, separable along the axes, in one pass over the buffer; its error at the voxels is
+   * available from GetApproximationErrors. The components are split over numberOfThreads threads,
+   * 0 meaning the global default of itk::MultiThreader.
+   */
+  Pointer FitBSpline( const ShrinkFactorsType & controlPointSpacing, ThreadIdType numberOfThreads = 0 ) const;
+
+  /**
+   * 1 if the buffer holds voxels that are interpolated linearly, 3 if it holds the control points
+   * of a cubic B-spline.
+   */
+  itkGetConstMacro( SplineOrder, unsigned int );
+
+  /** Number of voxels or control points from which a point is interpolated. */
+  unsigned int GetNumberOfCellCorners() const
+  {
+    return ( m_SplineOrder == 3 ) ? MaximumNumberOfCorners : NumberOfCorners;
+  }
+
+  /**
+   * For a B-spline basis, the root mean square difference between the B-spline and the voxel basis
+   * it was fitted to, over the voxels, for each component with the mean first, in the units of
+   * the displacement and relative to the root mean square magnitude of the component. Empty for a
+   * voxel basis.
+   */
+  itkGetConstReferenceMacro( ApproximationErrors, VarianceVectorType );
+  itkGetConstReferenceMacro( RelativeApproximationErrors, VarianceVectorType );
+
+  /**
+   * Write the geometry, the mode variances and the buffer to a file. With a tileSize, which must
+   * be a power of two, the voxels are written in tiles of tileSize^Dimension voxels; 0 writes them
+   * in linear order. Throws an ExceptionObject if the file cannot be written.
+   */
+  void WriteToFile( const std::string & fileName, unsigned int tileSize = 0 ) const;
+
+  /**
+   * Map a file written by WriteToFile read-only into memory and use it as buffer.
+   * The pages are shared with other processes that map the same file.
+   * A tiled file gets a tile cache, without a memory budget until one is set on it.
+   * A mapped basis must not be changed by SetComponent.
+   * Throws an ExceptionObject if the file cannot be mapped or does not match the
+   * scalar type and dimension of this class.
+   */
+  void ReadFromFile( const std::string & fileName );
+
+  /** The type in which the components are stored. */
+  itkGetConstMacro( StorageType, StorageType );
+
+  /** Size of the buffer in bytes. */
+  SizeValueType GetBufferSize() const { return m_Buffer->Size(); }
+
+  /**
+   * Factor by which the stored values of each component are multiplied, with the mean first.
+   * All ones, unless the storage type is Int16Storage.
+   */
+  itkGetConstReferenceMacro( ComponentScales, ScaleVectorType );
+
+  /** Returns true if the buffer is a read-only mapping of a file. */
+  bool IsMemoryMapped() const { return m_MappedFile.IsNotNull(); }
+
+  /** Edge length in voxels of the tiles of the buffer, 0 if the voxels are stored in linear order. */
+  itkGetConstMacro( TileSize, unsigned int );
+
+  /**
+   * The residency of the tiles of a tiled basis file, on which the memory budget is set and from
+   * which the hit and miss counters are read. Null for a basis that is not a mapped tiled file.
+   */
+  DeformationBasisTileCache * GetTileCache() const { return m_TileCache.GetPointer(); }
+
+  /**
+   * Read the tiles in which the points will be interpolated ahead of their use, in the order of
+   * the points. Does nothing without a tile cache.
+   */
+  void PrefetchPoints( const std::vector<PointType> & points ) const;
+
+  /** Variance of each mode, i.e. the eigenvalues of the model. Written to and read from files. */
+  itkSetMacro( ModeVariances, VarianceVectorType );
+  itkGetConstReferenceMacro( ModeVariances, VarianceVectorType );
+
+  /** Number of basis deformations, not counting the mean. */
+  itkGetConstMacro( NumberOfModes, unsigned int );
+
+  /** Geometry of the grid on which the basis is stored. */
+  itkGetConstReferenceMacro( Size, SizeType );
+  itkGetConstReferenceMacro( Spacing, SpacingType );
+  itkGetConstReferenceMacro( Origin, OriginType );
+  itkGetConstReferenceMacro( Direction, DirectionType );
+
+  /** Returns true if the point lies within the region in which the basis is interpolated. */
+  bool IsInsideBuffer( const PointType & point ) const;
+
+  /**
+   * Evaluate mean + sum_k coefficients[k] * basis_k for the first numberOfModes modes.
+   * Returns false, and leaves displacement untouched, if the point is outside the buffer.
+   */
+  bool EvaluateDisplacement( const PointType & point, const double * coefficients,
+    unsigned int numberOfModes, VectorType & displacement ) const;
+
+  /**
+   * Write the first numberOfModes basis vectors at the point into the columns of the
+   * jacobian, which must have at least numberOfModes columns.
+   * Returns false, and leaves the jacobian untouched, if the point is outside the buffer.
+   */
+  bool EvaluateBasis( const PointType & point, unsigned int numberOfModes,
+    JacobianType & jacobian ) const;
+
+  /**
+   * Evaluate the displacement and the basis matrix at the point in one pass:
+   * the basis is interpolated into the jacobian, after which the displacement is the
+   * interpolated mean plus jacobian * coefficients.
+   * Returns false, and leaves both outputs untouched, if the point is outside the buffer.
+   */
+  bool EvaluateDisplacementAndBasis( const PointType & point, const double * coefficients,
+    unsigned int numberOfModes, VectorType & displacement, JacobianType & jacobian ) const;
+
+  /**
+   * Evaluate mean + sum_k coefficients[k] * basis_k for the first numberOfModes modes at every
+   * voxel of the buffered region of the field, which must have been allocated. Voxels outside the
+   * buffer get a zero displacement, as TransformPoint leaves them in place. If the grid of the field
+   * samples that of the basis, i.e. it has the same direction, an integer multiple of its spacing and
+   * its voxels on voxels of the basis, the modes are combined at those voxels only, without
+   * interpolation. Otherwise, if the field has more corners to interpolate than the basis has voxels,
+   * the modes are first combined at every voxel of the basis, after which a single displacement is
+   * interpolated per voxel of the field. The voxels are split over numberOfThreads threads, 0 meaning
+   * the global default of itk::MultiThreader.
+   */
+  void EvaluateDisplacementField( const double * coefficients, unsigned int numberOfModes,
+    DeformationFieldType * field, ThreadIdType numberOfThreads ) const;
+
+  /**
+   * The support index of BuildModeSupport: a bitmap of the modes per block of BlockSize^Dimension
+   * voxels, and the largest number of supporting modes per number of modes. A BlockSize of 0 means
+   * no index. The index is kept by the caller, not by the basis, so a basis that is shared, e.g.
+   * through a model cache, is never changed by indexing it; it is valid until the buffer changes.
+   */
+  struct ModeSupportType
+  {
+    unsigned int               BlockSize;
+    unsigned int               Words;
+    double                     Tolerance;
+    OffsetValueType            BlockStrides[ TDimension ];
+    std::vector<uint64_t>      Blocks;
+    std::vector<unsigned int>  MaximumCounts;
+
+    ModeSupportType() : BlockSize( 0 ), Words( 0 ), Tolerance( 0.0 ) {}
+  };
+
+  /**
+   * Index, for each block of blockSize^Dimension voxels, the modes that are non-zero in it, for models
+   * whose modes are local, e.g. models of several organs or regions with separate modes. A mode is
+   * non-zero in a block if its magnitude exceeds tolerance times its largest magnitude at any voxel
+   * of the block or of the voxels one step above it along each axis, which are the corners of the
+   * cells whose lower corner lies in the block. With a tolerance of 0, the default, only modes that
+   * are exactly zero are left out, so the sparse evaluation gives the same results as the dense one.
+   * A blockSize of 0 leaves support without an index.
+   */
+  void BuildModeSupport( unsigned int blockSize, double tolerance, ModeSupportType & support ) const;
+
+  /**
+   * The largest number of the first numberOfModes modes that is non-zero in any block, i.e. the number
+   * of columns of the sparse Jacobian. numberOfModes without a support index.
+   */
+  static unsigned int GetMaximumNumberOfSupportingModes( const ModeSupportType & support, unsigned int numberOfModes );
+
+  /**
+   * Like EvaluateDisplacementAndBasis, for the modes that are non-zero at the point only. modes receives
+   * numberOfColumns mode indices, in ascending order those that are non-zero at the point followed by
+   * others, and the columns of the jacobian, which must have at least numberOfColumns columns, the
+   * corresponding modes; the columns of the modes that are zero at the point are zero.
+   * numberOfColumns must be at least GetMaximumNumberOfSupportingModes(support, numberOfModes).
+   * displacement may be null. Without a support index all modes are evaluated.
+   * Returns false, and leaves the outputs untouched, if the point is outside the buffer.
+   */
+  bool EvaluateSupportedDisplacementAndBasis( const ModeSupportType & support, const PointType & point,
+    const double * coefficients, unsigned int numberOfModes, unsigned int numberOfColumns, VectorType * displacement,
+    JacobianType & jacobian, ModeIndicesType & modes ) const;
+
+  /**
+   * The mode indices of EvaluateSupportedDisplacementAndBasis at the point, without evaluating the
+   * modes. Returns the number of modes that are non-zero at the point. Outside the buffer that is 0,
+   * and modes holds 0..numberOfColumns-1.
+   */
+  unsigned int GetSupportingModes( const ModeSupportType & support, const PointType & point, unsigned int numberOfModes,
+    unsigned int numberOfColumns, ModeIndicesType & modes ) const;
+
+  /**
+   * Batched EvaluateDisplacement and EvaluateBasis for numberOfPoints points, in structure-of-arrays
+   * layout: coordinates[i][p] is coordinate i of point p, and displacements[i][p] receives component i
+   * of its displacement. If jacobians is not null, it receives the Dimension x numberOfModes basis
+   * matrix of each point, row by row, point after point. Points outside the buffer get a zero
+   * displacement and Jacobian. The points are visited sorted by their cell in the grid, so that
+   * neighbouring points read the same voxels, and split over numberOfThreads threads, 0 meaning the
+   * global default of itk::MultiThreader. The results are those of the single point methods.
+   */
+  void EvaluatePoints( SizeValueType numberOfPoints, const TScalarType * const * coordinates,
+    const double * coefficients, unsigned int numberOfModes,
+    TScalarType * const * displacements, double * jacobians, ThreadIdType numberOfThreads ) const;
+
+  /**
+   * Evaluate the derivative of the interpolated displacement with respect to the physical
+   * coordinates, d displacement[i] / d x[j], for the first numberOfModes modes.
+   * If modeGradients is not null, the derivatives of the modes themselves are written to its
+   * first numberOfModes entries, computed in the same pass over the corners.
+   * The derivatives are those of the interpolation, i.e. exact for the displacement that
+   * EvaluateDisplacement returns: piecewise constant across the cells of a voxel grid, and
+   * continuous for a B-spline.
+   * Returns false, and leaves the outputs untouched, if the point is outside the buffer.
+   */
+  bool EvaluateSpatialJacobian( const PointType & point, const double * coefficients,
+    unsigned int numberOfModes, SpatialJacobianType & gradient,
+    JacobianOfSpatialJacobianType * modeGradients ) const;
+
+  /**
+   * Evaluate the second derivatives of the interpolated displacement, hessian[i](j, l) =
+   * d^2 displacement[i] / d x[j] d x[l], and optionally those of the first numberOfModes modes.
+   * The linear interpolation is linear along each grid axis, so only the mixed derivatives
+   * with respect to the grid axes are non-zero; a B-spline has all of them.
+   * Returns false, and leaves the outputs untouched, if the point is outside the buffer.
+   */
+  bool EvaluateSpatialHessian( const PointType & point, const double * coefficients,
+    unsigned int numberOfModes, SpatialHessianType & hessian,
+    JacobianOfSpatialHessianType * modeHessians ) const;
+
+  /**
+   * Bending energy of the displacement as a quadratic form in [ 1, coefficients ]: entry (i, j) is
+   * the mean over the interior voxels of the grid of sum_d sum_{j,l} H_i[d](j, l) * H_j[d](j, l),
+   * where H_i is the physical Hessian of component i (the mean for i = 0, mode i - 1 otherwise),
+   * computed with central differences. The bending energy of mean + sum_k c_k mode_k is then
+   * [ 1, c ]^T form [ 1, c ]. form is resized to numberOfModes + 1 squared; it is zero if the
+   * grid has fewer than three voxels along an axis. For a B-spline basis the differences are taken
+   * between the control points, which gives the second derivatives of the B-spline at the control
+   * points up to a smoothing along the other axes.
+   */
+  void ComputeBendingEnergyForm( unsigned int numberOfModes, QuadraticFormType & form ) const;
+
+  /**
+   * Norms of the first numberOfModes modes over the voxels of the grid, for the estimation of
+   * step sizes: meanSquaredNorms[k] is the mean of |mode_k|^2, and maximumSquaredNorm the largest
+   * sum_k weights[k]^2 |mode_k|^2 of any voxel, i.e. the largest squared Frobenius norm of the
+   * weighted basis matrix. A linear interpolation is a convex combination of voxels, so the
+   * latter also bounds the squared norm of the weighted basis at any point. weights may be null.
+   * A B-spline is a convex combination of its control points, so for a B-spline basis the norms
+   * are those of the control points, the bound holds as well, and the means are approximate.
+   */
+  void ComputeModeNorms( unsigned int numberOfModes, const double * weights,
+    VarianceVectorType & meanSquaredNorms, double & maximumSquaredNorm ) const;
+
+protected:
+
+  InterleavedDeformationBasis();
+  virtual ~InterleavedDeformationBasis() {};
+
+  void PrintSelf( std::ostream & os, Indent indent ) const;
+
+  /**
+   * Scalar offsets of the corner voxels, or control points, and their interpolation weights. The
+   * weight of a corner is a product of one factor per axis; AxisWeights holds these factors, and
+   * their first and second derivatives with respect to the continuous index, for the Width corners
+   * along each axis. Corner c has index (c >> (a * AxisShift)) & (Width - 1) along axis a.
+   * LowerIndex is the clamped index of the first corner along each axis.
+   */
+  struct InterpolationCell
+  {
+    unsigned int    NumberOfCorners;
+    unsigned int    Width;
+    unsigned int    AxisShift;
+    OffsetValueType Offsets[ MaximumNumberOfCorners ];
+    double          Weights[ MaximumNumberOfCorners ];
+    double          AxisWeights[ TDimension ][ 4 ];
+    double          AxisDerivatives[ TDimension ][ 4 ];
+    double          AxisSecondDerivatives[ TDimension ][ 4 ];
+    OffsetValueType LowerIndex[ TDimension ];
+  };
+
+  /**
+   * Fill modes with the supporting modes of the first numberOfModes at the cell, followed by the
+   * others up to numberOfColumns entries. Returns the number of supporting modes.
+   */
+  static unsigned int ComputeSupportingModes( const ModeSupportType & support, const InterpolationCell & cell,
+    unsigned int numberOfModes, unsigned int numberOfColumns, ModeIndicesType & modes );
+
+  /**
+   * First and second derivatives of the weight of each corner with respect to the physical
+   * coordinates of the point.
+   */
+  void ComputeWeightDerivatives( const InterpolationCell & cell, double derivatives[][ TDimension ] ) const;
+  void ComputeWeightSecondDerivatives( const InterpolationCell & cell,
+    double derivatives[][ TDimension ][ TDimension ] ) const;
+
+  /**
+   * The work of one thread of EvaluateDisplacementField. Without Field the modes are combined at
+   * all voxels of the basis. With Subsampled, voxel index i of the field lies on the voxel with
+   * index SubsampleStart[a] + i[a] * SubsampleFactors[a] of the basis.
+   */
+  struct DisplacementFieldThreadStruct
+  {
+    const Self *                 Basis;
+    const double *               Coefficients;
+    unsigned int                 NumberOfModes;
+    const DeformationFieldType * Field;
+    VectorType *                 Output;
+    SizeValueType                NumberOfVoxels;
+    bool                         Subsampled;
+    OffsetValueType              SubsampleStart[ TDimension ];
+    OffsetValueType              SubsampleFactors[ TDimension ];
+  };
+
+  static ITK_THREAD_RETURN_TYPE EvaluateDisplacementFieldThreaderCallback( void * arg );
+
+  void EvaluateDisplacementFieldRange( const DisplacementFieldThreadStruct & str,
+    SizeValueType first, SizeValueType last ) const;
+
+  /**
+   * The work of one thread of EvaluatePoints. In the first pass each point gets the offset of the
+   * first corner of its cell as sort key, -1 if it is outside; in the second the sorted points
+   * are evaluated.
+   */
+  struct PointBatchThreadStruct
+  {
+    const Self *                                     Basis;
+    SizeValueType                                    NumberOfPoints;
+    const TScalarType * const *                      Coordinates;
+    const double *                                   Coefficients;
+    unsigned int                                     NumberOfModes;
+    TScalarType * const *                            Displacements;
+    double *                                         Jacobians;
+    std::vector< std::pair<OffsetValueType, SizeValueType> > * Order;
+    bool                                             ComputeKeys;
+  };
+
+  static ITK_THREAD_RETURN_TYPE EvaluatePointsThreaderCallback( void * arg );
+
+  template < class TStorage >
+  void EvaluatePointsRangeInternal( const PointBatchThreadStruct & str,
+    SizeValueType first, SizeValueType last ) const;
+
+  /**
+   * Returns false if the point is outside the buffer. With touchTiles the accesses to the tiles of
+   * the corners are recorded in the tile cache.
+   */
+  bool ComputeInterpolationCell( const PointType & point, InterpolationCell & cell, bool touchTiles = true ) const;
+
+  /** Recompute the index matrix and the offset tables after a change of the geometry or the tiling. */
+  void UpdateGeometry();
+
+  /**
+   * Offset in stored values of the voxels with the given index along one axis, relative to index 0.
+   * The offset of a voxel is the sum of those along all axes, in the linear and the tiled layout.
+   */
+  OffsetValueType GetAxisOffset( unsigned int axis, OffsetValueType index ) const
+  {
+    if ( m_TileSize == 0 )
+    {
+      return index * m_VoxelOffsetTable[ axis ];
+    }
+    return ( index >> m_TileShift ) * m_TileOffsetTable[ axis ]
+      + ( index & static_cast<OffsetValueType>( m_TileSize - 1 ) ) * m_VoxelOffsetTable[ axis ];
+  }
+
+  /** Record the access to the tile holding the stored value at offset, if there is a tile cache. */
+  void TouchTile( OffsetValueType offset ) const
+  {
+    if ( m_TileCache.IsNotNull() )
+    {
+      m_TileCache->Touch( static_cast<SizeValueType>( offset ) / m_TileStride );
+    }
+  }
+
+  /** Number of stored values of a tile, rounded up to whole pages of the basis file. */
+  static SizeValueType GetTileStride( unsigned int tileSize, SizeValueType componentsPerVoxel, StorageType storage );
+
+  /**
+   * The samples of one axis of a B-spline fit: for each voxel the indices and weights of its four
+   * control points, and the Cholesky factor of the banded normal equations, with Factor[4 * j + m]
+   * the entry (j, j - m).
+   */
+  struct BSplineFitAxis
+  {
+    SizeValueType                NumberOfVoxels;
+    SizeValueType                NumberOfControlPoints;
+    std::vector<OffsetValueType> Indices;
+    std::vector<double>          Weights;
+    std::vector<double>          Factor;
+  };
+
+  /**
+   * The arrays shared by the threads of FitBSpline. Each thread fits a range of the components of
+   * every voxel, and writes only to the entries of those components.
+   */
+  struct BSplineFitThreadStruct
+  {
+    const Self *          Basis;
+    const BSplineFitAxis * Axes;
+    double *              Coefficients;
+    double *              SquaredErrors;
+    double *              SquaredValues;
+  };
+
+  static ITK_THREAD_RETURN_TYPE FitBSplineThreaderCallback( void * arg );
+
+  /** Cubic B-spline weights of the four control points around a fraction t, and their derivatives. */
+  static void ComputeBSplineWeights( double t, double weights[ 4 ], double derivatives[ 4 ], double secondDerivatives[ 4 ] );
+
+  static void InitializeBSplineFitAxis( SizeValueType numberOfVoxels, unsigned int spacing, BSplineFitAxis & axis );
+
+  /**
+   * Solve the normal equations of an axis for count right hand sides at once. Row j of the
+   * right hand sides starts at values + j * rowStride, and is overwritten by the solution.
+   */
+  static void SolveBanded( const BSplineFitAxis & axis, double * values, SizeValueType rowStride, SizeValueType count );
+
+  /**
+   * Fit, or evaluate, along one axis of an array of numberOfComponents values per point with the
+   * given size. The size of that axis changes to the number of control points, or of voxels.
+   */
+  static void FitAlongAxis( const std::vector<double> & input, std::vector<SizeValueType> & size, unsigned int axis,
+    unsigned int numberOfComponents, const BSplineFitAxis & fitAxis, std::vector<double> & output );
+  static void EvaluateAlongAxis( const std::vector<double> & input, std::vector<SizeValueType> & size, unsigned int axis,
+    unsigned int numberOfComponents, const BSplineFitAxis & fitAxis, std::vector<double> & output );
+
+  void FitBSplineRange( const BSplineFitThreadStruct & str, unsigned int first, unsigned int last ) const;
+
+  /** The components from first to last - 1 of the voxels with the given index along the last axis, scaled. */
+  void ReadSlab( OffsetValueType slab, unsigned int first, unsigned int last, std::vector<double> & values ) const;
+
+  template < class TStorage >
+  void ReadSlabInternal( OffsetValueType slab, unsigned int first, unsigned int last, std::vector<double> & values ) const;
+
+  template < class TStorage >
+  void SetCoefficientsInternal( const std::vector<double> & coefficients );
+
+  /** Smooth and subsample the buffer along one axis. */
+  void ShrinkAlongAxis( unsigned int axis, unsigned int factor );
+
+  /** Implementations for a storage type, selected by the public methods. */
+  template < class TStorage >
+  void ShrinkAlongAxisInternal( unsigned int axis, unsigned int factor );
+
+  template < class TStorage >
+  void SetComponentInternal( unsigned int component, const DeformationFieldType * field );
+
+  template < class TStorage >
+  void EvaluateDisplacementInternal( const InterpolationCell & cell, const double * coefficients,
+    unsigned int numberOfModes, VectorType & displacement ) const;
+
+  template < class TStorage >
+  void EvaluateBasisInternal( const InterpolationCell & cell, unsigned int numberOfModes,
+    JacobianType & jacobian ) const;
+
+  template < class TStorage >
+  void EvaluateDisplacementFieldRangeInternal( const DisplacementFieldThreadStruct & str,
+    SizeValueType first, SizeValueType last ) const;
+
+  template < class TStorage >
+  void EvaluateSpatialJacobianInternal( const InterpolationCell & cell, const double * coefficients,
+    unsigned int numberOfModes, SpatialJacobianType & gradient,
+    JacobianOfSpatialJacobianType * modeGradients ) const;
+
+  template < class TStorage >
+  void EvaluateSpatialHessianInternal( const InterpolationCell & cell, const double * coefficients,
+    unsigned int numberOfModes, SpatialHessianType & hessian,
+    JacobianOfSpatialHessianType * modeHessians ) const;
+
+  template < class TStorage >
+  void ComputeBendingEnergyFormInternal( unsigned int numberOfModes, QuadraticFormType & form ) const;
+
+  template < class TStorage >
+  void BuildModeSupportInternal( unsigned int blockSize, double tolerance, ModeSupportType & support ) const;
+
+  template < class TStorage >
+  void EvaluateSupportedDisplacementAndBasisInternal( const InterpolationCell & cell, const double * coefficients,
+    unsigned int numberOfSupportingModes, unsigned int numberOfColumns, const ModeIndicesType & modes,
+    VectorType * displacement, JacobianType & jacobian ) const;
+
+  template < class TStorage >
+  void ComputeModeNormsInternal( unsigned int numberOfModes, const double * weights,
+    VarianceVectorType & meanSquaredNorms, double & maximumSquaredNorm ) const;
+
+  template < class TStorage >
+  void EvaluateDisplacementAndBasisInternal( const InterpolationCell & cell, const double * coefficients,
+    unsigned int numberOfModes, VectorType & displacement, JacobianType & jacobian ) const;
+
+private:
+
+  InterleavedDeformationBasis( const Self & ); // purposely not implemented
+  void operator=( const Self & );              // purposely not implemented
+
+  unsigned int              m_NumberOfModes;
+  unsigned int              m_ComponentsPerVoxel;
+  IndexType                 m_StartIndex;
+  SizeType                  m_Size;
+  SpacingType               m_Spacing;
+  OriginType                m_Origin;
+  DirectionType             m_Direction;
+  InternalMatrixType        m_PhysicalPointToIndex;
+  OffsetValueType           m_OffsetTable[ TDimension ];
+  OffsetValueType           m_VoxelOffsetTable[ TDimension ];
+  OffsetValueType           m_TileOffsetTable[ TDimension ];
+  unsigned int              m_TileSize;
+  unsigned int              m_TileShift;
+  SizeValueType             m_TileStride;
+  StorageType               m_StorageType;
+  unsigned int              m_SplineOrder;
+  double                    m_DomainLower[ TDimension ];
+  double                    m_DomainUpper[ TDimension ];
+  VarianceVectorType        m_ApproximationErrors;
+  VarianceVectorType        m_RelativeApproximationErrors;
+  typename BufferType::Pointer m_Buffer;
+  ScaleVectorType           m_ComponentScales;
+  VarianceVectorType        m_ModeVariances;
+  MemoryMappedFile::Pointer m_MappedFile;
+  DeformationBasisTileCache::Pointer m_TileCache;
+
+}; // class InterleavedDeformationBasis
+
+}  // namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+# include "itkInterleavedDeformationBasis.txx"
+#endif
+
+#endif /* __itkInterleavedDeformationBasis_h */
@@ -0,0 +1,3071 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef _itkInterleavedDeformationBasis_txx
+#define _itkInterleavedDeformationBasis_txx
+
+#include "itkInterleavedDeformationBasis.h"
+#include "itkMath.h"
+#include "itkIntTypes.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+namespace itk
+{
+
+template < class TScalarType, unsigned int TDimension >
+InterleavedDeformationBasis<TScalarType, TDimension>
+::InterleavedDeformationBasis() :
+	m_NumberOfModes(0),
+	m_ComponentsPerVoxel(TDimension),
+	m_TileSize(0),
+	m_TileShift(0),
+	m_TileStride(0),
+	m_StorageType(NativeStorage),
+	m_SplineOrder(1)
+{
+	this->m_StartIndex.Fill(0);
+	this->m_Size.Fill(0);
+	this->m_Spacing.Fill(1.0);
+	this->m_Origin.Fill(0.0);
+	this->m_Direction.SetIdentity();
+	this->m_PhysicalPointToIndex.SetIdentity();
+	for (unsigned int i = 0; i < TDimension; i++) {
+		this->m_OffsetTable[i] = 0;
+		this->m_VoxelOffsetTable[i] = 0;
+		this->m_TileOffsetTable[i] = 0;
+		this->m_DomainLower[i] = 0.0;
+		this->m_DomainUpper[i] = 0.0;
+	}
+	this->m_Buffer = BufferType::New();
+	this->m_ComponentScales.SetSize(1);
+	this->m_ComponentScales.Fill(1.0);
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+unsigned int
+InterleavedDeformationBasis<TScalarType, TDimension>
+::GetStorageElementSize( StorageType storage )
+{
+	switch (storage) {
+	case Float32Storage:
+		return sizeof(float);
+	case Float16Storage:
+		return sizeof(DeformationBasisStorageTraits<Float16StorageTag>::ValueType);
+	case Int16Storage:
+		return sizeof(DeformationBasisStorageTraits<Int16StorageTag>::ValueType);
+	default:
+		return sizeof(TScalarType);
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+const char *
+InterleavedDeformationBasis<TScalarType, TDimension>
+::GetStorageTypeAsString( StorageType storage )
+{
+	switch (storage) {
+	case Float32Storage:
+		return "float32";
+	case Float16Storage:
+		return "float16";
+	case Int16Storage:
+		return "int16";
+	default:
+		return "native";
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+bool
+InterleavedDeformationBasis<TScalarType, TDimension>
+::GetStorageTypeFromString( const std::string & name, StorageType & storage )
+{
+	const StorageType storageTypes[] = { NativeStorage, Float32Storage, Float16Storage, Int16Storage };
+	for (unsigned int i = 0; i < sizeof(storageTypes) / sizeof(storageTypes[0]); i++) {
+		if (name == GetStorageTypeAsString(storageTypes[i])) {
+			storage = storageTypes[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/*!
+ * Take over the geometry of the reference field and allocate the buffer.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::Allocate( const DeformationFieldType * reference, unsigned int numberOfModes, StorageType storage )
+{
+	const typename DeformationFieldType::RegionType region = reference->GetLargestPossibleRegion();
+
+	/** A mapped file is read-only, so a new buffer is needed. */
+	if (this->m_MappedFile.IsNotNull()) {
+		this->m_Buffer = BufferType::New();
+		this->m_MappedFile = 0;
+		this->m_TileCache = 0;
+	}
+
+	this->m_TileSize = 0;
+	this->m_TileShift = 0;
+	this->m_SplineOrder = 1;
+	this->m_ApproximationErrors.SetSize(0);
+	this->m_RelativeApproximationErrors.SetSize(0);
+	this->m_NumberOfModes = numberOfModes;
+	this->m_ComponentsPerVoxel = (numberOfModes + 1) * TDimension;
+	this->m_StorageType = storage;
+	this->m_ComponentScales.SetSize(numberOfModes + 1);
+	this->m_ComponentScales.Fill(1.0);
+	this->m_ModeVariances.SetSize(numberOfModes);
+	this->m_ModeVariances.Fill(0.0);
+	this->m_StartIndex = region.GetIndex();
+	this->m_Size = region.GetSize();
+	this->m_Spacing = reference->GetSpacing();
+	this->m_Origin = reference->GetOrigin();
+	this->m_Direction = reference->GetDirection();
+	this->UpdateGeometry();
+
+	this->m_Buffer->Reserve(this->m_Size.GetNumberOfPixels() * this->m_ComponentsPerVoxel
+		* GetStorageElementSize(storage));
+	std::fill(this->m_Buffer->GetBufferPointer(),
+		this->m_Buffer->GetBufferPointer() + this->m_Buffer->Size(), 0);
+
+	this->Modified();
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::UpdateGeometry()
+{
+	InternalMatrixType indexToPhysicalPoint;
+	for (unsigned int i = 0; i < TDimension; i++) {
+		for (unsigned int j = 0; j < TDimension; j++) {
+			indexToPhysicalPoint[i][j] = this->m_Direction[i][j] * this->m_Spacing[j];
+		}
+	}
+	this->m_PhysicalPointToIndex = indexToPhysicalPoint.GetInverse();
+
+	OffsetValueType stride = 1;
+	for (unsigned int i = 0; i < TDimension; i++) {
+		this->m_OffsetTable[i] = stride;
+		stride *= this->m_Size[i];
+	}
+
+	/** The voxels are interpolated up to half a voxel beyond the outer ones; a B-spline keeps its domain. */
+	if (this->m_SplineOrder == 1) {
+		for (unsigned int i = 0; i < TDimension; i++) {
+			this->m_DomainLower[i] = -0.5;
+			this->m_DomainUpper[i] = this->m_Size[i] - 0.5;
+		}
+	}
+
+	/** Within a tile the voxels are in linear order, and the tiles themselves as well. */
+	if (this->m_TileSize == 0) {
+		for (unsigned int i = 0; i < TDimension; i++) {
+			this->m_VoxelOffsetTable[i] = this->m_OffsetTable[i] * this->m_ComponentsPerVoxel;
+			this->m_TileOffsetTable[i] = 0;
+		}
+		this->m_TileStride = 0;
+		return;
+	}
+	this->m_TileStride = GetTileStride(this->m_TileSize, this->m_ComponentsPerVoxel, this->m_StorageType);
+	OffsetValueType tileStride = this->m_TileStride;
+	for (unsigned int i = 0; i < TDimension; i++) {
+		this->m_VoxelOffsetTable[i] = (static_cast<OffsetValueType>(1) << (this->m_TileShift * i)) * this->m_ComponentsPerVoxel;
+		this->m_TileOffsetTable[i] = tileStride;
+		tileStride *= (this->m_Size[i] + this->m_TileSize - 1) / this->m_TileSize;
+	}
+}
+
+
+/*!
+ * The tiles of a file start at page boundaries, for the memory budget to release whole tiles.
+ * The values are 2, 4 or 8 bytes wide, so a page holds a whole number of them.
+ */
+template < class TScalarType, unsigned int TDimension >
+SizeValueType
+InterleavedDeformationBasis<TScalarType, TDimension>
+::GetTileStride( unsigned int tileSize, SizeValueType componentsPerVoxel, StorageType storage )
+{
+	const SizeValueType elementSize = GetStorageElementSize(storage);
+	const SizeValueType pageValues = 4096 / elementSize;
+	SizeValueType values = componentsPerVoxel;
+	for (unsigned int i = 0; i < TDimension; i++) {
+		values *= tileSize;
+	}
+	return ((values + pageValues - 1) / pageValues) * pageValues;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::PrefetchPoints( const std::vector<PointType> & points ) const
+{
+	if (this->m_TileCache.IsNull()) {
+		return;
+	}
+
+	/** Each tile once, in the order of its first use. */
+	std::vector<SizeValueType> tiles;
+	std::vector<bool> listed(this->m_TileCache->GetNumberOfTiles(), false);
+	for (SizeValueType p = 0; p < points.size(); p++) {
+		InterpolationCell cell;
+		if (!this->ComputeInterpolationCell(points[p], cell, false)) {
+			continue;
+		}
+		for (unsigned int c = 0; c < cell.NumberOfCorners; c++) {
+			const SizeValueType tile = static_cast<SizeValueType>(cell.Offsets[c]) / this->m_TileStride;
+			if (tile < listed.size() && !listed[tile]) {
+				listed[tile] = true;
+				tiles.push_back(tile);
+			}
+		}
+	}
+	this->m_TileCache->Prefetch(tiles);
+}
+
+
+/*!
+ * Copy the basis and shrink it axis by axis.
+ */
+template < class TScalarType, unsigned int TDimension >
+typename InterleavedDeformationBasis<TScalarType, TDimension>::Pointer
+InterleavedDeformationBasis<TScalarType, TDimension>
+::Downsample( const ShrinkFactorsType & factors ) const
+{
+	if (this->m_TileSize > 0) {
+		itkExceptionMacro( << "A tiled basis cannot be downsampled." );
+	}
+	if (this->m_SplineOrder != 1) {
+		itkExceptionMacro( << "A B-spline basis cannot be downsampled." );
+	}
+
+	Pointer coarse = Self::New();
+	coarse->m_NumberOfModes = this->m_NumberOfModes;
+	coarse->m_ComponentsPerVoxel = this->m_ComponentsPerVoxel;
+	coarse->m_StartIndex = this->m_StartIndex;
+	coarse->m_Size = this->m_Size;
+	coarse->m_Spacing = this->m_Spacing;
+	coarse->m_Origin = this->m_Origin;
+	coarse->m_Direction = this->m_Direction;
+	coarse->m_ModeVariances = this->m_ModeVariances;
+	coarse->m_StorageType = this->m_StorageType;
+	coarse->m_ComponentScales = this->m_ComponentScales;
+	coarse->UpdateGeometry();
+	coarse->m_Buffer->Reserve(this->m_Buffer->Size());
+	std::copy(this->m_Buffer->GetBufferPointer(),
+		this->m_Buffer->GetBufferPointer() + this->m_Buffer->Size(), coarse->m_Buffer->GetBufferPointer());
+
+	for (unsigned int axis = 0; axis < TDimension; axis++) {
+		if (factors[axis] > 1) {
+			coarse->ShrinkAlongAxis(axis, factors[axis]);
+		}
+	}
+
+	return coarse;
+}
+
+
+/*!
+ * The components of a voxel are contiguous, so the old ones are copied as one block per voxel.
+ */
+template < class TScalarType, unsigned int TDimension >
+typename InterleavedDeformationBasis<TScalarType, TDimension>::Pointer
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ExtendModes( unsigned int numberOfModes ) const
+{
+	if (this->m_TileSize > 0 || this->m_SplineOrder != 1) {
+		itkExceptionMacro( << "A tiled or B-spline basis cannot be extended." );
+	}
+	if (numberOfModes < this->m_NumberOfModes) {
+		itkExceptionMacro( << "The basis holds " << this->m_NumberOfModes << " modes, more than " << numberOfModes << "." );
+	}
+
+	Pointer extended = Self::New();
+	extended->m_NumberOfModes = numberOfModes;
+	extended->m_ComponentsPerVoxel = (numberOfModes + 1) * TDimension;
+	extended->m_StartIndex = this->m_StartIndex;
+	extended->m_Size = this->m_Size;
+	extended->m_Spacing = this->m_Spacing;
+	extended->m_Origin = this->m_Origin;
+	extended->m_Direction = this->m_Direction;
+	extended->m_StorageType = this->m_StorageType;
+	extended->m_ModeVariances.SetSize(numberOfModes);
+	extended->m_ModeVariances.Fill(0.0);
+	extended->m_ComponentScales.SetSize(numberOfModes + 1);
+	extended->m_ComponentScales.Fill(1.0);
+	for (unsigned int k = 0; k <= this->m_NumberOfModes; k++) {
+		extended->m_ComponentScales[k] = this->m_ComponentScales[k];
+		if (k < this->m_NumberOfModes && k < this->m_ModeVariances.GetSize()) {
+			extended->m_ModeVariances[k] = this->m_ModeVariances[k];
+		}
+	}
+	extended->UpdateGeometry();
+
+	const SizeValueType numberOfVoxels = this->m_Size.GetNumberOfPixels();
+	const SizeValueType elementSize = GetStorageElementSize(this->m_StorageType);
+	const SizeValueType sourceSize = this->m_ComponentsPerVoxel * elementSize;
+	const SizeValueType targetSize = extended->m_ComponentsPerVoxel * elementSize;
+	extended->m_Buffer->Reserve(numberOfVoxels * targetSize);
+	const unsigned char * source = this->m_Buffer->GetBufferPointer();
+	unsigned char * target = extended->m_Buffer->GetBufferPointer();
+	for (SizeValueType v = 0; v < numberOfVoxels; v++) {
+		std::memcpy(target + v * targetSize, source + v * sourceSize, sourceSize);
+		std::fill(target + v * targetSize + sourceSize, target + (v + 1) * targetSize, 0);
+	}
+
+	return extended;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ShrinkAlongAxis( unsigned int axis, unsigned int factor )
+{
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template ShrinkAlongAxisInternal<float>(axis, factor);
+		break;
+	case Float16Storage:
+		this->template ShrinkAlongAxisInternal<Float16StorageTag>(axis, factor);
+		break;
+	case Int16Storage:
+		this->template ShrinkAlongAxisInternal<Int16StorageTag>(axis, factor);
+		break;
+	default:
+		this->template ShrinkAlongAxisInternal<TScalarType>(axis, factor);
+	}
+}
+
+
+/*!
+ * The buffer is viewed as [outer][axis][inner], where inner holds all components of the
+ * voxels along the faster axes. Each coarse sample j is a normalised Gaussian average
+ * around the fine continuous index j * factor + (factor - 1) / 2, with replicated borders.
+ * The averages of quantized values stay within the range of the fine values, so the
+ * coarse basis keeps the scales of the fine one.
+ */
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ShrinkAlongAxisInternal( unsigned int axis, unsigned int factor )
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	const SizeValueType fineSize = this->m_Size[axis];
+	const SizeValueType coarseSize = std::max<SizeValueType>(1, fineSize / factor);
+	const double sigma = 0.5 * factor;
+	const OffsetValueType radius = static_cast<OffsetValueType>(std::ceil(3.0 * sigma));
+
+	SizeValueType inner = this->m_ComponentsPerVoxel;
+	for (unsigned int i = 0; i < axis; i++) {
+		inner *= this->m_Size[i];
+	}
+	SizeValueType outer = 1;
+	for (unsigned int i = axis + 1; i < TDimension; i++) {
+		outer *= this->m_Size[i];
+	}
+
+	typename BufferType::Pointer coarseBuffer = BufferType::New();
+	coarseBuffer->Reserve(outer * coarseSize * inner * sizeof(StorageValueType));
+	const StorageValueType * fineValues = reinterpret_cast<const StorageValueType *>(this->m_Buffer->GetBufferPointer());
+	StorageValueType * coarseValues = reinterpret_cast<StorageValueType *>(coarseBuffer->GetBufferPointer());
+
+	std::vector<double> accumulator(inner);
+	for (SizeValueType j = 0; j < coarseSize; j++) {
+		const double center = j * factor + 0.5 * (factor - 1);
+		const OffsetValueType first = static_cast<OffsetValueType>(std::ceil(center)) - radius;
+		const OffsetValueType last = static_cast<OffsetValueType>(std::floor(center)) + radius;
+
+		std::vector<OffsetValueType> taps;
+		std::vector<double> weights;
+		double weightSum = 0.0;
+		for (OffsetValueType i = first; i <= last; i++) {
+			const double x = (i - center) / sigma;
+			const double weight = std::exp(-0.5 * x * x);
+			taps.push_back(std::min<OffsetValueType>(std::max<OffsetValueType>(i, 0), static_cast<OffsetValueType>(fineSize) - 1));
+			weights.push_back(weight);
+			weightSum += weight;
+		}
+
+		for (SizeValueType o = 0; o < outer; o++) {
+			std::fill(accumulator.begin(), accumulator.end(), 0.0);
+			for (unsigned int t = 0; t < taps.size(); t++) {
+				const StorageValueType * source = fineValues + (o * fineSize + taps[t]) * inner;
+				const double weight = weights[t] / weightSum;
+				for (SizeValueType n = 0; n < inner; n++) {
+					accumulator[n] += weight * StorageTraits::Decode(source[n]);
+				}
+			}
+			StorageValueType * target = coarseValues + (o * coarseSize + j) * inner;
+			for (SizeValueType n = 0; n < inner; n++) {
+				target[n] = StorageTraits::Encode(accumulator[n]);
+			}
+		}
+	}
+
+	/** The first coarse sample lies at fine index (factor - 1) / 2. */
+	const double shift = (this->m_StartIndex[axis] + 0.5 * (factor - 1)) * this->m_Spacing[axis];
+	for (unsigned int i = 0; i < TDimension; i++) {
+		this->m_Origin[i] += this->m_Direction[i][axis] * shift;
+	}
+	this->m_StartIndex[axis] = 0;
+	this->m_Spacing[axis] *= factor;
+	this->m_Size[axis] = coarseSize;
+	this->m_Buffer = coarseBuffer;
+	this->UpdateGeometry();
+}
+
+
+/*!
+ * Fit the components separably: each slab of voxels along the last axis is fitted along the other
+ * axes and spread over the control planes it contributes to, after which one banded solve along
+ * the last axis completes the fit. A second pass evaluates the B-spline at the voxels for the errors.
+ */
+template < class TScalarType, unsigned int TDimension >
+typename InterleavedDeformationBasis<TScalarType, TDimension>::Pointer
+InterleavedDeformationBasis<TScalarType, TDimension>
+::FitBSpline( const ShrinkFactorsType & controlPointSpacing, ThreadIdType numberOfThreads ) const
+{
+	if (this->m_SplineOrder != 1) {
+		itkExceptionMacro( << "The basis is a B-spline already." );
+	}
+	if (this->m_Size.GetNumberOfPixels() == 0) {
+		itkExceptionMacro( << "The basis is empty." );
+	}
+	for (unsigned int a = 0; a < TDimension; a++) {
+		if (controlPointSpacing[a] == 0) {
+			itkExceptionMacro( << "The control point spacing must be at least one voxel, not " << controlPointSpacing << "." );
+		}
+	}
+
+	BSplineFitAxis axes[TDimension];
+	SizeValueType numberOfControlPoints = 1;
+	for (unsigned int a = 0; a < TDimension; a++) {
+		InitializeBSplineFitAxis(this->m_Size[a], controlPointSpacing[a], axes[a]);
+		numberOfControlPoints *= axes[a].NumberOfControlPoints;
+	}
+
+	std::vector<double> coefficients(numberOfControlPoints * this->m_ComponentsPerVoxel, 0.0);
+	std::vector<double> squaredErrors(this->m_ComponentsPerVoxel, 0.0);
+	std::vector<double> squaredValues(this->m_ComponentsPerVoxel, 0.0);
+
+	BSplineFitThreadStruct str;
+	str.Basis = this;
+	str.Axes = axes;
+	str.Coefficients = &coefficients[0];
+	str.SquaredErrors = &squaredErrors[0];
+	str.SquaredValues = &squaredValues[0];
+
+	MultiThreader::Pointer threader = MultiThreader::New();
+	if (numberOfThreads > 0) {
+		threader->SetNumberOfThreads(numberOfThreads);
+	}
+	threader->SetNumberOfThreads(std::min<ThreadIdType>(threader->GetNumberOfThreads(), this->m_ComponentsPerVoxel));
+	threader->SetSingleMethod(Self::FitBSplineThreaderCallback, &str);
+	threader->SingleMethodExecute();
+
+	/** Voxel index v lies at control index v / spacing + 1, so the grid starts one control point early. */
+	Pointer spline = Self::New();
+	spline->m_NumberOfModes = this->m_NumberOfModes;
+	spline->m_ComponentsPerVoxel = this->m_ComponentsPerVoxel;
+	spline->m_StorageType = this->m_StorageType;
+	spline->m_ModeVariances = this->m_ModeVariances;
+	spline->m_ComponentScales.SetSize(this->m_NumberOfModes + 1);
+	spline->m_ComponentScales.Fill(1.0);
+	spline->m_SplineOrder = 3;
+	spline->m_StartIndex.Fill(0);
+	spline->m_Direction = this->m_Direction;
+	spline->m_Origin = this->m_Origin;
+	for (unsigned int a = 0; a < TDimension; a++) {
+		spline->m_Size[a] = axes[a].NumberOfControlPoints;
+		spline->m_Spacing[a] = this->m_Spacing[a] * controlPointSpacing[a];
+		spline->m_DomainLower[a] = 1.0 - 0.5 / controlPointSpacing[a];
+		spline->m_DomainUpper[a] = 1.0 + (this->m_Size[a] - 0.5) / controlPointSpacing[a];
+		const double shift = (static_cast<double>(this->m_StartIndex[a]) - controlPointSpacing[a]) * this->m_Spacing[a];
+		for (unsigned int i = 0; i < TDimension; i++) {
+			spline->m_Origin[i] += this->m_Direction[i][a] * shift;
+		}
+	}
+	spline->UpdateGeometry();
+	spline->m_Buffer->Reserve(numberOfControlPoints * this->m_ComponentsPerVoxel * GetStorageElementSize(this->m_StorageType));
+
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		spline->template SetCoefficientsInternal<float>(coefficients);
+		break;
+	case Float16Storage:
+		spline->template SetCoefficientsInternal<Float16StorageTag>(coefficients);
+		break;
+	case Int16Storage:
+		spline->template SetCoefficientsInternal<Int16StorageTag>(coefficients);
+		break;
+	default:
+		spline->template SetCoefficientsInternal<TScalarType>(coefficients);
+	}
+
+	const double numberOfVoxels = static_cast<double>(this->m_Size.GetNumberOfPixels());
+	spline->m_ApproximationErrors.SetSize(this->m_NumberOfModes + 1);
+	spline->m_RelativeApproximationErrors.SetSize(this->m_NumberOfModes + 1);
+	for (unsigned int k = 0; k <= this->m_NumberOfModes; k++) {
+		double error = 0.0;
+		double value = 0.0;
+		for (unsigned int d = 0; d < TDimension; d++) {
+			error += squaredErrors[k * TDimension + d];
+			value += squaredValues[k * TDimension + d];
+		}
+		spline->m_ApproximationErrors[k] = std::sqrt(error / numberOfVoxels);
+		spline->m_RelativeApproximationErrors[k] = (value > 0.0) ? std::sqrt(error / value) : 0.0;
+	}
+
+	return spline;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+ITK_THREAD_RETURN_TYPE
+InterleavedDeformationBasis<TScalarType, TDimension>
+::FitBSplineThreaderCallback( void * arg )
+{
+	const MultiThreader::ThreadInfoStruct * info = static_cast<MultiThreader::ThreadInfoStruct *>(arg);
+	const BSplineFitThreadStruct * str = static_cast<BSplineFitThreadStruct *>(info->UserData);
+	const unsigned int numberOfComponents = static_cast<unsigned int>(str->Basis->m_ComponentsPerVoxel);
+
+	const unsigned int first = numberOfComponents * info->ThreadID / info->NumberOfThreads;
+	const unsigned int last = numberOfComponents * (info->ThreadID + 1) / info->NumberOfThreads;
+	if (first < last) {
+		str->Basis->FitBSplineRange(*str, first, last);
+	}
+	return ITK_THREAD_RETURN_VALUE;
+}
+
+
+/*!
+ * The value at u = t + base is sum_m weights[m] * c[base - 1 + m].
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ComputeBSplineWeights( double t, double weights[ 4 ], double derivatives[ 4 ], double secondDerivatives[ 4 ] )
+{
+	const double s = 1.0 - t;
+	const double t2 = t * t;
+	const double t3 = t2 * t;
+	weights[0] = s * s * s / 6.0;
+	weights[1] = (3.0 * t3 - 6.0 * t2 + 4.0) / 6.0;
+	weights[2] = (-3.0 * t3 + 3.0 * t2 + 3.0 * t + 1.0) / 6.0;
+	weights[3] = t3 / 6.0;
+	derivatives[0] = -0.5 * s * s;
+	derivatives[1] = 1.5 * t2 - 2.0 * t;
+	derivatives[2] = -1.5 * t2 + t + 0.5;
+	derivatives[3] = 0.5 * t2;
+	secondDerivatives[0] = s;
+	secondDerivatives[1] = 3.0 * t - 2.0;
+	secondDerivatives[2] = -3.0 * t + 1.0;
+	secondDerivatives[3] = t;
+}
+
+
+/*!
+ * The normal matrix of a cubic B-spline has three diagonals on either side, so its Cholesky factor
+ * has three below the diagonal. A tiny ridge keeps it definite where a control point is hardly used.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::InitializeBSplineFitAxis( SizeValueType numberOfVoxels, unsigned int spacing, BSplineFitAxis & axis )
+{
+	const SizeValueType numberOfControlPoints = (numberOfVoxels - 1) / spacing + 4;
+	axis.NumberOfVoxels = numberOfVoxels;
+	axis.NumberOfControlPoints = numberOfControlPoints;
+	axis.Indices.resize(4 * numberOfVoxels);
+	axis.Weights.resize(4 * numberOfVoxels);
+
+	/** normal[4 * j + m] is the entry (j, j - m) of the normal matrix. */
+	std::vector<double> normal(4 * numberOfControlPoints, 0.0);
+	for (SizeValueType v = 0; v < numberOfVoxels; v++) {
+		const double u = static_cast<double>(v) / spacing + 1.0;
+		const OffsetValueType base = Math::Floor<OffsetValueType>(u);
+		double weights[4];
+		double derivatives[4];
+		double secondDerivatives[4];
+		ComputeBSplineWeights(u - base, weights, derivatives, secondDerivatives);
+		for (unsigned int m = 0; m < 4; m++) {
+			axis.Indices[4 * v + m] = std::min<OffsetValueType>(std::max<OffsetValueType>(base - 1 + m, 0),
+				static_cast<OffsetValueType>(numberOfControlPoints) - 1);
+			axis.Weights[4 * v + m] = weights[m];
+		}
+
+		/** Both orders of a pair count if clamping maps its control points onto one. */
+		for (unsigned int m = 0; m < 4; m++) {
+			for (unsigned int n = 0; n < 4; n++) {
+				const OffsetValueType row = axis.Indices[4 * v + m];
+				const OffsetValueType column = axis.Indices[4 * v + n];
+				if (row >= column) {
+					normal[4 * row + (row - column)] += weights[m] * weights[n];
+				}
+			}
+		}
+	}
+
+	double maximum = 0.0;
+	for (SizeValueType j = 0; j < numberOfControlPoints; j++) {
+		maximum = std::max(maximum, normal[4 * j]);
+	}
+	const double ridge = 1e-12 * ((maximum > 0.0) ? maximum : 1.0);
+
+	axis.Factor.assign(4 * numberOfControlPoints, 0.0);
+	for (SizeValueType j = 0; j < numberOfControlPoints; j++) {
+		const unsigned int band = static_cast<unsigned int>(std::min<SizeValueType>(j, 3));
+		for (unsigned int m = band; m > 0; m--) {
+			const SizeValueType k = j - m;
+			double value = normal[4 * j + m];
+			for (SizeValueType l = j - band; l < k; l++) {
+				value -= axis.Factor[4 * j + (j - l)] * axis.Factor[4 * k + (k - l)];
+			}
+			axis.Factor[4 * j + m] = value / axis.Factor[4 * k];
+		}
+		double diagonal = normal[4 * j] + ridge;
+		for (unsigned int m = 1; m <= band; m++) {
+			diagonal -= axis.Factor[4 * j + m] * axis.Factor[4 * j + m];
+		}
+		axis.Factor[4 * j] = std::sqrt(std::max(diagonal, ridge));
+	}
+}
+
+
+/*!
+ * Forward and backward substitution with the banded factor, on all right hand sides of a row at once.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::SolveBanded( const BSplineFitAxis & axis, double * values, SizeValueType rowStride, SizeValueType count )
+{
+	const SizeValueType numberOfControlPoints = axis.NumberOfControlPoints;
+	for (SizeValueType j = 0; j < numberOfControlPoints; j++) {
+		double * row = values + j * rowStride;
+		for (unsigned int m = 1; m <= 3 && m <= j; m++) {
+			const double factor = axis.Factor[4 * j + m];
+			const double * previous = values + (j - m) * rowStride;
+			for (SizeValueType n = 0; n < count; n++) {
+				row[n] -= factor * previous[n];
+			}
+		}
+		const double inverse = 1.0 / axis.Factor[4 * j];
+		for (SizeValueType n = 0; n < count; n++) {
+			row[n] *= inverse;
+		}
+	}
+	for (SizeValueType j = numberOfControlPoints; j-- > 0;) {
+		double * row = values + j * rowStride;
+		for (unsigned int m = 1; m <= 3 && j + m < numberOfControlPoints; m++) {
+			const double factor = axis.Factor[4 * (j + m) + m];
+			const double * next = values + (j + m) * rowStride;
+			for (SizeValueType n = 0; n < count; n++) {
+				row[n] -= factor * next[n];
+			}
+		}
+		const double inverse = 1.0 / axis.Factor[4 * j];
+		for (SizeValueType n = 0; n < count; n++) {
+			row[n] *= inverse;
+		}
+	}
+}
+
+
+/*!
+ * The array is viewed as [outer][axis][inner], as in ShrinkAlongAxisInternal, so that each sample
+ * along the axis adds a contiguous block of inner values to its control points.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::FitAlongAxis( const std::vector<double> & input, std::vector<SizeValueType> & size, unsigned int axis,
+	unsigned int numberOfComponents, const BSplineFitAxis & fitAxis, std::vector<double> & output )
+{
+	SizeValueType inner = numberOfComponents;
+	for (unsigned int i = 0; i < axis; i++) {
+		inner *= size[i];
+	}
+	SizeValueType outer = 1;
+	for (unsigned int i = axis + 1; i < size.size(); i++) {
+		outer *= size[i];
+	}
+
+	const SizeValueType numberOfVoxels = fitAxis.NumberOfVoxels;
+	const SizeValueType numberOfControlPoints = fitAxis.NumberOfControlPoints;
+	output.assign(outer * numberOfControlPoints * inner, 0.0);
+	for (SizeValueType o = 0; o < outer; o++) {
+		const double * source = &input[o * numberOfVoxels * inner];
+		double * target = &output[o * numberOfControlPoints * inner];
+		for (SizeValueType v = 0; v < numberOfVoxels; v++) {
+			for (unsigned int m = 0; m < 4; m++) {
+				const double weight = fitAxis.Weights[4 * v + m];
+				double * controlPoint = target + fitAxis.Indices[4 * v + m] * inner;
+				for (SizeValueType n = 0; n < inner; n++) {
+					controlPoint[n] += weight * source[v * inner + n];
+				}
+			}
+		}
+		SolveBanded(fitAxis, target, inner, inner);
+	}
+	size[axis] = numberOfControlPoints;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateAlongAxis( const std::vector<double> & input, std::vector<SizeValueType> & size, unsigned int axis,
+	unsigned int numberOfComponents, const BSplineFitAxis & fitAxis, std::vector<double> & output )
+{
+	SizeValueType inner = numberOfComponents;
+	for (unsigned int i = 0; i < axis; i++) {
+		inner *= size[i];
+	}
+	SizeValueType outer = 1;
+	for (unsigned int i = axis + 1; i < size.size(); i++) {
+		outer *= size[i];
+	}
+
+	const SizeValueType numberOfVoxels = fitAxis.NumberOfVoxels;
+	const SizeValueType numberOfControlPoints = fitAxis.NumberOfControlPoints;
+	output.assign(outer * numberOfVoxels * inner, 0.0);
+	for (SizeValueType o = 0; o < outer; o++) {
+		const double * source = &input[o * numberOfControlPoints * inner];
+		double * target = &output[o * numberOfVoxels * inner];
+		for (SizeValueType v = 0; v < numberOfVoxels; v++) {
+			for (unsigned int m = 0; m < 4; m++) {
+				const double weight = fitAxis.Weights[4 * v + m];
+				const double * controlPoint = source + fitAxis.Indices[4 * v + m] * inner;
+				for (SizeValueType n = 0; n < inner; n++) {
+					target[v * inner + n] += weight * controlPoint[n];
+				}
+			}
+		}
+	}
+	size[axis] = numberOfVoxels;
+}
+
+
+/*!
+ * The right hand sides of the last axis are accumulated plane by plane, so that a slab is read
+ * once and the buffer is traversed in its order. Within a plane the control points hold all
+ * components, of which this thread owns first to last - 1.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::FitBSplineRange( const BSplineFitThreadStruct & str, unsigned int first, unsigned int last ) const
+{
+	const unsigned int lastAxis = TDimension - 1;
+	const unsigned int numberOfComponents = last - first;
+	const BSplineFitAxis & slabAxis = str.Axes[lastAxis];
+	SizeValueType planeSize = 1;
+	SizeValueType slabSize = 1;
+	for (unsigned int a = 0; a < lastAxis; a++) {
+		planeSize *= str.Axes[a].NumberOfControlPoints;
+		slabSize *= this->m_Size[a];
+	}
+	const SizeValueType planeStride = planeSize * this->m_ComponentsPerVoxel;
+
+	std::vector<double> values;
+	std::vector<double> fitted;
+	std::vector<double> work;
+	std::vector<SizeValueType> size(TDimension, 1);
+	for (SizeValueType z = 0; z < slabAxis.NumberOfVoxels; z++) {
+		this->ReadSlab(static_cast<OffsetValueType>(z), first, last, values);
+		fitted = values;
+		for (unsigned int a = 0; a < lastAxis; a++) {
+			size[a] = this->m_Size[a];
+		}
+		for (unsigned int a = 0; a < lastAxis; a++) {
+			FitAlongAxis(fitted, size, a, numberOfComponents, str.Axes[a], work);
+			fitted.swap(work);
+		}
+
+		for (unsigned int m = 0; m < 4; m++) {
+			const double weight = slabAxis.Weights[4 * z + m];
+			double * plane = str.Coefficients + slabAxis.Indices[4 * z + m] * planeStride + first;
+			for (SizeValueType i = 0; i < planeSize; i++) {
+				for (unsigned int c = 0; c < numberOfComponents; c++) {
+					plane[i * this->m_ComponentsPerVoxel + c] += weight * fitted[i * numberOfComponents + c];
+				}
+			}
+		}
+	}
+	for (SizeValueType i = 0; i < planeSize; i++) {
+		SolveBanded(slabAxis, str.Coefficients + i * this->m_ComponentsPerVoxel + first, planeStride, numberOfComponents);
+	}
+
+	/** Evaluate the B-spline at the voxels, slab by slab, and compare. */
+	for (SizeValueType z = 0; z < slabAxis.NumberOfVoxels; z++) {
+		fitted.assign(planeSize * numberOfComponents, 0.0);
+		for (unsigned int m = 0; m < 4; m++) {
+			const double weight = slabAxis.Weights[4 * z + m];
+			const double * plane = str.Coefficients + slabAxis.Indices[4 * z + m] * planeStride + first;
+			for (SizeValueType i = 0; i < planeSize; i++) {
+				for (unsigned int c = 0; c < numberOfComponents; c++) {
+					fitted[i * numberOfComponents + c] += weight * plane[i * this->m_ComponentsPerVoxel + c];
+				}
+			}
+		}
+		for (unsigned int a = 0; a < lastAxis; a++) {
+			size[a] = str.Axes[a].NumberOfControlPoints;
+		}
+		for (unsigned int a = 0; a < lastAxis; a++) {
+			EvaluateAlongAxis(fitted, size, a, numberOfComponents, str.Axes[a], work);
+			fitted.swap(work);
+		}
+
+		this->ReadSlab(static_cast<OffsetValueType>(z), first, last, values);
+		for (SizeValueType v = 0; v < slabSize; v++) {
+			for (unsigned int c = 0; c < numberOfComponents; c++) {
+				const double value = values[v * numberOfComponents + c];
+				const double error = fitted[v * numberOfComponents + c] - value;
+				str.SquaredErrors[first + c] += error * error;
+				str.SquaredValues[first + c] += value * value;
+			}
+		}
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ReadSlab( OffsetValueType slab, unsigned int first, unsigned int last, std::vector<double> & values ) const
+{
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template ReadSlabInternal<float>(slab, first, last, values);
+		break;
+	case Float16Storage:
+		this->template ReadSlabInternal<Float16StorageTag>(slab, first, last, values);
+		break;
+	case Int16Storage:
+		this->template ReadSlabInternal<Int16StorageTag>(slab, first, last, values);
+		break;
+	default:
+		this->template ReadSlabInternal<TScalarType>(slab, first, last, values);
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ReadSlabInternal( OffsetValueType slab, unsigned int first, unsigned int last, std::vector<double> & values ) const
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	const StorageValueType * buffer = reinterpret_cast<const StorageValueType *>(this->m_Buffer->GetBufferPointer());
+	const unsigned int lastAxis = TDimension - 1;
+	const unsigned int numberOfComponents = last - first;
+	SizeValueType slabSize = 1;
+	for (unsigned int a = 0; a < lastAxis; a++) {
+		slabSize *= this->m_Size[a];
+	}
+	values.resize(slabSize * numberOfComponents);
+
+	std::vector<double> scales(numberOfComponents);
+	for (unsigned int c = 0; c < numberOfComponents; c++) {
+		scales[c] = StorageTraits::IsQuantized ? this->m_ComponentScales[(first + c) / TDimension] : 1.0;
+	}
+
+	const OffsetValueType slabOffset = this->GetAxisOffset(lastAxis, slab);
+	OffsetValueType index[TDimension];
+	std::fill(index, index + TDimension, 0);
+	for (SizeValueType v = 0; v < slabSize; v++) {
+		OffsetValueType offset = slabOffset;
+		for (unsigned int a = 0; a < lastAxis; a++) {
+			offset += this->GetAxisOffset(a, index[a]);
+		}
+		const StorageValueType * voxel = buffer + offset + first;
+		double * target = &values[v * numberOfComponents];
+		for (unsigned int c = 0; c < numberOfComponents; c++) {
+			target[c] = scales[c] * StorageTraits::Decode(voxel[c]);
+		}
+
+		for (unsigned int a = 0; a < lastAxis && ++index[a] == static_cast<OffsetValueType>(this->m_Size[a]); a++) {
+			index[a] = 0;
+		}
+	}
+}
+
+
+/*!
+ * Store the fitted control points in the linear layout. Quantized components get the scale that
+ * maps their largest magnitude to the largest integer, as in SetComponentInternal.
+ */
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::SetCoefficientsInternal( const std::vector<double> & coefficients )
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	const SizeValueType numberOfControlPoints = this->m_Size.GetNumberOfPixels();
+	StorageValueType * target = reinterpret_cast<StorageValueType *>(this->m_Buffer->GetBufferPointer());
+
+	for (unsigned int k = 0; k <= this->m_NumberOfModes; k++) {
+		double scale = 1.0;
+		if (StorageTraits::IsQuantized) {
+			double maximum = 0.0;
+			for (SizeValueType p = 0; p < numberOfControlPoints; p++) {
+				for (unsigned int d = 0; d < TDimension; d++) {
+					maximum = std::max(maximum, std::abs(coefficients[p * this->m_ComponentsPerVoxel + k * TDimension + d]));
+				}
+			}
+			scale = (maximum > 0.0) ? maximum / StorageTraits::MaximumQuantizedValue : 1.0;
+		}
+		this->m_ComponentScales[k] = scale;
+
+		for (SizeValueType p = 0; p < numberOfControlPoints; p++) {
+			for (unsigned int d = 0; d < TDimension; d++) {
+				const SizeValueType n = p * this->m_ComponentsPerVoxel + k * TDimension + d;
+				target[n] = StorageTraits::Encode(coefficients[n] / scale);
+			}
+		}
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::SetComponent( unsigned int component, const DeformationFieldType * field )
+{
+	this->WriteComponent(component, field);
+	this->Modified();
+}
+
+
+/*!
+ * Scatter a deformation field into its slot of every voxel.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::WriteComponent( unsigned int component, const DeformationFieldType * field )
+{
+	if (component > this->m_NumberOfModes) {
+		itkExceptionMacro( << "Component " << component << " exceeds the " << this->m_NumberOfModes << " allocated modes." );
+	}
+	if (this->m_MappedFile.IsNotNull()) {
+		itkExceptionMacro( << "The basis is mapped read-only from " << this->m_MappedFile->GetFileName() << "." );
+	}
+	if (field->GetBufferedRegion().GetSize() != this->m_Size) {
+		itkExceptionMacro( << "The deformation field does not match the size of the basis." );
+	}
+
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template SetComponentInternal<float>(component, field);
+		break;
+	case Float16Storage:
+		this->template SetComponentInternal<Float16StorageTag>(component, field);
+		break;
+	case Int16Storage:
+		this->template SetComponentInternal<Int16StorageTag>(component, field);
+		break;
+	default:
+		this->template SetComponentInternal<TScalarType>(component, field);
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::SetComponentInternal( unsigned int component, const DeformationFieldType * field )
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	const SizeValueType numberOfVoxels = field->GetBufferedRegion().GetNumberOfPixels();
+	const VectorType * source = field->GetBufferPointer();
+	StorageValueType * target = reinterpret_cast<StorageValueType *>(this->m_Buffer->GetBufferPointer())
+		+ component * TDimension;
+
+	/** Map the largest magnitude of the component to the largest integer. */
+	double scale = 1.0;
+	if (StorageTraits::IsQuantized) {
+		double maximum = 0.0;
+		for (SizeValueType v = 0; v < numberOfVoxels; v++) {
+			for (unsigned int d = 0; d < TDimension; d++) {
+				maximum = std::max(maximum, std::abs(static_cast<double>(source[v][d])));
+			}
+		}
+		scale = (maximum > 0.0) ? maximum / StorageTraits::MaximumQuantizedValue : 1.0;
+	}
+	this->m_ComponentScales[component] = scale;
+
+	for (SizeValueType v = 0; v < numberOfVoxels; v++) {
+		for (unsigned int d = 0; d < TDimension; d++) {
+			target[d] = StorageTraits::Encode(source[v][d] / scale);
+		}
+		target += this->m_ComponentsPerVoxel;
+	}
+}
+
+
+/*!
+ * Continuous index, buffer test and clamping as in VectorLinearInterpolateImageFunction. The
+ * control points of a B-spline are clamped to the grid in the same way.
+ */
+template < class TScalarType, unsigned int TDimension >
+bool
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ComputeInterpolationCell( const PointType & point, InterpolationCell & cell, bool touchTiles ) const
+{
+	double cindex[TDimension];
+	for (unsigned int i = 0; i < TDimension; i++) {
+		cindex[i] = 0.0;
+		for (unsigned int j = 0; j < TDimension; j++) {
+			cindex[i] += this->m_PhysicalPointToIndex[i][j] * (point[j] - this->m_Origin[j]);
+		}
+		cindex[i] -= this->m_StartIndex[i];
+
+		if (cindex[i] < this->m_DomainLower[i] || !(cindex[i] < this->m_DomainUpper[i])) {
+			return false;
+		}
+	}
+
+	const bool cubic = (this->m_SplineOrder == 3);
+	cell.Width = cubic ? 4 : 2;
+	cell.AxisShift = cubic ? 2 : 1;
+	cell.NumberOfCorners = 1u << (cell.AxisShift * TDimension);
+
+	OffsetValueType axisOffsets[TDimension][4];
+	for (unsigned int i = 0; i < TDimension; i++) {
+		const OffsetValueType base = Math::Floor<OffsetValueType>(cindex[i]);
+		const double distance = cindex[i] - static_cast<double>(base);
+		const OffsetValueType last = static_cast<OffsetValueType>(this->m_Size[i]) - 1;
+		if (cubic) {
+			ComputeBSplineWeights(distance, cell.AxisWeights[i], cell.AxisDerivatives[i], cell.AxisSecondDerivatives[i]);
+		}
+		else {
+			cell.AxisWeights[i][0] = 1.0 - distance;
+			cell.AxisWeights[i][1] = distance;
+			cell.AxisDerivatives[i][0] = -1.0;
+			cell.AxisDerivatives[i][1] = 1.0;
+			cell.AxisSecondDerivatives[i][0] = 0.0;
+			cell.AxisSecondDerivatives[i][1] = 0.0;
+		}
+		const OffsetValueType first = cubic ? base - 1 : base;
+		cell.LowerIndex[i] = std::min(std::max<OffsetValueType>(first, 0), last);
+		for (unsigned int m = 0; m < cell.Width; m++) {
+			axisOffsets[i][m] = this->GetAxisOffset(i, std::min(std::max<OffsetValueType>(first + m, 0), last));
+		}
+	}
+
+	const unsigned int mask = cell.Width - 1;
+	for (unsigned int c = 0; c < cell.NumberOfCorners; c++) {
+		OffsetValueType offset = 0;
+		double weight = 1.0;
+		for (unsigned int i = 0; i < TDimension; i++) {
+			const unsigned int m = (c >> (cell.AxisShift * i)) & mask;
+			offset += axisOffsets[i][m];
+			weight *= cell.AxisWeights[i][m];
+		}
+		cell.Offsets[c] = offset;
+		cell.Weights[c] = weight;
+	}
+
+	/** The corners lie in at most 2^Dimension tiles, or more for a B-spline; each is touched once. */
+	if (touchTiles && this->m_TileCache.IsNotNull()) {
+		SizeValueType tiles[MaximumNumberOfCorners];
+		unsigned int numberOfTiles = 0;
+		for (unsigned int c = 0; c < cell.NumberOfCorners; c++) {
+			const SizeValueType tile = static_cast<SizeValueType>(cell.Offsets[c]) / this->m_TileStride;
+			if (std::find(tiles, tiles + numberOfTiles, tile) == tiles + numberOfTiles) {
+				tiles[numberOfTiles++] = tile;
+				this->m_TileCache->Touch(tile);
+			}
+		}
+	}
+
+	return true;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+bool
+InterleavedDeformationBasis<TScalarType, TDimension>
+::IsInsideBuffer( const PointType & point ) const
+{
+	InterpolationCell cell;
+	return this->ComputeInterpolationCell(point, cell);
+}
+
+
+/*!
+ * One weighted dot product per corner over the contiguous block of that voxel.
+ */
+template < class TScalarType, unsigned int TDimension >
+bool
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateDisplacement( const PointType & point, const double * coefficients,
+	unsigned int numberOfModes, VectorType & displacement ) const
+{
+	InterpolationCell cell;
+	if (this->ComputeInterpolationCell(point, cell) == false) {
+		return false;
+	}
+
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template EvaluateDisplacementInternal<float>(cell, coefficients, numberOfModes, displacement);
+		break;
+	case Float16Storage:
+		this->template EvaluateDisplacementInternal<Float16StorageTag>(cell, coefficients, numberOfModes, displacement);
+		break;
+	case Int16Storage:
+		this->template EvaluateDisplacementInternal<Int16StorageTag>(cell, coefficients, numberOfModes, displacement);
+		break;
+	default:
+		this->template EvaluateDisplacementInternal<TScalarType>(cell, coefficients, numberOfModes, displacement);
+	}
+	return true;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateDisplacementInternal( const InterpolationCell & cell, const double * coefficients,
+	unsigned int numberOfModes, VectorType & displacement ) const
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	const StorageValueType * buffer = reinterpret_cast<const StorageValueType *>(this->m_Buffer->GetBufferPointer());
+	const double * scales = this->m_ComponentScales.data_block();
+	double value[TDimension];
+	for (unsigned int d = 0; d < TDimension; d++) {
+		value[d] = 0.0;
+	}
+
+	for (unsigned int c = 0; c < cell.NumberOfCorners; c++) {
+		const double weight = cell.Weights[c];
+		if (weight == 0.0) {
+			continue;
+		}
+
+		const StorageValueType * voxel = buffer + cell.Offsets[c];
+		double local[TDimension];
+		for (unsigned int d = 0; d < TDimension; d++) {
+			local[d] = StorageTraits::Decode(voxel[d]);
+			if (StorageTraits::IsQuantized) {
+				local[d] *= scales[0];
+			}
+		}
+
+		/** The scale of a quantized mode is folded into its coefficient. */
+		const StorageValueType * mode = voxel + TDimension;
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			const double coefficient = StorageTraits::IsQuantized ? coefficients[k] * scales[k + 1] : coefficients[k];
+			for (unsigned int d = 0; d < TDimension; d++) {
+				local[d] += coefficient * StorageTraits::Decode(mode[d]);
+			}
+			mode += TDimension;
+		}
+
+		for (unsigned int d = 0; d < TDimension; d++) {
+			value[d] += weight * local[d];
+		}
+	}
+
+	for (unsigned int d = 0; d < TDimension; d++) {
+		displacement[d] = value[d];
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+bool
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateBasis( const PointType & point, unsigned int numberOfModes,
+	JacobianType & jacobian ) const
+{
+	InterpolationCell cell;
+	if (this->ComputeInterpolationCell(point, cell) == false) {
+		return false;
+	}
+
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template EvaluateBasisInternal<float>(cell, numberOfModes, jacobian);
+		break;
+	case Float16Storage:
+		this->template EvaluateBasisInternal<Float16StorageTag>(cell, numberOfModes, jacobian);
+		break;
+	case Int16Storage:
+		this->template EvaluateBasisInternal<Int16StorageTag>(cell, numberOfModes, jacobian);
+		break;
+	default:
+		this->template EvaluateBasisInternal<TScalarType>(cell, numberOfModes, jacobian);
+	}
+	return true;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateBasisInternal( const InterpolationCell & cell, unsigned int numberOfModes,
+	JacobianType & jacobian ) const
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	for (unsigned int d = 0; d < TDimension; d++) {
+		double * row = jacobian[d];
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			row[k] = 0.0;
+		}
+	}
+
+	const StorageValueType * buffer = reinterpret_cast<const StorageValueType *>(this->m_Buffer->GetBufferPointer());
+	for (unsigned int c = 0; c < cell.NumberOfCorners; c++) {
+		const double weight = cell.Weights[c];
+		if (weight == 0.0) {
+			continue;
+		}
+
+		const StorageValueType * mode = buffer + cell.Offsets[c] + TDimension;
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			for (unsigned int d = 0; d < TDimension; d++) {
+				jacobian[d][k] += weight * StorageTraits::Decode(mode[d]);
+			}
+			mode += TDimension;
+		}
+	}
+
+	if (StorageTraits::IsQuantized) {
+		const double * scales = this->m_ComponentScales.data_block();
+		for (unsigned int d = 0; d < TDimension; d++) {
+			double * row = jacobian[d];
+			for (unsigned int k = 0; k < numberOfModes; k++) {
+				row[k] *= scales[k + 1];
+			}
+		}
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+bool
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateDisplacementAndBasis( const PointType & point, const double * coefficients,
+	unsigned int numberOfModes, VectorType & displacement, JacobianType & jacobian ) const
+{
+	InterpolationCell cell;
+	if (this->ComputeInterpolationCell(point, cell) == false) {
+		return false;
+	}
+
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template EvaluateDisplacementAndBasisInternal<float>(cell, coefficients, numberOfModes, displacement, jacobian);
+		break;
+	case Float16Storage:
+		this->template EvaluateDisplacementAndBasisInternal<Float16StorageTag>(cell, coefficients, numberOfModes, displacement, jacobian);
+		break;
+	case Int16Storage:
+		this->template EvaluateDisplacementAndBasisInternal<Int16StorageTag>(cell, coefficients, numberOfModes, displacement, jacobian);
+		break;
+	default:
+		this->template EvaluateDisplacementAndBasisInternal<TScalarType>(cell, coefficients, numberOfModes, displacement, jacobian);
+	}
+	return true;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateDisplacementAndBasisInternal( const InterpolationCell & cell, const double * coefficients,
+	unsigned int numberOfModes, VectorType & displacement, JacobianType & jacobian ) const
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	double value[TDimension];
+	for (unsigned int d = 0; d < TDimension; d++) {
+		value[d] = 0.0;
+		double * row = jacobian[d];
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			row[k] = 0.0;
+		}
+	}
+
+	const StorageValueType * buffer = reinterpret_cast<const StorageValueType *>(this->m_Buffer->GetBufferPointer());
+	for (unsigned int c = 0; c < cell.NumberOfCorners; c++) {
+		const double weight = cell.Weights[c];
+		if (weight == 0.0) {
+			continue;
+		}
+
+		const StorageValueType * voxel = buffer + cell.Offsets[c];
+		for (unsigned int d = 0; d < TDimension; d++) {
+			value[d] += weight * StorageTraits::Decode(voxel[d]);
+		}
+
+		const StorageValueType * mode = voxel + TDimension;
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			for (unsigned int d = 0; d < TDimension; d++) {
+				jacobian[d][k] += weight * StorageTraits::Decode(mode[d]);
+			}
+			mode += TDimension;
+		}
+	}
+
+	const double * scales = this->m_ComponentScales.data_block();
+	for (unsigned int d = 0; d < TDimension; d++) {
+		double * row = jacobian[d];
+		if (StorageTraits::IsQuantized) {
+			value[d] *= scales[0];
+			for (unsigned int k = 0; k < numberOfModes; k++) {
+				row[k] *= scales[k + 1];
+			}
+		}
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			value[d] += row[k] * coefficients[k];
+		}
+		displacement[d] = value[d];
+	}
+}
+
+
+/*!
+ * The block of a cell is that of its lower corner. Blocks are dilated by one voxel along each axis,
+ * so that they also cover the upper corners of their cells.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::BuildModeSupport( unsigned int blockSize, double tolerance, ModeSupportType & support ) const
+{
+	support = ModeSupportType();
+	if (blockSize == 0 || this->m_NumberOfModes == 0) {
+		return;
+	}
+
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template BuildModeSupportInternal<float>(blockSize, tolerance, support);
+		break;
+	case Float16Storage:
+		this->template BuildModeSupportInternal<Float16StorageTag>(blockSize, tolerance, support);
+		break;
+	case Int16Storage:
+		this->template BuildModeSupportInternal<Int16StorageTag>(blockSize, tolerance, support);
+		break;
+	default:
+		this->template BuildModeSupportInternal<TScalarType>(blockSize, tolerance, support);
+	}
+}
+
+
+/*!
+ * Two passes over the buffer: the largest magnitude of each mode, then the modes above the
+ * threshold at each voxel, which are added to every block that covers the voxel. The scale of
+ * a quantized mode is the same at all voxels, so the stored values are compared directly.
+ */
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::BuildModeSupportInternal( unsigned int blockSize, double tolerance, ModeSupportType & support ) const
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	const unsigned int numberOfModes = this->m_NumberOfModes;
+	const unsigned int words = (numberOfModes + 63) / 64;
+	const OffsetValueType width = (this->m_SplineOrder == 3) ? 4 : 2;
+	OffsetValueType numberOfBlocks[TDimension];
+	OffsetValueType blockStrides[TDimension];
+	SizeValueType totalBlocks = 1;
+	for (unsigned int i = 0; i < TDimension; i++) {
+		numberOfBlocks[i] = (static_cast<OffsetValueType>(this->m_Size[i]) + blockSize - 1) / blockSize;
+		blockStrides[i] = static_cast<OffsetValueType>(totalBlocks);
+		totalBlocks *= numberOfBlocks[i];
+	}
+
+	const StorageValueType * buffer = reinterpret_cast<const StorageValueType *>(this->m_Buffer->GetBufferPointer());
+	const SizeValueType numberOfVoxels = this->m_Size.GetNumberOfPixels();
+	std::vector<double> thresholds(numberOfModes, 0.0);
+	for (unsigned int pass = 0; pass < 2; pass++) {
+		std::vector<uint64_t> voxelSupport(words);
+		OffsetValueType index[TDimension];
+		for (unsigned int i = 0; i < TDimension; i++) {
+			index[i] = 0;
+		}
+		for (SizeValueType v = 0; v < numberOfVoxels; v++) {
+			OffsetValueType offset = 0;
+			for (unsigned int i = 0; i < TDimension; i++) {
+				offset += this->GetAxisOffset(i, index[i]);
+			}
+
+			const StorageValueType * mode = buffer + offset + TDimension;
+			bool supported = false;
+			std::fill(voxelSupport.begin(), voxelSupport.end(), 0);
+			for (unsigned int k = 0; k < numberOfModes; k++) {
+				double magnitude = 0.0;
+				for (unsigned int d = 0; d < TDimension; d++) {
+					magnitude = std::max(magnitude, std::abs(static_cast<double>(StorageTraits::Decode(mode[d]))));
+				}
+				mode += TDimension;
+				if (pass == 0) {
+					thresholds[k] = std::max(thresholds[k], magnitude);
+				}
+				else if (magnitude > thresholds[k]) {
+					voxelSupport[k / 64] |= static_cast<uint64_t>(1) << (k % 64);
+					supported = true;
+				}
+			}
+
+			/**
+			 * A voxel is a corner of the cells whose lower corner is up to width - 1 voxels below it,
+			 * so it is added to the blocks of those as well.
+			 */
+			if (supported) {
+				OffsetValueType lowerBlock[TDimension];
+				OffsetValueType upperBlock[TDimension];
+				OffsetValueType block[TDimension];
+				for (unsigned int i = 0; i < TDimension; i++) {
+					lowerBlock[i] = std::max<OffsetValueType>(index[i] - (width - 1), 0) / blockSize;
+					upperBlock[i] = index[i] / blockSize;
+					block[i] = lowerBlock[i];
+				}
+				bool more = true;
+				while (more) {
+					OffsetValueType blockIndex = 0;
+					for (unsigned int i = 0; i < TDimension; i++) {
+						blockIndex += block[i] * blockStrides[i];
+					}
+					uint64_t * blockSupport = &support.Blocks[blockIndex * words];
+					for (unsigned int w = 0; w < words; w++) {
+						blockSupport[w] |= voxelSupport[w];
+					}
+					more = false;
+					for (unsigned int i = 0; i < TDimension && !more; i++) {
+						more = (++block[i] <= upperBlock[i]);
+						if (!more) {
+							block[i] = lowerBlock[i];
+						}
+					}
+				}
+			}
+
+			for (unsigned int i = 0; i < TDimension; i++) {
+				if (++index[i] < static_cast<OffsetValueType>(this->m_Size[i])) {
+					break;
+				}
+				index[i] = 0;
+			}
+		}
+
+		if (pass == 0) {
+			for (unsigned int k = 0; k < numberOfModes; k++) {
+				thresholds[k] *= tolerance;
+			}
+			support.Blocks.assign(totalBlocks * words, 0);
+		}
+	}
+
+	/** Entry n is the largest number of supporting modes among the first n, over all blocks. */
+	support.MaximumCounts.assign(numberOfModes + 1, 0);
+	for (SizeValueType block = 0; block < totalBlocks; block++) {
+		const uint64_t * blockSupport = &support.Blocks[block * words];
+		unsigned int count = 0;
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			if ((blockSupport[k / 64] >> (k % 64)) & 1) {
+				count++;
+			}
+			support.MaximumCounts[k + 1] = std::max(support.MaximumCounts[k + 1], count);
+		}
+	}
+
+	for (unsigned int i = 0; i < TDimension; i++) {
+		support.BlockStrides[i] = blockStrides[i];
+	}
+	support.Words = words;
+	support.Tolerance = tolerance;
+	support.BlockSize = blockSize;
+}
+
+
+/*!
+ * At least one column, so that a point where no mode is supported still has a valid Jacobian.
+ */
+template < class TScalarType, unsigned int TDimension >
+unsigned int
+InterleavedDeformationBasis<TScalarType, TDimension>
+::GetMaximumNumberOfSupportingModes( const ModeSupportType & support, unsigned int numberOfModes )
+{
+	if (support.BlockSize == 0 || numberOfModes == 0 || numberOfModes >= support.MaximumCounts.size()) {
+		return numberOfModes;
+	}
+	return std::max(support.MaximumCounts[numberOfModes], 1u);
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+unsigned int
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ComputeSupportingModes( const ModeSupportType & support, const InterpolationCell & cell,
+	unsigned int numberOfModes, unsigned int numberOfColumns, ModeIndicesType & modes )
+{
+	if (modes.size() != numberOfColumns) {
+		modes.resize(numberOfColumns);
+	}
+	if (support.BlockSize == 0) {
+		for (unsigned int j = 0; j < numberOfColumns; j++) {
+			modes[j] = j;
+		}
+		return std::min(numberOfModes, numberOfColumns);
+	}
+
+	OffsetValueType block = 0;
+	for (unsigned int i = 0; i < TDimension; i++) {
+		block += (cell.LowerIndex[i] / support.BlockSize) * support.BlockStrides[i];
+	}
+	const uint64_t * blockSupport = &support.Blocks[block * support.Words];
+
+	unsigned int numberOfSupportingModes = 0;
+	for (unsigned int k = 0; k < numberOfModes && numberOfSupportingModes < numberOfColumns; k++) {
+		if ((blockSupport[k / 64] >> (k % 64)) & 1) {
+			modes[numberOfSupportingModes++] = k;
+		}
+	}
+
+	/** The remaining columns are filled with modes that are zero here, for a constant number of columns. */
+	unsigned int j = numberOfSupportingModes;
+	for (unsigned int k = 0; k < numberOfModes && j < numberOfColumns; k++) {
+		if (((blockSupport[k / 64] >> (k % 64)) & 1) == 0) {
+			modes[j++] = k;
+		}
+	}
+	for (; j < numberOfColumns; j++) {
+		modes[j] = j;
+	}
+	return numberOfSupportingModes;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+unsigned int
+InterleavedDeformationBasis<TScalarType, TDimension>
+::GetSupportingModes( const ModeSupportType & support, const PointType & point, unsigned int numberOfModes,
+	unsigned int numberOfColumns, ModeIndicesType & modes ) const
+{
+	InterpolationCell cell;
+	if (this->ComputeInterpolationCell(point, cell, false) == false) {
+		modes.resize(numberOfColumns);
+		for (unsigned int j = 0; j < numberOfColumns; j++) {
+			modes[j] = j;
+		}
+		return 0;
+	}
+	return ComputeSupportingModes(support, cell, numberOfModes, numberOfColumns, modes);
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+bool
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateSupportedDisplacementAndBasis( const ModeSupportType & support, const PointType & point,
+	const double * coefficients, unsigned int numberOfModes, unsigned int numberOfColumns, VectorType * displacement,
+	JacobianType & jacobian, ModeIndicesType & modes ) const
+{
+	InterpolationCell cell;
+	if (this->ComputeInterpolationCell(point, cell) == false) {
+		return false;
+	}
+
+	const unsigned int numberOfSupportingModes = ComputeSupportingModes(support, cell, numberOfModes, numberOfColumns, modes);
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template EvaluateSupportedDisplacementAndBasisInternal<float>(cell, coefficients, numberOfSupportingModes,
+			numberOfColumns, modes, displacement, jacobian);
+		break;
+	case Float16Storage:
+		this->template EvaluateSupportedDisplacementAndBasisInternal<Float16StorageTag>(cell, coefficients, numberOfSupportingModes,
+			numberOfColumns, modes, displacement, jacobian);
+		break;
+	case Int16Storage:
+		this->template EvaluateSupportedDisplacementAndBasisInternal<Int16StorageTag>(cell, coefficients, numberOfSupportingModes,
+			numberOfColumns, modes, displacement, jacobian);
+		break;
+	default:
+		this->template EvaluateSupportedDisplacementAndBasisInternal<TScalarType>(cell, coefficients, numberOfSupportingModes,
+			numberOfColumns, modes, displacement, jacobian);
+	}
+	return true;
+}
+
+
+/*!
+ * As EvaluateDisplacementAndBasisInternal, with a gather of the supporting modes of each corner.
+ */
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateSupportedDisplacementAndBasisInternal( const InterpolationCell & cell, const double * coefficients,
+	unsigned int numberOfSupportingModes, unsigned int numberOfColumns, const ModeIndicesType & modes,
+	VectorType * displacement, JacobianType & jacobian ) const
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	double value[TDimension];
+	for (unsigned int d = 0; d < TDimension; d++) {
+		value[d] = 0.0;
+		double * row = jacobian[d];
+		for (unsigned int j = 0; j < numberOfColumns; j++) {
+			row[j] = 0.0;
+		}
+	}
+
+	const StorageValueType * buffer = reinterpret_cast<const StorageValueType *>(this->m_Buffer->GetBufferPointer());
+	for (unsigned int c = 0; c < cell.NumberOfCorners; c++) {
+		const double weight = cell.Weights[c];
+		if (weight == 0.0) {
+			continue;
+		}
+
+		const StorageValueType * voxel = buffer + cell.Offsets[c];
+		for (unsigned int d = 0; d < TDimension; d++) {
+			value[d] += weight * StorageTraits::Decode(voxel[d]);
+		}
+
+		for (unsigned int j = 0; j < numberOfSupportingModes; j++) {
+			const StorageValueType * mode = voxel + (modes[j] + 1) * TDimension;
+			for (unsigned int d = 0; d < TDimension; d++) {
+				jacobian[d][j] += weight * StorageTraits::Decode(mode[d]);
+			}
+		}
+	}
+
+	const double * scales = this->m_ComponentScales.data_block();
+	for (unsigned int d = 0; d < TDimension; d++) {
+		double * row = jacobian[d];
+		if (StorageTraits::IsQuantized) {
+			value[d] *= scales[0];
+			for (unsigned int j = 0; j < numberOfSupportingModes; j++) {
+				row[j] *= scales[modes[j] + 1];
+			}
+		}
+		for (unsigned int j = 0; j < numberOfSupportingModes; j++) {
+			value[d] += row[j] * coefficients[modes[j]];
+		}
+		if (displacement) {
+			(*displacement)[d] = value[d];
+		}
+	}
+}
+
+
+/*!
+ * Find out how the grid of the field lies on the grid of the basis, and split its voxels over the
+ * threads. The tolerances allow for the rounding of spacings and origins in image headers.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateDisplacementField( const double * coefficients, unsigned int numberOfModes,
+	DeformationFieldType * field, ThreadIdType numberOfThreads ) const
+{
+	if (numberOfModes > this->m_NumberOfModes) {
+		itkExceptionMacro( << "The basis holds " << this->m_NumberOfModes << " modes, not " << numberOfModes << "." );
+	}
+
+	const typename DeformationFieldType::RegionType region = field->GetBufferedRegion();
+	DisplacementFieldThreadStruct str;
+	str.Basis = this;
+	str.Coefficients = coefficients;
+	str.NumberOfModes = numberOfModes;
+	str.Field = field;
+	str.Output = field->GetBufferPointer();
+	str.NumberOfVoxels = region.GetNumberOfPixels();
+	str.Subsampled = true;
+	for (unsigned int a = 0; a < TDimension; a++) {
+		str.SubsampleStart[a] = 0;
+		str.SubsampleFactors[a] = 0;
+	}
+
+	for (unsigned int i = 0; i < TDimension; i++) {
+		for (unsigned int j = 0; j < TDimension; j++) {
+			str.Subsampled &= std::abs(field->GetDirection()[i][j] - this->m_Direction[i][j]) < 1e-6;
+		}
+	}
+	/** The control points of a B-spline are not samples of the displacement. */
+	str.Subsampled &= (this->m_SplineOrder == 1);
+	PointType firstPoint;
+	field->TransformIndexToPhysicalPoint(region.GetIndex(), firstPoint);
+	for (unsigned int a = 0; a < TDimension && str.Subsampled; a++) {
+		const double ratio = field->GetSpacing()[a] / this->m_Spacing[a];
+		const OffsetValueType factor = Math::Round<OffsetValueType>(ratio);
+		double cindex = -static_cast<double>(this->m_StartIndex[a]);
+		for (unsigned int j = 0; j < TDimension; j++) {
+			cindex += this->m_PhysicalPointToIndex[a][j] * (firstPoint[j] - this->m_Origin[j]);
+		}
+		const OffsetValueType start = Math::Round<OffsetValueType>(cindex);
+		const OffsetValueType end = start + factor * (static_cast<OffsetValueType>(region.GetSize()[a]) - 1);
+		str.Subsampled = factor >= 1 && std::abs(ratio - factor) < 1e-6 * ratio && std::abs(cindex - start) < 1e-4
+			&& start >= 0 && end < static_cast<OffsetValueType>(this->m_Size[a]);
+		str.SubsampleStart[a] = start;
+		str.SubsampleFactors[a] = factor;
+	}
+
+	MultiThreader::Pointer threader = MultiThreader::New();
+	if (numberOfThreads > 0) {
+		threader->SetNumberOfThreads(numberOfThreads);
+	}
+
+	/**
+	 * Interpolating K + 1 components per corner costs more than combining them once per voxel. The
+	 * interpolation is linear in the components, so this holds for the control points of a B-spline too.
+	 */
+	Pointer collapsed;
+	if (!str.Subsampled && numberOfModes > 0
+		&& this->m_Size.GetNumberOfPixels() < str.NumberOfVoxels * this->GetNumberOfCellCorners()) {
+		collapsed = Self::New();
+		collapsed->m_ComponentsPerVoxel = TDimension;
+		collapsed->m_StartIndex = this->m_StartIndex;
+		collapsed->m_Size = this->m_Size;
+		collapsed->m_Spacing = this->m_Spacing;
+		collapsed->m_Origin = this->m_Origin;
+		collapsed->m_Direction = this->m_Direction;
+		collapsed->m_SplineOrder = this->m_SplineOrder;
+		for (unsigned int i = 0; i < TDimension; i++) {
+			collapsed->m_DomainLower[i] = this->m_DomainLower[i];
+			collapsed->m_DomainUpper[i] = this->m_DomainUpper[i];
+		}
+		collapsed->UpdateGeometry();
+		collapsed->m_Buffer->Reserve(this->m_Size.GetNumberOfPixels() * TDimension * sizeof(TScalarType));
+
+		DisplacementFieldThreadStruct collapseStr = str;
+		collapseStr.Field = 0;
+		collapseStr.Output = reinterpret_cast<VectorType *>(collapsed->m_Buffer->GetBufferPointer());
+		collapseStr.NumberOfVoxels = this->m_Size.GetNumberOfPixels();
+		threader->SetSingleMethod(Self::EvaluateDisplacementFieldThreaderCallback, &collapseStr);
+		threader->SingleMethodExecute();
+
+		str.Basis = collapsed;
+		str.Coefficients = 0;
+		str.NumberOfModes = 0;
+	}
+
+	threader->SetSingleMethod(Self::EvaluateDisplacementFieldThreaderCallback, &str);
+	threader->SingleMethodExecute();
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+ITK_THREAD_RETURN_TYPE
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateDisplacementFieldThreaderCallback( void * arg )
+{
+	const MultiThreader::ThreadInfoStruct * info = static_cast<MultiThreader::ThreadInfoStruct *>(arg);
+	const DisplacementFieldThreadStruct * str = static_cast<DisplacementFieldThreadStruct *>(info->UserData);
+
+	const SizeValueType first = str->NumberOfVoxels * info->ThreadID / info->NumberOfThreads;
+	const SizeValueType last = str->NumberOfVoxels * (info->ThreadID + 1) / info->NumberOfThreads;
+	if (first < last) {
+		str->Basis->EvaluateDisplacementFieldRange(*str, first, last);
+	}
+
+	return ITK_THREAD_RETURN_VALUE;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateDisplacementFieldRange( const DisplacementFieldThreadStruct & str,
+	SizeValueType first, SizeValueType last ) const
+{
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template EvaluateDisplacementFieldRangeInternal<float>(str, first, last);
+		break;
+	case Float16Storage:
+		this->template EvaluateDisplacementFieldRangeInternal<Float16StorageTag>(str, first, last);
+		break;
+	case Int16Storage:
+		this->template EvaluateDisplacementFieldRangeInternal<Int16StorageTag>(str, first, last);
+		break;
+	default:
+		this->template EvaluateDisplacementFieldRangeInternal<TScalarType>(str, first, last);
+	}
+}
+
+
+/*!
+ * A voxel of the basis is a cell with a single corner of weight 1, so the modes are combined by
+ * the same code as for an interpolated point. Along a scanline of the field the index of the
+ * voxel, or the physical point, advances by a constant step.
+ */
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateDisplacementFieldRangeInternal( const DisplacementFieldThreadStruct & str,
+	SizeValueType first, SizeValueType last ) const
+{
+	InterpolationCell voxelCell;
+	voxelCell.NumberOfCorners = 1;
+	voxelCell.Offsets[0] = 0;
+	voxelCell.Weights[0] = 1.0;
+
+	/** The tile of the previous voxel, to record each run of voxels in a tile once. */
+	OffsetValueType tile = -1;
+
+	if (str.Field == 0) {
+		for (SizeValueType v = first; v < last; v++) {
+			SizeValueType remainder = v;
+			OffsetValueType offset = 0;
+			for (unsigned int a = 0; a < TDimension; a++) {
+				offset += this->GetAxisOffset(a, static_cast<OffsetValueType>(remainder % this->m_Size[a]));
+				remainder /= this->m_Size[a];
+			}
+			if (this->m_TileStride > 0 && offset / static_cast<OffsetValueType>(this->m_TileStride) != tile) {
+				tile = offset / static_cast<OffsetValueType>(this->m_TileStride);
+				this->TouchTile(offset);
+			}
+			voxelCell.Offsets[0] = offset;
+			this->template EvaluateDisplacementInternal<TStorage>(voxelCell, str.Coefficients, str.NumberOfModes, str.Output[v]);
+		}
+		return;
+	}
+
+	const typename DeformationFieldType::RegionType region = str.Field->GetBufferedRegion();
+	const SizeType & size = region.GetSize();
+	OffsetValueType position[TDimension];
+	SizeValueType remainder = first;
+	for (unsigned int a = 0; a < TDimension; a++) {
+		position[a] = remainder % size[a];
+		remainder /= size[a];
+	}
+
+	InternalMatrixType indexToPhysicalPoint;
+	for (unsigned int i = 0; i < TDimension; i++) {
+		for (unsigned int j = 0; j < TDimension; j++) {
+			indexToPhysicalPoint[i][j] = str.Field->GetDirection()[i][j] * str.Field->GetSpacing()[j];
+		}
+	}
+
+	for (SizeValueType v = first; v < last; ) {
+		OffsetValueType scanlineOffset = 0;
+		OffsetValueType voxel = str.SubsampleStart[0] + position[0] * str.SubsampleFactors[0];
+		PointType point;
+		for (unsigned int i = 0; i < TDimension; i++) {
+			if (i > 0) {
+				scanlineOffset += this->GetAxisOffset(i, str.SubsampleStart[i] + position[i] * str.SubsampleFactors[i]);
+			}
+			point[i] = str.Field->GetOrigin()[i];
+			for (unsigned int j = 0; j < TDimension; j++) {
+				point[i] += indexToPhysicalPoint[i][j] * (region.GetIndex()[j] + position[j]);
+			}
+		}
+
+		const SizeValueType scanlineEnd = std::min<SizeValueType>(last, v + size[0] - position[0]);
+		for (; v < scanlineEnd; v++) {
+			if (str.Subsampled) {
+				const OffsetValueType offset = scanlineOffset + this->GetAxisOffset(0, voxel);
+				if (this->m_TileStride > 0 && offset / static_cast<OffsetValueType>(this->m_TileStride) != tile) {
+					tile = offset / static_cast<OffsetValueType>(this->m_TileStride);
+					this->TouchTile(offset);
+				}
+				voxelCell.Offsets[0] = offset;
+				this->template EvaluateDisplacementInternal<TStorage>(voxelCell, str.Coefficients, str.NumberOfModes, str.Output[v]);
+				voxel += str.SubsampleFactors[0];
+			}
+			else {
+				InterpolationCell cell;
+				if (this->ComputeInterpolationCell(point, cell)) {
+					this->template EvaluateDisplacementInternal<TStorage>(cell, str.Coefficients, str.NumberOfModes, str.Output[v]);
+				}
+				else {
+					str.Output[v].Fill(0.0);
+				}
+				for (unsigned int i = 0; i < TDimension; i++) {
+					point[i] += indexToPhysicalPoint[i][0];
+				}
+			}
+		}
+
+		position[0] = 0;
+		for (unsigned int a = 1; a < TDimension; a++) {
+			if (++position[a] < static_cast<OffsetValueType>(size[a])) {
+				break;
+			}
+			position[a] = 0;
+		}
+	}
+}
+
+
+/*!
+ * Points outside the buffer sort first and are skipped by the threads.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluatePoints( SizeValueType numberOfPoints, const TScalarType * const * coordinates,
+	const double * coefficients, unsigned int numberOfModes,
+	TScalarType * const * displacements, double * jacobians, ThreadIdType numberOfThreads ) const
+{
+	if (numberOfModes > this->m_NumberOfModes) {
+		itkExceptionMacro( << "The basis holds " << this->m_NumberOfModes << " modes, not " << numberOfModes << "." );
+	}
+
+	std::vector< std::pair<OffsetValueType, SizeValueType> > order(numberOfPoints);
+	PointBatchThreadStruct str;
+	str.Basis = this;
+	str.NumberOfPoints = numberOfPoints;
+	str.Coordinates = coordinates;
+	str.Coefficients = coefficients;
+	str.NumberOfModes = numberOfModes;
+	str.Displacements = displacements;
+	str.Jacobians = jacobians;
+	str.Order = &order;
+	str.ComputeKeys = true;
+
+	MultiThreader::Pointer threader = MultiThreader::New();
+	if (numberOfThreads > 0) {
+		threader->SetNumberOfThreads(numberOfThreads);
+	}
+	threader->SetSingleMethod(Self::EvaluatePointsThreaderCallback, &str);
+	threader->SingleMethodExecute();
+
+	std::sort(order.begin(), order.end());
+
+	str.ComputeKeys = false;
+	threader->SingleMethodExecute();
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+ITK_THREAD_RETURN_TYPE
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluatePointsThreaderCallback( void * arg )
+{
+	const MultiThreader::ThreadInfoStruct * info = static_cast<MultiThreader::ThreadInfoStruct *>(arg);
+	const PointBatchThreadStruct * str = static_cast<PointBatchThreadStruct *>(info->UserData);
+	const Self * basis = str->Basis;
+
+	const SizeValueType first = str->NumberOfPoints * info->ThreadID / info->NumberOfThreads;
+	const SizeValueType last = str->NumberOfPoints * (info->ThreadID + 1) / info->NumberOfThreads;
+	if (first >= last) {
+		return ITK_THREAD_RETURN_VALUE;
+	}
+
+	switch (basis->m_StorageType) {
+	case Float32Storage:
+		basis->template EvaluatePointsRangeInternal<float>(*str, first, last);
+		break;
+	case Float16Storage:
+		basis->template EvaluatePointsRangeInternal<Float16StorageTag>(*str, first, last);
+		break;
+	case Int16Storage:
+		basis->template EvaluatePointsRangeInternal<Int16StorageTag>(*str, first, last);
+		break;
+	default:
+		basis->template EvaluatePointsRangeInternal<TScalarType>(*str, first, last);
+	}
+
+	return ITK_THREAD_RETURN_VALUE;
+}
+
+
+/*!
+ * The basis matrix is interpolated into a Jacobian of the thread and copied to the output, which
+ * the single point methods would have to do as well.
+ */
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluatePointsRangeInternal( const PointBatchThreadStruct & str,
+	SizeValueType first, SizeValueType last ) const
+{
+	std::vector< std::pair<OffsetValueType, SizeValueType> > & order = *str.Order;
+	const SizeValueType jacobianSize = TDimension * str.NumberOfModes;
+	InterpolationCell cell;
+
+	if (str.ComputeKeys) {
+		for (SizeValueType p = first; p < last; p++) {
+			PointType point;
+			for (unsigned int i = 0; i < TDimension; i++) {
+				point[i] = str.Coordinates[i][p];
+			}
+			order[p].first = this->ComputeInterpolationCell(point, cell, false) ? cell.Offsets[0] : -1;
+			order[p].second = p;
+		}
+		return;
+	}
+
+	JacobianType jacobian(TDimension, str.NumberOfModes);
+	for (SizeValueType n = first; n < last; n++) {
+		const SizeValueType p = order[n].second;
+		VectorType displacement;
+		displacement.Fill(0.0);
+
+		PointType point;
+		for (unsigned int i = 0; i < TDimension; i++) {
+			point[i] = str.Coordinates[i][p];
+		}
+		if (order[n].first < 0 || this->ComputeInterpolationCell(point, cell) == false) {
+			if (str.Jacobians != 0) {
+				std::fill(str.Jacobians + p * jacobianSize, str.Jacobians + (p + 1) * jacobianSize, 0.0);
+			}
+		}
+		else if (str.Jacobians != 0) {
+			this->template EvaluateDisplacementAndBasisInternal<TStorage>(cell, str.Coefficients, str.NumberOfModes, displacement, jacobian);
+			std::copy(jacobian.data_block(), jacobian.data_block() + jacobianSize, str.Jacobians + p * jacobianSize);
+		}
+		else {
+			this->template EvaluateDisplacementInternal<TStorage>(cell, str.Coefficients, str.NumberOfModes, displacement);
+		}
+
+		for (unsigned int i = 0; i < TDimension; i++) {
+			str.Displacements[i][p] = displacement[i];
+		}
+	}
+}
+
+
+/*!
+ * The weight of a corner is a product of one factor per axis, so its derivative along an axis
+ * replaces that factor by its derivative. The index derivatives are mapped to physical ones
+ * through m_PhysicalPointToIndex.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ComputeWeightDerivatives( const InterpolationCell & cell, double derivatives[][ TDimension ] ) const
+{
+	const unsigned int mask = cell.Width - 1;
+	for (unsigned int c = 0; c < cell.NumberOfCorners; c++) {
+		unsigned int corner[TDimension];
+		for (unsigned int a = 0; a < TDimension; a++) {
+			corner[a] = (c >> (cell.AxisShift * a)) & mask;
+		}
+
+		double indexDerivative[TDimension];
+		for (unsigned int a = 0; a < TDimension; a++) {
+			double value = 1.0;
+			for (unsigned int b = 0; b < TDimension; b++) {
+				value *= (b == a) ? cell.AxisDerivatives[b][corner[b]] : cell.AxisWeights[b][corner[b]];
+			}
+			indexDerivative[a] = value;
+		}
+
+		for (unsigned int j = 0; j < TDimension; j++) {
+			double value = 0.0;
+			for (unsigned int a = 0; a < TDimension; a++) {
+				value += indexDerivative[a] * this->m_PhysicalPointToIndex[a][j];
+			}
+			derivatives[c][j] = value;
+		}
+	}
+}
+
+
+/*!
+ * The second derivative along one axis is zero for the linear factors, but not for the B-spline ones.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ComputeWeightSecondDerivatives( const InterpolationCell & cell,
+	double derivatives[][ TDimension ][ TDimension ] ) const
+{
+	const unsigned int mask = cell.Width - 1;
+	for (unsigned int c = 0; c < cell.NumberOfCorners; c++) {
+		unsigned int corner[TDimension];
+		for (unsigned int a = 0; a < TDimension; a++) {
+			corner[a] = (c >> (cell.AxisShift * a)) & mask;
+		}
+
+		double indexDerivative[TDimension][TDimension];
+		for (unsigned int a = 0; a < TDimension; a++) {
+			for (unsigned int b = a; b < TDimension; b++) {
+				double value = 1.0;
+				for (unsigned int e = 0; e < TDimension; e++) {
+					if (e == a && e == b) {
+						value *= cell.AxisSecondDerivatives[e][corner[e]];
+					}
+					else if (e == a || e == b) {
+						value *= cell.AxisDerivatives[e][corner[e]];
+					}
+					else {
+						value *= cell.AxisWeights[e][corner[e]];
+					}
+				}
+				indexDerivative[a][b] = value;
+				indexDerivative[b][a] = value;
+			}
+		}
+
+		for (unsigned int j = 0; j < TDimension; j++) {
+			for (unsigned int l = 0; l < TDimension; l++) {
+				double value = 0.0;
+				for (unsigned int a = 0; a < TDimension; a++) {
+					for (unsigned int b = 0; b < TDimension; b++) {
+						value += indexDerivative[a][b] * this->m_PhysicalPointToIndex[a][j] * this->m_PhysicalPointToIndex[b][l];
+					}
+				}
+				derivatives[c][j][l] = value;
+			}
+		}
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+bool
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateSpatialJacobian( const PointType & point, const double * coefficients,
+	unsigned int numberOfModes, SpatialJacobianType & gradient,
+	JacobianOfSpatialJacobianType * modeGradients ) const
+{
+	InterpolationCell cell;
+	if (this->ComputeInterpolationCell(point, cell) == false) {
+		return false;
+	}
+
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template EvaluateSpatialJacobianInternal<float>(cell, coefficients, numberOfModes, gradient, modeGradients);
+		break;
+	case Float16Storage:
+		this->template EvaluateSpatialJacobianInternal<Float16StorageTag>(cell, coefficients, numberOfModes, gradient, modeGradients);
+		break;
+	case Int16Storage:
+		this->template EvaluateSpatialJacobianInternal<Int16StorageTag>(cell, coefficients, numberOfModes, gradient, modeGradients);
+		break;
+	default:
+		this->template EvaluateSpatialJacobianInternal<TScalarType>(cell, coefficients, numberOfModes, gradient, modeGradients);
+	}
+	return true;
+}
+
+
+/*!
+ * Same pass over the corners as EvaluateDisplacementInternal, with the weights replaced by their
+ * derivatives. A corner with a zero weight can still have a non-zero derivative.
+ */
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateSpatialJacobianInternal( const InterpolationCell & cell, const double * coefficients,
+	unsigned int numberOfModes, SpatialJacobianType & gradient,
+	JacobianOfSpatialJacobianType * modeGradients ) const
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	double weightDerivatives[MaximumNumberOfCorners][TDimension];
+	this->ComputeWeightDerivatives(cell, weightDerivatives);
+
+	double value[TDimension][TDimension];
+	for (unsigned int d = 0; d < TDimension; d++) {
+		for (unsigned int j = 0; j < TDimension; j++) {
+			value[d][j] = 0.0;
+		}
+	}
+	if (modeGradients) {
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			(*modeGradients)[k].Fill(0.0);
+		}
+	}
+
+	const StorageValueType * buffer = reinterpret_cast<const StorageValueType *>(this->m_Buffer->GetBufferPointer());
+	const double * scales = this->m_ComponentScales.data_block();
+	for (unsigned int c = 0; c < cell.NumberOfCorners; c++) {
+		const double * weight = weightDerivatives[c];
+
+		const StorageValueType * voxel = buffer + cell.Offsets[c];
+		double local[TDimension];
+		for (unsigned int d = 0; d < TDimension; d++) {
+			local[d] = StorageTraits::Decode(voxel[d]);
+			if (StorageTraits::IsQuantized) {
+				local[d] *= scales[0];
+			}
+		}
+
+		const StorageValueType * mode = voxel + TDimension;
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			const double scale = StorageTraits::IsQuantized ? scales[k + 1] : 1.0;
+			for (unsigned int d = 0; d < TDimension; d++) {
+				const double component = scale * StorageTraits::Decode(mode[d]);
+				local[d] += coefficients[k] * component;
+				if (modeGradients) {
+					SpatialJacobianType & modeGradient = (*modeGradients)[k];
+					for (unsigned int j = 0; j < TDimension; j++) {
+						modeGradient[d][j] += weight[j] * component;
+					}
+				}
+			}
+			mode += TDimension;
+		}
+
+		for (unsigned int d = 0; d < TDimension; d++) {
+			for (unsigned int j = 0; j < TDimension; j++) {
+				value[d][j] += weight[j] * local[d];
+			}
+		}
+	}
+
+	for (unsigned int d = 0; d < TDimension; d++) {
+		for (unsigned int j = 0; j < TDimension; j++) {
+			gradient[d][j] = value[d][j];
+		}
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+bool
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateSpatialHessian( const PointType & point, const double * coefficients,
+	unsigned int numberOfModes, SpatialHessianType & hessian,
+	JacobianOfSpatialHessianType * modeHessians ) const
+{
+	InterpolationCell cell;
+	if (this->ComputeInterpolationCell(point, cell) == false) {
+		return false;
+	}
+
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template EvaluateSpatialHessianInternal<float>(cell, coefficients, numberOfModes, hessian, modeHessians);
+		break;
+	case Float16Storage:
+		this->template EvaluateSpatialHessianInternal<Float16StorageTag>(cell, coefficients, numberOfModes, hessian, modeHessians);
+		break;
+	case Int16Storage:
+		this->template EvaluateSpatialHessianInternal<Int16StorageTag>(cell, coefficients, numberOfModes, hessian, modeHessians);
+		break;
+	default:
+		this->template EvaluateSpatialHessianInternal<TScalarType>(cell, coefficients, numberOfModes, hessian, modeHessians);
+	}
+	return true;
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::EvaluateSpatialHessianInternal( const InterpolationCell & cell, const double * coefficients,
+	unsigned int numberOfModes, SpatialHessianType & hessian,
+	JacobianOfSpatialHessianType * modeHessians ) const
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	double weightDerivatives[MaximumNumberOfCorners][TDimension][TDimension];
+	this->ComputeWeightSecondDerivatives(cell, weightDerivatives);
+
+	double value[TDimension][TDimension][TDimension];
+	for (unsigned int d = 0; d < TDimension; d++) {
+		for (unsigned int j = 0; j < TDimension; j++) {
+			for (unsigned int l = 0; l < TDimension; l++) {
+				value[d][j][l] = 0.0;
+			}
+		}
+	}
+	if (modeHessians) {
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			for (unsigned int d = 0; d < TDimension; d++) {
+				(*modeHessians)[k][d].Fill(0.0);
+			}
+		}
+	}
+
+	const StorageValueType * buffer = reinterpret_cast<const StorageValueType *>(this->m_Buffer->GetBufferPointer());
+	const double * scales = this->m_ComponentScales.data_block();
+	for (unsigned int c = 0; c < cell.NumberOfCorners; c++) {
+		const StorageValueType * voxel = buffer + cell.Offsets[c];
+		double local[TDimension];
+		for (unsigned int d = 0; d < TDimension; d++) {
+			local[d] = StorageTraits::Decode(voxel[d]);
+			if (StorageTraits::IsQuantized) {
+				local[d] *= scales[0];
+			}
+		}
+
+		const StorageValueType * mode = voxel + TDimension;
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			const double scale = StorageTraits::IsQuantized ? scales[k + 1] : 1.0;
+			for (unsigned int d = 0; d < TDimension; d++) {
+				const double component = scale * StorageTraits::Decode(mode[d]);
+				local[d] += coefficients[k] * component;
+				if (modeHessians) {
+					SpatialJacobianType & modeHessian = (*modeHessians)[k][d];
+					for (unsigned int j = 0; j < TDimension; j++) {
+						for (unsigned int l = 0; l < TDimension; l++) {
+							modeHessian[j][l] += weightDerivatives[c][j][l] * component;
+						}
+					}
+				}
+			}
+			mode += TDimension;
+		}
+
+		for (unsigned int d = 0; d < TDimension; d++) {
+			for (unsigned int j = 0; j < TDimension; j++) {
+				for (unsigned int l = 0; l < TDimension; l++) {
+					value[d][j][l] += weightDerivatives[c][j][l] * local[d];
+				}
+			}
+		}
+	}
+
+	for (unsigned int d = 0; d < TDimension; d++) {
+		for (unsigned int j = 0; j < TDimension; j++) {
+			for (unsigned int l = 0; l < TDimension; l++) {
+				hessian[d][j][l] = value[d][j][l];
+			}
+		}
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ComputeBendingEnergyForm( unsigned int numberOfModes, QuadraticFormType & form ) const
+{
+	if (numberOfModes > this->m_NumberOfModes) {
+		itkExceptionMacro( << "The basis holds " << this->m_NumberOfModes << " modes, not " << numberOfModes << "." );
+	}
+
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template ComputeBendingEnergyFormInternal<float>(numberOfModes, form);
+		break;
+	case Float16Storage:
+		this->template ComputeBendingEnergyFormInternal<Float16StorageTag>(numberOfModes, form);
+		break;
+	case Int16Storage:
+		this->template ComputeBendingEnergyFormInternal<Int16StorageTag>(numberOfModes, form);
+		break;
+	default:
+		this->template ComputeBendingEnergyFormInternal<TScalarType>(numberOfModes, form);
+	}
+}
+
+
+/*!
+ * Per voxel, the second differences of all components are mapped to physical coordinates and
+ * collected in one row per component, after which the form receives the products of all rows.
+ * The Hessians are symmetric, so only the entries (j, l) with j <= l are stored; those with
+ * j < l appear twice in the sum and are weighted by sqrt(2).
+ */
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ComputeBendingEnergyFormInternal( unsigned int numberOfModes, QuadraticFormType & form ) const
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	const unsigned int numberOfComponents = numberOfModes + 1;
+	const unsigned int numberOfPairs = TDimension * (TDimension + 1) / 2;
+	const unsigned int rowLength = TDimension * numberOfPairs;
+
+	form.SetSize(numberOfComponents, numberOfComponents);
+	form.Fill(0.0);
+	for (unsigned int i = 0; i < TDimension; i++) {
+		if (this->m_Size[i] < 3) {
+			return;
+		}
+	}
+
+	/** Stencils of the second differences in index space, as steps along the axes a and b, and their mapping to physical space. */
+	std::vector<OffsetValueType> stencilSteps;
+	std::vector<unsigned int>    stencilAxes;
+	std::vector<double>          stencilWeights;
+	std::vector<unsigned int>    stencilPairs;
+	std::vector<double>          toPhysical(numberOfPairs * numberOfPairs);
+	unsigned int pair = 0;
+	for (unsigned int a = 0; a < TDimension; a++) {
+		for (unsigned int b = a; b < TDimension; b++, pair++) {
+			if (a == b) {
+				const OffsetValueType steps[3] = { 1, 0, -1 };
+				const double weights[3] = { 1.0, -2.0, 1.0 };
+				for (unsigned int s = 0; s < 3; s++) {
+					stencilAxes.push_back(a);
+					stencilAxes.push_back(b);
+					stencilSteps.push_back(steps[s]);
+					stencilSteps.push_back(0);
+					stencilWeights.push_back(weights[s]);
+					stencilPairs.push_back(pair);
+				}
+			}
+			else {
+				const OffsetValueType stepsA[4] = { 1, 1, -1, -1 };
+				const OffsetValueType stepsB[4] = { 1, -1, 1, -1 };
+				const double weights[4] = { 0.25, -0.25, -0.25, 0.25 };
+				for (unsigned int s = 0; s < 4; s++) {
+					stencilAxes.push_back(a);
+					stencilAxes.push_back(b);
+					stencilSteps.push_back(stepsA[s]);
+					stencilSteps.push_back(stepsB[s]);
+					stencilWeights.push_back(weights[s]);
+					stencilPairs.push_back(pair);
+				}
+			}
+
+			unsigned int entry = 0;
+			for (unsigned int j = 0; j < TDimension; j++) {
+				for (unsigned int l = j; l < TDimension; l++, entry++) {
+					double value = this->m_PhysicalPointToIndex[a][j] * this->m_PhysicalPointToIndex[b][l];
+					if (a != b) {
+						value += this->m_PhysicalPointToIndex[b][j] * this->m_PhysicalPointToIndex[a][l];
+					}
+					if (j != l) {
+						value *= std::sqrt(2.0);
+					}
+					toPhysical[entry * numberOfPairs + pair] = value;
+				}
+			}
+		}
+	}
+
+	const StorageValueType * buffer = reinterpret_cast<const StorageValueType *>(this->m_Buffer->GetBufferPointer());
+	const double * scales = this->m_ComponentScales.data_block();
+	std::vector<double> indexHessians(numberOfComponents * TDimension * numberOfPairs);
+	std::vector<double> rows(numberOfComponents * rowLength);
+	SizeValueType numberOfVoxels = 0;
+
+	OffsetValueType index[TDimension];
+	for (unsigned int i = 0; i < TDimension; i++) {
+		index[i] = 1;
+	}
+	for (;;) {
+		/** In a tiled buffer a step along an axis may cross into another tile, so the offsets are per axis. */
+		OffsetValueType voxel = 0;
+		for (unsigned int i = 0; i < TDimension; i++) {
+			voxel += this->GetAxisOffset(i, index[i]);
+		}
+
+		std::fill(indexHessians.begin(), indexHessians.end(), 0.0);
+		for (unsigned int s = 0; s < stencilWeights.size(); s++) {
+			const double weight = stencilWeights[s];
+			OffsetValueType offset = voxel;
+			for (unsigned int t = 2 * s; t < 2 * s + 2; t++) {
+				const unsigned int axis = stencilAxes[t];
+				offset += this->GetAxisOffset(axis, index[axis] + stencilSteps[t]) - this->GetAxisOffset(axis, index[axis]);
+			}
+			const StorageValueType * values = buffer + offset;
+			double * hessian = &indexHessians[stencilPairs[s]];
+			for (unsigned int k = 0; k < numberOfComponents; k++) {
+				const double scale = StorageTraits::IsQuantized ? weight * scales[k] : weight;
+				for (unsigned int d = 0; d < TDimension; d++) {
+					*hessian += scale * StorageTraits::Decode(values[d]);
+					hessian += numberOfPairs;
+				}
+				values += TDimension;
+			}
+		}
+
+		for (unsigned int r = 0; r < numberOfComponents * TDimension; r++) {
+			const double * hessian = &indexHessians[r * numberOfPairs];
+			double * row = &rows[r * numberOfPairs];
+			for (unsigned int e = 0; e < numberOfPairs; e++) {
+				double value = 0.0;
+				for (unsigned int p = 0; p < numberOfPairs; p++) {
+					value += toPhysical[e * numberOfPairs + p] * hessian[p];
+				}
+				row[e] = value;
+			}
+		}
+
+		for (unsigned int i = 0; i < numberOfComponents; i++) {
+			const double * rowI = &rows[i * rowLength];
+			for (unsigned int j = i; j < numberOfComponents; j++) {
+				const double * rowJ = &rows[j * rowLength];
+				double value = 0.0;
+				for (unsigned int e = 0; e < rowLength; e++) {
+					value += rowI[e] * rowJ[e];
+				}
+				form[i][j] += value;
+			}
+		}
+		numberOfVoxels++;
+
+		unsigned int axis = 0;
+		while (axis < TDimension && ++index[axis] == static_cast<OffsetValueType>(this->m_Size[axis]) - 1) {
+			index[axis] = 1;
+			axis++;
+		}
+		if (axis == TDimension) {
+			break;
+		}
+	}
+
+	for (unsigned int i = 0; i < numberOfComponents; i++) {
+		for (unsigned int j = i; j < numberOfComponents; j++) {
+			form[i][j] /= static_cast<double>(numberOfVoxels);
+			form[j][i] = form[i][j];
+		}
+	}
+}
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ComputeModeNorms( unsigned int numberOfModes, const double * weights,
+	VarianceVectorType & meanSquaredNorms, double & maximumSquaredNorm ) const
+{
+	if (numberOfModes > this->m_NumberOfModes) {
+		itkExceptionMacro( << "The basis holds " << this->m_NumberOfModes << " modes, not " << numberOfModes << "." );
+	}
+
+	switch (this->m_StorageType) {
+	case Float32Storage:
+		this->template ComputeModeNormsInternal<float>(numberOfModes, weights, meanSquaredNorms, maximumSquaredNorm);
+		break;
+	case Float16Storage:
+		this->template ComputeModeNormsInternal<Float16StorageTag>(numberOfModes, weights, meanSquaredNorms, maximumSquaredNorm);
+		break;
+	case Int16Storage:
+		this->template ComputeModeNormsInternal<Int16StorageTag>(numberOfModes, weights, meanSquaredNorms, maximumSquaredNorm);
+		break;
+	default:
+		this->template ComputeModeNormsInternal<TScalarType>(numberOfModes, weights, meanSquaredNorms, maximumSquaredNorm);
+	}
+}
+
+
+/*!
+ * One pass over the voxels, in which the stored values are squared before the scales of
+ * quantized modes are applied, once per mode.
+ */
+template < class TScalarType, unsigned int TDimension >
+template < class TStorage >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ComputeModeNormsInternal( unsigned int numberOfModes, const double * weights,
+	VarianceVectorType & meanSquaredNorms, double & maximumSquaredNorm ) const
+{
+	typedef DeformationBasisStorageTraits<TStorage> StorageTraits;
+	typedef typename StorageTraits::ValueType       StorageValueType;
+
+	std::vector<double> factors(numberOfModes);
+	for (unsigned int k = 0; k < numberOfModes; k++) {
+		const double scale = StorageTraits::IsQuantized ? this->m_ComponentScales[k + 1] : 1.0;
+		const double weight = (weights != 0) ? weights[k] : 1.0;
+		factors[k] = scale * scale * weight * weight;
+	}
+
+	std::vector<double> sums(numberOfModes, 0.0);
+	maximumSquaredNorm = 0.0;
+	const SizeValueType numberOfVoxels = this->m_Size.GetNumberOfPixels();
+	const StorageValueType * buffer = reinterpret_cast<const StorageValueType *>(this->m_Buffer->GetBufferPointer());
+	OffsetValueType index[TDimension];
+	for (unsigned int i = 0; i < TDimension; i++) {
+		index[i] = 0;
+	}
+	for (SizeValueType v = 0; v < numberOfVoxels; v++) {
+		OffsetValueType offset = 0;
+		for (unsigned int i = 0; i < TDimension; i++) {
+			offset += this->GetAxisOffset(i, index[i]);
+		}
+		const StorageValueType * mode = buffer + offset + TDimension;
+		double norm = 0.0;
+		for (unsigned int k = 0; k < numberOfModes; k++) {
+			double squaredNorm = 0.0;
+			for (unsigned int d = 0; d < TDimension; d++) {
+				const double value = StorageTraits::Decode(mode[d]);
+				squaredNorm += value * value;
+			}
+			sums[k] += squaredNorm;
+			norm += factors[k] * squaredNorm;
+			mode += TDimension;
+		}
+		maximumSquaredNorm = std::max(maximumSquaredNorm, norm);
+
+		for (unsigned int i = 0; i < TDimension && ++index[i] == static_cast<OffsetValueType>(this->m_Size[i]); i++) {
+			index[i] = 0;
+		}
+	}
+
+	meanSquaredNorms.SetSize(numberOfModes);
+	for (unsigned int k = 0; k < numberOfModes; k++) {
+		const double scale = StorageTraits::IsQuantized ? this->m_ComponentScales[k + 1] : 1.0;
+		meanSquaredNorms[k] = (numberOfVoxels > 0) ? scale * scale * sums[k] / numberOfVoxels : 0.0;
+	}
+}
+
+
+/*!
+ * Fixed part of the header of a basis file. It is followed by the start index, size, spacing,
+ * origin and direction of the grid, the mode variances, the component scales, from version 3 on
+ * the tiling block, from version 4 on the spline block with the domain and the approximation
+ * errors, and, at DataOffset, the buffer. ScalarSize is the size of one stored value.
+ */
+struct InterleavedDeformationBasisFileHeader
+{
+	char     Magic[8];
+	uint32_t Version;
+	uint32_t ByteOrderMark;
+	uint32_t Dimension;
+	uint32_t ScalarSize;
+	uint32_t NumberOfModes;
+	uint32_t StorageType;
+	uint64_t NumberOfVoxels;
+	uint64_t DataOffset;
+};
+
+/*!
+ * Edge length of the tiles in voxels, 0 for a buffer in linear voxel order.
+ */
+struct InterleavedDeformationBasisFileTiling
+{
+	uint32_t TileSize;
+	uint32_t Reserved;
+};
+
+/*!
+ * Order of the interpolation of the grid, 1 for voxels and 3 for B-spline control points. It is
+ * followed by the lower and upper bounds of the domain in continuous indices, and the absolute
+ * and relative approximation errors of the mean and the modes, all zero for voxels.
+ */
+struct InterleavedDeformationBasisFileSpline
+{
+	uint32_t SplineOrder;
+	uint32_t Reserved;
+};
+
+static const char     InterleavedDeformationBasisFileMagic[8] = { 'S', 'D', 'M', 'B', 'A', 'S', 'I', 'S' };
+static const uint32_t InterleavedDeformationBasisFileVersion = 4;
+static const uint32_t InterleavedDeformationBasisFileTiledVersion = 3;
+static const uint32_t InterleavedDeformationBasisFileLinearVersion = 2;
+static const uint32_t InterleavedDeformationBasisFileMaximumTileSize = 1024;
+static const uint32_t InterleavedDeformationBasisFileByteOrderMark = 0x01020304;
+static const uint64_t InterleavedDeformationBasisFileAlignment = 4096;
+
+
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::WriteToFile( const std::string & fileName, unsigned int tileSize ) const
+{
+	if ((tileSize & (tileSize - 1)) != 0 || tileSize > InterleavedDeformationBasisFileMaximumTileSize) {
+		itkExceptionMacro( << "The tile size must be a power of two up to "
+			<< InterleavedDeformationBasisFileMaximumTileSize << ", not " << tileSize << "." );
+	}
+
+	std::vector<int64_t>  startIndex(TDimension);
+	std::vector<uint64_t> size(TDimension);
+	std::vector<double>   geometry;
+	for (unsigned int i = 0; i < TDimension; i++) {
+		startIndex[i] = this->m_StartIndex[i];
+		size[i] = this->m_Size[i];
+	}
+	for (unsigned int i = 0; i < TDimension; i++) {
+		geometry.push_back(this->m_Spacing[i]);
+	}
+	for (unsigned int i = 0; i < TDimension; i++) {
+		geometry.push_back(this->m_Origin[i]);
+	}
+	for (unsigned int i = 0; i < TDimension; i++) {
+		for (unsigned int j = 0; j < TDimension; j++) {
+			geometry.push_back(this->m_Direction[i][j]);
+		}
+	}
+	std::vector<double> variances(this->m_NumberOfModes, 0.0);
+	for (unsigned int k = 0; k < this->m_NumberOfModes && k < this->m_ModeVariances.GetSize(); k++) {
+		variances[k] = this->m_ModeVariances[k];
+	}
+	std::vector<double> spline;
+	for (unsigned int i = 0; i < TDimension; i++) {
+		spline.push_back(this->m_DomainLower[i]);
+	}
+	for (unsigned int i = 0; i < TDimension; i++) {
+		spline.push_back(this->m_DomainUpper[i]);
+	}
+	for (unsigned int k = 0; k <= this->m_NumberOfModes; k++) {
+		spline.push_back(k < this->m_ApproximationErrors.GetSize() ? this->m_ApproximationErrors[k] : 0.0);
+	}
+	for (unsigned int k = 0; k <= this->m_NumberOfModes; k++) {
+		spline.push_back(k < this->m_RelativeApproximationErrors.GetSize() ? this->m_RelativeApproximationErrors[k] : 0.0);
+	}
+
+	InterleavedDeformationBasisFileHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.Magic, InterleavedDeformationBasisFileMagic, sizeof(header.Magic));
+	header.Version = InterleavedDeformationBasisFileVersion;
+	header.ByteOrderMark = InterleavedDeformationBasisFileByteOrderMark;
+	header.Dimension = TDimension;
+	header.ScalarSize = GetStorageElementSize(this->m_StorageType);
+	header.NumberOfModes = this->m_NumberOfModes;
+	header.StorageType = this->m_StorageType;
+	header.NumberOfVoxels = this->m_Size.GetNumberOfPixels();
+
+	InterleavedDeformationBasisFileTiling tiling;
+	tiling.TileSize = tileSize;
+	tiling.Reserved = 0;
+	InterleavedDeformationBasisFileSpline splineOrder;
+	splineOrder.SplineOrder = this->m_SplineOrder;
+	splineOrder.Reserved = 0;
+
+	const uint64_t headerSize = sizeof(header) + TDimension * (sizeof(int64_t) + sizeof(uint64_t))
+		+ geometry.size() * sizeof(double) + variances.size() * sizeof(double)
+		+ this->m_ComponentScales.GetSize() * sizeof(double) + sizeof(tiling)
+		+ sizeof(splineOrder) + spline.size() * sizeof(double);
+	header.DataOffset = ((headerSize + InterleavedDeformationBasisFileAlignment - 1)
+		/ InterleavedDeformationBasisFileAlignment) * InterleavedDeformationBasisFileAlignment;
+
+	std::ofstream file(fileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file) {
+		itkExceptionMacro( << "Cannot open " << fileName << " for writing." );
+	}
+	file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char *>(&startIndex[0]), TDimension * sizeof(int64_t));
+	file.write(reinterpret_cast<const char *>(&size[0]), TDimension * sizeof(uint64_t));
+	file.write(reinterpret_cast<const char *>(&geometry[0]), geometry.size() * sizeof(double));
+	if (!variances.empty()) {
+		file.write(reinterpret_cast<const char *>(&variances[0]), variances.size() * sizeof(double));
+	}
+	file.write(reinterpret_cast<const char *>(this->m_ComponentScales.data_block()),
+		this->m_ComponentScales.GetSize() * sizeof(double));
+	file.write(reinterpret_cast<const char *>(&tiling), sizeof(tiling));
+	file.write(reinterpret_cast<const char *>(&splineOrder), sizeof(splineOrder));
+	file.write(reinterpret_cast<const char *>(&spline[0]), spline.size() * sizeof(double));
+	const std::vector<char> padding(static_cast<size_t>(header.DataOffset - headerSize), 0);
+	if (!padding.empty()) {
+		file.write(&padding[0], padding.size());
+	}
+
+	/**
+	 * The buffer is written as is if it has the requested layout. Otherwise the voxels are copied
+	 * one output tile, or one row of voxels, at a time, so that a basis larger than the memory can
+	 * be converted between layouts.
+	 */
+	const char * buffer = reinterpret_cast<const char *>(this->m_Buffer->GetBufferPointer());
+	const SizeValueType elementSize = GetStorageElementSize(this->m_StorageType);
+	const SizeValueType voxelSize = this->m_ComponentsPerVoxel * elementSize;
+	if (tileSize == this->m_TileSize) {
+		file.write(buffer, this->m_Buffer->Size());
+	}
+	else if (tileSize == 0) {
+		std::vector<char> row(this->m_Size[0] * voxelSize);
+		const SizeValueType numberOfRows = this->m_Size.GetNumberOfPixels() / std::max<SizeValueType>(this->m_Size[0], 1);
+		for (SizeValueType r = 0; r < numberOfRows; r++) {
+			SizeValueType remainder = r;
+			OffsetValueType rowOffset = 0;
+			for (unsigned int a = 1; a < TDimension; a++) {
+				rowOffset += this->GetAxisOffset(a, static_cast<OffsetValueType>(remainder % this->m_Size[a]));
+				remainder /= this->m_Size[a];
+			}
+			for (SizeValueType x = 0; x < this->m_Size[0]; x++) {
+				std::memcpy(&row[x * voxelSize], buffer + (rowOffset + this->GetAxisOffset(0, x)) * elementSize, voxelSize);
+			}
+			file.write(&row[0], row.size());
+		}
+	}
+	else {
+		unsigned int tileShift = 0;
+		while ((1u << tileShift) < tileSize) {
+			tileShift++;
+		}
+		SizeValueType numberOfTiles = 1;
+		SizeValueType voxelsPerTile = 1;
+		for (unsigned int a = 0; a < TDimension; a++) {
+			numberOfTiles *= (this->m_Size[a] + tileSize - 1) / tileSize;
+			voxelsPerTile *= tileSize;
+		}
+		std::vector<char> tile(GetTileStride(tileSize, this->m_ComponentsPerVoxel, this->m_StorageType) * elementSize);
+		for (SizeValueType t = 0; t < numberOfTiles; t++) {
+			OffsetValueType tileIndex[TDimension];
+			SizeValueType remainder = t;
+			for (unsigned int a = 0; a < TDimension; a++) {
+				const SizeValueType tilesAlongAxis = (this->m_Size[a] + tileSize - 1) / tileSize;
+				tileIndex[a] = static_cast<OffsetValueType>(remainder % tilesAlongAxis) * tileSize;
+				remainder /= tilesAlongAxis;
+			}
+
+			/** Voxels beyond the grid pad the tiles at its upper borders with zeros. */
+			std::fill(tile.begin(), tile.end(), 0);
+			for (SizeValueType v = 0; v < voxelsPerTile; v++) {
+				OffsetValueType offset = 0;
+				bool inside = true;
+				for (unsigned int a = 0; a < TDimension; a++) {
+					const OffsetValueType index = tileIndex[a] + static_cast<OffsetValueType>((v >> (tileShift * a)) & (tileSize - 1));
+					inside &= index < static_cast<OffsetValueType>(this->m_Size[a]);
+					offset += inside ? this->GetAxisOffset(a, index) : 0;
+				}
+				if (inside) {
+					std::memcpy(&tile[v * voxelSize], buffer + offset * elementSize, voxelSize);
+				}
+			}
+			file.write(&tile[0], tile.size());
+		}
+	}
+	file.close();
+	if (!file) {
+		itkExceptionMacro( << "Error while writing " << fileName << "." );
+	}
+}
+
+
+/*!
+ * Map the file and point the buffer into the mapping, without copying.
+ */
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::ReadFromFile( const std::string & fileName )
+{
+	MemoryMappedFile::Pointer mappedFile = MemoryMappedFile::New();
+	mappedFile->Open(fileName);
+
+	const char * data = mappedFile->GetData();
+	InterleavedDeformationBasisFileHeader header;
+	if (mappedFile->GetSize() < sizeof(header)) {
+		itkExceptionMacro( << fileName << " is not a statistical model basis file." );
+	}
+	std::memcpy(&header, data, sizeof(header));
+	if (std::memcmp(header.Magic, InterleavedDeformationBasisFileMagic, sizeof(header.Magic)) != 0) {
+		itkExceptionMacro( << fileName << " is not a statistical model basis file." );
+	}
+	if (header.Version < InterleavedDeformationBasisFileLinearVersion || header.Version > InterleavedDeformationBasisFileVersion
+		|| header.ByteOrderMark != InterleavedDeformationBasisFileByteOrderMark) {
+		itkExceptionMacro( << fileName << " has been written by an incompatible version or on a machine with another byte order." );
+	}
+	if (header.Dimension != TDimension) {
+		itkExceptionMacro( << fileName << " holds a " << header.Dimension << "D basis, but a "
+			<< TDimension << "D basis is required." );
+	}
+
+	/** A native basis written with another scalar type can be read if that is float. */
+	StorageType storage = static_cast<StorageType>(header.StorageType);
+	if (storage == NativeStorage && header.ScalarSize != sizeof(TScalarType) && header.ScalarSize == sizeof(float)) {
+		storage = Float32Storage;
+	}
+	if (header.StorageType > Int16Storage || header.ScalarSize != GetStorageElementSize(storage)) {
+		itkExceptionMacro( << fileName << " holds a basis of " << 8 * header.ScalarSize
+			<< " bit values, which cannot be read into a basis of " << 8 * sizeof(TScalarType) << " bit scalars." );
+	}
+
+	const SizeValueType componentsPerVoxel = (header.NumberOfModes + 1) * TDimension;
+	const uint64_t tilingSize = (header.Version < InterleavedDeformationBasisFileTiledVersion)
+		? 0 : sizeof(InterleavedDeformationBasisFileTiling);
+	const uint64_t splineSize = (header.Version < InterleavedDeformationBasisFileVersion)
+		? 0 : sizeof(InterleavedDeformationBasisFileSpline) + (2 * TDimension + 2 * (static_cast<uint64_t>(header.NumberOfModes) + 1)) * sizeof(double);
+	const uint64_t headerSize = sizeof(header) + TDimension * (sizeof(int64_t) + sizeof(uint64_t))
+		+ (TDimension * (TDimension + 2) + 2 * static_cast<uint64_t>(header.NumberOfModes) + 1) * sizeof(double)
+		+ tilingSize + splineSize;
+	if (header.DataOffset % InterleavedDeformationBasisFileAlignment != 0 || header.DataOffset < headerSize
+		|| mappedFile->GetSize() < header.DataOffset) {
+		itkExceptionMacro( << fileName << " is truncated or corrupt." );
+	}
+
+	const char * position = data + sizeof(header);
+	std::vector<int64_t>  startIndex(TDimension);
+	std::vector<uint64_t> size(TDimension);
+	std::vector<double>   geometry(TDimension * (TDimension + 2));
+	std::memcpy(&startIndex[0], position, TDimension * sizeof(int64_t));
+	position += TDimension * sizeof(int64_t);
+	std::memcpy(&size[0], position, TDimension * sizeof(uint64_t));
+	position += TDimension * sizeof(uint64_t);
+	std::memcpy(&geometry[0], position, geometry.size() * sizeof(double));
+	position += geometry.size() * sizeof(double);
+
+	this->m_ModeVariances.SetSize(header.NumberOfModes);
+	for (unsigned int k = 0; k < header.NumberOfModes; k++) {
+		std::memcpy(&this->m_ModeVariances[k], position, sizeof(double));
+		position += sizeof(double);
+	}
+	this->m_ComponentScales.SetSize(header.NumberOfModes + 1);
+	for (unsigned int k = 0; k <= header.NumberOfModes; k++) {
+		std::memcpy(&this->m_ComponentScales[k], position, sizeof(double));
+		position += sizeof(double);
+	}
+	InterleavedDeformationBasisFileTiling tiling;
+	std::memset(&tiling, 0, sizeof(tiling));
+	std::memcpy(&tiling, position, static_cast<size_t>(tilingSize));
+	position += tilingSize;
+	if ((tiling.TileSize & (tiling.TileSize - 1)) != 0 || tiling.TileSize > InterleavedDeformationBasisFileMaximumTileSize) {
+		itkExceptionMacro( << fileName << " is truncated or corrupt." );
+	}
+
+	/** Files before version 4 hold voxels, whose domain follows from the size. */
+	InterleavedDeformationBasisFileSpline splineOrder;
+	splineOrder.SplineOrder = 1;
+	std::vector<double> spline;
+	if (splineSize > 0) {
+		std::memcpy(&splineOrder, position, sizeof(splineOrder));
+		position += sizeof(splineOrder);
+		spline.resize(2 * TDimension + 2 * (header.NumberOfModes + 1));
+		std::memcpy(&spline[0], position, spline.size() * sizeof(double));
+		position += spline.size() * sizeof(double);
+	}
+	if (splineOrder.SplineOrder != 1 && splineOrder.SplineOrder != 3) {
+		itkExceptionMacro( << fileName << " is truncated or corrupt." );
+	}
+
+	this->m_NumberOfModes = header.NumberOfModes;
+	this->m_ComponentsPerVoxel = componentsPerVoxel;
+	this->m_StorageType = storage;
+	for (unsigned int i = 0; i < TDimension; i++) {
+		this->m_StartIndex[i] = startIndex[i];
+		this->m_Size[i] = size[i];
+		this->m_Spacing[i] = geometry[i];
+		this->m_Origin[i] = geometry[TDimension + i];
+		for (unsigned int j = 0; j < TDimension; j++) {
+			this->m_Direction[i][j] = geometry[2 * TDimension + i * TDimension + j];
+		}
+	}
+	if (this->m_Size.GetNumberOfPixels() != header.NumberOfVoxels) {
+		itkExceptionMacro( << fileName << " is truncated or corrupt." );
+	}
+	this->m_TileSize = tiling.TileSize;
+	this->m_TileShift = 0;
+	while ((1u << this->m_TileShift) < this->m_TileSize) {
+		this->m_TileShift++;
+	}
+	this->m_SplineOrder = splineOrder.SplineOrder;
+	this->m_ApproximationErrors.SetSize(0);
+	this->m_RelativeApproximationErrors.SetSize(0);
+	if (this->m_SplineOrder == 3) {
+		this->m_ApproximationErrors.SetSize(header.NumberOfModes + 1);
+		this->m_RelativeApproximationErrors.SetSize(header.NumberOfModes + 1);
+		for (unsigned int i = 0; i < TDimension; i++) {
+			this->m_DomainLower[i] = spline[i];
+			this->m_DomainUpper[i] = spline[TDimension + i];
+		}
+		for (unsigned int k = 0; k <= header.NumberOfModes; k++) {
+			this->m_ApproximationErrors[k] = spline[2 * TDimension + k];
+			this->m_RelativeApproximationErrors[k] = spline[2 * TDimension + header.NumberOfModes + 1 + k];
+		}
+	}
+	this->UpdateGeometry();
+
+	uint64_t bufferSize = header.NumberOfVoxels * componentsPerVoxel * header.ScalarSize;
+	SizeValueType numberOfTiles = 0;
+	if (this->m_TileSize > 0) {
+		numberOfTiles = 1;
+		for (unsigned int i = 0; i < TDimension; i++) {
+			numberOfTiles *= (this->m_Size[i] + this->m_TileSize - 1) / this->m_TileSize;
+		}
+		bufferSize = static_cast<uint64_t>(numberOfTiles) * this->m_TileStride * header.ScalarSize;
+	}
+	if (mappedFile->GetSize() < header.DataOffset + bufferSize) {
+		itkExceptionMacro( << fileName << " is truncated or corrupt." );
+	}
+
+	/** The container does not own the memory; the mapping is released together with this basis. */
+	this->m_Buffer = BufferType::New();
+	this->m_Buffer->SetImportPointer(
+		const_cast<unsigned char *>(reinterpret_cast<const unsigned char *>(data + header.DataOffset)),
+		static_cast<SizeValueType>(bufferSize), false);
+	this->m_MappedFile = mappedFile;
+
+	/** A cell may span a tile along every axis, so as many tiles as a cell has corners always stay resident. */
+	this->m_TileCache = 0;
+	if (this->m_TileSize > 0) {
+		this->m_TileCache = DeformationBasisTileCache::New();
+		this->m_TileCache->Initialize(mappedFile, header.DataOffset, this->m_TileStride * header.ScalarSize,
+			numberOfTiles, this->GetNumberOfCellCorners());
+	}
+
+	this->Modified();
+}
+
+
+// Print self
+template < class TScalarType, unsigned int TDimension >
+void
+InterleavedDeformationBasis<TScalarType, TDimension>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+	Superclass::PrintSelf(os, indent);
+	os << indent << "NumberOfModes: " << this->m_NumberOfModes << std::endl;
+	os << indent << "StorageType: " << GetStorageTypeAsString(this->m_StorageType) << std::endl;
+	os << indent << "Size: " << this->m_Size << std::endl;
+	os << indent << "Spacing: " << this->m_Spacing << std::endl;
+	os << indent << "Origin: " << this->m_Origin << std::endl;
+	if (this->m_MappedFile.IsNotNull()) {
+		os << indent << "MappedFile: " << this->m_MappedFile->GetFileName() << std::endl;
+	}
+	os << indent << "TileSize: " << this->m_TileSize << std::endl;
+	os << indent << "SplineOrder: " << this->m_SplineOrder << std::endl;
+}
+
+} // namespace
+
+#endif
@@ -0,0 +1,212 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#include "itkMemoryMappedFile.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace itk
+{
+
+MemoryMappedFile
+::MemoryMappedFile() :
+  m_Data(0),
+  m_Size(0)
+#ifdef _WIN32
+  , m_FileHandle(0),
+  m_MappingHandle(0)
+#endif
+{
+}
+
+
+MemoryMappedFile
+::~MemoryMappedFile()
+{
+  this->Close();
+}
+
+
+void
+MemoryMappedFile
+::Open( const std::string & fileName )
+{
+  this->Close();
+
+#ifdef _WIN32
+  HANDLE file = CreateFileA( fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+  if ( file == INVALID_HANDLE_VALUE )
+  {
+    itkExceptionMacro( << "Cannot open " << fileName );
+  }
+  LARGE_INTEGER size;
+  if ( !GetFileSizeEx( file, &size ) || size.QuadPart == 0 )
+  {
+    CloseHandle( file );
+    itkExceptionMacro( << "Cannot map the empty or unreadable file " << fileName );
+  }
+  HANDLE mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+  const void * data = ( mapping != NULL ) ? MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+  if ( data == NULL )
+  {
+    if ( mapping != NULL )
+    {
+      CloseHandle( mapping );
+    }
+    CloseHandle( file );
+    itkExceptionMacro( << "Cannot map " << fileName );
+  }
+  this->m_FileHandle = file;
+  this->m_MappingHandle = mapping;
+  this->m_Size = static_cast<SizeValueType>( size.QuadPart );
+#else
+  const int file = open( fileName.c_str(), O_RDONLY );
+  if ( file < 0 )
+  {
+    itkExceptionMacro( << "Cannot open " << fileName );
+  }
+  struct stat status;
+  if ( fstat( file, &status ) != 0 || status.st_size == 0 )
+  {
+    close( file );
+    itkExceptionMacro( << "Cannot map the empty or unreadable file " << fileName );
+  }
+  void * data = mmap( 0, static_cast<size_t>( status.st_size ), PROT_READ, MAP_SHARED, file, 0 );
+  /** The mapping stays valid after the descriptor is closed. */
+  close( file );
+  if ( data == MAP_FAILED )
+  {
+    itkExceptionMacro( << "Cannot map " << fileName );
+  }
+  this->m_Size = static_cast<SizeValueType>( status.st_size );
+#endif
+
+  this->m_Data = static_cast<const char *>( data );
+  this->m_FileName = fileName;
+  this->Modified();
+}
+
+
+void
+MemoryMappedFile
+::Close()
+{
+  if ( this->m_Data == 0 )
+  {
+    return;
+  }
+
+#ifdef _WIN32
+  UnmapViewOfFile( this->m_Data );
+  CloseHandle( this->m_MappingHandle );
+  CloseHandle( this->m_FileHandle );
+  this->m_MappingHandle = 0;
+  this->m_FileHandle = 0;
+#else
+  munmap( const_cast<char *>( this->m_Data ), static_cast<size_t>( this->m_Size ) );
+#endif
+
+  this->m_Data = 0;
+  this->m_Size = 0;
+  this->m_FileName.clear();
+}
+
+
+/**
+ * On Windows the working set is managed by the system, so both hints are left out.
+ */
+void
+MemoryMappedFile
+::WillNeed( SizeValueType offset, SizeValueType size ) const
+{
+#ifndef _WIN32
+  if ( this->m_Data == 0 || offset >= this->m_Size )
+  {
+    return;
+  }
+  const SizeValueType pageSize = static_cast<SizeValueType>( sysconf( _SC_PAGESIZE ) );
+  const SizeValueType first = ( offset / pageSize ) * pageSize;
+  const SizeValueType last = std::min( offset + size, this->m_Size );
+  madvise( const_cast<char *>( this->m_Data ) + first, static_cast<size_t>( last - first ), MADV_WILLNEED );
+#else
+  (void)offset;
+  (void)size;
+#endif
+}
+
+
+void
+MemoryMappedFile
+::DontNeed( SizeValueType offset, SizeValueType size ) const
+{
+#ifndef _WIN32
+  if ( this->m_Data == 0 || offset >= this->m_Size )
+  {
+    return;
+  }
+  const SizeValueType pageSize = static_cast<SizeValueType>( sysconf( _SC_PAGESIZE ) );
+  const SizeValueType first = ( ( offset + pageSize - 1 ) / pageSize ) * pageSize;
+  const SizeValueType last = ( std::min( offset + size, this->m_Size ) / pageSize ) * pageSize;
+  if ( first < last )
+  {
+    madvise( const_cast<char *>( this->m_Data ) + first, static_cast<size_t>( last - first ), MADV_DONTNEED );
+  }
+#else
+  (void)offset;
+  (void)size;
+#endif
+}
+
+
+void
+MemoryMappedFile
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "FileName: " << this->m_FileName << std::endl;
+  os << indent << "Size: " << this->m_Size << std::endl;
+}
+
+}  // namespace itk
@@ -0,0 +1,117 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef __itkMemoryMappedFile_h
+#define __itkMemoryMappedFile_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+
+#include <string>
+
+namespace itk
+{
+
+/**
+ * \brief Read-only memory mapping of a whole file.
+ *
+ * The pages are loaded by the operating system on first access and are shared between all
+ * processes that map the same file. The mapping is released when the object is destroyed.
+ *
+ * \ingroup Transforms
+ */
+class MemoryMappedFile : public Object
+{
+public:
+  /** Standard typedefs   */
+  typedef MemoryMappedFile           Self;
+  typedef Object                     Superclass;
+  typedef SmartPointer<Self>         Pointer;
+  typedef SmartPointer<const Self>   ConstPointer;
+
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( MemoryMappedFile, Object );
+
+  /** Map the file. Throws an ExceptionObject if the file cannot be opened or mapped. */
+  void Open( const std::string & fileName );
+
+  /** Release the mapping. */
+  void Close();
+
+  /** Start of the mapped file, or 0 if no file is mapped. */
+  const char * GetData() const { return m_Data; }
+
+  /** Size of the mapped file in bytes. */
+  SizeValueType GetSize() const { return m_Size; }
+
+  const std::string & GetFileName() const { return m_FileName; }
+
+  /**
+   * Advise the operating system that a byte range of the file will be read soon, so that it is
+   * read ahead, or that it is not needed any more, so that its pages can be released. The range
+   * is widened to whole pages for WillNeed and narrowed to whole pages for DontNeed, so that
+   * neighbouring data is never released. A released page is read again on its next access.
+   * Both are hints and do nothing where they are not supported.
+   */
+  void WillNeed( SizeValueType offset, SizeValueType size ) const;
+  void DontNeed( SizeValueType offset, SizeValueType size ) const;
+
+protected:
+
+  MemoryMappedFile();
+  virtual ~MemoryMappedFile();
+
+  void PrintSelf( std::ostream & os, Indent indent ) const;
+
+private:
+
+  MemoryMappedFile( const Self & ); // purposely not implemented
+  void operator=( const Self & );   // purposely not implemented
+
+  std::string    m_FileName;
+  const char *   m_Data;
+  SizeValueType  m_Size;
+#ifdef _WIN32
+  void *         m_FileHandle;
+  void *         m_MappingHandle;
+#endif
+
+}; // class MemoryMappedFile
+
+}  // namespace itk
+
+#endif /* __itkMemoryMappedFile_h */
@@ -0,0 +1,227 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef __itkStatisticalModelCache_h
+#define __itkStatisticalModelCache_h
+
+#include "itkSimpleFastMutexLock.h"
+#include "itkMutexLockHolder.h"
+
+#include <map>
+#include <string>
+
+namespace itk
+{
+
+/**
+ * \brief Process-wide cache of loaded statistical models and the bases built from them.
+ *
+ * Loading a model and drawing its basis dominates the start-up of short registrations. When one
+ * process registers many images against the same model, or runs transformix after elastix, the
+ * cache hands out the model and the basis that were built before.
+ *
+ * Entries are keyed by the file name, its modification time, the number of modes in the basis and
+ * the type in which the basis is stored, so that a changed file is loaded again. An entry of a
+ * released model, see BasisOnly, holds the basis only; its model pointer is null. An entry is idle
+ * when no transform refers to its model or basis any more, i.e. when the cache holds the only
+ * reference. Idle entries are evicted, least recently used first, as soon as there are more than
+ * GetMaximumNumberOfIdleEntries() of them. Entries of a file that has been modified since are
+ * evicted as soon as they are idle.
+ *
+ * Eviction is therefore not purely by reference count: by default the most recently used idle
+ * entry is kept, such that the next registration with the same model finds it. This is why the
+ * model of a finished registration stays in memory while the cache is used. Eviction only takes
+ * place in Insert and SetMaximumNumberOfIdleEntries; with a maximum of 0, an idle entry is freed
+ * by the next of these calls.
+ *
+ * Nothing is cached unless Insert is called, so a process that does not use the cache keeps no
+ * model alive. The elastix transform only inserts with (CacheStatisticalModel "true").
+ *
+ * All methods are thread-safe. The state of the cache, including its mutex, is held in static data
+ * members. Those of a class template are initialized dynamically, in no defined order with respect
+ * to the static objects of other translation units, so the cache must not be used during static
+ * initialization. No elastix component constructs a transform before main, so the mutex exists
+ * before any thread uses it. The cached objects are shared and must not be modified.
+ *
+ * \ingroup Transforms
+ */
+template < class TStatisticalModel, class TBasis >
+class StatisticalModelCache
+{
+public:
+  typedef StatisticalModelCache                   Self;
+  typedef typename TStatisticalModel::Pointer     StatisticalModelPointer;
+  typedef typename TBasis::ConstPointer           BasisConstPointer;
+
+  struct KeyType
+  {
+    std::string  FileName;
+    long         ModifiedTime;
+    unsigned int NumberOfModes;
+    unsigned int StorageType;
+    typename TBasis::ShrinkFactorsType ControlPointSpacing;
+    bool         BasisOnly;
+
+    bool operator<( const KeyType & other ) const
+    {
+      if (FileName != other.FileName) return FileName < other.FileName;
+      if (ModifiedTime != other.ModifiedTime) return ModifiedTime < other.ModifiedTime;
+      if (NumberOfModes != other.NumberOfModes) return NumberOfModes < other.NumberOfModes;
+      if (StorageType != other.StorageType) return StorageType < other.StorageType;
+      for (unsigned int i = 0; i < TBasis::Dimension; i++) {
+        if (ControlPointSpacing[i] != other.ControlPointSpacing[i]) return ControlPointSpacing[i] < other.ControlPointSpacing[i];
+      }
+      return BasisOnly < other.BasisOnly;
+    }
+  };
+
+  /** Look up an entry. Returns false if the model has not been cached. */
+  static bool Find( const KeyType & key, StatisticalModelPointer & model, BasisConstPointer & basis )
+  {
+    MutexLockHolder<SimpleFastMutexLock> holder( m_Mutex );
+    typename EntryMapType::iterator it = m_Entries.find( key );
+    if (it == m_Entries.end()) {
+      return false;
+    }
+    it->second.LastUse = ++m_UseCounter;
+    model = it->second.Model;
+    basis = it->second.Basis;
+    return true;
+  }
+
+  /** Add or replace an entry, and evict idle entries that are stale or above the limit. */
+  static void Insert( const KeyType & key, TStatisticalModel * model, const TBasis * basis )
+  {
+    MutexLockHolder<SimpleFastMutexLock> holder( m_Mutex );
+    EntryType & entry = m_Entries[ key ];
+    entry.Model = model;
+    entry.Basis = basis;
+    entry.LastUse = ++m_UseCounter;
+
+    for (typename EntryMapType::iterator it = m_Entries.begin(); it != m_Entries.end(); ) {
+      const bool stale = it->first.FileName == key.FileName && it->first.ModifiedTime != key.ModifiedTime;
+      if (stale && IsIdle( it->second )) {
+        m_Entries.erase( it++ );
+      }
+      else {
+        ++it;
+      }
+    }
+    EvictIdleEntries();
+  }
+
+  /** Maximum number of entries that are kept while no transform uses them. Default 1, 0 keeps none. */
+  static void SetMaximumNumberOfIdleEntries( unsigned int n )
+  {
+    MutexLockHolder<SimpleFastMutexLock> holder( m_Mutex );
+    m_MaximumNumberOfIdleEntries = n;
+    EvictIdleEntries();
+  }
+
+  static unsigned int GetMaximumNumberOfIdleEntries()
+  {
+    MutexLockHolder<SimpleFastMutexLock> holder( m_Mutex );
+    return m_MaximumNumberOfIdleEntries;
+  }
+
+  /** Drop all entries. Transforms that use a model keep their own references. */
+  static void Clear()
+  {
+    MutexLockHolder<SimpleFastMutexLock> holder( m_Mutex );
+    m_Entries.clear();
+  }
+
+private:
+
+  struct EntryType
+  {
+    StatisticalModelPointer Model;
+    BasisConstPointer       Basis;
+    unsigned long           LastUse;
+  };
+
+  typedef std::map<KeyType, EntryType> EntryMapType;
+
+  static bool IsIdle( const EntryType & entry )
+  {
+    return ( entry.Model.IsNull() || entry.Model->GetReferenceCount() <= 1 ) && entry.Basis->GetReferenceCount() <= 1;
+  }
+
+  /** Remove the least recently used idle entries above the limit. Expects the mutex to be held. */
+  static void EvictIdleEntries()
+  {
+    for (;;) {
+      unsigned int numberOfIdleEntries = 0;
+      typename EntryMapType::iterator oldest = m_Entries.end();
+      for (typename EntryMapType::iterator it = m_Entries.begin(); it != m_Entries.end(); ++it) {
+        if (IsIdle( it->second )) {
+          numberOfIdleEntries++;
+          if (oldest == m_Entries.end() || it->second.LastUse < oldest->second.LastUse) {
+            oldest = it;
+          }
+        }
+      }
+      if (numberOfIdleEntries <= m_MaximumNumberOfIdleEntries) {
+        return;
+      }
+      m_Entries.erase( oldest );
+    }
+  }
+
+  static EntryMapType        m_Entries;
+  static SimpleFastMutexLock m_Mutex;
+  static unsigned long       m_UseCounter;
+  static unsigned int        m_MaximumNumberOfIdleEntries;
+
+  StatisticalModelCache(); // purposely not implemented
+
+}; // class StatisticalModelCache
+
+template < class TStatisticalModel, class TBasis >
+typename StatisticalModelCache<TStatisticalModel, TBasis>::EntryMapType
+StatisticalModelCache<TStatisticalModel, TBasis>::m_Entries;
+
+template < class TStatisticalModel, class TBasis >
+SimpleFastMutexLock StatisticalModelCache<TStatisticalModel, TBasis>::m_Mutex;
+
+template < class TStatisticalModel, class TBasis >
+unsigned long StatisticalModelCache<TStatisticalModel, TBasis>::m_UseCounter = 0;
+
+template < class TStatisticalModel, class TBasis >
+unsigned int StatisticalModelCache<TStatisticalModel, TBasis>::m_MaximumNumberOfIdleEntries = 1;
+
+}  // namespace itk
+
+#endif /* __itkStatisticalModelCache_h */
@@ -0,0 +1,19 @@
+/*======================================================================
+
+  This file is part of the elastix software.
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+  Copyright (c) University Medical Center Utrecht. All rights reserved.
+  See src/CopyrightElastix.txt or http://elastix.isi.uu.nl/legal.php for
+  details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE. See the above copyright notices for more information.
+
+======================================================================*/
+
+#include "elxStatisticalModelQuadraticPenalty.h"
+
+elxInstallMacro( StatisticalModelQuadraticPenalty );
@@ -0,0 +1,141 @@
+/*======================================================================
+
+  This file is part of the elastix software.
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+  Copyright (c) University Medical Center Utrecht. All rights reserved.
+  See src/CopyrightElastix.txt or http://elastix.isi.uu.nl/legal.php for
+  details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE. See the above copyright notices for more information.
+
+======================================================================*/
+
+#ifndef __elxStatisticalModelQuadraticPenalty_H_
+#define __elxStatisticalModelQuadraticPenalty_H_
+
+#include "elxIncludes.h"
+#include "itkStatisticalModelQuadraticPenaltyTerm.h"
+#include "itkAdvancedStatisticalDeformationModelTransform.h"
+#include "itkStandardImageRepresenter.h"
+
+namespace elastix
+{
+
+  /**
+   * \class StatisticalModelQuadraticPenalty
+   * \brief A penalty on the coefficients of the SimpleStatisticalDeformationModelTransform.
+   *
+   * The bending energy of the deformation of the model and the squared Mahalanobis distance of
+   * its coefficients are quadratic forms in the coefficients. The bending energy form is computed
+   * once from the basis of the transform, after which value and derivative cost O(n^2) for n
+   * coefficients, without any image samples. See itk::StatisticalModelQuadraticPenaltyTerm.
+   * Combine it with a similarity metric in a "MultiMetricMultiResolutionRegistration".
+   *
+   * The parameters used in this class are:
+   * \parameter Metric: Select this metric as follows:\n
+   *    <tt>(Metric "AdvancedMattesMutualInformation" "StatisticalModelQuadraticPenalty")</tt>
+   * \parameter StatisticalModelBendingEnergyWeight: Weight of the bending energy of the deformation
+   * 		within this penalty. Can be given for each resolution. \n
+   *    example: <tt>(StatisticalModelBendingEnergyWeight 1.0)</tt> \n
+   *    The default value is 1.0.\n
+   * \parameter StatisticalModelMahalanobisWeight: Weight of the squared Mahalanobis distance of the
+   * 		deformation to the mean, i.e. of the sum of the squared coefficients. Can be given for each
+   * 		resolution. \n
+   *    example: <tt>(StatisticalModelMahalanobisWeight 0.1)</tt> \n
+   *    The default value is 0.0.\n
+   * \parameter CacheStatisticalModelBendingEnergyForm: Whether to store the bending energy form
+   * 		next to the model, in the file StatisticalModelName (or StatisticalModelBasisFileName, if
+   * 		given) with the extension ".bendingenergy", and to read it from there in later runs. A
+   * 		stored form that does not match the grid or the variances of the basis is computed again. \n
+   *    example: <tt>(CacheStatisticalModelBendingEnergyForm "true")</tt> \n
+   *    The default value is "false".\n
+   *
+   * \ingroup Metrics
+   */
+
+  template < class TElastix >
+    class StatisticalModelQuadraticPenalty :
+      public itk::StatisticalModelQuadraticPenaltyTerm<
+        typename MetricBase<TElastix>::FixedImageType, double >,
+      public MetricBase<TElastix>
+  {
+  public:
+
+    /** Standard ITK-stuff. */
+    typedef StatisticalModelQuadraticPenalty                Self;
+    typedef itk::StatisticalModelQuadraticPenaltyTerm<
+      typename MetricBase<TElastix>::FixedImageType, double > Superclass1;
+    typedef MetricBase<TElastix>                            Superclass2;
+    typedef itk::SmartPointer<Self>                         Pointer;
+    typedef itk::SmartPointer<const Self>                   ConstPointer;
+
+    /** Method for creation through the object factory. */
+    itkNewMacro( Self );
+
+    /** Run-time type information (and related methods). */
+    itkTypeMacro( StatisticalModelQuadraticPenalty, itk::StatisticalModelQuadraticPenaltyTerm );
+
+    /** Name of this class.
+     * Use this name in the parameter file to select this specific metric. \n
+     * example: <tt>(Metric "StatisticalModelQuadraticPenalty")</tt>\n
+     */
+    elxClassNameMacro( "StatisticalModelQuadraticPenalty" );
+
+    /** Typedefs from the superclasses. */
+    typedef typename Superclass1::BasisType                 BasisType;
+    typedef typename Superclass2::ElastixType               ElastixType;
+    typedef typename Superclass2::ElastixPointer            ElastixPointer;
+    typedef typename Superclass2::ConfigurationType         ConfigurationType;
+    typedef typename Superclass2::ConfigurationPointer      ConfigurationPointer;
+    typedef typename Superclass2::RegistrationType          RegistrationType;
+    typedef typename Superclass2::RegistrationPointer       RegistrationPointer;
+    typedef typename Superclass2::ITKBaseType               ITKBaseType;
+
+    itkStaticConstMacro( FixedImageDimension, unsigned int, Superclass1::FixedImageDimension );
+
+    /** The transform whose basis is penalised, as in SimpleStatisticalDeformationModelTransformElastix. */
+    typedef typename ElastixType::CoordRepType              CoordRepType;
+    typedef itk::Vector<CoordRepType, FixedImageDimension>  VectorPixelType;
+    typedef itk::StandardImageRepresenter<VectorPixelType, FixedImageDimension> RepresenterType;
+    typedef itk::AdvancedStatisticalDeformationModelTransform<
+      RepresenterType, CoordRepType, FixedImageDimension >  StatisticalDeformationModelTransformType;
+
+    /** Compute or read the bending energy form of the basis of the transform.
+     * \li Throws if the transform is not a SimpleStatisticalDeformationModelTransform.
+     */
+    virtual void Initialize( void ) throw ( itk::ExceptionObject );
+
+    /** Read the weights of this resolution. */
+    virtual void BeforeEachResolution( void );
+
+  protected:
+
+    /** The constructor. */
+    StatisticalModelQuadraticPenalty() {};
+    /** The destructor. */
+    virtual ~StatisticalModelQuadraticPenalty() {};
+
+    /** The basis from which the current form has been computed. */
+    typename BasisType::ConstPointer m_FormBasis;
+
+  private:
+
+    /** The private constructor. */
+    StatisticalModelQuadraticPenalty( const Self& ); // purposely not implemented
+    /** The private copy constructor. */
+    void operator=( const Self& );                   // purposely not implemented
+
+  }; // end class StatisticalModelQuadraticPenalty
+
+
+} // end namespace elastix
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "elxStatisticalModelQuadraticPenalty.hxx"
+#endif
+
+#endif // end #ifndef __elxStatisticalModelQuadraticPenalty_H_
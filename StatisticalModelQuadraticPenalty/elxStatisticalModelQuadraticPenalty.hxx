@@ -0,0 +1,124 @@
+/*======================================================================
+
+  This file is part of the elastix software.
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+  Copyright (c) University Medical Center Utrecht. All rights reserved.
+  See src/CopyrightElastix.txt or http://elastix.isi.uu.nl/legal.php for
+  details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE. See the above copyright notices for more information.
+
+======================================================================*/
+
+#ifndef __elxStatisticalModelQuadraticPenalty_HXX_
+#define __elxStatisticalModelQuadraticPenalty_HXX_
+
+#include "elxStatisticalModelQuadraticPenalty.h"
+#include "itkTimeProbe.h"
+
+namespace elastix
+{
+
+  /**
+   * ******************* Initialize ***********************
+   */
+
+  template <class TElastix>
+    void StatisticalModelQuadraticPenalty<TElastix>
+    ::Initialize( void ) throw ( itk::ExceptionObject )
+  {
+    this->Superclass1::Initialize();
+
+    const StatisticalDeformationModelTransformType * transform =
+      dynamic_cast<const StatisticalDeformationModelTransformType *>(
+        this->GetElastix()->GetElxTransformBase()->GetAsITKBaseType()->GetCurrentTransform() );
+    if ( transform == 0 || transform->GetFullResolutionBasis() == 0 )
+    {
+      itkExceptionMacro( << "StatisticalModelQuadraticPenalty needs the SimpleStatisticalDeformationModelTransform." );
+    }
+
+    /** The form belongs to the full resolution basis, which does not change between resolutions. */
+    const BasisType * basis = transform->GetFullResolutionBasis();
+    if ( basis == this->m_FormBasis.GetPointer() )
+    {
+      return;
+    }
+
+    std::string formFileName = "";
+    bool cacheForm = false;
+    this->GetConfiguration()->ReadParameter( cacheForm,
+      "CacheStatisticalModelBendingEnergyForm", 0, false );
+    if ( cacheForm )
+    {
+      this->GetConfiguration()->ReadParameter( formFileName, "StatisticalModelName", 0, false );
+      this->GetConfiguration()->ReadParameter( formFileName, "StatisticalModelBasisFileName", 0, false );
+      if ( !formFileName.empty() )
+      {
+        formFileName += ".bendingenergy";
+      }
+    }
+
+    if ( !formFileName.empty() && this->ReadBendingEnergyForm( formFileName, basis ) )
+    {
+      elxout << "Read the bending energy form of " << basis->GetNumberOfModes()
+        << " modes from " << formFileName << "." << std::endl;
+    }
+    else
+    {
+      itk::TimeProbe timer;
+      timer.Start();
+      this->SetBasis( basis );
+      timer.Stop();
+      elxout << "Computing the bending energy form of " << basis->GetNumberOfModes()
+        << " modes took " << static_cast<long>( timer.GetMean() * 1000 ) << " ms." << std::endl;
+
+      if ( !formFileName.empty() )
+      {
+        try
+        {
+          this->WriteBendingEnergyForm( formFileName, basis );
+        }
+        catch ( itk::ExceptionObject & excp )
+        {
+          xout["warning"] << "WARNING: the bending energy form could not be stored: "
+            << excp.GetDescription() << std::endl;
+        }
+      }
+    }
+    this->m_FormBasis = basis;
+
+  } // end Initialize
+
+
+  /**
+   * ******************* BeforeEachResolution ***********************
+   */
+
+  template <class TElastix>
+    void StatisticalModelQuadraticPenalty<TElastix>
+    ::BeforeEachResolution( void )
+  {
+    const unsigned int level =
+      this->m_Registration->GetAsITKBaseType()->GetCurrentLevel();
+
+    double bendingEnergyWeight = 1.0;
+    this->GetConfiguration()->ReadParameter( bendingEnergyWeight,
+      "StatisticalModelBendingEnergyWeight", this->GetComponentLabel(), level, 0 );
+    this->SetBendingEnergyWeight( bendingEnergyWeight );
+
+    double mahalanobisWeight = 0.0;
+    this->GetConfiguration()->ReadParameter( mahalanobisWeight,
+      "StatisticalModelMahalanobisWeight", this->GetComponentLabel(), level, 0 );
+    this->SetMahalanobisWeight( mahalanobisWeight );
+
+  } // end BeforeEachResolution
+
+
+} // end namespace elastix
+
+
+#endif // end #ifndef __elxStatisticalModelQuadraticPenalty_HXX_
@@ -0,0 +1,158 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef __itkStatisticalModelQuadraticPenaltyTerm_h
+#define __itkStatisticalModelQuadraticPenaltyTerm_h
+
+#include "itkTransformPenaltyTerm.h"
+#include "itkInterleavedDeformationBasis.h"
+
+#include <string>
+
+namespace itk
+{
+
+/**
+ * \brief A penalty on the coefficients of a statistical deformation model that needs no samples.
+ *
+ * The displacement of the model is mean + U c, so every quadratic penalty on the displacement is
+ * a quadratic form in the coefficients c. This term combines two of them:
+ *
+ *   BendingEnergyWeight * [ 1, c ]^T F [ 1, c ] + MahalanobisWeight * c^T c,
+ *
+ * where F is the bending energy form of the basis, see InterleavedDeformationBasis::ComputeBendingEnergyForm.
+ * The coefficients of statismo are in units of standard deviation, so c^T c is the squared
+ * Mahalanobis distance of the deformation to the mean.
+ *
+ * F is computed once per basis, at a cost linear in the number of voxels and quadratic in the number
+ * of modes, and can be stored in a file. Value and derivative then take O(n^2) operations for n
+ * parameters, independent of the image size. The parameters are the first n coefficients of the
+ * basis; the bending energy is that of the current transform only, not of an initial transform.
+ *
+ * \ingroup RegistrationMetrics
+ */
+template< class TFixedImage, class TScalarType = double >
+class StatisticalModelQuadraticPenaltyTerm :
+  public TransformPenaltyTerm< TFixedImage, TScalarType >
+{
+public:
+
+  /** Standard itk stuff. */
+  typedef StatisticalModelQuadraticPenaltyTerm             Self;
+  typedef TransformPenaltyTerm< TFixedImage, TScalarType > Superclass;
+  typedef SmartPointer< Self >                             Pointer;
+  typedef SmartPointer< const Self >                       ConstPointer;
+
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( StatisticalModelQuadraticPenaltyTerm, TransformPenaltyTerm );
+
+  typedef typename Superclass::ParametersType ParametersType;
+  typedef typename Superclass::MeasureType    MeasureType;
+  typedef typename Superclass::DerivativeType DerivativeType;
+  typedef typename Superclass::FixedImageType FixedImageType;
+
+  itkStaticConstMacro( FixedImageDimension, unsigned int, FixedImageType::ImageDimension );
+
+  typedef InterleavedDeformationBasis< TScalarType,
+    itkGetStaticConstMacro( FixedImageDimension ) >   BasisType;
+  typedef typename BasisType::QuadraticFormType      QuadraticFormType;
+
+  /** Compute the bending energy form of all modes of the basis. */
+  void SetBasis( const BasisType * basis );
+
+  /**
+   * Use a bending energy form that has been computed before. Entry (0, 0) belongs to the mean,
+   * entry (i, j) to modes i - 1 and j - 1.
+   */
+  void SetBendingEnergyForm( const QuadraticFormType & form );
+  itkGetConstReferenceMacro( BendingEnergyForm, QuadraticFormType );
+
+  /**
+   * Read the bending energy form of the basis from a file written by WriteBendingEnergyForm.
+   * Returns false if the file does not exist or was written for a basis with a different grid,
+   * different mode variances or fewer modes. A form of more modes is cut to those of the basis.
+   */
+  bool ReadBendingEnergyForm( const std::string & fileName, const BasisType * basis );
+
+  /**
+   * Write the current form, together with the grid and the mode variances of the basis it was
+   * computed from. Throws an ExceptionObject if the file cannot be written.
+   */
+  void WriteBendingEnergyForm( const std::string & fileName, const BasisType * basis ) const;
+
+  /** Weights of the bending energy and of the squared Mahalanobis distance. Default 1 and 0. */
+  itkSetMacro( BendingEnergyWeight, double );
+  itkGetConstMacro( BendingEnergyWeight, double );
+  itkSetMacro( MahalanobisWeight, double );
+  itkGetConstMacro( MahalanobisWeight, double );
+
+  /** The value of the penalty for the given coefficients. */
+  virtual MeasureType GetValue( const ParametersType & parameters ) const;
+
+  /** The derivative of the penalty, 2 (F c + f) weighted plus 2 c weighted. */
+  virtual void GetDerivative( const ParametersType & parameters,
+    DerivativeType & derivative ) const;
+
+  /** Value and derivative, sharing the product F c. */
+  virtual void GetValueAndDerivative( const ParametersType & parameters,
+    MeasureType & value, DerivativeType & derivative ) const;
+
+protected:
+
+  StatisticalModelQuadraticPenaltyTerm();
+  virtual ~StatisticalModelQuadraticPenaltyTerm() {};
+
+  void PrintSelf( std::ostream & os, Indent indent ) const;
+
+private:
+
+  StatisticalModelQuadraticPenaltyTerm( const Self & ); // purposely not implemented
+  void operator=( const Self & );                       // purposely not implemented
+
+  QuadraticFormType m_BendingEnergyForm;
+  double            m_BendingEnergyWeight;
+  double            m_MahalanobisWeight;
+
+}; // end class StatisticalModelQuadraticPenaltyTerm
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkStatisticalModelQuadraticPenaltyTerm.txx"
+#endif
+
+#endif // #ifndef __itkStatisticalModelQuadraticPenaltyTerm_h
@@ -0,0 +1,315 @@
+/*======================================================================
+
+  This file is part of the statismo software.
+
+	Copyright (c) University of Basel. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+======================================================================*/
+
+#ifndef _itkStatisticalModelQuadraticPenaltyTerm_txx
+#define _itkStatisticalModelQuadraticPenaltyTerm_txx
+
+#include "itkStatisticalModelQuadraticPenaltyTerm.h"
+
+#include "itkIntTypes.h"
+
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+namespace itk
+{
+
+template< class TFixedImage, class TScalarType >
+StatisticalModelQuadraticPenaltyTerm< TFixedImage, TScalarType >
+::StatisticalModelQuadraticPenaltyTerm() :
+	m_BendingEnergyWeight(1.0),
+	m_MahalanobisWeight(0.0)
+{
+	/** The penalty is evaluated in coefficient space, so no samples are drawn. */
+	this->SetUseImageSampler(false);
+	this->SetUseFixedImageLimiter(false);
+	this->SetUseMovingImageLimiter(false);
+}
+
+
+template< class TFixedImage, class TScalarType >
+void
+StatisticalModelQuadraticPenaltyTerm< TFixedImage, TScalarType >
+::SetBasis( const BasisType * basis )
+{
+	basis->ComputeBendingEnergyForm(basis->GetNumberOfModes(), this->m_BendingEnergyForm);
+	this->Modified();
+}
+
+
+template< class TFixedImage, class TScalarType >
+void
+StatisticalModelQuadraticPenaltyTerm< TFixedImage, TScalarType >
+::SetBendingEnergyForm( const QuadraticFormType & form )
+{
+	if (form.rows() != form.cols() || form.rows() == 0) {
+		itkExceptionMacro( << "The bending energy form must be a non-empty square matrix." );
+	}
+	this->m_BendingEnergyForm = form;
+	this->Modified();
+}
+
+
+/*!
+ * Fixed part of a bending energy form file. It is followed by the size, spacing, origin and
+ * direction of the grid of the basis, the variances of its modes and the form, row by row.
+ */
+struct StatisticalModelBendingEnergyFormFileHeader
+{
+	char     Magic[8];
+	uint32_t Version;
+	uint32_t ByteOrderMark;
+	uint32_t Dimension;
+	uint32_t NumberOfModes;
+};
+
+static const char     StatisticalModelBendingEnergyFormFileMagic[8] = { 'S', 'D', 'M', 'B', 'E', 'N', 'D', 'E' };
+static const uint32_t StatisticalModelBendingEnergyFormFileVersion = 1;
+static const uint32_t StatisticalModelBendingEnergyFormFileByteOrderMark = 0x01020304;
+
+
+/*!
+ * The geometry of the basis, as written to and compared with a form file.
+ */
+template< class TBasis >
+static std::vector<double>
+GetStatisticalModelBendingEnergyFormGeometry( const TBasis * basis, unsigned int dimension )
+{
+	std::vector<double> geometry;
+	for (unsigned int i = 0; i < dimension; i++) {
+		geometry.push_back(static_cast<double>(basis->GetSize()[i]));
+	}
+	for (unsigned int i = 0; i < dimension; i++) {
+		geometry.push_back(basis->GetSpacing()[i]);
+	}
+	for (unsigned int i = 0; i < dimension; i++) {
+		geometry.push_back(basis->GetOrigin()[i]);
+	}
+	for (unsigned int i = 0; i < dimension; i++) {
+		for (unsigned int j = 0; j < dimension; j++) {
+			geometry.push_back(basis->GetDirection()[i][j]);
+		}
+	}
+	return geometry;
+}
+
+
+template< class TFixedImage, class TScalarType >
+void
+StatisticalModelQuadraticPenaltyTerm< TFixedImage, TScalarType >
+::WriteBendingEnergyForm( const std::string & fileName, const BasisType * basis ) const
+{
+	const unsigned int numberOfModes = this->m_BendingEnergyForm.rows() - 1;
+	if (this->m_BendingEnergyForm.rows() == 0 || numberOfModes > basis->GetNumberOfModes()) {
+		itkExceptionMacro( << "The bending energy form does not belong to the basis." );
+	}
+
+	StatisticalModelBendingEnergyFormFileHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.Magic, StatisticalModelBendingEnergyFormFileMagic, sizeof(header.Magic));
+	header.Version = StatisticalModelBendingEnergyFormFileVersion;
+	header.ByteOrderMark = StatisticalModelBendingEnergyFormFileByteOrderMark;
+	header.Dimension = FixedImageDimension;
+	header.NumberOfModes = numberOfModes;
+
+	const std::vector<double> geometry = GetStatisticalModelBendingEnergyFormGeometry(basis, FixedImageDimension);
+	std::vector<double> variances(numberOfModes, 0.0);
+	for (unsigned int k = 0; k < numberOfModes && k < basis->GetModeVariances().GetSize(); k++) {
+		variances[k] = basis->GetModeVariances()[k];
+	}
+
+	std::ofstream file(fileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file) {
+		itkExceptionMacro( << "Cannot open " << fileName << " for writing." );
+	}
+	file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char *>(&geometry[0]), geometry.size() * sizeof(double));
+	if (!variances.empty()) {
+		file.write(reinterpret_cast<const char *>(&variances[0]), variances.size() * sizeof(double));
+	}
+	file.write(reinterpret_cast<const char *>(this->m_BendingEnergyForm.data_block()),
+		this->m_BendingEnergyForm.size() * sizeof(double));
+	file.close();
+	if (!file) {
+		itkExceptionMacro( << "Error while writing " << fileName << "." );
+	}
+}
+
+
+/*!
+ * The form is only valid for the basis it was computed from, so the grid and the variances are
+ * compared exactly. A file of more modes holds the form of the basis in its upper left block.
+ */
+template< class TFixedImage, class TScalarType >
+bool
+StatisticalModelQuadraticPenaltyTerm< TFixedImage, TScalarType >
+::ReadBendingEnergyForm( const std::string & fileName, const BasisType * basis )
+{
+	std::ifstream file(fileName.c_str(), std::ios::in | std::ios::binary);
+	if (!file) {
+		return false;
+	}
+
+	StatisticalModelBendingEnergyFormFileHeader header;
+	file.read(reinterpret_cast<char *>(&header), sizeof(header));
+	if (!file || std::memcmp(header.Magic, StatisticalModelBendingEnergyFormFileMagic, sizeof(header.Magic)) != 0
+		|| header.Version != StatisticalModelBendingEnergyFormFileVersion
+		|| header.ByteOrderMark != StatisticalModelBendingEnergyFormFileByteOrderMark
+		|| header.Dimension != FixedImageDimension || header.NumberOfModes < basis->GetNumberOfModes()) {
+		return false;
+	}
+
+	const std::vector<double> geometry = GetStatisticalModelBendingEnergyFormGeometry(basis, FixedImageDimension);
+	std::vector<double> storedGeometry(geometry.size());
+	file.read(reinterpret_cast<char *>(&storedGeometry[0]), storedGeometry.size() * sizeof(double));
+	if (!file || storedGeometry != geometry) {
+		return false;
+	}
+
+	std::vector<double> storedVariances(header.NumberOfModes);
+	if (header.NumberOfModes > 0) {
+		file.read(reinterpret_cast<char *>(&storedVariances[0]), storedVariances.size() * sizeof(double));
+	}
+	for (unsigned int k = 0; k < basis->GetNumberOfModes(); k++) {
+		const double variance = (k < basis->GetModeVariances().GetSize()) ? basis->GetModeVariances()[k] : 0.0;
+		if (!file || storedVariances[k] != variance) {
+			return false;
+		}
+	}
+
+	const unsigned int storedComponents = header.NumberOfModes + 1;
+	const unsigned int numberOfComponents = basis->GetNumberOfModes() + 1;
+	std::vector<double> row(storedComponents);
+	QuadraticFormType form(numberOfComponents, numberOfComponents);
+	for (unsigned int i = 0; i < numberOfComponents; i++) {
+		file.read(reinterpret_cast<char *>(&row[0]), row.size() * sizeof(double));
+		for (unsigned int j = 0; j < numberOfComponents; j++) {
+			form[i][j] = row[j];
+		}
+	}
+	if (!file) {
+		return false;
+	}
+
+	this->m_BendingEnergyForm = form;
+	this->Modified();
+	return true;
+}
+
+
+template< class TFixedImage, class TScalarType >
+typename StatisticalModelQuadraticPenaltyTerm< TFixedImage, TScalarType >::MeasureType
+StatisticalModelQuadraticPenaltyTerm< TFixedImage, TScalarType >
+::GetValue( const ParametersType & parameters ) const
+{
+	MeasureType value = NumericTraits< MeasureType >::Zero;
+	DerivativeType derivative;
+	this->GetValueAndDerivative(parameters, value, derivative);
+	return value;
+}
+
+
+template< class TFixedImage, class TScalarType >
+void
+StatisticalModelQuadraticPenaltyTerm< TFixedImage, TScalarType >
+::GetDerivative( const ParametersType & parameters, DerivativeType & derivative ) const
+{
+	MeasureType value = NumericTraits< MeasureType >::Zero;
+	this->GetValueAndDerivative(parameters, value, derivative);
+}
+
+
+/*!
+ * With g = F[1.., 0] + F[1.., 1..] c, the bending energy is F[0, 0] + c^T (F[1.., 0] + g) and
+ * its derivative 2 g, so one product of the form with the coefficients gives both.
+ */
+template< class TFixedImage, class TScalarType >
+void
+StatisticalModelQuadraticPenaltyTerm< TFixedImage, TScalarType >
+::GetValueAndDerivative( const ParametersType & parameters,
+	MeasureType & value, DerivativeType & derivative ) const
+{
+	const unsigned int numberOfParameters = parameters.GetSize();
+	derivative.SetSize(numberOfParameters);
+	derivative.Fill(NumericTraits< typename DerivativeType::ValueType >::Zero);
+	value = NumericTraits< MeasureType >::Zero;
+
+	if (this->m_BendingEnergyWeight != 0.0) {
+		if (this->m_BendingEnergyForm.rows() < numberOfParameters + 1) {
+			itkExceptionMacro( << "The bending energy form holds " << this->m_BendingEnergyForm.rows()
+				<< " components, but " << numberOfParameters + 1 << " are needed." );
+		}
+
+		const QuadraticFormType & form = this->m_BendingEnergyForm;
+		double bendingEnergy = form[0][0];
+		for (unsigned int i = 0; i < numberOfParameters; i++) {
+			const double * row = form[i + 1];
+			double gradient = row[0];
+			for (unsigned int j = 0; j < numberOfParameters; j++) {
+				gradient += row[j + 1] * parameters[j];
+			}
+			bendingEnergy += parameters[i] * (row[0] + gradient);
+			derivative[i] = 2.0 * this->m_BendingEnergyWeight * gradient;
+		}
+		value = this->m_BendingEnergyWeight * bendingEnergy;
+	}
+
+	if (this->m_MahalanobisWeight != 0.0) {
+		double squaredDistance = 0.0;
+		for (unsigned int i = 0; i < numberOfParameters; i++) {
+			squaredDistance += parameters[i] * parameters[i];
+			derivative[i] += 2.0 * this->m_MahalanobisWeight * parameters[i];
+		}
+		value += this->m_MahalanobisWeight * squaredDistance;
+	}
+}
+
+
+template< class TFixedImage, class TScalarType >
+void
+StatisticalModelQuadraticPenaltyTerm< TFixedImage, TScalarType >
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+	Superclass::PrintSelf(os, indent);
+	os << indent << "BendingEnergyWeight: " << this->m_BendingEnergyWeight << std::endl;
+	os << indent << "MahalanobisWeight: " << this->m_MahalanobisWeight << std::endl;
+	os << indent << "BendingEnergyForm: " << this->m_BendingEnergyForm.rows() << " x "
+		<< this->m_BendingEnergyForm.cols() << std::endl;
+}
+
+} // end namespace itk
+
+#endif // #ifndef _itkStatisticalModelQuadraticPenaltyTerm_txx